@@ -0,0 +1,346 @@
+/**
+ * @file buffer_pool.cpp
+ * @brief Pool of fixed-size aligned buffers
+ */
+
+// Project includes
+#include "buffer_pool.h"
+
+// Libraries
+#include <QTCore/qt_windows.h>
+
+// C++
+#include <new>
+
+using namespace std;
+
+/**
+ * @brief BufferMemorySettings constructor
+ * @arg None
+ *
+ * Large pages where possible; ordinary pages are not locked.
+ */
+BufferMemorySettings::BufferMemorySettings( void )
+    : largePages( true ),
+      locked( false )
+{
+}
+
+/** Serializes changes to the process working set */
+static std::mutex workingSetMutex;
+
+/**
+ * @brief Whether the process may allocate large pages, enabling the privilege the first time.
+ * @arg None.
+ * @returns True if the machine has large pages and the account has the "Lock pages in memory" right.
+ */
+static bool mayUseLargePages()
+{
+    static bool allowed = []() {
+        HANDLE token;
+        if ( GetLargePageMinimum() == 0 || !OpenProcessToken( GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token ) )
+            return false;
+
+        TOKEN_PRIVILEGES privileges;
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[ 0 ].Attributes = SE_PRIVILEGE_ENABLED;
+        bool granted = LookupPrivilegeValueW( NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[ 0 ].Luid ) &&
+                       AdjustTokenPrivileges( token, FALSE, &privileges, 0, NULL, NULL ) &&
+                       GetLastError() != ERROR_NOT_ALL_ASSIGNED;
+        CloseHandle( token );
+        return granted;
+    }();
+    return allowed;
+}
+
+/**
+ * @brief BufferPool constructor
+ * @arg None
+ */
+BufferPool::BufferPool( void )
+    : size( 0 ),
+      bufferNode( -1 ),
+      largePages( false ),
+      largePagesFailed( false ),
+      region( NULL ),
+      locked( false )
+{
+}
+
+/**
+ * @brief BufferPool destructor
+ * @arg None
+ */
+BufferPool::~BufferPool( void )
+{
+    deallocate();
+}
+
+/**
+ * @brief Choose how the memory of the buffers is obtained.
+ * @param settings Whether to use large pages, and whether to lock ordinary pages.
+ * @returns void.
+ * @note Takes effect on the next call to allocate().
+ */
+void BufferPool::setMemory( const BufferMemorySettings& settings )
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( settings.largePages != memory.largePages )
+        largePagesFailed = false;
+    memory = settings;
+}
+
+/**
+ * @brief Allocate the pool's buffers.
+ * @param bufferSize Size of each buffer in bytes.
+ * @param count Number of buffers.
+ * @param alignment Alignment of each buffer in bytes (power of two, at most a page).
+ * @param node NUMA node whose memory the buffers come from; -1 for any.
+ * @returns Whether the pool holds the buffers; false if some are handed out, in which case nothing changes.
+ *
+ * If the pool already holds enough buffers of sufficient size on the node, they are reused.
+ * Buffers come from large pages if possible, and are touched page by page otherwise,
+ * so that they are resident before they are first used. acquire() and tryAcquire()
+ * wait while the buffers are replaced, so they may be called meanwhile.
+ */
+bool BufferPool::allocate( size_t bufferSize, int count, size_t alignment, int node )
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( freeBuffers.size() != buffers.size() )
+        return false;
+
+    bool large = memory.largePages && !largePagesFailed && mayUseLargePages();
+    if ( (int)buffers.size() == count && size >= bufferSize && bufferNode == node && largePages == large )
+        return true;
+
+    deallocate();
+    if ( large && !allocateBuffers( bufferSize, count, alignment, node, true ) )
+    {
+        // Large pages must be physically contiguous, and may have run out; don't fault a pool in again every time
+        large = false;
+        largePagesFailed = true;
+    }
+    if ( !large && !allocateBuffers( bufferSize, count, alignment, node, false ) )
+        throw std::bad_alloc();
+    return true;
+}
+
+/**
+ * @brief Allocate the buffers one way.
+ * @param bufferSize Size of each buffer in bytes.
+ * @param count Number of buffers.
+ * @param alignment Alignment of each buffer.
+ * @param node NUMA node; -1 for any.
+ * @param large Whether to use large pages.
+ * @returns Whether all buffers could be allocated; if not, none are.
+ */
+bool BufferPool::allocateBuffers( size_t bufferSize, int count, size_t alignment, int node, bool large )
+{
+    if ( large || node >= 0 )
+    {
+        // One region for the pool, rounded up to whole pages once
+        size_t stride = ( bufferSize + alignment - 1 ) / alignment * alignment;
+        size_t page = large ? GetLargePageMinimum() : PAGE_SIZE;
+        size_t allocation = ( stride * count + page - 1 ) / page * page;
+        DWORD type = MEM_RESERVE | MEM_COMMIT | ( large ? MEM_LARGE_PAGES : 0 );
+        if ( node >= 0 )
+            region = (unsigned char*)VirtualAllocExNuma( GetCurrentProcess(), NULL, allocation, type, PAGE_READWRITE, node );
+        else
+            region = (unsigned char*)VirtualAlloc( NULL, allocation, type, PAGE_READWRITE );
+        if ( !region )
+            return false;
+        for ( int i = 0; i < count; i++ )
+            buffers.push_back( region + i * stride );
+    }
+    else
+    {
+        for ( int i = 0; i < count; i++ )
+        {
+            unsigned char* buffer = (unsigned char*)_aligned_malloc( bufferSize, alignment );
+            if ( !buffer )
+            {
+                deallocate();
+                return false;
+            }
+            buffers.push_back( buffer );
+        }
+    }
+
+    // Fault the pages in now, rather than with the first frames; large pages are resident already
+    if ( !large )
+    {
+        for ( auto buffer : buffers )
+        {
+            for ( size_t offset = 0; offset < bufferSize; offset += PAGE_SIZE )
+                buffer[ offset ] = 0;
+        }
+    }
+    largePages = large;
+    bufferNode = node;
+    freeBuffers = buffers;
+    size = bufferSize;
+    return true;
+}
+
+/**
+ * @brief Free all buffers.
+ * @arg None.
+ * @returns void.
+ * @note Must not be called while buffers are handed out.
+ */
+void BufferPool::deallocate()
+{
+    unlock();
+    if ( region )
+    {
+        VirtualFree( region, 0, MEM_RELEASE );
+    }
+    else
+    {
+        for ( auto buffer : buffers )
+            _aligned_free( buffer );
+    }
+    buffers.clear();
+    freeBuffers.clear();
+    size = 0;
+    bufferNode = -1;
+    largePages = false;
+    region = NULL;
+}
+
+/**
+ * @brief Keep the buffers in the working set, if so configured, e.g. while a channel streams.
+ * @arg None.
+ * @returns void.
+ *
+ * Large pages are never paged out, so they need no locking. The working set
+ * is grown by the size of the pool, as VirtualLock fails beyond its minimum.
+ */
+void BufferPool::lock()
+{
+    if ( locked || largePages || !memory.locked || buffers.empty() )
+        return;
+
+    lock_guard<std::mutex> guard( workingSetMutex );
+    SIZE_T minimum, maximum;
+    SIZE_T total = size * buffers.size();
+    if ( GetProcessWorkingSetSize( GetCurrentProcess(), &minimum, &maximum ) )
+        SetProcessWorkingSetSize( GetCurrentProcess(), minimum + total, maximum + total );
+    for ( auto buffer : buffers )
+        VirtualLock( buffer, size );
+    locked = true;
+}
+
+/**
+ * @brief Let the buffers be paged out again.
+ * @arg None.
+ * @returns void.
+ */
+void BufferPool::unlock()
+{
+    if ( !locked )
+        return;
+
+    lock_guard<std::mutex> guard( workingSetMutex );
+    for ( auto buffer : buffers )
+        VirtualUnlock( buffer, size );
+    SIZE_T minimum, maximum;
+    SIZE_T total = size * buffers.size();
+    if ( GetProcessWorkingSetSize( GetCurrentProcess(), &minimum, &maximum ) && minimum > total && maximum > total )
+        SetProcessWorkingSetSize( GetCurrentProcess(), minimum - total, maximum - total );
+    locked = false;
+}
+
+/**
+ * @brief Take a buffer out of the pool, waiting for one to be recycled if necessary.
+ * @arg None.
+ * @returns The buffer.
+ */
+unsigned char* BufferPool::acquire()
+{
+    unique_lock<std::mutex> lock( mutex );
+    returned.wait( lock, [this] { return !freeBuffers.empty(); } );
+    unsigned char* buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+    return buffer;
+}
+
+/**
+ * @brief Take a buffer out of the pool, if one is left.
+ * @arg None.
+ * @returns The buffer, or NULL if all of them are handed out.
+ */
+unsigned char* BufferPool::tryAcquire()
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( freeBuffers.empty() )
+        return NULL;
+    unsigned char* buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+    return buffer;
+}
+
+/**
+ * @brief Return a buffer to the pool.
+ * @param buffer A buffer previously obtained from acquire().
+ * @returns void.
+ */
+void BufferPool::recycle( unsigned char* buffer )
+{
+    {
+        lock_guard<std::mutex> lock( mutex );
+        freeBuffers.push_back( buffer );
+    }
+    returned.notify_one();
+}
+
+/**
+ * @brief Accessor for the buffer size.
+ * @arg None.
+ * @returns Size of each buffer in bytes.
+ */
+size_t BufferPool::bufferSize()
+{
+    return size;
+}
+
+/**
+ * @brief Accessor for the number of buffers.
+ * @arg None.
+ * @returns Number of buffers owned by the pool.
+ */
+int BufferPool::count()
+{
+    return (int)buffers.size();
+}
+
+/**
+ * @brief Number of buffers currently in the pool.
+ * @arg None.
+ * @returns Number of buffers not handed out.
+ */
+int BufferPool::available()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return (int)freeBuffers.size();
+}
+
+/**
+ * @brief Accessor for the NUMA node of the buffers.
+ * @arg None.
+ * @returns The node the buffers were allocated on, or -1 if any.
+ */
+int BufferPool::node()
+{
+    return bufferNode;
+}
+
+/**
+ * @brief Whether the buffers are on large pages.
+ * @arg None.
+ * @returns True if large pages were configured and could be had.
+ */
+bool BufferPool::usesLargePages()
+{
+    return largePages;
+}
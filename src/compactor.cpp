@@ -0,0 +1,263 @@
+/**
+ * @file compactor.cpp
+ * @brief Background JPEG compression of raw recordings
+ */
+
+// Project includes
+#include "compactor.h"
+#include "seq_reader.h"
+#include "pugixml.hpp"
+
+// Libraries
+#include <QTCore/qt_windows.h>
+#include <QTCore/QtDebug>
+
+// C++
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * @brief Compactor constructor
+ * @param threads Number of files compressed at once when nothing is being recorded.
+ */
+Compactor::Compactor( int threads )
+    : activeJobs( 0 ),
+      recording( false ),
+      behind( false ),
+      stopping( false )
+{
+    for ( int i = 0; i < (std::max)( threads, 1 ); i++ )
+        workers.push_back( std::thread( &Compactor::worker, this, i ) );
+}
+
+/**
+ * @brief Compactor destructor
+ * @arg None
+ *
+ * Files not yet compressed are left raw. A file being compressed is abandoned,
+ * and its raw original kept.
+ */
+Compactor::~Compactor( void )
+{
+    {
+        lock_guard<std::mutex> lock( mutex );
+        stopping = true;
+    }
+    queued.notify_all();
+    for ( auto& thread : workers )
+        thread.join();
+}
+
+/**
+ * @brief Queue a raw recording for compression.
+ * @param job The file and the settings to compress it with.
+ * @returns void.
+ */
+void Compactor::enqueue( const Job& job )
+{
+    {
+        lock_guard<std::mutex> lock( mutex );
+        jobs.push_back( job );
+    }
+    queued.notify_one();
+}
+
+/**
+ * @brief Tell the compactor how capture is doing, so it can stay out of the way.
+ * @param recording Whether a recording is running.
+ * @param behind Whether capture is falling behind (QoS ladder degraded).
+ * @returns void.
+ */
+void Compactor::setCaptureState( bool recording, bool behind )
+{
+    this->recording = recording;
+    this->behind = behind;
+}
+
+/**
+ * @brief Number of files waiting for or undergoing compression.
+ * @arg None.
+ * @returns Files not yet compressed.
+ */
+int Compactor::pending()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return (int)jobs.size() + activeJobs;
+}
+
+/**
+ * @brief Wait until a worker may process another frame.
+ * @param index Index of the worker.
+ * @returns False if the compactor is shutting down.
+ */
+bool Compactor::mayWork( int index )
+{
+    while ( !stopping && ( behind || ( recording && index > 0 ) ) )
+        this_thread::sleep_for( chrono::milliseconds( PAUSE_POLL_MS ) );
+    return !stopping;
+}
+
+/**
+ * @brief Worker thread: compresses queued files one at a time.
+ * @param index Index of the worker. Only worker 0 keeps going while recording.
+ * @returns void.
+ */
+void Compactor::worker( int index )
+{
+    // Idle CPU priority, and low I/O and memory priority
+    SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_IDLE );
+    SetThreadPriority( GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN );
+
+    while ( true )
+    {
+        Job job;
+        {
+            unique_lock<std::mutex> lock( mutex );
+            queued.wait( lock, [ this ] { return stopping || !jobs.empty(); } );
+            if ( stopping )
+                return;
+            job = jobs.front();
+            jobs.pop_front();
+            activeJobs++;
+        }
+
+        QString compressedPath;
+        bool done = compact( job, index, compressedPath ) && verify( job.rawPath, compressedPath );
+        if ( done )
+        {
+            QFile::remove( job.rawPath );
+            updateManifest( job, compressedPath );
+        }
+        else if ( !compressedPath.isEmpty() )
+        {
+            // Keep the raw file; it is still a complete recording
+            QFile::remove( compressedPath );
+            QFile::remove( SidecarWriter::pathFor( compressedPath, "quality" ) );
+        }
+#ifdef DEBUG
+        qDebug() << ( done ? "Compressed" : "Could not compress" ) << job.rawPath << endl;
+#endif
+
+        lock_guard<std::mutex> lock( mutex );
+        activeJobs--;
+    }
+}
+
+/**
+ * @brief Write a raw recording again as JPEG.
+ * @param job The file and the settings to compress it with.
+ * @param index Index of the worker, for throttling.
+ * @param compressedPath Out: path of the JPEG file, if one was started.
+ * @returns Whether every frame was written.
+ *
+ * The frames go through SEQWriter with the same channel, output root, timestamp
+ * and encoder settings as the live recording, so the result has the name and
+ * contents a live JPEG recording would have had.
+ */
+bool Compactor::compact( const Job& job, int index, QString& compressedPath )
+{
+    SEQReader reader;
+    if ( !reader.open( job.rawPath ) || reader.isCompressed() )
+        return false;
+
+    SEQWriter writer( job.channel );
+    writer.setStorageBackend( job.backend, job.queueDepth );
+    writer.setEncoderProfile( job.profile );
+    writer.setResidualCodec( job.residual );
+    writer.setRateControl( job.rateTarget, job.rateMinQuality, job.rateMaxQuality );
+    writer.startRecording( job.outputDir, reader.getWidth(), reader.getHeight(), true, job.dateTime, job.isPGswitched, reader.getFrameRate() );
+    compressedPath = writer.getFileName();
+
+    bool complete = true;
+    QImage frame;
+    int secs;
+    short ms;
+    for ( int i = 0; i < reader.getFrameCount(); i++ )
+    {
+        if ( !mayWork( index ) || !reader.readFrame( frame, secs, ms ) )
+        {
+            complete = false;
+            break;
+        }
+        writer.writeFrame( &frame, secs, ms );
+    }
+    writer.stopRecording();
+    return complete;
+}
+
+/**
+ * @brief Check a compressed file against its raw original.
+ * @param rawPath The raw recording.
+ * @param compressedPath The JPEG recording.
+ * @returns Whether the JPEG file has the same size, frame count and timestamps, and every frame is a complete JPEG
+ *          (or, for residual files, decodes).
+ */
+bool Compactor::verify( const QString& rawPath, const QString& compressedPath )
+{
+    SEQReader raw;
+    SEQReader compressed;
+    if ( !raw.open( rawPath ) || !compressed.open( compressedPath ) || !compressed.isCompressed() ||
+         raw.getWidth() != compressed.getWidth() || raw.getHeight() != compressed.getHeight() ||
+         raw.getFrameCount() != compressed.getFrameCount() )
+        return false;
+
+    tjhandle decompressor = tjInitDecompress();
+    std::vector<unsigned char> rawData, jpegData;
+    QImage decoded;
+    bool valid = true;
+    for ( int i = 0; valid && i < raw.getFrameCount(); i++ )
+    {
+        if ( compressed.isResidual() )
+        {
+            int rawSecs, residualSecs;
+            short rawMs, residualMs;
+            valid = raw.readRecord( rawData, rawSecs, rawMs ) && compressed.readFrame( decoded, residualSecs, residualMs ) &&
+                    rawSecs == residualSecs && rawMs == residualMs;
+            continue;
+        }
+
+        int rawSecs, jpegSecs, width, height, subsampling;
+        short rawMs, jpegMs;
+        valid = raw.readRecord( rawData, rawSecs, rawMs ) && compressed.readRecord( jpegData, jpegSecs, jpegMs ) &&
+                rawSecs == jpegSecs && rawMs == jpegMs &&
+                jpegData.size() > 2 && jpegData[ jpegData.size() - 2 ] == 0xFF && jpegData.back() == 0xD9 &&
+                tjDecompressHeader2( decompressor, jpegData.data(), (unsigned long)jpegData.size(), &width, &height, &subsampling ) == 0 &&
+                width == raw.getWidth() && height == raw.getHeight();
+    }
+    tjDestroy( decompressor );
+    return valid;
+}
+
+/**
+ * @brief Point the session manifest at the compressed file.
+ * @param job The job, which names the manifest.
+ * @param compressedPath The JPEG recording that replaces the raw one.
+ * @returns void.
+ */
+void Compactor::updateManifest( const Job& job, const QString& compressedPath )
+{
+    if ( job.manifestPath.empty() )
+        return;
+
+    // Channels of one session finish on different workers
+    static std::mutex manifestMutex;
+    lock_guard<std::mutex> lock( manifestMutex );
+
+    pugi::xml_document doc;
+    if ( !doc.load_file( job.manifestPath.c_str() ) )
+        return;
+
+    std::string rawPath = job.rawPath.toStdString();
+    for ( pugi::xml_node file = doc.child( "session" ).child( "file" ); file; file = file.next_sibling( "file" ) )
+    {
+        if ( rawPath != file.child_value() )
+            continue;
+        file.first_child().set_value( compressedPath.toStdString().c_str() );
+        file.remove_attribute( "deferred" );
+        if ( file.attribute( "bytes" ) )
+            file.attribute( "bytes" ) = (long long)QFile( compressedPath ).size();
+    }
+    doc.save_file( job.manifestPath.c_str() );
+}
@@ -0,0 +1,445 @@
+/**
+ * @file control_server.cpp
+ * @brief Local control server, for starting and stopping recordings from scripts
+ */
+
+// Winsock 2 has to come before windows.h, which the project headers pull in
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+// Project includes
+#include "control_server.h"
+#include "streamer.h"
+#include "camera_controller.h"
+#include "seq_writer.h"
+#include "exceptions.h"
+
+// Libraries
+#include <QTCore/QtDebug>
+
+// C++
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <memory>
+#include <sstream>
+
+using namespace std;
+
+/**
+ * @brief ControlServerSettings constructor
+ * @arg None
+ *
+ * The server is off by default.
+ */
+ControlServerSettings::ControlServerSettings( void )
+    : enabled( false ),
+      port( ControlServer::DEFAULT_PORT )
+{
+}
+
+/**
+ * @brief Quote a string for a JSON reply.
+ * @param text The string.
+ * @returns The string in double quotes, with quotes, backslashes and control characters escaped.
+ */
+static string quoted( const string& text )
+{
+    string result = "\"";
+    for ( char c : text )
+    {
+        if ( c == '"' || c == '\\' )
+            result += '\\';
+        if ( (unsigned char)c < ' ' )
+            c = ' ';
+        result += c;
+    }
+    return result + "\"";
+}
+
+/**
+ * @brief Reply for a failed command.
+ * @param message Why it failed.
+ * @returns The JSON line.
+ */
+static string failure( const string& message )
+{
+    return "{\"ok\":false,\"error\":" + quoted( message ) + "}";
+}
+
+/**
+ * @brief Look up a camera by the name a client gave it.
+ * @param name top, front, color or depth, or a file name channel; in any case.
+ * @returns The camera, or NUM_CAMERAS if the name is unknown.
+ */
+static CameraController::Cameras cameraFromName( string name )
+{
+    const char* names[] = { "top", "front", "color", "depth" };
+    transform( name.begin(), name.end(), name.begin(), ::tolower );
+    for ( int c = 0; c < CameraController::Cameras::NUM_CAMERAS; c++ )
+    {
+        string fileName = SEQWriter::fileNameChannels[ c ];
+        transform( fileName.begin(), fileName.end(), fileName.begin(), ::tolower );
+        if ( name == names[ c ] || name == fileName )
+            return (CameraController::Cameras)c;
+    }
+    return CameraController::Cameras::NUM_CAMERAS;
+}
+
+/**
+ * @brief ControlServer constructor
+ * @param streamer The Streamer the commands go to.
+ * @param camera The controller of its cameras.
+ */
+ControlServer::ControlServer( Streamer* streamer, CameraController* camera )
+    : streamer( streamer ),
+      camera( camera ),
+      listener( INVALID_SOCKET ),
+      serving( false )
+{
+}
+
+/**
+ * @brief ControlServer destructor
+ */
+ControlServer::~ControlServer( void )
+{
+    close();
+}
+
+/**
+ * @brief Start listening.
+ * @param settings The port.
+ * @returns Whether the server is listening; it is not if the port is taken.
+ */
+bool ControlServer::open( const ControlServerSettings& settings )
+{
+    close();
+
+    WSADATA data;
+    if ( WSAStartup( MAKEWORD( 2, 2 ), &data ) != 0 )
+        return false;
+
+    // Local clients only, and no other process may share the port
+    SOCKET handle = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons( (u_short)settings.port );
+    inet_pton( AF_INET, "127.0.0.1", &address.sin_addr );
+    BOOL exclusive = TRUE;
+    if ( handle == INVALID_SOCKET ||
+         setsockopt( handle, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char*)&exclusive, sizeof( exclusive ) ) != 0 ||
+         bind( handle, (const sockaddr*)&address, sizeof( address ) ) != 0 ||
+         listen( handle, SOMAXCONN ) != 0 )
+    {
+#ifdef DEBUG
+        qDebug() << "Control server cannot listen on port" << settings.port << endl;
+#endif
+        if ( handle != INVALID_SOCKET )
+            closesocket( handle );
+        WSACleanup();
+        return false;
+    }
+
+    listener = handle;
+    serving = true;
+    thread = std::thread( &ControlServer::serve, this );
+    return true;
+}
+
+/**
+ * @brief Stop listening, and drop all clients.
+ * @arg None.
+ * @returns void.
+ */
+void ControlServer::close()
+{
+    if ( !serving )
+        return;
+    serving = false;
+    thread.join();
+
+    for ( auto& client : clients )
+        closesocket( (SOCKET)client.socket );
+    clients.clear();
+    closesocket( (SOCKET)listener );
+    listener = INVALID_SOCKET;
+    WSACleanup();
+}
+
+/**
+ * @brief Whether the server is listening.
+ * @arg None.
+ * @returns True between a successful open() and close().
+ */
+bool ControlServer::isOpen()
+{
+    return serving;
+}
+
+/**
+ * @brief Accept clients and answer their commands, until close().
+ * @arg None.
+ * @returns void.
+ *
+ * One thread serves all clients, so commands are answered in the order they arrive.
+ */
+void ControlServer::serve()
+{
+    while ( serving )
+    {
+        fd_set readable;
+        FD_ZERO( &readable );
+        FD_SET( (SOCKET)listener, &readable );
+        for ( auto& client : clients )
+            FD_SET( (SOCKET)client.socket, &readable );
+        timeval timeout = { 0, POLL_MS * 1000 };
+        if ( select( 0, &readable, NULL, NULL, &timeout ) <= 0 )
+            continue;
+
+        if ( FD_ISSET( (SOCKET)listener, &readable ) )
+        {
+            SOCKET handle = accept( (SOCKET)listener, NULL, NULL );
+            if ( handle != INVALID_SOCKET && clients.size() >= MAX_CLIENTS )
+            {
+                string reply = failure( "too many clients" ) + "\n";
+                send( handle, reply.c_str(), (int)reply.size(), 0 );
+                closesocket( handle );
+            }
+            else if ( handle != INVALID_SOCKET )
+            {
+                Client client;
+                client.socket = handle;
+                clients.push_back( client );
+            }
+        }
+
+        for ( size_t i = 0; i < clients.size(); )
+        {
+            Client& client = clients[ i ];
+            bool connected = true;
+            if ( FD_ISSET( (SOCKET)client.socket, &readable ) )
+            {
+                char data[ 512 ];
+                int received = recv( (SOCKET)client.socket, data, sizeof( data ), 0 );
+                connected = received > 0;
+                if ( connected )
+                    client.buffer.append( data, received );
+
+                // Answer every complete line
+                size_t end;
+                while ( connected && ( end = client.buffer.find( '\n' ) ) != string::npos )
+                {
+                    string line = client.buffer.substr( 0, end );
+                    client.buffer.erase( 0, end + 1 );
+                    if ( !line.empty() && line.back() == '\r' )
+                        line.pop_back();
+                    if ( line.find_first_not_of( " \t" ) == string::npos )
+                        continue;
+                    string reply = execute( line ) + "\n";
+                    connected = send( (SOCKET)client.socket, reply.c_str(), (int)reply.size(), 0 ) == (int)reply.size();
+                }
+                if ( client.buffer.size() > MAX_LINE_LENGTH )
+                    connected = false;
+            }
+
+            if ( connected )
+            {
+                i++;
+                continue;
+            }
+            closesocket( (SOCKET)client.socket );
+            clients.erase( clients.begin() + i );
+        }
+    }
+}
+
+/**
+ * @brief Run a command.
+ * @param line The command and its arguments, separated by white space.
+ * @returns The JSON reply, without a newline.
+ */
+std::string ControlServer::execute( const std::string& line )
+{
+    istringstream words( line );
+    string command;
+    words >> command;
+    transform( command.begin(), command.end(), command.begin(), ::tolower );
+
+    if ( command == "stats" )
+        return stats();
+
+    // Everything else runs between frame sets, on the transporter thread; the error is filled in there
+    Streamer* streamer = this->streamer;
+    CameraController* camera = this->camera;
+    auto error = make_shared<string>();
+    function<void()> action;
+    bool callOff = false; // Whether to call the command off rather than let it run late
+
+    if ( command == "start" )
+    {
+        bool channels[ CameraController::Cameras::NUM_CAMERAS ] = {};
+        bool any = false;
+        string name;
+        while ( words >> name )
+        {
+            CameraController::Cameras cam = cameraFromName( name );
+            if ( cam == CameraController::Cameras::NUM_CAMERAS )
+                return failure( "unknown channel " + name );
+            channels[ cam ] = true;
+            any = true;
+        }
+        if ( !any )
+            return failure( "start needs at least one channel" );
+        bool pgt = channels[ CameraController::Cameras::PointGreyTop ];
+        bool pgf = channels[ CameraController::Cameras::PointGreyFront ];
+        bool color = channels[ CameraController::Cameras::Color ];
+        bool depth = channels[ CameraController::Cameras::Depth ];
+        action = [ streamer, error, pgt, pgf, color, depth ]() {
+            if ( streamer->isRecording() )
+            {
+                *error = "already recording";
+                return;
+            }
+            if ( streamer->isSaving() )
+            {
+                *error = "still saving the last recording";
+                return;
+            }
+            streamer->startRecording( pgt, pgf, color, depth );
+            emit streamer->recordingChanged( true );
+        };
+        callOff = true;
+    }
+    else if ( command == "stop" )
+    {
+        action = [ streamer, error ]() {
+            if ( !streamer->isRecording() )
+            {
+                *error = "not recording";
+                return;
+            }
+            streamer->stopRecording();
+            emit streamer->recordingChanged( false );
+        };
+    }
+    else if ( command == "roi" )
+    {
+        string name;
+        int x, y, w, h;
+        if ( !( words >> name >> x >> y >> w >> h ) )
+            return failure( "usage: roi <channel> <x> <y> <width> <height>" );
+        CameraController::Cameras cam = cameraFromName( name );
+        if ( cam == CameraController::Cameras::NUM_CAMERAS )
+            return failure( "unknown channel " + name );
+        if ( x < 0 || y < 0 || w <= 0 || h <= 0 ||
+             x + w > streamer->getOriginalROI( cam, Streamer::ROICoordinates::W ) ||
+             y + h > streamer->getOriginalROI( cam, Streamer::ROICoordinates::H ) )
+            return failure( "ROI outside the frame" );
+        action = [ streamer, error, cam, x, y, w, h ]() {
+            if ( streamer->isRecording() )
+            {
+                *error = "the ROI can't change while recording";
+                return;
+            }
+            streamer->setROI( cam, x, y, w, h );
+        };
+        callOff = true;
+    }
+    else if ( command == "set" )
+    {
+        string name, property;
+        float value;
+        if ( !( words >> name >> property >> value ) )
+            return failure( "usage: set <channel> <fps|shutter|gain|brightness> <value>" );
+        CameraController::Cameras cam = cameraFromName( name );
+        if ( cam != CameraController::Cameras::PointGreyTop && cam != CameraController::Cameras::PointGreyFront )
+            return failure( "properties can only be set on top and front" );
+        const char* names[] = { "fps", "shutter", "gain", "brightness" };
+        const CameraController::CameraProperties properties[] = { CameraController::CameraProperties::FPS,
+                                                                  CameraController::CameraProperties::Shutter,
+                                                                  CameraController::CameraProperties::Gain,
+                                                                  CameraController::CameraProperties::Brightness };
+        transform( property.begin(), property.end(), property.begin(), ::tolower );
+        int p = (int)( find( names, names + 4, property ) - names );
+        if ( p == 4 )
+            return failure( "unknown property " + property );
+        CameraController::CameraProperties prop = properties[ p ];
+        action = [ streamer, camera, error, cam, prop, value ]() {
+            // Like the side bar, the settings follow the channel when the cameras are switched
+            CameraController::Cameras target = cam;
+            if ( streamer->isPGswitched )
+                target = cam == CameraController::Cameras::PointGreyTop ? CameraController::Cameras::PointGreyFront : CameraController::Cameras::PointGreyTop;
+            try
+            {
+                camera->setValue( target, prop, value );
+            }
+            catch ( exception_t e )
+            {
+                *error = "the camera rejected the value";
+            }
+        };
+        callOff = true;
+    }
+    else if ( command == "snapshot" )
+    {
+        string name;
+        words >> name;
+        CameraController::Cameras cam = cameraFromName( name );
+        if ( cam == CameraController::Cameras::NUM_CAMERAS )
+            return failure( "usage: snapshot <channel>" );
+        action = [ streamer, cam ]() {
+            streamer->saveSnapshot( cam );
+        };
+    }
+    else
+    {
+        return failure( "unknown command " + command );
+    }
+
+    // A late stop or snapshot still does what was asked; a late start, ROI or setting would surprise the script
+    unsigned long long frameSet;
+    if ( callOff )
+    {
+        if ( !streamer->tryAtFrameSetBoundary( action, frameSet ) )
+            return failure( "timed out waiting for a frame set boundary; the command was called off" );
+    }
+    else if ( !streamer->runAtFrameSetBoundary( action, frameSet ) )
+    {
+        return failure( "timed out waiting for a frame set boundary; the command will still run" );
+    }
+    if ( !error->empty() )
+        return failure( *error );
+    return "{\"ok\":true,\"frameSet\":" + to_string( frameSet ) + "}";
+}
+
+/**
+ * @brief Reply to the stats command: what each channel has written so far.
+ * @arg None.
+ * @returns The JSON reply, without a newline.
+ */
+std::string ControlServer::stats()
+{
+    ostringstream reply;
+    reply << "{\"ok\":true"
+          << ",\"recording\":" << ( streamer->isRecording() ? "true" : "false" )
+          << ",\"saving\":" << ( streamer->isSaving() ? "true" : "false" )
+          << ",\"frameSet\":" << streamer->getFrameSets()
+          << ",\"qos\":" << quoted( QoSController::levelNames[ streamer->getQoSLevel() ] )
+          << ",\"pendingCompactions\":" << streamer->pendingCompactions()
+          << ",\"channels\":{";
+    for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+    {
+        Streamer::ChannelStatus status = streamer->getChannelStatus( (Streamer::Channels)c );
+        reply << ( c ? "," : "" ) << quoted( SEQWriter::fileNameChannels[ c ] )
+              << ":{\"recording\":" << ( status.recording ? "true" : "false" )
+              << ",\"frames\":" << status.frames
+              << ",\"bytes\":" << status.bytes
+              << ",\"dropped\":" << status.dropped
+              << ",\"crossNodeHandoffs\":" << status.crossNodeHandoffs
+              << ",\"crossNodeFrames\":" << status.crossNodeFrames
+              << ",\"failedWrites\":" << status.failedWrites << "}";
+    }
+    reply << "}}";
+    return reply.str();
+}
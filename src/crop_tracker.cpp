@@ -0,0 +1,212 @@
+/**
+ * @file crop_tracker.cpp
+ * @brief Moving crop that follows the animal in a Point Grey stream
+ */
+
+// Project includes
+#include "crop_tracker.h"
+#include "motion_gate.h"
+
+// C++
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+using namespace std;
+
+/**
+ * @brief DynamicCropSettings constructor
+ * @arg None
+ *
+ * The crop is off by default.
+ */
+DynamicCropSettings::DynamicCropSettings( void )
+    : enabled( false ),
+      width( CropTracker::DEFAULT_SIZE ),
+      height( CropTracker::DEFAULT_SIZE ),
+      contextInterval( CropTracker::DEFAULT_CONTEXT_INTERVAL )
+{
+}
+
+/**
+ * @brief Size of the crop within an ROI.
+ * @param roi Size of the ROI.
+ * @returns The configured size, clamped to the ROI.
+ */
+QSize DynamicCropSettings::cropSize( const QSize& roi ) const
+{
+    return QSize( (std::min)( (std::max)( width, 1 ), roi.width() ), (std::min)( (std::max)( height, 1 ), roi.height() ) );
+}
+
+/**
+ * @brief CropTracker constructor
+ * @arg None
+ */
+CropTracker::CropTracker( void )
+    : active( false ),
+      centreX( 0 ),
+      centreY( 0 ),
+      following( false ),
+      columns( 0 ),
+      rows( 0 )
+{
+}
+
+/**
+ * @brief Start following the animal for a recording.
+ * @param settings The crop settings.
+ * @param roi Size of the ROI the crop moves in.
+ * @param sessionPath Recordings folder, session prefix and channel, e.g. .../recordings/Mouse_<date>_Top; the sidecar is named after it.
+ * @returns void.
+ *
+ * The crop starts in the middle of the ROI.
+ */
+void CropTracker::start( const DynamicCropSettings& settings, const QSize& roi, const QString& sessionPath )
+{
+    lock_guard<std::mutex> lock( mutex );
+    area = roi;
+    size = settings.cropSize( roi );
+    centreX = roi.width() / 2.0;
+    centreY = roi.height() / 2.0;
+    following = false;
+    background.clear();
+    sidecar.open( sessionPath, "crop", "index,seconds,milliseconds,x,y,found" );
+    active = true;
+}
+
+/**
+ * @brief Find the animal in a frame and place the crop.
+ * @param index Arrival index of the frame.
+ * @param frame The whole 8-bit frame.
+ * @param roi The channel's ROI within the frame.
+ * @param secs Timestamp of the frame: seconds.
+ * @param ms Timestamp of the frame: milliseconds.
+ * @returns The crop, relative to the ROI.
+ */
+QRect CropTracker::update( unsigned long long index, const QImage& frame, const QRect& roi, int secs, int ms )
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( !active )
+        return QRect( QPoint( 0, 0 ), roi.size() );
+
+    MotionGate::downsample( frame.constBits(), frame.bytesPerLine(), roi, blocks );
+    columns = roi.width() / MotionGate::BLOCK_SIZE;
+    rows = roi.height() / MotionGate::BLOCK_SIZE;
+    if ( background.size() != blocks.size() )
+    {
+        background.resize( blocks.size() );
+        for ( size_t i = 0; i < blocks.size(); i++ )
+            background[ i ] = blocks[ i ] << 8;
+    }
+
+    // Look near the crop first; only if the animal isn't there, look everywhere
+    double x = 0;
+    double y = 0;
+    bool found = false;
+    if ( following )
+    {
+        int reachX = size.width() / MotionGate::BLOCK_SIZE;
+        int reachY = size.height() / MotionGate::BLOCK_SIZE;
+        int column = (int)( centreX / MotionGate::BLOCK_SIZE );
+        int row = (int)( centreY / MotionGate::BLOCK_SIZE );
+        found = locate( column - reachX, row - reachY, column + reachX, row + reachY, x, y );
+    }
+    if ( !found )
+        found = locate( 0, 0, columns - 1, rows - 1, x, y );
+    following = found;
+
+    // Move the crop just far enough to bring the animal back within the leash
+    if ( found )
+    {
+        double leashX = (double)size.width() / LEASH_FRACTION;
+        double leashY = (double)size.height() / LEASH_FRACTION;
+        if ( x - centreX > leashX )
+            centreX = x - leashX;
+        else if ( centreX - x > leashX )
+            centreX = x + leashX;
+        if ( y - centreY > leashY )
+            centreY = y - leashY;
+        else if ( centreY - y > leashY )
+            centreY = y + leashY;
+    }
+    int left = (std::min)( (std::max)( (int)lround( centreX - size.width() / 2.0 ), 0 ), area.width() - size.width() );
+    int top = (std::min)( (std::max)( (int)lround( centreY - size.height() / 2.0 ), 0 ), area.height() - size.height() );
+
+    // Follow slow changes of the scene; the animal itself only fades in slowly
+    for ( size_t i = 0; i < blocks.size(); i++ )
+    {
+        int target = blocks[ i ] << 8;
+        int difference = target - background[ i ];
+        bool foreground = abs( difference ) > ( FOREGROUND_THRESHOLD << 8 );
+        background[ i ] = (uint16_t)( background[ i ] + ( difference >> ( foreground ? FOREGROUND_SHIFT : BACKGROUND_SHIFT ) ) );
+    }
+
+    sidecar.writeRow( "%llu,%d,%d,%d,%d,%d", index, secs, ms, left, top, found ? 1 : 0 );
+    return QRect( left, top, size.width(), size.height() );
+}
+
+/**
+ * @brief Stop following at the end of a recording.
+ * @arg None.
+ * @returns void.
+ */
+void CropTracker::stop()
+{
+    lock_guard<std::mutex> lock( mutex );
+    active = false;
+    sidecar.close();
+}
+
+/**
+ * @brief Accessor for the size of the crop.
+ * @arg None.
+ * @returns The size of the current (or last) recording's crop.
+ */
+QSize CropTracker::getSize()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return size;
+}
+
+/**
+ * @brief Centroid of the foreground blocks in a range of blocks.
+ * @param left First column searched; clamped to the ROI, as are the others.
+ * @param top First row searched.
+ * @param right Last column searched.
+ * @param bottom Last row searched.
+ * @param x Out: centroid column, in ROI pixels.
+ * @param y Out: centroid row, in ROI pixels.
+ * @returns Whether any block in the range is foreground.
+ */
+bool CropTracker::locate( int left, int top, int right, int bottom, double& x, double& y )
+{
+    left = (std::max)( left, 0 );
+    top = (std::max)( top, 0 );
+    right = (std::min)( right, columns - 1 );
+    bottom = (std::min)( bottom, rows - 1 );
+
+    double weight = 0;
+    double sumX = 0;
+    double sumY = 0;
+    for ( int row = top; row <= bottom; row++ )
+    {
+        const uint8_t* means = &blocks[ row * columns ];
+        const uint16_t* model = &background[ row * columns ];
+        for ( int column = left; column <= right; column++ )
+        {
+            int difference = abs( ( means[ column ] << 8 ) - model[ column ] ) >> 8;
+            if ( difference <= FOREGROUND_THRESHOLD )
+                continue;
+            double w = difference - FOREGROUND_THRESHOLD;
+            weight += w;
+            sumX += w * column;
+            sumY += w * row;
+        }
+    }
+    if ( weight == 0 )
+        return false;
+
+    x = ( sumX / weight + 0.5 ) * MotionGate::BLOCK_SIZE;
+    y = ( sumY / weight + 0.5 ) * MotionGate::BLOCK_SIZE;
+    return true;
+}
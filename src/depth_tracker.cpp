@@ -0,0 +1,288 @@
+/**
+ * @file depth_tracker.cpp
+ * @brief Online mouse tracking on the depth stream
+ */
+
+// Project includes
+#include "depth_tracker.h"
+
+// Libraries
+#include <QTCore/QtDebug>
+
+// C++
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+/**
+ * @brief DepthTracker constructor
+ * @arg None
+ */
+DepthTracker::DepthTracker( void )
+    : active( false ),
+      frames( 0 ),
+      skipped( 0 ),
+      totalSeconds( 0 ),
+      maxSeconds( 0 )
+{
+}
+
+/**
+ * @brief Start tracking for a recording.
+ * @param sessionPath Recordings folder and session prefix, e.g. .../recordings/Mouse_<date>; the tracking sidecar is named after it.
+ * @returns void.
+ */
+void DepthTracker::start( const QString& sessionPath )
+{
+    lock_guard<std::mutex> lock( mutex );
+    frames = 0;
+    skipped = 0;
+    totalSeconds = 0;
+    maxSeconds = 0;
+    active = sidecar.open( sessionPath, "tracking", "index,seconds,milliseconds,found,x,y,meanHeightMM,maxHeightMM,area,orientation,elongation" );
+}
+
+/**
+ * @brief Find the animal in a depth frame and log where it is.
+ * @param index Arrival index of the frame.
+ * @param depth The raw depth frame, 16 bits per pixel in mm.
+ * @param roi The recorded part of the frame; only it is searched.
+ * @param backgroundMM Depth of the background.
+ * @param secs Timestamp of the frame: seconds.
+ * @param ms Timestamp of the frame: milliseconds.
+ * @returns void.
+ */
+void DepthTracker::track( unsigned long long index, const QImage& depth, const QRect& roi, int backgroundMM, int secs, int ms )
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( !active )
+        return;
+
+    auto start = chrono::steady_clock::now();
+    TrackingResult result = analyse( depth, roi, backgroundMM );
+    sidecar.writeRow( "%llu,%d,%d,%d,%.2f,%.2f,%.1f,%d,%d,%.1f,%.2f",
+                      index, secs, ms, result.found ? 1 : 0, result.x, result.y,
+                      result.meanHeightMM, result.maxHeightMM, result.area, result.orientation, result.elongation );
+    double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+    frames++;
+    totalSeconds += seconds;
+    maxSeconds = (std::max)( maxSeconds, seconds );
+}
+
+/**
+ * @brief Count a frame that was not tracked because capture is falling behind.
+ * @arg None.
+ * @returns void.
+ *
+ * The frame gets no row in the sidecar.
+ */
+void DepthTracker::skip()
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( active )
+        skipped++;
+}
+
+/**
+ * @brief Stop tracking at the end of a recording.
+ * @arg None.
+ * @returns void.
+ */
+void DepthTracker::stop()
+{
+    lock_guard<std::mutex> lock( mutex );
+    active = false;
+    sidecar.close();
+#ifdef DEBUG
+    qDebug() << "Tracked" << frames << "depth frames," << skipped << "skipped, at most" << maxSeconds * 1000 << "ms per frame" << endl;
+#endif
+}
+
+/**
+ * @brief Number of frames tracked in the current (or last) recording.
+ * @arg None.
+ * @returns Frames with a row in the sidecar.
+ */
+int DepthTracker::getFrames()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return frames;
+}
+
+/**
+ * @brief Number of frames not tracked in the current (or last) recording.
+ * @arg None.
+ * @returns Frames skipped while capture was falling behind.
+ */
+int DepthTracker::getSkipped()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return skipped;
+}
+
+/**
+ * @brief Mean time taken per frame tracked.
+ * @arg None.
+ * @returns Milliseconds, including writing the sidecar row.
+ */
+double DepthTracker::getMeanMilliseconds()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return frames > 0 ? totalSeconds * 1000 / frames : 0;
+}
+
+/**
+ * @brief Longest time taken by a frame.
+ * @arg None.
+ * @returns Milliseconds, including writing the sidecar row.
+ */
+double DepthTracker::getMaxMilliseconds()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return maxSeconds * 1000;
+}
+
+/**
+ * @brief Label the foreground of a depth frame and describe its largest component.
+ * @param depth The raw depth frame, 16 bits per pixel in mm.
+ * @param roi The part of the frame searched; coordinates are relative to it.
+ * @param backgroundMM Depth of the background.
+ * @returns Where the animal is; found is false if no component is large enough.
+ */
+TrackingResult DepthTracker::analyse( const QImage& depth, const QRect& roi, int backgroundMM )
+{
+    TrackingResult result = {};
+    QRect region = roi.intersected( depth.rect() );
+    int width = region.width();
+    if ( region.isEmpty() )
+        return result;
+
+    // One pass: label each foreground pixel after its left or upper neighbour, merging labels where both are
+    // foreground, and accumulate moments per label. Only two rows of labels are needed.
+    labels.assign( 2 * width, -1 );
+    parent.clear();
+    moments.clear();
+    for ( int y = 0; y < region.height(); y++ )
+    {
+        const uint16_t* row = (const uint16_t*)depth.constScanLine( region.y() + y ) + region.x();
+        int* current = &labels[ ( y & 1 ) * width ];
+        const int* above = &labels[ ( ( y + 1 ) & 1 ) * width ];
+        for ( int x = 0; x < width; x++ )
+        {
+            int value = row[ x ];
+            int height = backgroundMM - value;
+            if ( value == 0 || value >= INVALID_DEPTH || height < MIN_HEIGHT_MM )
+            {
+                current[ x ] = -1;
+                continue;
+            }
+
+            int left = ( x > 0 ) ? current[ x - 1 ] : -1;
+            int up = above[ x ];
+            int label;
+            if ( left < 0 && up < 0 )
+            {
+                label = (int)parent.size();
+                parent.push_back( label );
+                moments.push_back( Moments() );
+            }
+            else if ( left < 0 )
+            {
+                label = up;
+            }
+            else
+            {
+                label = left;
+                if ( up >= 0 )
+                {
+                    int a = find( left );
+                    int b = find( up );
+                    if ( a != b )
+                        parent[ (std::max)( a, b ) ] = (std::min)( a, b );
+                }
+            }
+            current[ x ] = label;
+
+            Moments& m = moments[ label ];
+            m.count++;
+            m.sumX += x;
+            m.sumY += y;
+            m.sumXX += (double)x * x;
+            m.sumYY += (double)y * y;
+            m.sumXY += (double)x * y;
+            m.sumHeight += height;
+            m.maxHeight = (std::max)( m.maxHeight, height );
+        }
+    }
+
+    // Fold every label into its root; roots are the smallest label of their component
+    int best = -1;
+    for ( int label = 0; label < (int)parent.size(); label++ )
+    {
+        int root = find( label );
+        if ( root != label )
+        {
+            Moments& m = moments[ root ];
+            const Moments& part = moments[ label ];
+            m.count += part.count;
+            m.sumX += part.sumX;
+            m.sumY += part.sumY;
+            m.sumXX += part.sumXX;
+            m.sumYY += part.sumYY;
+            m.sumXY += part.sumXY;
+            m.sumHeight += part.sumHeight;
+            m.maxHeight = (std::max)( m.maxHeight, part.maxHeight );
+        }
+    }
+    for ( int label = 0; label < (int)parent.size(); label++ )
+    {
+        if ( parent[ label ] == label && ( best < 0 || moments[ label ].count > moments[ best ].count ) )
+            best = label;
+    }
+    if ( best < 0 || moments[ best ].count < MIN_AREA )
+        return result;
+
+    // Centroid, and orientation and elongation from the central second moments
+    const Moments& m = moments[ best ];
+    double n = m.count;
+    double x = m.sumX / n;
+    double y = m.sumY / n;
+    double mu20 = m.sumXX / n - x * x;
+    double mu02 = m.sumYY / n - y * y;
+    double mu11 = m.sumXY / n - x * y;
+    double spread = sqrt( ( mu20 - mu02 ) * ( mu20 - mu02 ) / 4 + mu11 * mu11 );
+    double major = ( mu20 + mu02 ) / 2 + spread;
+    double minor = ( mu20 + mu02 ) / 2 - spread;
+
+    result.found = true;
+    result.x = x;
+    result.y = y;
+    result.meanHeightMM = m.sumHeight / n;
+    result.maxHeightMM = m.maxHeight;
+    result.area = m.count;
+    result.orientation = 0.5 * atan2( 2 * mu11, mu20 - mu02 ) * 180 / 3.14159265358979323846;
+    result.elongation = minor > 0 ? sqrt( major / minor ) : 0;
+    return result;
+}
+
+/**
+ * @brief Root of a label in the union-find forest, compressing the path on the way.
+ * @param label A provisional label.
+ * @returns The smallest label of its component.
+ */
+int DepthTracker::find( int label )
+{
+    int root = label;
+    while ( parent[ root ] != root )
+        root = parent[ root ];
+    while ( parent[ label ] != root )
+    {
+        int next = parent[ label ];
+        parent[ label ] = root;
+        label = next;
+    }
+    return root;
+}
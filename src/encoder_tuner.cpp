@@ -0,0 +1,274 @@
+/**
+ * @file encoder_tuner.cpp
+ * @brief Picks encoder settings per channel that the rig can sustain
+ */
+
+// Project includes
+#include "encoder_tuner.h"
+#include "sidecar_writer.h"
+
+// Libraries
+#include <QTCore/QFile.h>
+#include <QTCore/QtDebug>
+
+// C++
+#include <chrono>
+#include <thread>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+// JPEG qualities tried, best first
+static const int LADDER_QUALITIES[] = { 95, 90, 80, 70, 60, 50, 40 };
+
+// A paced trial never quite reaches its pace; this share of it counts as keeping up
+static const double PACE_TOLERANCE = 0.95;
+
+/**
+ * @brief EncoderTuner constructor
+ * @param backend Storage backend the trials write through, as in a recording.
+ * @param queueDepth Writes in flight for asynchronous backends.
+ */
+EncoderTuner::EncoderTuner( SEQStorage::Backend backend, int queueDepth )
+    : backend( backend ),
+      queueDepth( queueDepth )
+{
+}
+
+/**
+ * @brief Add a channel to be tuned.
+ * @param channel The channel.
+ * @param width Width of the channel's ROI.
+ * @param height Height of the channel's ROI.
+ * @param fps Frame rate the channel must sustain.
+ * @param sample A frame of the channel, in the format it is recorded in; null for a synthetic one.
+ * @param outputDir Directory the channel records to. The trial files are written to its recordings folder and deleted.
+ * @param follows Index of a previously added channel whose settings this one shares (e.g. IR follows depth), or -1.
+ * @returns void.
+ */
+void EncoderTuner::addChannel( Streamer::Channels channel, int width, int height, double fps, const QImage& sample, std::string outputDir, int follows )
+{
+    Channel entry;
+    entry.channel = channel;
+    entry.width = width;
+    entry.height = height;
+    entry.fps = fps;
+    entry.sample = ( sample.isNull() || sample.width() != width || sample.height() != height )
+                   ? syntheticFrame( channel, width, height )
+                   : sample;
+    entry.outputDir = outputDir;
+    entry.follows = follows;
+    entry.ladder = makeLadder( entry.sample );
+    entry.step = 0;
+    entry.achievedFps = 0;
+    channels.push_back( entry );
+}
+
+/**
+ * @brief Generate a frame for channels without a live sample.
+ * @param channel The channel, which sets the pixel format.
+ * @param width Width of the frame.
+ * @param height Height of the frame.
+ * @returns A gradient with some noise on top, which compresses roughly like a camera frame.
+ */
+QImage EncoderTuner::syntheticFrame( Streamer::Channels channel, int width, int height )
+{
+    QImage::Format format = QImage::Format_Grayscale8;
+    if ( channel == Streamer::Channels::Color )
+        format = QImage::Format_RGB888;
+    else if ( channel == Streamer::Channels::Depth || channel == Streamer::Channels::IR )
+        format = QImage::Format_RGB16;
+
+    QImage frame( width, height, format );
+    int bytesPerPixel = frame.depth() / 8;
+    uint32_t noise = 2463534242u;
+    for ( int y = 0; y < height; y++ )
+    {
+        unsigned char* line = frame.scanLine( y );
+        for ( int x = 0; x < width * bytesPerPixel; x++ )
+        {
+            noise ^= noise << 13;
+            noise ^= noise >> 17;
+            noise ^= noise << 5;
+            line[ x ] = (unsigned char)( ( x / bytesPerPixel + y ) / 4 + ( noise & 0x0F ) );
+        }
+    }
+    return frame;
+}
+
+/**
+ * @brief Build the ladder of candidate settings for a channel.
+ * @param sample A frame of the channel.
+ * @returns Candidates, best first.
+ *
+ * Raw comes first. Then, for each quality, every chroma subsampling (color frames
+ * only), and for each of those 1, 2, 4... encoder threads up to the core count, so
+ * that spending more CPU is preferred over losing image quality.
+ */
+std::vector<EncoderTuner::Candidate> EncoderTuner::makeLadder( const QImage& sample )
+{
+    std::vector<Candidate> ladder;
+    Candidate candidate;
+    candidate.compressed = false;
+    ladder.push_back( candidate );
+
+    std::vector<int> subsamplings = { TJSAMP_444 };
+    if ( sample.format() != QImage::Format_Grayscale8 )
+        subsamplings = { TJSAMP_444, TJSAMP_422, TJSAMP_420 };
+    int cores = (std::max)( (int)std::thread::hardware_concurrency(), 1 );
+
+    candidate.compressed = true;
+    for ( int quality : LADDER_QUALITIES )
+    {
+        for ( int subsampling : subsamplings )
+        {
+            for ( int threads = 1; threads <= cores; threads *= 2 )
+            {
+                candidate.profile = EncoderProfile();
+                candidate.profile.quality = quality;
+                candidate.profile.subsampling = subsampling;
+                candidate.profile.threads = threads;
+                ladder.push_back( candidate );
+            }
+        }
+    }
+    return ladder;
+}
+
+/**
+ * @brief Describe a candidate for the report.
+ * @param candidate The candidate.
+ * @returns e.g. "raw" or "JPEG quality=80 subsampling=444 ...".
+ */
+std::string EncoderTuner::describe( const Candidate& candidate )
+{
+    if ( !candidate.compressed )
+        return "raw";
+    ostringstream description;
+    description << "JPEG quality=" << candidate.profile.quality << " " << candidate.profile.describe();
+    return description.str();
+}
+
+/**
+ * @brief Find settings for every channel added.
+ * @param report Out: one line per channel with the chosen setting and the frame rate it reached.
+ * @returns The settings, one per channel added, in the same order.
+ */
+std::vector<EncoderTuner::Result> EncoderTuner::run( std::string& report )
+{
+    double margin = 1.0 + SAFETY_MARGIN_PERCENT / 100.0;
+    auto keepsUp = [ & ]( const Channel& channel ) { return channel.achievedFps >= channel.fps * margin * PACE_TOLERANCE; };
+    int rounds = 0;
+
+    while ( !channels.empty() )
+    {
+        trial();
+        rounds++;
+
+        // Step down every channel that fell behind, or whose followers did
+        bool stepped = false;
+        for ( size_t i = 0; i < channels.size(); i++ )
+        {
+            if ( channels[ i ].follows >= 0 )
+                continue;
+            bool behind = !keepsUp( channels[ i ] );
+            for ( auto& follower : channels )
+                behind = behind || ( follower.follows == (int)i && !keepsUp( follower ) );
+            if ( behind && channels[ i ].step + 1 < channels[ i ].ladder.size() )
+            {
+                channels[ i ].step++;
+                stepped = true;
+            }
+        }
+        if ( !stepped )
+            break;
+    }
+
+    std::vector<Result> results;
+    ostringstream lines;
+    lines << fixed << setprecision( 1 );
+    for ( auto& channel : channels )
+    {
+        const Channel& leader = channel.follows >= 0 ? channels[ channel.follows ] : channel;
+        const Candidate& candidate = leader.ladder[ leader.step ];
+
+        Result result;
+        result.channel = channel.channel;
+        result.compressed = candidate.compressed;
+        result.profile = candidate.profile;
+        result.requiredFps = channel.fps;
+        result.achievedFps = channel.achievedFps;
+        result.sustained = keepsUp( channel );
+        results.push_back( result );
+
+        lines << SEQWriter::fileNameChannels[ channel.channel ] << ": " << describe( candidate )
+              << ", " << channel.achievedFps << " fps written for " << channel.fps << " fps needed"
+              << ( result.sustained ? "" : " - CANNOT KEEP UP, even at the lowest setting" ) << endl;
+    }
+    lines << rounds << " trial" << ( rounds == 1 ? "" : "s" ) << ", " << SAFETY_MARGIN_PERCENT << "% safety margin" << endl;
+
+    report = lines.str();
+    return results;
+}
+
+/**
+ * @brief Write every channel at once with its current candidate.
+ * @arg None.
+ * @returns void.
+ */
+void EncoderTuner::trial()
+{
+    std::vector<std::thread> writers;
+    for ( auto& channel : channels )
+    {
+        const Channel& leader = channel.follows >= 0 ? channels[ channel.follows ] : channel;
+        writers.push_back( std::thread( &EncoderTuner::writeTrial, &channel, backend, queueDepth, leader.ladder[ leader.step ] ) );
+    }
+    for ( auto& writer : writers )
+        writer.join();
+
+#ifdef DEBUG
+    for ( auto& channel : channels )
+        qDebug() << "Auto-tune" << SEQWriter::fileNameChannels[ channel.channel ].c_str() << channel.achievedFps << "fps" << endl;
+#endif
+}
+
+/**
+ * @brief Record one channel's trial file and measure the rate it was written at.
+ * @param channel The channel; its achievedFps is filled in.
+ * @param backend Storage backend.
+ * @param queueDepth Writes in flight for asynchronous backends.
+ * @param candidate The setting to try.
+ * @returns void.
+ *
+ * Frames are paced at the required rate plus the safety margin, as a camera would
+ * deliver them, so that channels compete for CPU and disk for the whole trial.
+ */
+void EncoderTuner::writeTrial( Channel* channel, SEQStorage::Backend backend, int queueDepth, const Candidate& candidate )
+{
+    double pace = channel->fps * ( 1.0 + SAFETY_MARGIN_PERCENT / 100.0 );
+    int frames = (std::max)( (int)( channel->fps * TRIAL_SECONDS ), (int)MIN_TRIAL_FRAMES );
+    QImage frame = channel->sample.copy();
+
+    SEQWriter writer( channel->channel );
+    writer.setStorageBackend( backend, queueDepth );
+    writer.setEncoderProfile( candidate.profile );
+
+    auto start = chrono::steady_clock::now();
+    writer.startRecording( channel->outputDir, channel->width, channel->height, candidate.compressed, "autotune", false, channel->fps );
+    for ( int i = 0; i < frames; i++ )
+    {
+        this_thread::sleep_until( start + chrono::duration_cast<chrono::steady_clock::duration>( chrono::duration<double>( i / pace ) ) );
+        double timestamp = i / channel->fps;
+        writer.writeFrame( &frame, (int)timestamp, (short)( ( timestamp - (int)timestamp ) * 1000 ) );
+    }
+    writer.stopRecording();
+    double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+    channel->achievedFps = frames / seconds;
+
+    QFile::remove( writer.getFileName() );
+    QFile::remove( SidecarWriter::pathFor( writer.getFileName(), "quality" ) );
+}
@@ -0,0 +1,344 @@
+/**
+ * @file frame_bus_publisher.cpp
+ * @brief Publishes synchronized frame sets on the shared memory frame bus
+ */
+
+// Project includes
+#include "frame_bus_publisher.h"
+
+// Libraries
+#include <QTCore/QtDebug>
+
+// C++
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief FrameBusSettings constructor
+ * @arg None
+ *
+ * The bus is off by default.
+ */
+FrameBusSettings::FrameBusSettings( void )
+    : enabled( false ),
+      name( FrameBusLayout::defaultName() ),
+      slotCount( FrameBusPublisher::DEFAULT_SLOTS ),
+      slotMegabytes( FrameBusPublisher::DEFAULT_SLOT_MEGABYTES )
+{
+}
+
+/**
+ * @brief FrameBusPublisher constructor
+ * @arg None
+ */
+FrameBusPublisher::FrameBusPublisher( void )
+    : mapping( NULL ),
+      header( NULL ),
+      truncated( 0 )
+{
+}
+
+/**
+ * @brief FrameBusPublisher destructor
+ */
+FrameBusPublisher::~FrameBusPublisher( void )
+{
+    close();
+}
+
+/**
+ * @brief Create the bus.
+ * @param settings Its name and size.
+ * @returns Whether the bus was created; it is not if another process publishes under the same name.
+ */
+bool FrameBusPublisher::open( const FrameBusSettings& settings )
+{
+    close();
+    lock_guard<std::mutex> lock( mutex );
+
+    int slotCount = (std::max)( settings.slotCount, (int)MIN_SLOTS );
+    unsigned long long slotSize = (unsigned long long)(std::max)( settings.slotMegabytes, 1 ) * 1024 * 1024;
+    // One slot more than used: a reader that raced the publisher may combine an offset and a size from
+    // different sets, and must still stay inside the mapping. Pages never written cost no memory.
+    unsigned long long size = FrameBusLayout::HEADER_SIZE + ( slotCount + 1 ) * slotSize;
+    mapping = CreateFileMappingA( INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                  (DWORD)( size >> 32 ), (DWORD)( size & 0xFFFFFFFF ), settings.name.c_str() );
+    if ( mapping && GetLastError() == ERROR_ALREADY_EXISTS )
+    {
+        CloseHandle( mapping );
+        mapping = NULL;
+    }
+    if ( !mapping )
+    {
+#ifdef DEBUG
+        qDebug() << "Cannot create frame bus" << settings.name.c_str() << endl;
+#endif
+        return false;
+    }
+
+    header = (FrameBusHeader*)MapViewOfFile( mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0 );
+    if ( !header )
+    {
+        CloseHandle( mapping );
+        mapping = NULL;
+        return false;
+    }
+
+    // Readers check the magic number last, so fill it in once everything else is there
+    header->version = FrameBusLayout::VERSION;
+    header->slotCount = slotCount;
+    header->publisherProcess = GetCurrentProcessId();
+    header->slotSize = slotSize;
+    header->published = 0;
+    MemoryBarrier();
+    header->magic = FrameBusLayout::MAGIC;
+    truncated = 0;
+    return true;
+}
+
+/**
+ * @brief Remove the bus; it disappears once the last reader unmaps it.
+ * @arg None.
+ * @returns void.
+ */
+void FrameBusPublisher::close()
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( header )
+        UnmapViewOfFile( header );
+    if ( mapping )
+        CloseHandle( mapping );
+    header = NULL;
+    mapping = NULL;
+}
+
+/**
+ * @brief Whether the bus is up.
+ * @arg None.
+ * @returns True between a successful open() and close().
+ */
+bool FrameBusPublisher::isOpen()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return header != NULL;
+}
+
+/**
+ * @brief Copy a frame set into the next slot.
+ * @param frames One frame per channel, in the order of Streamer::Channels.
+ * @param recording Whether the set is being recorded.
+ * @param gateOpen Whether the motion gate lets it be written.
+ * @returns void.
+ */
+void FrameBusPublisher::publish( const Frame frames[ FrameBusLayout::MAX_CHANNELS ], bool recording, bool gateOpen )
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( !header )
+        return;
+
+    // Odd while the slot is written, so readers can tell
+    int64_t set = header->published;
+    FrameBusSlot* slot = (FrameBusSlot*)( (uint8_t*)header + FrameBusLayout::HEADER_SIZE + ( set % header->slotCount ) * header->slotSize );
+    InterlockedExchange64( (volatile LONG64*)&slot->sequence, 2 * set + 1 );
+
+    slot->set = set;
+    slot->recording = recording ? 1 : 0;
+    slot->gateOpen = gateOpen ? 1 : 0;
+    uint64_t offset = FrameBusLayout::SLOT_HEADER_SIZE;
+    for ( int c = 0; c < FrameBusLayout::MAX_CHANNELS; c++ )
+    {
+        const Frame& frame = frames[ c ];
+        FrameBusChannel& channel = slot->channels[ c ];
+        channel.format = frame.data ? frame.format : FrameBusLayout::NoFrame;
+        channel.size = 0;
+        if ( channel.format == FrameBusLayout::NoFrame )
+            continue;
+
+        channel.width = frame.width;
+        channel.height = frame.height;
+        channel.stride = frame.stride;
+        channel.roiX = frame.roi.x();
+        channel.roiY = frame.roi.y();
+        channel.roiWidth = frame.roi.width();
+        channel.roiHeight = frame.roi.height();
+        channel.timestampSeconds = frame.timestampSeconds;
+        channel.timestampMilliSeconds = frame.timestampMilliSeconds;
+        channel.frameIndex = frame.frameIndex;
+        channel.offset = offset;
+
+        uint64_t size = (uint64_t)frame.stride * frame.height;
+        if ( offset + size > header->slotSize )
+        {
+            truncated++;
+            continue;
+        }
+        memcpy( (uint8_t*)slot + offset, frame.data, size );
+        channel.size = size;
+        offset += ( size + FrameBusLayout::FRAME_ALIGNMENT - 1 ) & ~(uint64_t)( FrameBusLayout::FRAME_ALIGNMENT - 1 );
+    }
+
+    InterlockedExchange64( (volatile LONG64*)&slot->sequence, 2 * set + 2 );
+    InterlockedExchange64( (volatile LONG64*)&header->published, set + 1 );
+}
+
+/**
+ * @brief Number of sets published since the bus was created.
+ * @arg None.
+ * @returns Sets; 0 if the bus is not up.
+ */
+long long FrameBusPublisher::getPublished()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return header ? header->published : 0;
+}
+
+/**
+ * @brief Number of frames published without their data because the slots are too small.
+ * @arg None.
+ * @returns Frames since the bus was created.
+ */
+long long FrameBusPublisher::getTruncated()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return truncated;
+}
+
+/**
+ * @brief Measure how fast frame sets go through the bus to several readers.
+ * @param readers Number of reader threads.
+ * @param seconds How long to publish for.
+ * @returns A human-readable report: the publisher's rate, then one line per reader.
+ *
+ * Synthetic sets the size of a full recording (two 1920x1200 Point Grey
+ * frames, a 1280x720 color frame, and depth and IR at 320x240) are published
+ * as fast as possible on a private bus. Each reader maps it through
+ * FrameBusReader, like a client process would, and reads every byte of each
+ * set it gets to.
+ */
+std::string FrameBusPublisher::benchmark( int readers, double seconds )
+{
+    FrameBusSettings settings;
+    settings.name = string( FrameBusLayout::defaultName() ) + "Benchmark" + to_string( GetCurrentProcessId() );
+    FrameBusPublisher publisher;
+    ostringstream report;
+    report << fixed << setprecision( 1 );
+    if ( !publisher.open( settings ) )
+    {
+        report << "Cannot create " << settings.name << endl;
+        return report.str();
+    }
+
+    // Gradients rather than constants, so nothing along the way can shortcut the data
+    const int sizes[][ 3 ] = { { 1920, 1200, 1 }, { 1920, 1200, 1 }, { 1280, 720, 3 }, { 320, 240, 2 }, { 320, 240, 2 } };
+    const FrameBusLayout::Format formats[] = { FrameBusLayout::Grey8, FrameBusLayout::Grey8, FrameBusLayout::BGR24,
+                                               FrameBusLayout::Depth16, FrameBusLayout::Depth16 };
+    vector<vector<uint8_t>> data( FrameBusLayout::MAX_CHANNELS );
+    Frame frames[ FrameBusLayout::MAX_CHANNELS ];
+    double setMegabytes = 0;
+    for ( int c = 0; c < FrameBusLayout::MAX_CHANNELS; c++ )
+    {
+        int stride = sizes[ c ][ 0 ] * sizes[ c ][ 2 ];
+        data[ c ].resize( (size_t)stride * sizes[ c ][ 1 ] );
+        for ( size_t i = 0; i < data[ c ].size(); i++ )
+            data[ c ][ i ] = (uint8_t)( i + c );
+        frames[ c ].format = formats[ c ];
+        frames[ c ].data = &data[ c ][ 0 ];
+        frames[ c ].width = sizes[ c ][ 0 ];
+        frames[ c ].height = sizes[ c ][ 1 ];
+        frames[ c ].stride = stride;
+        frames[ c ].roi = QRect( 0, 0, sizes[ c ][ 0 ], sizes[ c ][ 1 ] );
+        setMegabytes += (double)data[ c ].size() / ( 1024 * 1024 );
+    }
+
+    /** What a reader got through */
+    struct ReaderResult
+    {
+        long long sets;
+        long long torn;
+        long long lapped;
+        unsigned long long checksum;
+    };
+    vector<ReaderResult> results( readers );
+    atomic<bool> done( false );
+    vector<thread> threads;
+    for ( int r = 0; r < readers; r++ )
+    {
+        threads.push_back( thread( [ &, r ]() {
+            ReaderResult result = {};
+            FrameBusReader reader;
+            FrameBusReader::View view;
+            if ( reader.open( settings.name.c_str() ) )
+            {
+                while ( !done )
+                {
+                    if ( !reader.next( view ) )
+                    {
+                        this_thread::yield();
+                        continue;
+                    }
+                    unsigned long long sum = 0;
+                    for ( int c = 0; c < FrameBusLayout::MAX_CHANNELS; c++ )
+                    {
+                        if ( !view.has( c ) )
+                            continue;
+                        const uint64_t* words = (const uint64_t*)view.data( c );
+                        for ( uint64_t i = 0; i < view.channel( c ).size / sizeof( uint64_t ); i++ )
+                            sum += words[ i ];
+                    }
+                    if ( reader.valid( view ) )
+                    {
+                        result.sets++;
+                        result.checksum += sum;
+                    }
+                    else
+                    {
+                        result.torn++;
+                    }
+                }
+                result.lapped = reader.getLapped();
+            }
+            results[ r ] = result;
+        } ) );
+    }
+
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0;
+    long long published = 0;
+    while ( elapsed < seconds )
+    {
+        for ( int c = 0; c < FrameBusLayout::MAX_CHANNELS; c++ )
+        {
+            frames[ c ].frameIndex = published;
+            frames[ c ].timestampSeconds = (int)( published / 30 );
+            frames[ c ].timestampMilliSeconds = (int)( published % 30 ) * 33;
+        }
+        publisher.publish( frames, false, true );
+        published++;
+        elapsed = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+    }
+    done = true;
+    for ( auto& t : threads )
+        t.join();
+
+    report << "Publisher: " << published << " sets of " << setMegabytes << " MB in " << elapsed << " s, "
+           << published / elapsed << " sets/s, "
+           << published * setMegabytes / elapsed << " MB/s" << endl;
+    for ( int r = 0; r < readers; r++ )
+    {
+        report << "Reader " << r + 1 << ": "
+               << results[ r ].sets << " sets, "
+               << results[ r ].sets / elapsed << " sets/s, "
+               << results[ r ].sets * setMegabytes / elapsed << " MB/s, "
+               << results[ r ].lapped << " lapped, "
+               << results[ r ].torn << " overwritten while read" << endl;
+    }
+    return report.str();
+}
@@ -0,0 +1,425 @@
+/**
+ * @file headless_recorder.cpp
+ * @brief Records from the command line, without the main window
+ */
+
+// Project includes
+#include "headless_recorder.h"
+#include "hunter.h"
+#include "seq_writer.h"
+#include "exceptions.h"
+
+// Libraries
+#include <QTCore/QDir>
+
+// C++
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+using namespace std;
+
+std::atomic<int> HeadlessRecorder::stopRequests( 0 );
+
+/**
+ * @brief HeadlessRecorder constructor
+ * @arg None
+ *
+ * Starts the cameras, exactly like the main window does.
+ */
+HeadlessRecorder::HeadlessRecorder( void )
+    : admissionPolicy( AdmissionRefuse )
+{
+    for ( int c = 0; c < CameraController::Cameras::NUM_CAMERAS; c++ )
+        recorded[ c ] = false;
+
+    cc = new CameraController();
+    streamer = new Streamer( cc );
+    streamer->run();
+}
+
+/**
+ * @brief HeadlessRecorder destructor
+ */
+HeadlessRecorder::~HeadlessRecorder( void )
+{
+    delete streamer;
+    delete cc;
+}
+
+/**
+ * @brief Load a configuration saved by the UI.
+ * @param fileName Path to the configuration.
+ * @param error Out: why the configuration could not be used.
+ * @returns Whether the configuration was loaded.
+ */
+bool HeadlessRecorder::loadConfig( const std::string& fileName, std::string& error )
+{
+    pugi::xml_document doc;
+    pugi::xml_parse_result result = doc.load_file( fileName.c_str() );
+    if ( !result )
+    {
+        error = fileName + ": " + result.description();
+        return false;
+    }
+
+    pugi::xml_node cameraSetting = doc.first_child();
+    pugi::xml_node pointGreyTop = cameraSetting.find_child_by_attribute( "pointGrey", "location", "top" );
+    pugi::xml_node pointGreyFront = cameraSetting.find_child_by_attribute( "pointGrey", "location", "front" );
+    pugi::xml_node intelColor = cameraSetting.child( "intelColor" );
+    pugi::xml_node intelDepth = cameraSetting.child( "intelDepth" );
+
+    // Working directory; like the UI, fall back to the current one
+    QString dir = cameraSetting.child_value( "currentWorkingDirectory" );
+    if ( dir.isEmpty() || !QDir( dir ).exists() )
+        dir = QDir::currentPath();
+    streamer->setCurrentWorkingDir( dir.toStdString() );
+
+    Hunter::loadStreamerSettings( cameraSetting, streamer );
+
+    string admission = cameraSetting.child_value( "admissionCheck" );
+    if ( admission == "off" )
+        admissionPolicy = AdmissionOff;
+    else if ( admission == "warn" )
+        admissionPolicy = AdmissionWarn;
+    else
+        admissionPolicy = AdmissionRefuse;
+
+    // The front camera on USB 0 means the Point Grey cameras are switched
+    streamer->isPGswitched = !strcmp( pointGreyFront.attribute( "usb" ).value(), "0" );
+
+    loadRecord( pointGreyTop, CameraController::Cameras::PointGreyTop );
+    loadRecord( pointGreyFront, CameraController::Cameras::PointGreyFront );
+    loadRecord( intelColor, CameraController::Cameras::Color );
+    loadRecord( intelDepth, CameraController::Cameras::Depth );
+
+    loadPointGrey( pointGreyTop, CameraController::Cameras::PointGreyTop );
+    loadPointGrey( pointGreyFront, CameraController::Cameras::PointGreyFront );
+    if ( !loadROI( intelColor.child( "roi" ), CameraController::Cameras::Color ) )
+        printf( "Ignoring the color ROI, which is outside the frame\n" );
+    if ( !loadROI( intelDepth.child( "roi" ), CameraController::Cameras::Depth ) )
+        printf( "Ignoring the depth ROI, which is outside the frame\n" );
+    int maxDepth = intelDepth.child( "maxValue" ).text().as_int();
+    if ( maxDepth > 0 )
+        streamer->maxDepthMM = maxDepth;
+
+    return true;
+}
+
+/**
+ * @brief Take a camera's Record and JPEG settings from the configuration.
+ * @param node The camera's node.
+ * @param camera The camera.
+ * @returns void.
+ */
+void HeadlessRecorder::loadRecord( pugi::xml_node node, CameraController::Cameras camera )
+{
+    recorded[ camera ] = !strcmp( node.child_value( "record" ), "true" );
+    streamer->setCompressed( camera, recorded[ camera ] && !strcmp( node.child( "record" ).attribute( "method" ).value(), "jpeg" ) );
+}
+
+/**
+ * @brief Apply a Point Grey camera's properties and ROI from the configuration.
+ * @param node The camera's node.
+ * @param camera The camera the node describes.
+ * @returns void.
+ *
+ * Like the UI, the settings go to the other camera if the cameras are switched.
+ */
+void HeadlessRecorder::loadPointGrey( pugi::xml_node node, CameraController::Cameras camera )
+{
+    if ( streamer->isPGswitched )
+        camera = camera == CameraController::Cameras::PointGreyTop ? CameraController::Cameras::PointGreyFront : CameraController::Cameras::PointGreyTop;
+
+    const char* names[] = { "frameRate", "shutterSpeed", "gain", "brightness" };
+    const CameraController::CameraProperties properties[] = { CameraController::CameraProperties::FPS,
+                                                              CameraController::CameraProperties::Shutter,
+                                                              CameraController::CameraProperties::Gain,
+                                                              CameraController::CameraProperties::Brightness };
+    for ( int i = 0; i < 4; i++ )
+    {
+        if ( !*node.child_value( names[ i ] ) )
+            continue;
+        try
+        {
+            cc->setValue( camera, properties[ i ], node.child( names[ i ] ).text().as_float() );
+        }
+        catch ( exception_t e )
+        {
+            printf( "Cannot set the %s of the %s camera\n", names[ i ], SEQWriter::fileNameChannels[ camera ].c_str() );
+        }
+    }
+
+    if ( !loadROI( node.child( "roi" ), camera ) )
+        printf( "Ignoring the %s ROI, which is outside the frame\n", SEQWriter::fileNameChannels[ camera ].c_str() );
+}
+
+/**
+ * @brief Apply a camera's ROI from the configuration.
+ * @param roi The ROI's node.
+ * @param camera The camera.
+ * @returns False if the ROI is given but does not fit in the camera's frame.
+ */
+bool HeadlessRecorder::loadROI( pugi::xml_node roi, CameraController::Cameras camera )
+{
+    if ( !roi )
+        return true;
+
+    int x = roi.child( "x" ).text().as_int();
+    int y = roi.child( "y" ).text().as_int();
+    int w = roi.child( "width" ).text().as_int();
+    int h = roi.child( "height" ).text().as_int();
+    if ( x < 0 || y < 0 || w <= 0 || h <= 0 ||
+         x + w > streamer->getOriginalROI( camera, Streamer::ROICoordinates::W ) ||
+         y + h > streamer->getOriginalROI( camera, Streamer::ROICoordinates::H ) )
+        return false;
+    streamer->setROI( camera, x, y, w, h );
+    return true;
+}
+
+/**
+ * @brief Record the configured channels.
+ * @param seconds How long to record for; 0 to record until stopped.
+ * @param statsSeconds Interval between reports.
+ * @returns Exit code: 0 if the recording ran, 1 if nothing is selected, the disks were judged too slow, or it did not start or stop in time.
+ *
+ * Ctrl+C, or a stop command through the control server, stops the recording.
+ * If deferred compression is on, the recorder then waits for it to finish; a
+ * second Ctrl+C leaves the remaining files raw.
+ */
+int HeadlessRecorder::record( double seconds, double statsSeconds )
+{
+    bool pgt = recorded[ CameraController::Cameras::PointGreyTop ];
+    bool pgf = recorded[ CameraController::Cameras::PointGreyFront ];
+    bool color = recorded[ CameraController::Cameras::Color ];
+    bool depth = recorded[ CameraController::Cameras::Depth ];
+    if ( !pgt && !pgf && !color && !depth )
+    {
+        printf( "The configuration does not select any camera for recording\n" );
+        return 1;
+    }
+
+    // Nobody to ask, so a warning is only printed
+    if ( admissionPolicy != AdmissionOff )
+    {
+        string report;
+        Streamer::Admission admission = streamer->checkWriteThroughput( pgt, pgf, color, depth, report );
+        printf( "%s", report.c_str() );
+        if ( admission == Streamer::Admission::Overcommitted && admissionPolicy == AdmissionRefuse )
+        {
+            printf( "Not recording: the selected streams need more than the output disk can sustain\n" );
+            return 1;
+        }
+        if ( admission != Streamer::Admission::Admitted )
+            printf( "Warning: the output disk may be too slow; frames may be dropped\n" );
+    }
+
+    stopRequests = 0;
+    SetConsoleCtrlHandler( consoleHandler, TRUE );
+
+    // Between frame sets, like the control server does. If that takes too long, the start is called off,
+    // as the command would otherwise still run later with nobody to stop it.
+    Streamer* streamer = this->streamer;
+    unsigned long long frameSet = 0;
+    if ( !streamer->tryAtFrameSetBoundary( [ streamer, pgt, pgf, color, depth ]() {
+        if ( !streamer->isRecording() )
+            streamer->startRecording( pgt, pgf, color, depth );
+    }, frameSet ) )
+    {
+        printf( "Not recording: no frame set boundary within %d ms; are the cameras delivering frames?\n", Streamer::BOUNDARY_TIMEOUT_MS );
+        SetConsoleCtrlHandler( consoleHandler, FALSE );
+        return 1;
+    }
+    for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+        lastStatus[ c ] = streamer->getChannelStatus( (Streamer::Channels)c );
+    printf( "Recording from frame set %llu%s\n", frameSet, seconds > 0 ? "" : " until Ctrl+C" );
+    fflush( stdout );
+
+    auto start = chrono::steady_clock::now();
+    auto lastReport = start;
+    while ( !stopRequests && streamer->isRecording() )
+    {
+        this_thread::sleep_for( chrono::milliseconds( POLL_MS ) );
+        auto now = chrono::steady_clock::now();
+        if ( seconds > 0 && chrono::duration<double>( now - start ).count() >= seconds )
+            break;
+        double sinceReport = chrono::duration<double>( now - lastReport ).count();
+        if ( sinceReport >= statsSeconds )
+        {
+            printStats( sinceReport );
+            lastReport = now;
+        }
+    }
+
+    bool stopped = finish( chrono::duration<double>( chrono::steady_clock::now() - lastReport ).count() );
+    if ( stopped )
+        printf( "Stopped after %.1f s\n", chrono::duration<double>( chrono::steady_clock::now() - start ).count() );
+    fflush( stdout );
+    waitForCompression();
+
+    SetConsoleCtrlHandler( consoleHandler, FALSE );
+    return stopped ? 0 : 1;
+}
+
+/**
+ * @brief Leave recording to the control server, and report on its recordings, until Ctrl+C.
+ * @param statsSeconds Interval between reports while recording.
+ * @returns Exit code: 0, or 1 if the configuration doesn't enable the control server.
+ */
+int HeadlessRecorder::serve( double statsSeconds )
+{
+    ControlServerSettings control = streamer->getControlServer();
+    if ( !control.enabled )
+    {
+        printf( "Serving needs <controlServer> in the configuration\n" );
+        return 1;
+    }
+
+    stopRequests = 0;
+    SetConsoleCtrlHandler( consoleHandler, TRUE );
+    printf( "Waiting for commands on 127.0.0.1:%d until Ctrl+C\n", control.port );
+    fflush( stdout );
+
+    bool wasRecording = false;
+    auto lastReport = chrono::steady_clock::now();
+    while ( !stopRequests )
+    {
+        this_thread::sleep_for( chrono::milliseconds( POLL_MS ) );
+        auto now = chrono::steady_clock::now();
+        double sinceReport = chrono::duration<double>( now - lastReport ).count();
+        bool isRecording = streamer->isRecording();
+        if ( isRecording != wasRecording )
+        {
+            // Report the end of the last recording, or start counting from the new one
+            if ( isRecording )
+            {
+                for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+                    lastStatus[ c ] = streamer->getChannelStatus( (Streamer::Channels)c );
+            }
+            else
+            {
+                streamer->waitForStop(); // So the counts are final
+                printStats( sinceReport );
+            }
+            printf( "Recording %s at frame set %llu\n", isRecording ? "started" : "stopped", streamer->getFrameSets() );
+            fflush( stdout );
+            wasRecording = isRecording;
+            lastReport = now;
+        }
+        else if ( isRecording && sinceReport >= statsSeconds )
+        {
+            printStats( sinceReport );
+            lastReport = now;
+        }
+    }
+
+    bool stopped = true;
+    if ( streamer->isRecording() )
+    {
+        stopped = finish( chrono::duration<double>( chrono::steady_clock::now() - lastReport ).count() );
+        if ( stopped )
+            printf( "Stopped\n" );
+        fflush( stdout );
+    }
+    waitForCompression();
+
+    SetConsoleCtrlHandler( consoleHandler, FALSE );
+    return stopped ? 0 : 1;
+}
+
+/**
+ * @brief Stop the recording, unless the control server already did, and print the last report.
+ * @param seconds Time since the last report.
+ * @returns Whether the recording stopped in time; see stop().
+ */
+bool HeadlessRecorder::finish( double seconds )
+{
+    bool stopped = stop();
+    printStats( seconds );
+    return stopped;
+}
+
+/**
+ * @brief Stop the recording between frame sets, unless the control server already did, and wait until it is written out.
+ * @arg None.
+ * @returns Whether the stop ran within the boundary timeout.
+ *
+ * If it did not, the transporter is stuck, and the recording is stopped as the streamer is destroyed.
+ */
+bool HeadlessRecorder::stop()
+{
+    Streamer* streamer = this->streamer;
+    unsigned long long frameSet;
+    if ( !streamer->runAtFrameSetBoundary( [ streamer ]() {
+        if ( streamer->isRecording() )
+            streamer->stopRecording();
+    }, frameSet ) )
+    {
+        printf( "The recording did not stop: no frame set boundary within %d ms. It is written out as Hunter exits.\n", Streamer::BOUNDARY_TIMEOUT_MS );
+        return false;
+    }
+    streamer->waitForStop();
+    return true;
+}
+
+/**
+ * @brief Wait for deferred compression to finish, unless Ctrl+C is pressed.
+ * @arg None.
+ * @returns void.
+ */
+void HeadlessRecorder::waitForCompression()
+{
+    int stopsBefore = stopRequests;
+    int pending = streamer->pendingCompactions();
+    if ( pending > 0 )
+    {
+        printf( "Compressing %d files; Ctrl+C to leave them raw\n", pending );
+        fflush( stdout );
+    }
+    while ( streamer->pendingCompactions() > 0 && stopRequests == stopsBefore )
+        this_thread::sleep_for( chrono::milliseconds( POLL_MS ) );
+}
+
+/**
+ * @brief Print what each recorded channel wrote since the last report.
+ * @param seconds Time since the last report.
+ * @returns void.
+ */
+void HeadlessRecorder::printStats( double seconds )
+{
+    seconds = (std::max)( seconds, 0.001 );
+    for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+    {
+        Streamer::ChannelStatus status = streamer->getChannelStatus( (Streamer::Channels)c );
+        if ( status.frames == 0 && !status.recording )
+            continue;
+        printf( "%-6s %8d frames %7.1f fps %8.1f MB/s %6d dropped",
+                SEQWriter::fileNameChannels[ c ].c_str(),
+                status.frames,
+                ( status.frames - lastStatus[ c ].frames ) / seconds,
+                ( status.bytes - lastStatus[ c ].bytes ) / seconds / ( 1024 * 1024 ),
+                status.dropped );
+        // Only on NUMA machines, where frames can cross nodes
+        if ( status.crossNodeHandoffs || status.crossNodeFrames )
+            printf( " %6d/%d cross-node handoffs/frames", status.crossNodeHandoffs, status.crossNodeFrames );
+        if ( status.failedWrites )
+            printf( " %6d FAILED WRITES", status.failedWrites );
+        printf( "\n" );
+        lastStatus[ c ] = status;
+    }
+    printf( "QoS: %s\n", QoSController::levelNames[ streamer->getQoSLevel() ].c_str() );
+    fflush( stdout );
+}
+
+/**
+ * @brief Console control handler: Ctrl+C, Ctrl+Break, or the console closing.
+ * @param event The event.
+ * @returns TRUE, so that the process isn't terminated and can close its files.
+ */
+BOOL WINAPI HeadlessRecorder::consoleHandler( DWORD event )
+{
+    stopRequests++;
+    return TRUE;
+}
@@ -12,6 +12,7 @@
 #include "hunter.h"
 #include "camera_controller.h"
 #include "exceptions.h"
+#include "seq_writer.h"
 
 // Libraries
 #include <QTCore/QtDebug>
@@ -19,7 +20,9 @@
 #include <QTCore/QObject>
 #include <QTWidgets/QFileDialog>
 #include <QTWidgets/QMessageBox>
+#include <QTWidgets/QApplication>
 #include <QTCore/QThread>
+#include <QTConcurrent/QtConcurrentRun>
 
 // C++
 #include <omp.h>
@@ -118,7 +121,20 @@ Hunter::Hunter( QWidget *parent )
 	QObject::connect( streamer,
 		              SIGNAL( onStopSavingEvent() ),
 		              this, 
-		              SLOT( updateRecordButtonOnStopSaving() ) );
+		              SLOT( updateRecordButtonOnStopSaving() ),
+		              Qt::QueuedConnection );
+
+	QObject::connect( streamer,
+		              SIGNAL( recordingChanged( bool ) ),
+		              this,
+		              SLOT( updateRecordButtonOnRecordingChanged( bool ) ),
+		              Qt::QueuedConnection );
+
+	QObject::connect( &autoTuneWatcher,
+		              SIGNAL( finished() ),
+		              this,
+		              SLOT( autoTuneFinished() ) );
+	autoTuneProgress = NULL;
 
 	// Instantiate and bind timer to this
 	QTimer *timer = new QTimer( this );
@@ -131,6 +147,7 @@ Hunter::Hunter( QWidget *parent )
 	// Initialize variables
 	recording = false;  // We're not recording
 	calibrationInitialized = false; // Calibration hasn't been initialized yet
+	admissionPolicy = AdmissionRefuse; // Don't start recordings the disks can't keep up with
 
 	// Setup UI
 	ui.setupUi( this );
@@ -181,7 +198,8 @@ Hunter::~Hunter()
 	// Save configuration
 	saveConfig( DEFAULT_CONFIG_FILE );
 	
-	// And clean up
+	// And clean up, once the encoder tuning no longer uses the streamer
+	autoTuneWatcher.waitForFinished();
 	delete streamer;
     delete cc;
     delete player;
@@ -789,60 +807,223 @@ void Hunter::on_recordButton_clicked()
 	// Check whether we want to record
 	if ( ui.recordButton->text() == "Record" )
 	{
-		// Update UI
-		ui.recordButton->setText( tr( "Stop" ) );
-		ui.recordButton->setStyleSheet( "QPushButton { background-color: rgb(255, 50, 50) }" );
-		ui.inputSwitchPG->setDisabled( true );
-		ui.applyButtonPGT->setDisabled( true );
-		ui.applyButtonPGF->setDisabled( true );
-		ui.applyButtonColor->setDisabled( true );
-		ui.applyButtonDepth->setDisabled( true );
-		ui.clearButtonPGT->setDisabled( true );
-		ui.clearButtonPGF->setDisabled( true );
-		ui.clearButtonColor->setDisabled( true );
-		ui.clearButtonDepth->setDisabled( true );
-
-		// Start recording
-
-		streamer->startRecording((**cameras[CameraController::Cameras::PointGreyTop].recordCheckBox).isChecked(),
-								(**cameras[CameraController::Cameras::PointGreyFront].recordCheckBox).isChecked(),
-								(**cameras[CameraController::Cameras::Color].recordCheckBox).isChecked(),
-								(**cameras[CameraController::Cameras::Depth].recordCheckBox).isChecked() );
-        recording = true;
-		// Save the recording start time
-		mStartTime = QDateTime::currentDateTime();
-		
+		bool pgt = (**cameras[CameraController::Cameras::PointGreyTop].recordCheckBox).isChecked();
+		bool pgf = (**cameras[CameraController::Cameras::PointGreyFront].recordCheckBox).isChecked();
+		bool color = (**cameras[CameraController::Cameras::Color].recordCheckBox).isChecked();
+		bool depth = (**cameras[CameraController::Cameras::Depth].recordCheckBox).isChecked();
+
+		// Started through the control server already; the button catches up when its signal arrives
+		if ( streamer->isRecording() )
+			return;
+
+		// Make sure the disks can keep up before any frames are dropped
+		if ( !admitRecording( pgt, pgf, color, depth ) )
+			return;
+
+		// Start recording between two frame sets, like the control server does, unless it started one
+		// while the disks were checked. The button and the start time follow recordingChanged.
+		// If that takes too long the start is called off, rather than begin when nobody expects it.
+		Streamer* streamer = this->streamer;
+		unsigned long long frameSet;
+		if ( !streamer->tryAtFrameSetBoundary( [ streamer, pgt, pgf, color, depth ]() {
+			if ( streamer->isRecording() )
+				return;
+			streamer->startRecording( pgt, pgf, color, depth );
+			emit streamer->recordingChanged( true );
+		}, frameSet ) )
+		{
+			QMessageBox::warning( this, tr( "Record" ),
+			                      tr( "Recording did not start: no frame set arrived within %1 s. Are the cameras delivering frames?" )
+			                          .arg( Streamer::BOUNDARY_TIMEOUT_MS / 1000 ) );
+		}
 	}
 	else if ( ui.recordButton->text() == "Stop" ) // We want to stop
 	{
+		// Stopped through the control server already; the button catches up when its signal arrives
+		if ( !streamer->isRecording() )
+			return;
+
 		// Update UI
 		ui.recordButton->setText( tr( "Saving..." ) );
 		ui.recordButton->setStyleSheet( "QPushButton { background-color: rgb(255, 50, 50) }" );
 		ui.recordButton->setDisabled( true );
 
-		// Actually stop recording
-		streamer->stopRecording();
-		recording = false;
+		// Actually stop recording, off this thread. The transporter only ends the recording between two
+		// frame sets; the streamer writes out the last sets and signals onStopSavingEvent once every channel is written.
+		Streamer* streamer = this->streamer;
+		streamer->postAtFrameSetBoundary( [ streamer ]() {
+			if ( !streamer->isRecording() )
+				return;
+			streamer->stopRecording();
+			emit streamer->recordingChanged( false );
+		} );
+	}
+	
+}
 
-		this_thread::sleep_for(std::chrono::milliseconds(1000)); // Wait for the file to hopefully finish saving
-																 // Update UI
-		ui.recordButton->setText(tr("Record"));
-		ui.recordButton->setStyleSheet("QPushButton { background-color: rgb(50, 255, 50) }");
-		ui.recordButton->setDisabled(false);
+/**
+* @brief Pre-flight check of the output disks' write throughput.
+* @param pgt Whether the Point Grey Top camera stream will be recorded.
+* @param pgf Whether the Point Grey Front camera stream will be recorded.
+* @param color Whether the Color camera stream will be recorded.
+* @param depth Whether the Depth camera stream will be recorded.
+* @returns Whether recording should go ahead.
+*
+* The first check of each disk writes a test file, which takes a few seconds.
+*/
+bool Hunter::admitRecording( bool pgt, bool pgf, bool color, bool depth )
+{
+	if ( admissionPolicy == AdmissionOff )
+		return true;
 
+	string report;
+	QApplication::setOverrideCursor( Qt::WaitCursor );
+	Streamer::Admission admission = streamer->checkWriteThroughput( pgt, pgf, color, depth, report );
+	QApplication::restoreOverrideCursor();
 
-		ui.inputSwitchPG->setDisabled(false);
-		ui.applyButtonPGT->setDisabled(false);
-		ui.applyButtonPGF->setDisabled(false);
-		ui.applyButtonColor->setDisabled(false);
-		ui.applyButtonDepth->setDisabled(false);
-		ui.clearButtonPGT->setDisabled(false);
-		ui.clearButtonPGF->setDisabled(false);
-		ui.clearButtonColor->setDisabled(false);
-		ui.clearButtonDepth->setDisabled(false);
+	if ( admission == Streamer::Admission::Admitted )
+		return true;
 
+	if ( admission == Streamer::Admission::Overcommitted && admissionPolicy == AdmissionRefuse )
+	{
+		QMessageBox::critical( this,
+		                       tr( "Disk too slow" ),
+		                       tr( "The selected streams need more than the output disk can sustain, so frames would be dropped. "
+		                           "Reduce the ROI, frame rate or number of streams, enable JPEG, or choose a faster disk.\n\n" ) +
+		                       QString::fromStdString( report ) );
+		return false;
 	}
-	
+
+	QMessageBox::StandardButton answer =
+		QMessageBox::warning( this,
+		                      tr( "Disk may be too slow" ),
+		                      tr( "The selected streams need most of what the output disk can sustain; frames may be dropped.\n\n" ) +
+		                      QString::fromStdString( report ) +
+		                      tr( "\nRecord anyway?" ),
+		                      QMessageBox::Yes | QMessageBox::No,
+		                      QMessageBox::No );
+	return answer == QMessageBox::Yes;
+}
+
+/**
+* @brief Slot for Auto-tune Encoders action.
+* @arg None.
+* @returns void.
+*/
+void Hunter::on_menu_autoTune_triggered()
+{
+	if ( recording || streamer->isSaving() )
+	{
+		QMessageBox::warning( this, tr( "Auto-tune" ), tr( "Stop recording before tuning the encoders." ) );
+		return;
+	}
+	if ( autoTuneWatcher.isRunning() )
+		return;
+
+	bool selected[ CameraController::Cameras::NUM_CAMERAS ];
+	AutoTuneResult start;
+	if ( !autoTuneSelection( selected, start.compressed ) )
+	{
+		QMessageBox::information( this, tr( "Auto-tune" ), tr( "No streams are selected for recording." ) );
+		return;
+	}
+
+	// The trials take seconds each, so they run on a worker and the previews keep going.
+	// Nothing may be recorded meanwhile; the trials write to the same folders.
+	ui.menu_autoTune->setEnabled( false );
+	ui.recordButton->setDisabled( true );
+	autoTuneProgress = new QProgressDialog( tr( "Tuning the encoders. This takes a few seconds per trial..." ), QString(), 0, 0, this );
+	autoTuneProgress->setWindowModality( Qt::WindowModal );
+	autoTuneProgress->setMinimumDuration( 0 );
+	autoTuneProgress->show();
+
+	Streamer* streamer = this->streamer;
+	bool pgt = selected[ CameraController::Cameras::PointGreyTop ];
+	bool pgf = selected[ CameraController::Cameras::PointGreyFront ];
+	bool color = selected[ CameraController::Cameras::Color ];
+	bool depth = selected[ CameraController::Cameras::Depth ];
+	autoTuneWatcher.setFuture( QtConcurrent::run( [ streamer, pgt, pgf, color, depth, start ]() {
+		AutoTuneResult result = start;
+		result.report = streamer->autoTuneEncoders( pgt, pgf, color, depth, result.compressed );
+		return result;
+	} ) );
+}
+
+/**
+* @brief Slot for the encoder tuning started from the menu finishing: apply and save its result.
+* @arg None.
+* @returns void.
+*/
+void Hunter::autoTuneFinished()
+{
+	delete autoTuneProgress;
+	autoTuneProgress = NULL;
+	ui.menu_autoTune->setEnabled( true );
+	ui.recordButton->setDisabled( false );
+
+	QString report = QString::fromStdString( applyAutoTune( autoTuneWatcher.result() ) );
+	QMessageBox::information( this, tr( "Auto-tune" ), report );
+}
+
+/**
+* @brief Pick encoder settings for the streams selected for recording, and save them.
+* @arg None.
+* @returns A human-readable report of the chosen settings.
+*
+* Each stream is written to its output folder at its ROI and frame rate with
+* progressively cheaper settings until all of them keep up with a safety margin.
+* Raw-versus-JPEG is applied through the JPEG check boxes, and the result is
+* saved to the default configuration. Takes a few seconds per trial, on this
+* thread; the menu runs the same tuning on a worker.
+*/
+std::string Hunter::autoTuneEncoders()
+{
+	bool selected[ CameraController::Cameras::NUM_CAMERAS ];
+	AutoTuneResult result;
+	if ( !autoTuneSelection( selected, result.compressed ) )
+		return "No streams are selected for recording.\n";
+
+	result.report = streamer->autoTuneEncoders( selected[ CameraController::Cameras::PointGreyTop ],
+	                                            selected[ CameraController::Cameras::PointGreyFront ],
+	                                            selected[ CameraController::Cameras::Color ],
+	                                            selected[ CameraController::Cameras::Depth ],
+	                                            result.compressed );
+	return applyAutoTune( result );
+}
+
+/**
+* @brief Read which streams the encoder tuning is for from the side bar.
+* @param selected Out: per camera, whether its stream is selected for recording.
+* @param compressed Out: per channel, whether its stream is JPEG compressed now.
+* @returns Whether any stream is selected.
+*/
+bool Hunter::autoTuneSelection( bool selected[ CameraController::Cameras::NUM_CAMERAS ], bool compressed[ Streamer::N_CHANNELS ] )
+{
+	bool any = false;
+	for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+		compressed[ c ] = false;
+	for ( int c = 0; c < CameraController::Cameras::NUM_CAMERAS; c++ )
+	{
+		selected[ c ] = (**cameras[ c ].recordCheckBox).isChecked();
+		compressed[ c ] = (**cameras[ c ].compressedCheckBox).isChecked();
+		any = any || selected[ c ];
+	}
+	return any;
+}
+
+/**
+* @brief Apply the outcome of the encoder tuning, and save it to the default configuration.
+* @param result The report, and the raw-versus-JPEG choice per channel.
+* @returns The report, saying where it was saved.
+*/
+std::string Hunter::applyAutoTune( const AutoTuneResult& result )
+{
+	// The check boxes pass the choice on to the streamer
+	for ( int c = 0; c < CameraController::Cameras::NUM_CAMERAS; c++ )
+		(**cameras[ c ].compressedCheckBox).setChecked( result.compressed[ c ] );
+
+	saveConfig( DEFAULT_CONFIG_FILE );
+	return result.report + "Saved to " + DEFAULT_CONFIG_FILE.toStdString() + ".\n";
 }
 
 /**
@@ -875,6 +1056,18 @@ void Hunter::updateRecordButtonOnStopSaving()
 		ui.clearButtonColor->setDisabled( false );
 		ui.clearButtonDepth->setDisabled( false );
 	}
+
+	// The writers are closed by now, so the counts are final; also after stops through the control server
+	QString failures;
+	for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+	{
+		int failed = streamer->getChannelStatus( (Streamer::Channels)c ).failedWrites;
+		if ( failed )
+			failures += tr( "\n%1: %2 failed writes" ).arg( QString::fromStdString( SEQWriter::fileNameChannels[ c ] ) ).arg( failed );
+	}
+	if ( !failures.isEmpty() )
+		QMessageBox::warning( this, tr( "Recording incomplete" ),
+		                      tr( "Some frames could not be written to disk, so these files are incomplete:" ) + failures );
 }
 
 /**
@@ -892,6 +1085,49 @@ void Hunter::on_snapButton_clicked()
     }
 }
 
+/**
+* @brief Slot for recordings started or stopped, from here or through the control server.
+* @param recording Whether a recording is now running.
+* @returns void.
+*
+* Puts the record button and the controls in the state that goes with the recording.
+* A stopped recording may still be saving; the button then waits for onStopSavingEvent.
+*/
+void Hunter::updateRecordButtonOnRecordingChanged( bool recording )
+{
+	this->recording = recording;
+	if ( recording )
+	{
+		mStartTime = QDateTime::currentDateTime();
+		ui.recordButton->setText( tr( "Stop" ) );
+		ui.recordButton->setStyleSheet( "QPushButton { background-color: rgb(255, 50, 50) }" );
+		ui.recordButton->setDisabled( false );
+	}
+	else if ( streamer->isSaving() )
+	{
+		ui.recordButton->setText( tr( "Saving..." ) );
+		ui.recordButton->setStyleSheet( "QPushButton { background-color: rgb(255, 50, 50) }" );
+		ui.recordButton->setDisabled( true );
+		return; // The controls stay disabled until the files are closed
+	}
+	else
+	{
+		ui.recordButton->setText( tr( "Record" ) );
+		ui.recordButton->setStyleSheet( "QPushButton { background-color: rgb(50, 255, 50) }" );
+		ui.recordButton->setDisabled( false );
+	}
+
+	ui.inputSwitchPG->setDisabled( recording );
+	ui.applyButtonPGT->setDisabled( recording );
+	ui.applyButtonPGF->setDisabled( recording );
+	ui.applyButtonColor->setDisabled( recording );
+	ui.applyButtonDepth->setDisabled( recording );
+	ui.clearButtonPGT->setDisabled( recording );
+	ui.clearButtonPGF->setDisabled( recording );
+	ui.clearButtonColor->setDisabled( recording );
+	ui.clearButtonDepth->setDisabled( recording );
+}
+
 /**
 * @brief Slot for main timer expiration event.
 * @arg None.
@@ -921,12 +1157,21 @@ void Hunter::timerEvent()
 * @returns void.
 *
 * If currently recording, warn the user about this and let them abort.
+* Likewise if recordings are still waiting for deferred compression; those stay raw.
 *
 */
 void Hunter::closeEvent( QCloseEvent* event )
 {
-    // If user is not recording, everything is good.
+    // If user is not recording, everything is good, unless files are left uncompressed.
 	if ( recording == false ) {
+		int pending = streamer->pendingCompactions();
+		if ( pending > 0 &&
+		     QMessageBox::question( this, "Compression in progress",
+		                            QString( "%1 recorded file(s) are still being compressed. Exit anyway and keep them raw?" ).arg( pending ),
+		                            QMessageBox::Yes | QMessageBox::No ) != QMessageBox::Yes ) {
+			event->ignore();
+			return;
+		}
 		event->accept();
 	}
 	else { // User is recording; warn them.
@@ -938,8 +1183,14 @@ void Hunter::closeEvent( QCloseEvent* event )
 
         // Proceed as necessary
 		if ( warningBox.clickedButton() == saveButton ) { // User wants to exit
-            // Stop recording
-			streamer->stopRecording();
+            // Stop recording between two frame sets, like the record button. If the transporter
+			// doesn't get to it in time, the streamer stops the recording as it is destroyed.
+			Streamer* streamer = this->streamer;
+			unsigned long long frameSet;
+			streamer->runAtFrameSetBoundary( [ streamer ]() {
+				if ( streamer->isRecording() )
+					streamer->stopRecording();
+			}, frameSet );
 			recording = false;
             // And exit
 			event->accept();
@@ -1817,6 +2068,17 @@ void Hunter::loadConfig( QString fileName )
     string dir = cameraSetting.child_value( "currentWorkingDirectory" );
     setWorkingDirectory( &QString( dir.c_str() ), true );
 
+	loadStreamerSettings( cameraSetting, streamer );
+
+	// Write throughput check before recording
+	string admission = cameraSetting.child_value( "admissionCheck" );
+	if ( admission == "off" )
+		admissionPolicy = AdmissionOff;
+	else if ( admission == "warn" )
+		admissionPolicy = AdmissionWarn;
+	else
+		admissionPolicy = AdmissionRefuse;
+
 	// Point Grey Top Camera
 	usb = pointGreyTop.attribute( "usb" );
 	if ( usb ) 
@@ -1922,6 +2184,229 @@ void Hunter::loadConfig( QString fileName )
 
 }
 
+/**
+* @brief Apply the recording settings of a configuration to a Streamer.
+* @param cameraSetting Root node of the configuration.
+* @param streamer The Streamer.
+* @returns void.
+*
+* Covers everything that has no control on the side bar, so that the headless
+* recorder loads it exactly like the UI does.
+*/
+void Hunter::loadStreamerSettings( pugi::xml_node cameraSetting, Streamer* streamer )
+{
+	// Storage backend; older files only have the directIO flag
+	pugi::xml_node storage = cameraSetting.child( "storageBackend" );
+	if ( storage )
+		streamer->setStorageBackend( SEQStorage::backendFromName( storage.child_value() ),
+		                             storage.attribute( "queueDepth" ).as_int( SEQStorage::DEFAULT_QUEUE_DEPTH ) );
+	else
+		streamer->setStorageBackend( !strcmp( cameraSetting.child_value( "directIO" ), "true" ) ? SEQStorage::DirectBackend : SEQStorage::QFileBackend,
+		                             SEQStorage::DEFAULT_QUEUE_DEPTH );
+
+	// Output roots, for spreading recordings over several drives
+	pugi::xml_node outputRoots = cameraSetting.child( "outputRoots" );
+	Streamer::OutputMode outputMode = Streamer::OutputMode::SingleRoot;
+	vector<string> roots;
+	if ( !strcmp( outputRoots.attribute( "mode" ).value(), "channel" ) )
+	{
+		outputMode = Streamer::OutputMode::PerChannelRoots;
+		roots.resize( Streamer::N_CHANNELS );
+		for ( pugi::xml_node root = outputRoots.child( "root" ); root; root = root.next_sibling( "root" ) )
+		{
+			for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+			{
+				if ( SEQWriter::fileNameChannels[ c ] == root.attribute( "channel" ).value() )
+					roots[ c ] = root.child_value();
+			}
+		}
+	}
+	else if ( !strcmp( outputRoots.attribute( "mode" ).value(), "roundRobin" ) )
+	{
+		outputMode = Streamer::OutputMode::RoundRobinRoots;
+		for ( pugi::xml_node root = outputRoots.child( "root" ); root; root = root.next_sibling( "root" ) )
+			roots.push_back( root.child_value() );
+	}
+	streamer->setOutputRoots( outputMode, roots );
+
+	// JPEG rate control, per channel
+	for ( pugi::xml_node rate = cameraSetting.child( "rateControl" ); rate; rate = rate.next_sibling( "rateControl" ) )
+	{
+		for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+		{
+			if ( SEQWriter::fileNameChannels[ c ] == rate.attribute( "channel" ).value() )
+				streamer->setRateControl( (Streamer::Channels)c,
+				                          rate.attribute( "targetMBps" ).as_double() * 1024 * 1024,
+				                          rate.attribute( "minQuality" ).as_int( 30 ),
+				                          rate.attribute( "maxQuality" ).as_int( 95 ) );
+		}
+	}
+
+	// JPEG encoder profiles, per channel; channels not listed use the defaults
+	for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+		streamer->setEncoderProfile( (Streamer::Channels)c, EncoderProfile() );
+	for ( pugi::xml_node encoding = cameraSetting.child( "encoderProfile" ); encoding; encoding = encoding.next_sibling( "encoderProfile" ) )
+	{
+		for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+		{
+			if ( SEQWriter::fileNameChannels[ c ] != encoding.attribute( "channel" ).value() )
+				continue;
+			EncoderProfile profile;
+			profile.quality = (std::min)( (std::max)( encoding.attribute( "quality" ).as_int( profile.quality ), 1 ), 100 );
+			int subsampling = EncoderProfile::subsamplingFromName( encoding.attribute( "subsampling" ).value() );
+			if ( subsampling >= 0 )
+				profile.subsampling = subsampling;
+			profile.accurateDCT = !strcmp( encoding.attribute( "dct" ).value(), "accurate" );
+			profile.progressive = encoding.attribute( "progressive" ).as_bool( false );
+			profile.restartRows = (std::max)( encoding.attribute( "restartRows" ).as_int( 0 ), 0 );
+			profile.threads = (std::max)( encoding.attribute( "threads" ).as_int( 1 ), 1 );
+			streamer->setEncoderProfile( (Streamer::Channels)c, profile );
+		}
+	}
+
+	// Residual codec for the Point Grey channels; off unless listed
+	for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+		streamer->setResidualCodec( (Streamer::Channels)c, ResidualSettings() );
+	for ( pugi::xml_node codec = cameraSetting.child( "residualCodec" ); codec; codec = codec.next_sibling( "residualCodec" ) )
+	{
+		for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+		{
+			if ( SEQWriter::fileNameChannels[ c ] != codec.attribute( "channel" ).value() )
+				continue;
+			ResidualSettings settings;
+			settings.enabled = true;
+			settings.threshold = (std::max)( codec.attribute( "threshold" ).as_int( settings.threshold ), 1 );
+			settings.keyframeInterval = (std::max)( codec.attribute( "keyframeInterval" ).as_int( settings.keyframeInterval ), 1 );
+			streamer->setResidualCodec( (Streamer::Channels)c, settings );
+		}
+	}
+
+	// Moving crops for the Point Grey channels; off unless listed
+	for ( int c = Streamer::Channels::PointGreyTop; c <= Streamer::Channels::PointGreyFront; c++ )
+		streamer->setDynamicCrop( (Streamer::Channels)c, DynamicCropSettings() );
+	for ( pugi::xml_node crop = cameraSetting.child( "dynamicCrop" ); crop; crop = crop.next_sibling( "dynamicCrop" ) )
+	{
+		for ( int c = Streamer::Channels::PointGreyTop; c <= Streamer::Channels::PointGreyFront; c++ )
+		{
+			if ( SEQWriter::fileNameChannels[ c ] != crop.attribute( "channel" ).value() )
+				continue;
+			DynamicCropSettings settings;
+			settings.enabled = true;
+			settings.width = (std::max)( crop.attribute( "width" ).as_int( settings.width ), 16 );
+			settings.height = (std::max)( crop.attribute( "height" ).as_int( settings.height ), 16 );
+			settings.contextInterval = (std::max)( crop.attribute( "contextInterval" ).as_int( settings.contextInterval ), 0 );
+			streamer->setDynamicCrop( (Streamer::Channels)c, settings );
+		}
+	}
+
+	// Motion gate; off unless present, and it can only watch a Point Grey channel
+	MotionGateSettings gate;
+	pugi::xml_node motionGate = cameraSetting.child( "motionGate" );
+	for ( int c = Streamer::Channels::PointGreyTop; motionGate && c <= Streamer::Channels::PointGreyFront; c++ )
+	{
+		if ( SEQWriter::fileNameChannels[ c ] != motionGate.attribute( "channel" ).value() )
+			continue;
+		gate.enabled = true;
+		gate.channel = c;
+		gate.threshold = (std::max)( motionGate.attribute( "threshold" ).as_double( gate.threshold ), 0.0 );
+		gate.holdSeconds = (std::max)( motionGate.attribute( "holdSeconds" ).as_double( gate.holdSeconds ), 0.0 );
+		gate.preRollFrames = (std::max)( motionGate.attribute( "preRollFrames" ).as_int( gate.preRollFrames ), 0 );
+	}
+	streamer->setMotionGate( gate );
+
+	// Track the animal on the depth stream while recording
+	streamer->setDepthTracking( !strcmp( cameraSetting.child_value( "depthTracking" ), "true" ) );
+
+	// Closed-loop triggers, one per zone; only on the Point Grey and depth channels
+	std::vector<TriggerZone> zones;
+	for ( pugi::xml_node trigger = cameraSetting.child( "trigger" ); trigger; trigger = trigger.next_sibling( "trigger" ) )
+	{
+		for ( int c = Streamer::Channels::PointGreyTop; c <= Streamer::Channels::Depth; c++ )
+		{
+			if ( c == Streamer::Channels::Color || SEQWriter::fileNameChannels[ c ] != trigger.attribute( "channel" ).value() )
+				continue;
+			TriggerZone zone;
+			zone.name = trigger.attribute( "name" ).as_string( ( "trigger" + to_string( zones.size() + 1 ) ).c_str() );
+			zone.channel = c;
+			zone.zone = QRect( trigger.attribute( "x" ).as_int(), trigger.attribute( "y" ).as_int(),
+			                   trigger.attribute( "width" ).as_int(), trigger.attribute( "height" ).as_int() );
+			int level = ( c == Streamer::Channels::Depth ) ? TriggerEngine::DEFAULT_DEPTH_LEVEL : TriggerEngine::DEFAULT_GREY_LEVEL;
+			zone.level = (std::max)( trigger.attribute( "level" ).as_int( level ), 1 );
+			zone.fraction = (std::min)( (std::max)( trigger.attribute( "fraction" ).as_double( zone.fraction ), 0.01 ), 1.0 );
+			zone.edge = TriggerZone::edgeFromName( trigger.attribute( "edge" ).value() );
+			zone.sink = TriggerSink::kindFromName( trigger.attribute( "sink" ).value() );
+			zone.target = trigger.attribute( "target" ).as_string( to_string( TriggerSink::DEFAULT_PORT ).c_str() );
+			zones.push_back( zone );
+		}
+	}
+	streamer->setTriggerZones( zones );
+
+	// Shared memory frame bus for other processes; off unless present
+	FrameBusSettings bus;
+	pugi::xml_node frameBus = cameraSetting.child( "frameBus" );
+	if ( frameBus )
+	{
+		bus.enabled = true;
+		bus.name = frameBus.attribute( "name" ).as_string( bus.name.c_str() );
+		bus.slotCount = (std::max)( frameBus.attribute( "slots" ).as_int( bus.slotCount ), (int)FrameBusPublisher::MIN_SLOTS );
+		bus.slotMegabytes = (std::max)( frameBus.attribute( "slotMegabytes" ).as_int( bus.slotMegabytes ), 1 );
+	}
+	if ( !streamer->setFrameBus( bus ) && bus.enabled )
+	{
+#ifdef DEBUG
+		qDebug() << "Frame bus" << bus.name.c_str() << "could not be created" << endl;
+#endif
+	}
+
+	// Control server for scripts on this machine; off unless present
+	ControlServerSettings control;
+	pugi::xml_node controlServer = cameraSetting.child( "controlServer" );
+	if ( controlServer )
+	{
+		control.enabled = true;
+		control.port = controlServer.attribute( "port" ).as_int( control.port );
+	}
+	if ( !streamer->setControlServer( control ) && control.enabled )
+	{
+#ifdef DEBUG
+		qDebug() << "Control server could not listen on port" << control.port << endl;
+#endif
+	}
+
+	// Memory of the frame and staging buffers: <bufferMemory largePages="true" lock="false"/>
+	BufferMemorySettings memory;
+	pugi::xml_node bufferMemory = cameraSetting.child( "bufferMemory" );
+	if ( bufferMemory )
+	{
+		memory.largePages = bufferMemory.attribute( "largePages" ).as_bool( memory.largePages );
+		memory.locked = bufferMemory.attribute( "lock" ).as_bool( memory.locked );
+	}
+	streamer->setBufferMemory( memory );
+
+	// Placement of the processor workers, one <worker core=""/> or <worker node=""/> per worker;
+	// spread over the NUMA nodes unless present
+	PipelineSettings placement;
+	pugi::xml_node pipeline = cameraSetting.child( "pipeline" );
+	if ( pipeline )
+	{
+		placement.priority = PipelineExecutor::priorityFromName( pipeline.attribute( "priority" ).value() );
+		for ( pugi::xml_node worker = pipeline.child( "worker" ); worker; worker = worker.next_sibling( "worker" ) )
+		{
+			placement.cores.push_back( worker.attribute( "core" ).as_int( -1 ) );
+			placement.nodes.push_back( worker.attribute( "node" ).as_int( -1 ) );
+		}
+	}
+	if ( !streamer->setPipeline( placement ) )
+	{
+#ifdef DEBUG
+		qDebug() << "Pipeline workers could not all be placed as configured" << endl;
+#endif
+	}
+
+	// Record JPEG channels raw and compress them afterwards
+	streamer->setDeferredCompression( !strcmp( cameraSetting.child_value( "deferredCompression" ), "true" ) );
+}
+
 /**
 * @brief Load Region-Of-Interest values from XML.
 * @param roi XML Node for the ROI
@@ -1992,6 +2477,169 @@ void Hunter::saveConfig( QString fileName )
 	pugi::xml_node cwd = cameraSettings.append_child( "currentWorkingDirectory" );
 	cwd.append_child( pugi::node_pcdata ).set_value( workingDir.c_str() );
 
+	// Save storage backend
+	pugi::xml_node storage = cameraSettings.append_child( "storageBackend" );
+	storage.append_attribute( "queueDepth" ) = streamer->getStorageQueueDepth();
+	storage.append_child( pugi::node_pcdata ).set_value( SEQStorage::backendNames[ streamer->getStorageBackend() ].c_str() );
+
+	// Save output roots
+	pugi::xml_node outputRoots = cameraSettings.append_child( "outputRoots" );
+	vector<string> roots = streamer->getOutputRoots();
+	switch ( streamer->getOutputMode() )
+	{
+	case Streamer::OutputMode::PerChannelRoots:
+		outputRoots.append_attribute( "mode" ) = "channel";
+		for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+		{
+			if ( roots[ c ].empty() )
+				continue;
+			pugi::xml_node root = outputRoots.append_child( "root" );
+			root.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ c ].c_str();
+			root.append_child( pugi::node_pcdata ).set_value( roots[ c ].c_str() );
+		}
+		break;
+	case Streamer::OutputMode::RoundRobinRoots:
+		outputRoots.append_attribute( "mode" ) = "roundRobin";
+		for ( auto& dir : roots )
+			outputRoots.append_child( "root" ).append_child( pugi::node_pcdata ).set_value( dir.c_str() );
+		break;
+	default:
+		outputRoots.append_attribute( "mode" ) = "single";
+		break;
+	}
+
+	// Save JPEG rate control
+	for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+	{
+		if ( streamer->getRateTarget( (Streamer::Channels)c ) <= 0 )
+			continue;
+		pugi::xml_node rate = cameraSettings.append_child( "rateControl" );
+		rate.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ c ].c_str();
+		rate.append_attribute( "targetMBps" ) = streamer->getRateTarget( (Streamer::Channels)c ) / ( 1024 * 1024 );
+		rate.append_attribute( "minQuality" ) = streamer->getRateMinQuality( (Streamer::Channels)c );
+		rate.append_attribute( "maxQuality" ) = streamer->getRateMaxQuality( (Streamer::Channels)c );
+	}
+
+	// Save JPEG encoder profiles
+	for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+	{
+		EncoderProfile profile = streamer->getEncoderProfile( (Streamer::Channels)c );
+		pugi::xml_node encoding = cameraSettings.append_child( "encoderProfile" );
+		encoding.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ c ].c_str();
+		encoding.append_attribute( "quality" ) = profile.quality;
+		encoding.append_attribute( "subsampling" ) = EncoderProfile::subsamplingName( profile.subsampling ).c_str();
+		encoding.append_attribute( "dct" ) = profile.accurateDCT ? "accurate" : "fast";
+		encoding.append_attribute( "progressive" ) = profile.progressive;
+		encoding.append_attribute( "restartRows" ) = profile.restartRows;
+		encoding.append_attribute( "threads" ) = profile.threads;
+	}
+
+	// Save residual codec settings
+	for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+	{
+		ResidualSettings settings = streamer->getResidualCodec( (Streamer::Channels)c );
+		if ( !settings.enabled )
+			continue;
+		pugi::xml_node codec = cameraSettings.append_child( "residualCodec" );
+		codec.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ c ].c_str();
+		codec.append_attribute( "threshold" ) = settings.threshold;
+		codec.append_attribute( "keyframeInterval" ) = settings.keyframeInterval;
+	}
+
+	// Save moving crops
+	for ( int c = Streamer::Channels::PointGreyTop; c <= Streamer::Channels::PointGreyFront; c++ )
+	{
+		DynamicCropSettings settings = streamer->getDynamicCrop( (Streamer::Channels)c );
+		if ( !settings.enabled )
+			continue;
+		pugi::xml_node crop = cameraSettings.append_child( "dynamicCrop" );
+		crop.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ c ].c_str();
+		crop.append_attribute( "width" ) = settings.width;
+		crop.append_attribute( "height" ) = settings.height;
+		crop.append_attribute( "contextInterval" ) = settings.contextInterval;
+	}
+
+	// Save motion gate
+	MotionGateSettings gate = streamer->getMotionGate();
+	if ( gate.enabled )
+	{
+		pugi::xml_node motionGate = cameraSettings.append_child( "motionGate" );
+		motionGate.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ gate.channel ].c_str();
+		motionGate.append_attribute( "threshold" ) = gate.threshold;
+		motionGate.append_attribute( "holdSeconds" ) = gate.holdSeconds;
+		motionGate.append_attribute( "preRollFrames" ) = gate.preRollFrames;
+	}
+
+	// Save depth tracking
+	pugi::xml_node tracking = cameraSettings.append_child( "depthTracking" );
+	tracking.append_child( pugi::node_pcdata ).set_value( streamer->getDepthTracking() ? "true" : "false" );
+
+	// Save closed-loop triggers
+	for ( auto& zone : streamer->getTriggerZones() )
+	{
+		pugi::xml_node trigger = cameraSettings.append_child( "trigger" );
+		trigger.append_attribute( "name" ) = zone.name.c_str();
+		trigger.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ zone.channel ].c_str();
+		trigger.append_attribute( "x" ) = zone.zone.x();
+		trigger.append_attribute( "y" ) = zone.zone.y();
+		trigger.append_attribute( "width" ) = zone.zone.width();
+		trigger.append_attribute( "height" ) = zone.zone.height();
+		trigger.append_attribute( "level" ) = zone.level;
+		trigger.append_attribute( "fraction" ) = zone.fraction;
+		trigger.append_attribute( "edge" ) = TriggerZone::edgeNames[ zone.edge ].c_str();
+		trigger.append_attribute( "sink" ) = TriggerSink::kindNames[ zone.sink ].c_str();
+		trigger.append_attribute( "target" ) = zone.target.c_str();
+	}
+
+	// Save frame bus
+	FrameBusSettings bus = streamer->getFrameBus();
+	if ( bus.enabled )
+	{
+		pugi::xml_node frameBus = cameraSettings.append_child( "frameBus" );
+		frameBus.append_attribute( "name" ) = bus.name.c_str();
+		frameBus.append_attribute( "slots" ) = bus.slotCount;
+		frameBus.append_attribute( "slotMegabytes" ) = bus.slotMegabytes;
+	}
+
+	// Save control server
+	ControlServerSettings control = streamer->getControlServer();
+	if ( control.enabled )
+		cameraSettings.append_child( "controlServer" ).append_attribute( "port" ) = control.port;
+
+	// Save buffer memory
+	BufferMemorySettings memory = streamer->getBufferMemory();
+	if ( memory.largePages != BufferMemorySettings().largePages || memory.locked != BufferMemorySettings().locked )
+	{
+		pugi::xml_node bufferMemory = cameraSettings.append_child( "bufferMemory" );
+		bufferMemory.append_attribute( "largePages" ) = memory.largePages;
+		bufferMemory.append_attribute( "lock" ) = memory.locked;
+	}
+
+	// Save pipeline placement
+	PipelineSettings placement = streamer->getPipeline();
+	if ( !placement.cores.empty() || placement.priority != PipelineSettings().priority )
+	{
+		pugi::xml_node pipeline = cameraSettings.append_child( "pipeline" );
+		pipeline.append_attribute( "priority" ) = PipelineExecutor::priorityNames[ placement.priority ].c_str();
+		for ( size_t i = 0; i < placement.cores.size(); i++ )
+		{
+			pugi::xml_node worker = pipeline.append_child( "worker" );
+			if ( placement.cores[ i ] >= 0 )
+				worker.append_attribute( "core" ) = placement.cores[ i ];
+			else if ( placement.nodes[ i ] >= 0 )
+				worker.append_attribute( "node" ) = placement.nodes[ i ];
+		}
+	}
+
+	// Save deferred compression
+	pugi::xml_node deferred = cameraSettings.append_child( "deferredCompression" );
+	deferred.append_child( pugi::node_pcdata ).set_value( streamer->getDeferredCompression() ? "true" : "false" );
+
+	// Save write throughput check
+	const char* admissionNames[] = { "off", "warn", "refuse" };
+	pugi::xml_node admission = cameraSettings.append_child( "admissionCheck" );
+	admission.append_child( pugi::node_pcdata ).set_value( admissionNames[ admissionPolicy ] );
+
 	// Point Grey Top Camera
 	getPGvalues( &cameraSettings,
 		         ui.usb0PGT,
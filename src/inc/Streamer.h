@@ -26,15 +26,29 @@
 #include <string>
 #include <chrono>
 #include <queue>
+#include <deque>
 #include <iomanip>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <vector>
+#include <functional>
 
 // Project includes
 #include "camera_controller.h"
+#include "seq_storage.h"
+#include "buffer_pool.h"
+#include "qos_controller.h"
+#include "jpeg_encoder.h"
+#include "residual_codec.h"
+#include "motion_gate.h"
+#include "depth_tracker.h"
+#include "crop_tracker.h"
+#include "trigger_engine.h"
+#include "frame_bus_publisher.h"
+#include "control_server.h"
+#include "pipeline_executor.h"
 
 using namespace std;
 
@@ -45,6 +59,7 @@ using namespace std;
 
 
 class SEQWriter;
+class Compactor;
 
 class CameraFrame
 {
@@ -59,6 +74,11 @@ public:
     FlyCapture2::Image *PGData;            /**< Point Grey frame data. */
     int timestampSeconds;                  /**< Timestamp: seconds value. */
     int timestampMilliSeconds;             /**< Timestamp: milliseconds value. */
+    unsigned long long frameIndex;         /**< Arrival index within the channel, assigned by the SynchronizationQueue. */
+    unsigned long long frameSet = 0;       /**< Number of its frame set, assigned when the set is queued. */
+    bool gateOpen = true;                  /**< Whether the motion gate lets its frame set be written. */
+    BufferPool *pool = NULL;               /**< Frame pool PGData was copied into; NULL if it owns its data. */
+    unsigned char *pooled = NULL;          /**< The buffer from the pool. */
     CameraFrame() { };
 
     CameraFrame( DepthSense::Pointer<uint8_t> data, DepthSense::FrameFormat format, int sec, int ms ) 
@@ -75,6 +95,9 @@ public:
 		if (PGData) {
 			delete PGData;
 		}
+		if (pooled) {
+			pool->recycle(pooled);
+		}
 	}
 };
 
@@ -98,13 +121,33 @@ public:
 	void push(CameraFrame* frame);
 };
 */
+struct DroppedFrame
+{
+	unsigned long long index;  /**< Arrival index within the channel. */
+	int timestampSeconds;      /**< Timestamp: seconds value. */
+	int timestampMilliSeconds; /**< Timestamp: milliseconds value. */
+};
+
+struct HeldFrame
+{
+	QImage image;              /**< The frame as it would have been written. */
+	int timestampSeconds;      /**< Timestamp: seconds value. */
+	int timestampMilliSeconds; /**< Timestamp: milliseconds value. */
+};
+
 class SynchronizationQueue
 {
 public:
 	static const int max_synchronization_queue_size = 2;    /**< Max size queue can grow */
 	std::mutex mutex;			// Access control mutex
 	std::queue<CameraFrame*> current_frame_queue;
+	unsigned long long next_index = 0;           // Arrival index of the next frame
+	bool log_drops = false;                      // Whether drops are recorded in dropped_frames
+	std::vector<DroppedFrame> dropped_frames;    // Frames dropped while logging
 	void push(CameraFrame* frame);
+	void dropFront();
+	void startLog();
+	void stopLog();
 };
 
 class Streamer : public QThread
@@ -113,10 +156,6 @@ class Streamer : public QThread
 
 public:
     // Constants
-    enum
-    {
-       JPEG_QUALITY = 70                /**< JPEG Compression quality (0-100). */
-    };
     enum Channels
     {
         PointGreyTop = CameraController::Cameras::PointGreyTop,     /**< The Point Grey Top camera channel. */
@@ -126,8 +165,12 @@ public:
         IR,                                                         /**< The IR channel. */
     };
     static const int N_CHANNELS = 5;                                /**< Number of channels. */
-	static const int MAX_QUEUE_SIZE = 5;                            /**< Max size frame queue can grow */
+	static const int MAX_QUEUE_SIZE = 5;                            /**< Max size frame queue can grow once the QoS ladder is exhausted */
+	static const int HARD_QUEUE_SIZE = 30;                          /**< Max size frame queue can grow while quality can still be lowered */
+	static const int FRAME_POOL_BUFFERS = HARD_QUEUE_SIZE + 8;      /**< Point Grey frames in flight per channel before copies go to the heap */
 	static const int UI_UPDATE_RATE = 100;                            /**< Update rate, in ms, of the UI, per channel */
+	static const int DRAIN_TIMEOUT_MS = 5000;                       /**< Longest wait for the processors to write the last frame sets of a recording */
+	static const int BOUNDARY_TIMEOUT_MS = 2 * DRAIN_TIMEOUT_MS;    /**< Longest wait for the transporter to run a command between frame sets; a stop drains in between */
 	
 
     enum ROICoordinates
@@ -139,6 +182,34 @@ public:
         ROI_SIZE /**< Number of items per ROI. */
     };
 
+    enum Admission
+    {
+        Admitted,      /**< The disks can comfortably sustain the selected streams. */
+        Marginal,      /**< The selected streams need most of what a disk can sustain. */
+        Overcommitted, /**< The selected streams need more than a disk can sustain. */
+    };
+    static const int THROUGHPUT_MARGINAL_PERCENT = 70;      /**< Share of a disk's measured rate above which recording is marginal. */
+    static const int THROUGHPUT_OVERCOMMITTED_PERCENT = 90; /**< Share of a disk's measured rate above which recording is overcommitted. */
+
+    /** Progress of a channel's current (or last) recording */
+    struct ChannelStatus
+    {
+        bool recording;           /**< Whether the channel is recording. */
+        int frames;               /**< Frames written. */
+        qint64 bytes;             /**< Bytes written, including staged data. */
+        int dropped;              /**< Frames dropped before they could be queued; Depth counts them for IR too. */
+        int crossNodeHandoffs;    /**< Frames a camera callback copied on another NUMA node than the channel's. */
+        int crossNodeFrames;      /**< Frames processed on another NUMA node than the one they were stored on. */
+        int failedWrites;         /**< Writes to the channel's file that failed; the file is incomplete if any did. */
+    };
+
+    enum OutputMode
+    {
+        SingleRoot,      /**< Every channel records under the working directory. */
+        PerChannelRoots, /**< Each channel has its own output root. */
+        RoundRobinRoots, /**< Roots are dealt out to PG Top, PG Front and the DepthSense channels in turn. */
+    };
+
 	//Constructor
 	Streamer( CameraController* _camera );
 	//Destructor
@@ -149,6 +220,9 @@ public:
 
 	// Set working dir
 	void setCurrentWorkingDir(std::string workingDir);
+	void setOutputRoots( OutputMode mode, std::vector<std::string> roots );
+	OutputMode getOutputMode();
+	std::vector<std::string> getOutputRoots();
 
 	int maxDepthMM;
 
@@ -157,13 +231,54 @@ public:
 	bool isPGswitched;
 
 	void stopRecording();
+    void waitForStop();
     void startRecording(bool pgt, bool pgf, bool color, bool depth);
+    Admission checkWriteThroughput( bool pgt, bool pgf, bool color, bool depth, std::string& report );
+    std::string autoTuneEncoders( bool pgt, bool pgf, bool color, bool depth, bool compressed[ N_CHANNELS ] );
 
     void startStreaming( CameraController::Cameras camera );
     void stopStreaming( CameraController::Cameras camera );
 
     void setROI( CameraController::Cameras camera, int x, int y, int w, int h );
     void setCompressed( CameraController::Cameras camera, bool compressed );
+    void setStorageBackend( SEQStorage::Backend backend, int queueDepth );
+    SEQStorage::Backend getStorageBackend();
+    int getStorageQueueDepth();
+    void setRateControl( Channels channel, double targetBytesPerSecond, int minQuality, int maxQuality );
+    double getRateTarget( Channels channel );
+    int getRateMinQuality( Channels channel );
+    int getRateMaxQuality( Channels channel );
+    void setEncoderProfile( Channels channel, const EncoderProfile& profile );
+    EncoderProfile getEncoderProfile( Channels channel );
+    void setResidualCodec( Channels channel, const ResidualSettings& settings );
+    ResidualSettings getResidualCodec( Channels channel );
+    void setMotionGate( const MotionGateSettings& settings );
+    MotionGateSettings getMotionGate();
+    void setDynamicCrop( Channels channel, const DynamicCropSettings& settings );
+    DynamicCropSettings getDynamicCrop( Channels channel );
+    void setDepthTracking( bool tracking );
+    bool getDepthTracking();
+    void setTriggerZones( const std::vector<TriggerZone>& zones );
+    std::vector<TriggerZone> getTriggerZones();
+    bool setFrameBus( const FrameBusSettings& settings );
+    FrameBusSettings getFrameBus();
+    void setDeferredCompression( bool deferred );
+    bool getDeferredCompression();
+    bool setControlServer( const ControlServerSettings& settings );
+    ControlServerSettings getControlServer();
+    bool setPipeline( const PipelineSettings& settings );
+    PipelineSettings getPipeline();
+    void setBufferMemory( const BufferMemorySettings& settings );
+    BufferMemorySettings getBufferMemory();
+    int pendingCompactions();
+    ChannelStatus getChannelStatus( Channels channel );
+    QoSController::Level getQoSLevel();
+    bool isRecording();
+    bool isSaving();
+    unsigned long long getFrameSets();
+    bool runAtFrameSetBoundary( std::function<void()> command, unsigned long long& frameSet );
+    void postAtFrameSetBoundary( std::function<void()> command );
+    bool tryAtFrameSetBoundary( std::function<void()> command, unsigned long long& frameSet );
     void saveSnapshot( CameraController::Cameras camera );
 
     int getROI( CameraController::Cameras camera, ROICoordinates value );
@@ -202,6 +317,9 @@ signals:
 
 	void onStopSavingEvent();
 
+	// A recording was started or stopped, from the main window or the control server, between two frame sets
+	void recordingChanged( bool recording );
+
 private:
     // Constants
     enum 
@@ -222,6 +340,7 @@ private:
 
     // Objects
     SEQWriter *seqWriters[ N_CHANNELS ];
+    SEQWriter *contextWriters[ N_CHANNELS ];  /**< Full-ROI context files of dynamically cropped channels; Point Grey only. */
     FrameQueue frameQueues[ N_CHANNELS ];
 	//SingleFrameBuffer frame_buffers[N_CHANNELS];
 	SynchronizationQueue synchronizationQueues[N_CHANNELS];
@@ -234,11 +353,104 @@ private:
 
     stream_attributes streamAttributes[ N_CHANNELS ];
 
-    // Streamer control
-    bool recording;
+    // Streamer control. The destructor stops the transporter before the processors, to stop a recording in between.
+    std::atomic<bool> recording;
     bool running;
+    std::atomic<bool> transporting;
+
+	// Pipeline threads, joined on shutdown. A processor is a task on the pipeline executor that runs while its
+	// channel streams or records; processorActive is cleared under processorMutex as it decides to return,
+	// so it is never queued twice.
+	std::thread depthSenseThread;
+	std::thread transporterThread;
+	PipelineExecutor* pipeline;
+	PipelineSettings pipelineSettings;
+
+	// Point Grey frames are copied out of the callback into these, on the node of the channel's worker.
+	// They are locked (if so configured) while their channel streams or records.
+	// A pool is replaced only while its processor is stopped and every buffer is back; until then it is stale,
+	// and replaced when the channel next starts.
+	BufferPool framePools[ N_CHANNELS ];
+	bool framePoolStale[ N_CHANNELS ];
+	BufferMemorySettings bufferMemory;
+	std::atomic<int> crossNodeHandoffs[ N_CHANNELS ];
+	std::atomic<int> crossNodeFrames[ N_CHANNELS ];
+	bool processorActive[ N_CHANNELS ];
+	std::mutex processorMutex;
 
 	std::string workingDir;
+
+	// Output roots. Per channel: indexed by channel, empty for the working directory. Round robin: in order.
+	OutputMode outputMode;
+	std::vector<std::string> outputRoots;
+	std::string sessionDateTime;           /**< Timestamp of the current (or last) recording. */
+	bool sessionChannels[ N_CHANNELS ];    /**< Channels recorded in the current (or last) recording. */
+
+	// JPEG channels recorded raw and compressed once the recording stops
+	bool deferredCompression;
+	bool sessionDeferred[ N_CHANNELS ];    /**< Channels of the current (or last) recording whose compression is deferred. */
+	Compactor *compactor;
+
+	// Pauses recording while the watched channel shows no motion
+	MotionGateSettings motionGateSettings;
+	MotionGate motionGate;
+	bool sessionGated;                     /**< Whether the gate acts on the current (or last) recording. */
+
+	// Point Grey channels that record a crop following the animal
+	DynamicCropSettings cropSettings[ N_CHANNELS ];
+	CropTracker cropTrackers[ N_CHANNELS ];
+	bool sessionCropped[ N_CHANNELS ];         /**< Channels of the current (or last) recording that record a moving crop. */
+	int sessionContextInterval[ N_CHANNELS ];  /**< Their context interval; 0 for no context file. */
+
+	// Finds the animal in the raw depth frames while recording
+	bool depthTracking;
+	bool sessionTracked;                   /**< Whether the current (or last) recording is tracked. */
+	DepthTracker depthTracker;
+
+	// Fires outputs from the camera callbacks when the animal enters or leaves a zone
+	TriggerEngine triggers;
+	bool sessionTriggered;                 /**< Whether triggers are armed for the current (or last) recording. */
+
+	// Publishes every frame set in shared memory for other processes
+	FrameBusSettings frameBusSettings;
+	FrameBusPublisher frameBus;
+
+	// Takes commands from scripts on this machine; they run between frame sets
+	ControlServerSettings controlServerSettings;
+	ControlServer *controlServer;
+	std::deque<std::function<void()>> boundaryCommands;
+	std::mutex boundaryMutex;              /**< Protects boundaryCommands. */
+	std::atomic<unsigned long long> frameSets;  /**< Frame sets assembled since the cameras started, queued or dropped. */
+
+	// A recording is the frame sets from recordFirstSet up to, not including, recordEndSet. Both are set
+	// under setMutex, which the transporter holds while it assembles and numbers a set.
+	std::mutex setMutex;
+	std::atomic<unsigned long long> recordFirstSet;
+	std::atomic<unsigned long long> recordEndSet;
+	std::atomic<bool> drained[ N_CHANNELS ];  /**< Per processor: no frame of the stopped recording left to write. */
+	std::mutex drainMutex;
+	std::condition_variable drainCondition;   /**< Signalled as processors drain. */
+
+	// A processor holds its channel's writeMutex from taking a frame until the frame is written, and writes
+	// only while its channel is open. finishRecording closes the channels under it before closing the writers,
+	// so a processor that did not drain in time writes nothing more.
+	bool channelOpen[ N_CHANNELS ];
+	std::mutex writeMutexes[ N_CHANNELS ];
+
+	// stopRecording only ends the recording between two frame sets; the stopper thread waits for the
+	// processors and closes the files, so frame sets keep being assembled meanwhile.
+	std::mutex stopMutex;                       /**< Serializes stopRecording and waitForStop. */
+	std::thread stopperThread;                  /**< Runs finishRecording for the last recording; joined by waitForStop. */
+	std::atomic<bool> saving;                   /**< Whether the stopper thread is still writing out a recording. */
+	bool sessionDrained;                        /**< Whether every set of the current (or last) recording was written. */
+	int sessionUnwritten[ N_CHANNELS ];         /**< Sets of the current (or last) recording left unwritten when it stopped. */
+
+	// Degrades preview and JPEG quality before frames are dropped
+	QoSController qos;
+
+	// Most recent preview of each channel, for sampling how well it compresses
+	QImage lastPreview[ N_CHANNELS ];
+	std::mutex previewMutex;
 	
 	// Camera Controller
     CameraController *camera;
@@ -246,8 +458,26 @@ private:
 	std::chrono::high_resolution_clock::time_point startTime;
 
     const std::string currentDateTime();
+    double getFrameRate( Channels channel );
+    std::string getOutputDir( Channels channel );
+    std::string getSessionPrefix();
+    void startDynamicCrop( Channels channel, std::string dateTime );
+    void publishFrameSet( CameraFrame* const set[], const std::vector<Channels>& channels, bool gateOpen );
+    void runBoundaryCommands();
+    bool isRecordedSet( unsigned long long frameSet );
+    void checkDrained( Channels channel );
+    void finishRecording();
+    std::string getManifestPath();
+    void writeSessionManifest( bool complete );
 
     void imageProcessor( Channels channel );
+    void startProcessor( Channels channel );
+    void allocateFramePool( Channels channel );
+    void allocateFramePools();
+    void followChannel( Channels channel );
+    CameraFrame* handOffPG( Channels channel, FlyCapture2::Image* image, int sec, int ms );
+    bool keepProcessing( Channels channel );
+    void recordFrame( Channels channel, QImage image, int secs, int ms, bool gateOpen, std::deque<HeldFrame>& held );
 	void PGImageTransporter(FlyCapture2::Image* pImage, const void* pCallbackData);
 	void SaveSnapshot(Streamer::Channels channel, QImage* rawImage, CameraFrame* current_frame);
 
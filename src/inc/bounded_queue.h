@@ -0,0 +1,86 @@
+/**
+ * @file bounded_queue.h
+ * @brief Blocking FIFO with a fixed capacity
+ *
+ * Connects the stages of a pipeline. A producer that gets ahead blocks in
+ * push() instead of buffering without bound, which caps the memory a
+ * pipeline holds at the capacity of its queues.
+ */
+
+#pragma once
+
+// C++
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+template <typename T>
+class BoundedQueue
+{
+public:
+    /**
+     * @brief BoundedQueue constructor
+     * @param capacity Number of items the queue holds before push() blocks.
+     */
+    BoundedQueue( size_t capacity )
+        : capacity( capacity ),
+          closed( false )
+    {
+    }
+
+    /**
+     * @brief Append an item, waiting for space if the queue is full.
+     * @param item The item, which is moved into the queue.
+     * @returns False if the queue was closed; the item is dropped.
+     */
+    bool push( T item )
+    {
+        std::unique_lock<std::mutex> lock( mutex );
+        notFull.wait( lock, [ this ] { return closed || items.size() < capacity; } );
+        if ( closed )
+            return false;
+        items.push_back( std::move( item ) );
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Take the oldest item, waiting for one if the queue is empty.
+     * @param item Out: the item.
+     * @returns False once the queue is closed and empty.
+     */
+    bool pop( T& item )
+    {
+        std::unique_lock<std::mutex> lock( mutex );
+        notEmpty.wait( lock, [ this ] { return closed || !items.empty(); } );
+        if ( items.empty() )
+            return false;
+        item = std::move( items.front() );
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Signal that no more items will be pushed.
+     * @arg None.
+     * @returns void.
+     *
+     * Items already queued can still be popped. Blocked producers return false.
+     */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notEmpty;   /**< Signalled when an item is pushed or the queue is closed. */
+    std::condition_variable notFull;    /**< Signalled when an item is popped or the queue is closed. */
+    bool closed;
+};
@@ -0,0 +1,74 @@
+/**
+ * @file buffer_pool.h
+ * @brief Pool of fixed-size aligned buffers
+ *
+ * Buffers are allocated once and recycled, so the recording path never
+ * allocates memory while frames are flowing. They can be allocated from the
+ * memory of a NUMA node, for the threads placed on that node.
+ *
+ * Nor should it fault pages in: buffers are touched when they are allocated,
+ * and come from large pages, which are never paged out, if the account has
+ * the "Lock pages in memory" right. Otherwise they can be locked in the
+ * working set while they are needed. Buffers allocated with VirtualAlloc are
+ * carved out of one region per pool, so only the pool is rounded up to a
+ * whole number of (large) pages, not every buffer.
+ */
+
+#pragma once
+
+// C++
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+/** How the memory of buffer pools is obtained */
+struct BufferMemorySettings
+{
+    bool largePages;    /**< Use large pages where the account may; ordinary pages otherwise. */
+    bool locked;        /**< Lock ordinary pages in the working set while the buffers are in use. */
+
+    BufferMemorySettings( void );
+};
+
+class BufferPool
+{
+public:
+    enum
+    {
+        PAGE_SIZE = 4096,   /**< Ordinary page size, the stride at which new buffers are touched. */
+    };
+
+    BufferPool( void );
+    ~BufferPool( void );
+
+    void setMemory( const BufferMemorySettings& settings );
+    bool allocate( size_t bufferSize, int count, size_t alignment, int node = -1 );
+    void deallocate();
+    void lock();
+    void unlock();
+
+    unsigned char* acquire();
+    unsigned char* tryAcquire();
+    void recycle( unsigned char* buffer );
+
+    size_t bufferSize();
+    int count();
+    int available();
+    int node();
+    bool usesLargePages();
+
+private:
+    bool allocateBuffers( size_t bufferSize, int count, size_t alignment, int node, bool large );
+
+    std::vector<unsigned char*> buffers;     /**< Every buffer owned by the pool. */
+    std::vector<unsigned char*> freeBuffers; /**< Buffers ready to be handed out. */
+    size_t size;                             /**< Size of each buffer in bytes. */
+    int bufferNode;                          /**< NUMA node the buffers were allocated on; -1 for any. */
+    BufferMemorySettings memory;             /**< For the next allocation. */
+    bool largePages;                         /**< Whether the buffers are on large pages. */
+    bool largePagesFailed;                   /**< Whether large pages could not be had; not tried again until setMemory() asks anew. */
+    unsigned char* region;                   /**< The buffers' VirtualAlloc region, or NULL if they are on the heap. */
+    bool locked;                             /**< Whether the buffers are locked in the working set. */
+    std::mutex mutex;                        /**< Protects freeBuffers, and the buffers while allocate() replaces them. */
+    std::condition_variable returned;        /**< Signalled whenever a buffer is recycled. */
+};
@@ -0,0 +1,79 @@
+/**
+ * @file compactor.h
+ * @brief Background JPEG compression of raw recordings
+ *
+ * With deferred compression, JPEG channels are recorded raw and queued here
+ * when the recording stops. Worker threads then write each file again through
+ * a SEQWriter with the channel's encoder settings, which gives exactly the file
+ * a live JPEG recording would have given. The copy is verified against the raw
+ * file before the raw file is deleted.
+ *
+ * The workers run at background priority (CPU and I/O). While a recording is
+ * running only one of them works, and all of them pause while the QoS ladder
+ * reports that capture is falling behind.
+ */
+
+#pragma once
+
+// Project includes
+#include "seq_writer.h"
+#include "sidecar_writer.h"
+
+// C++
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class Compactor
+{
+public:
+    enum
+    {
+        PAUSE_POLL_MS = 100,   /**< How often paused workers check whether they may resume. */
+    };
+
+    /** A raw file to be compressed */
+    struct Job
+    {
+        QString rawPath;                   /**< The raw recording. */
+        Streamer::Channels channel;        /**< Channel it was recorded from. */
+        std::string outputDir;             /**< Output root of the channel, as passed to SEQWriter::startRecording(). */
+        std::string dateTime;              /**< Timestamp of the recording. */
+        bool isPGswitched;                 /**< Whether the Point Grey cameras were swapped. */
+        EncoderProfile profile;            /**< Encoder profile of the channel. */
+        ResidualSettings residual;         /**< Residual codec settings of the channel. */
+        double rateTarget;                 /**< Rate control target in bytes/s; 0 for none. */
+        int rateMinQuality;
+        int rateMaxQuality;
+        SEQStorage::Backend backend;       /**< Storage backend to write with. */
+        int queueDepth;
+        std::string manifestPath;          /**< Session manifest to update once done; empty for none. */
+    };
+
+    Compactor( int threads );
+    ~Compactor( void );
+
+    void enqueue( const Job& job );
+    void setCaptureState( bool recording, bool behind );
+    int pending();
+
+private:
+    void worker( int index );
+    bool compact( const Job& job, int index, QString& compressedPath );
+    bool mayWork( int index );
+    static bool verify( const QString& rawPath, const QString& compressedPath );
+    static void updateManifest( const Job& job, const QString& compressedPath );
+
+    std::vector<std::thread> workers;
+    std::deque<Job> jobs;
+    int activeJobs;                      /**< Jobs being compressed right now. */
+    std::mutex mutex;                    /**< Protects jobs and activeJobs. */
+    std::condition_variable queued;      /**< Signalled when a job is queued. */
+    std::atomic<bool> recording;         /**< Whether capture is recording. */
+    std::atomic<bool> behind;            /**< Whether capture is falling behind. */
+    std::atomic<bool> stopping;
+};
@@ -0,0 +1,86 @@
+/**
+ * @file control_server.h
+ * @brief Local control server, for starting and stopping recordings from scripts
+ *
+ * While enabled, the server listens on a TCP port on 127.0.0.1 only. A client
+ * sends one command per line and gets one line of JSON back:
+ *
+ *     start <channel>...                     {"ok":true,"frameSet":1234}
+ *     stop                                   {"ok":true,"frameSet":1890}
+ *     roi <channel> <x> <y> <width> <height> {"ok":true,"frameSet":1901}
+ *     set <channel> <property> <value>       {"ok":true,"frameSet":1902}
+ *     snapshot <channel>                     {"ok":true,"frameSet":1903}
+ *     stats                                  {"ok":true,"recording":false,"frameSet":1904,...}
+ *
+ * or {"ok":false,"error":"..."}. Channels are top, front, color and depth
+ * (or the file name channels Top, Front, Color and DepGr); properties are
+ * fps, shutter, gain and brightness, and only apply to top and front.
+ *
+ * Every command except stats is run by the transporter thread between two
+ * frame sets, and the reply gives the number of the first set it applies to,
+ * so that a scheduler driving several rigs knows exactly where each one
+ * started and stopped. Recordings started here skip the admission check, and
+ * the main window follows them through Streamer::recordingChanged.
+ *
+ * A stop replies once the recording has ended; its files are closed after that,
+ * while stats reports "saving":true, and until then a new start is refused.
+ */
+
+#pragma once
+
+// C++
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+class Streamer;
+class CameraController;
+
+/** Settings of the control server */
+struct ControlServerSettings
+{
+    bool enabled;       /**< Whether the server listens. */
+    int port;           /**< TCP port on 127.0.0.1. */
+
+    ControlServerSettings( void );
+};
+
+class ControlServer
+{
+public:
+    enum
+    {
+        DEFAULT_PORT = 5010,        /**< Default TCP port. */
+        MAX_CLIENTS = 16,           /**< Connections served at the same time; more are turned away. */
+        MAX_LINE_LENGTH = 1024,     /**< Longest command; a client sending longer lines is disconnected. */
+        POLL_MS = 100,              /**< How often the server checks whether it should stop. */
+    };
+
+    ControlServer( Streamer* streamer, CameraController* camera );
+    ~ControlServer( void );
+
+    bool open( const ControlServerSettings& settings );
+    void close();
+    bool isOpen();
+
+private:
+    /** A connected client */
+    struct Client
+    {
+        uintptr_t socket;       /**< A SOCKET; winsock2.h can't be included here. */
+        std::string buffer;     /**< Received, not yet a complete line. */
+    };
+
+    void serve();
+    std::string execute( const std::string& line );
+    std::string stats();
+
+    Streamer* streamer;
+    CameraController* camera;
+    uintptr_t listener;         /**< The listening SOCKET. */
+    std::vector<Client> clients;
+    std::thread thread;
+    std::atomic<bool> serving;
+};
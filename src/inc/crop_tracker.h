@@ -0,0 +1,82 @@
+/**
+ * @file crop_tracker.h
+ * @brief Moving crop that follows the animal in a Point Grey stream
+ *
+ * With a dynamic crop, a Point Grey channel records a fixed-size window
+ * around the animal instead of its whole ROI. The tracker works on the ROI
+ * reduced to MotionGate::BLOCK_SIZE block means: blocks that differ from a
+ * running-average background by more than FOREGROUND_THRESHOLD are the
+ * animal, and their centroid, weighted by the difference, is where it is.
+ * The search is limited to the neighbourhood of the last position while the
+ * animal is there, so a reflection elsewhere doesn't pull the crop away.
+ *
+ * The crop follows the animal on a leash: it only moves once the animal is
+ * more than a quarter of the crop from its centre, so it doesn't jitter, and
+ * it stays inside the ROI. Where nothing is found it stays put. The origin
+ * of each frame's crop, relative to the ROI, goes to a sidecar,
+ * Mouse_<date>_<channel>_crop.csv next to the session manifest.
+ */
+
+#pragma once
+
+// Project includes
+#include "sidecar_writer.h"
+
+// Libraries
+#include <QTGui/QImage>
+
+// C++
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+/** Settings of a channel's dynamic crop */
+struct DynamicCropSettings
+{
+    bool enabled;           /**< Whether the channel records a moving crop. */
+    int width;              /**< Width of the crop; clamped to the ROI. */
+    int height;             /**< Height of the crop; clamped to the ROI. */
+    int contextInterval;    /**< Every this many frames, the whole ROI goes to a context file; 0 for none. */
+
+    DynamicCropSettings( void );
+
+    QSize cropSize( const QSize& roi ) const;
+};
+
+class CropTracker
+{
+public:
+    enum
+    {
+        FOREGROUND_THRESHOLD = 20,      /**< Difference from the background, in grey levels, that makes a block foreground. */
+        BACKGROUND_SHIFT = 7,           /**< The background moves 1/2^BACKGROUND_SHIFT of the way to the frame per frame. */
+        FOREGROUND_SHIFT = 10,          /**< The same for foreground blocks, so a resting animal fades only slowly. */
+        LEASH_FRACTION = 4,             /**< The crop moves once the animal is 1/LEASH_FRACTION of it off centre. */
+        DEFAULT_SIZE = 384,             /**< Default crop width and height. */
+        DEFAULT_CONTEXT_INTERVAL = 30,  /**< Default context interval. */
+    };
+
+    CropTracker( void );
+
+    void start( const DynamicCropSettings& settings, const QSize& roi, const QString& sessionPath );
+    QRect update( unsigned long long index, const QImage& frame, const QRect& roi, int secs, int ms );
+    void stop();
+
+    QSize getSize();
+
+private:
+    bool locate( int left, int top, int right, int bottom, double& x, double& y );
+
+    bool active;
+    QSize size;                         /**< Size of the crop. */
+    QSize area;                         /**< Size of the ROI it moves in. */
+    double centreX;                     /**< Centre of the crop, in ROI pixels. */
+    double centreY;
+    bool following;                     /**< Whether the animal was found in the last frame. */
+    int columns;                        /**< Blocks across the ROI. */
+    int rows;                           /**< Blocks down the ROI. */
+    std::vector<uint8_t> blocks;        /**< Block means of the current frame. */
+    std::vector<uint16_t> background;   /**< Background block means in 8.8 fixed point. */
+    SidecarWriter sidecar;
+    std::mutex mutex;                   /**< Protects all of the above. */
+};
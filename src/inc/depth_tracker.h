@@ -0,0 +1,95 @@
+/**
+ * @file depth_tracker.h
+ * @brief Online mouse tracking on the depth stream
+ *
+ * Finds the animal in each raw 16-bit depth frame while recording, so the
+ * depth files need not be read again to get its position and posture. Pixels
+ * at least MIN_HEIGHT_MM closer to the camera than the background (the UI's
+ * maximum depth) are foreground; 4-connected foreground pixels are labelled
+ * into components in one pass with union-find, and the largest component of
+ * at least MIN_AREA pixels is taken to be the animal. Its centroid, height
+ * above the background and orientation (from the second moments) are written,
+ * keyed by frame index and timestamp, to the session's tracking sidecar,
+ * Mouse_<date>_tracking.csv next to the manifest. Coordinates are in pixels
+ * of the recorded (ROI) frame.
+ *
+ * A 320x240 frame takes well under a millisecond, a small part of the 33 ms
+ * frame budget; the time taken is reported in the manifest.
+ */
+
+#pragma once
+
+// Project includes
+#include "sidecar_writer.h"
+
+// Libraries
+#include <QTGui/QImage>
+
+// C++
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+/** Where the animal is in one depth frame */
+struct TrackingResult
+{
+    bool found;             /**< Whether a component large enough was found; the rest is 0 if not. */
+    double x;               /**< Centroid column. */
+    double y;               /**< Centroid row. */
+    double meanHeightMM;    /**< Mean height above the background. */
+    int maxHeightMM;        /**< Greatest height above the background. */
+    int area;               /**< Pixels in the component. */
+    double orientation;     /**< Angle of the major axis, in degrees from the x axis, clockwise as rows go down. */
+    double elongation;      /**< Ratio of the major to the minor axis. */
+};
+
+class DepthTracker
+{
+public:
+    enum
+    {
+        MIN_HEIGHT_MM = 10,     /**< Height above the background a pixel needs to be foreground. */
+        MIN_AREA = 50,          /**< Pixels a component needs to be taken for the animal. */
+        INVALID_DEPTH = 32000,  /**< Depths from here on are saturated or invalid pixels. */
+    };
+
+    DepthTracker( void );
+
+    void start( const QString& sessionPath );
+    void track( unsigned long long index, const QImage& depth, const QRect& roi, int backgroundMM, int secs, int ms );
+    void skip();
+    void stop();
+
+    int getFrames();
+    int getSkipped();
+    double getMeanMilliseconds();
+    double getMaxMilliseconds();
+
+private:
+    /** Sums over the pixels of a (provisional) component */
+    struct Moments
+    {
+        int count;
+        double sumX;
+        double sumY;
+        double sumXX;
+        double sumYY;
+        double sumXY;
+        double sumHeight;
+        int maxHeight;
+    };
+
+    TrackingResult analyse( const QImage& depth, const QRect& roi, int backgroundMM );
+    int find( int label );
+
+    bool active;
+    std::vector<int> labels;            /**< Provisional label of each pixel of the previous row and the current one. */
+    std::vector<int> parent;            /**< Union-find forest of provisional labels. */
+    std::vector<Moments> moments;       /**< Per provisional label, then per component. */
+    SidecarWriter sidecar;
+    int frames;                         /**< Frames tracked in the session. */
+    int skipped;                        /**< Frames not tracked because capture was falling behind. */
+    double totalSeconds;
+    double maxSeconds;
+    std::mutex mutex;                   /**< Protects all of the above. */
+};
@@ -0,0 +1,83 @@
+/**
+ * @file encoder_tuner.h
+ * @brief Picks encoder settings per channel that the rig can sustain
+ *
+ * Each channel has a ladder of candidate settings, best first: raw, then JPEG
+ * from high to low quality, with more encoder threads tried before chroma is
+ * subsampled or quality is lowered. All channels are written at once, through
+ * real SEQWriters, paced at their frame rate plus a safety margin. Channels
+ * that can't keep up step down their ladder, and the trial is repeated until
+ * every channel keeps up or has run out of candidates.
+ */
+
+#pragma once
+
+// Project includes
+#include "seq_writer.h"
+#include "jpeg_encoder.h"
+
+// Libraries
+#include <QTGui/QImage>
+
+// C++
+#include <string>
+#include <vector>
+
+class EncoderTuner
+{
+public:
+    enum
+    {
+        SAFETY_MARGIN_PERCENT = 25,  /**< How much faster than its frame rate a channel must be written. */
+        TRIAL_SECONDS = 2,           /**< Length of one trial at the target frame rate. */
+        MIN_TRIAL_FRAMES = 30,       /**< Fewest frames written per channel per trial. */
+    };
+
+    /** Outcome for one channel */
+    struct Result
+    {
+        Streamer::Channels channel;  /**< The channel. */
+        bool compressed;             /**< Whether the channel should be compressed. */
+        EncoderProfile profile;      /**< Encoder profile, if compressed. */
+        double requiredFps;          /**< Frame rate the channel must sustain. */
+        double achievedFps;          /**< Frame rate reached in the last trial, paced at the required rate plus margin. */
+        bool sustained;              /**< Whether the setting kept up. */
+    };
+
+    EncoderTuner( SEQStorage::Backend backend, int queueDepth );
+
+    void addChannel( Streamer::Channels channel, int width, int height, double fps, const QImage& sample, std::string outputDir, int follows = -1 );
+    std::vector<Result> run( std::string& report );
+
+    static QImage syntheticFrame( Streamer::Channels channel, int width, int height );
+
+private:
+    struct Candidate
+    {
+        bool compressed;
+        EncoderProfile profile;
+    };
+
+    struct Channel
+    {
+        Streamer::Channels channel;
+        int width;
+        int height;
+        double fps;
+        QImage sample;                    /**< Frame written over and over, in the format the channel records. */
+        std::string outputDir;
+        int follows;                      /**< Index of the channel whose settings this one shares, or -1. */
+        std::vector<Candidate> ladder;    /**< Candidate settings, best first. */
+        size_t step;                      /**< Current position on the ladder. */
+        double achievedFps;
+    };
+
+    static std::vector<Candidate> makeLadder( const QImage& sample );
+    void trial();
+    static void writeTrial( Channel* channel, SEQStorage::Backend backend, int queueDepth, const Candidate& candidate );
+    static std::string describe( const Candidate& candidate );
+
+    SEQStorage::Backend backend;
+    int queueDepth;
+    std::vector<Channel> channels;
+};
@@ -0,0 +1,241 @@
+/**
+ * @file frame_bus.h
+ * @brief Live frame sets in shared memory, and the client library that reads them
+ *
+ * While the bus is enabled, the Streamer publishes every synchronized frame
+ * set into a named shared memory ring of fixed slots, so that tracking and
+ * analysis tools in other processes can see frames as they are captured.
+ * Each slot holds one set: a header per channel (format, size, ROI,
+ * timestamp and arrival index) followed by the whole raw frames.
+ *
+ * Readers never write to the bus, so they cannot hold up capture. Instead each
+ * slot carries a sequence number, odd while the publisher writes set n into it
+ * (2n + 1) and 2n + 2 once the set is complete; a reader checks it before and
+ * after using a set, and a reader that was too slow finds that the publisher
+ * has lapped it and moves on to a newer set.
+ *
+ * This header is all a client needs: it has no dependencies beyond the
+ * Windows API. The reader maps the bus read-only and hands out pointers into
+ * it, without copying:
+ *
+ *     FrameBusReader reader;
+ *     FrameBusReader::View view;
+ *     reader.open();
+ *     while ( ... )
+ *         if ( reader.next( view ) )
+ *         {
+ *             // Use view.data( c ) and view.channel( c ) ...
+ *             if ( !reader.valid( view ) )
+ *                 ; // ... and discard the result: the set was overwritten meanwhile
+ *         }
+ */
+
+#pragma once
+
+// Libraries
+#include <windows.h>
+
+// C++
+#include <stdint.h>
+
+/** Constants shared by the publisher and its readers */
+struct FrameBusLayout
+{
+    enum
+    {
+        MAGIC = 0x53554248,             /**< "HBUS". */
+        VERSION = 1,                    /**< Changes whenever the layout does. */
+        MAX_CHANNELS = 5,               /**< Channels per set, in the order of Streamer::Channels. */
+        HEADER_SIZE = 4096,             /**< Space for the FrameBusHeader; the slots follow. */
+        SLOT_HEADER_SIZE = 4096,        /**< Space for the FrameBusSlot at the start of each slot; the frames follow. */
+        FRAME_ALIGNMENT = 64,           /**< Alignment of each frame within its slot. */
+    };
+
+    enum Format
+    {
+        NoFrame = 0,    /**< The channel is not in the set. */
+        Grey8,          /**< 8-bit grey: the Point Grey channels. */
+        BGR24,          /**< 24-bit blue, green, red: the color channel. */
+        Depth16,        /**< 16-bit depth in mm, or confidence: the depth and IR channels. */
+        NUM_FORMATS     /**< Number of formats. */
+    };
+
+    static const char* defaultName() { return "Local\\HunterFrameBus"; }
+};
+
+/** One channel's frame in a slot */
+struct FrameBusChannel
+{
+    int32_t format;                 /**< A FrameBusLayout::Format. */
+    int32_t width;
+    int32_t height;
+    int32_t stride;                 /**< Bytes per row. */
+    int32_t roiX;                   /**< The channel's ROI, which is what gets recorded. */
+    int32_t roiY;
+    int32_t roiWidth;
+    int32_t roiHeight;
+    int32_t timestampSeconds;       /**< Timestamp as recorded: seconds. */
+    int32_t timestampMilliSeconds;  /**< Timestamp as recorded: milliseconds. */
+    uint64_t frameIndex;            /**< Arrival index within the channel. */
+    uint64_t offset;                /**< Of the frame from the start of the slot. */
+    uint64_t size;                  /**< Bytes of frame data; 0 if the frame did not fit in the slot. */
+};
+
+/** Header of a slot */
+struct FrameBusSlot
+{
+    volatile int64_t sequence;      /**< 2n + 1 while set n is written, 2n + 2 once it is complete. */
+    uint64_t set;                   /**< Number of the set in the slot. */
+    int32_t recording;              /**< Whether the set is being recorded. */
+    int32_t gateOpen;               /**< Whether the motion gate lets it be written. */
+    FrameBusChannel channels[ FrameBusLayout::MAX_CHANNELS ];
+};
+
+/** Header of the bus */
+struct FrameBusHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t publisherProcess;      /**< Process ID of the publisher; a new one means a new bus. */
+    uint64_t slotSize;              /**< Bytes per slot, header included. */
+    volatile int64_t published;     /**< Number of sets completely published. */
+};
+
+class FrameBusReader
+{
+public:
+    /** A set in the bus. It stays valid until the publisher laps it. */
+    struct View
+    {
+        int64_t set;
+        const FrameBusSlot* slot;
+
+        const FrameBusChannel& channel( int c ) const { return slot->channels[ c ]; }
+        bool has( int c ) const { return slot->channels[ c ].format != FrameBusLayout::NoFrame && slot->channels[ c ].size > 0; }
+        const uint8_t* data( int c ) const { return (const uint8_t*)slot + slot->channels[ c ].offset; }
+    };
+
+    FrameBusReader( void ) : mapping( NULL ), header( NULL ), lastSet( -1 ), lapped( 0 ) {}
+    ~FrameBusReader( void ) { close(); }
+
+    /**
+     * @brief Map a bus.
+     * @param name Name of the bus, as configured in Hunter.
+     * @returns Whether a bus of this version is published under the name.
+     */
+    bool open( const char* name = FrameBusLayout::defaultName() )
+    {
+        close();
+        mapping = OpenFileMappingA( FILE_MAP_READ, FALSE, name );
+        if ( !mapping )
+            return false;
+        header = (const FrameBusHeader*)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+        if ( !header || header->magic != FrameBusLayout::MAGIC || header->version != FrameBusLayout::VERSION )
+        {
+            close();
+            return false;
+        }
+        // Start from the newest set
+        int64_t newest = latest();
+        lastSet = ( newest < 0 ) ? -1 : newest - 1;
+        lapped = 0;
+        return true;
+    }
+
+    /**
+     * @brief Unmap the bus.
+     * @arg None.
+     * @returns void.
+     */
+    void close()
+    {
+        if ( header )
+            UnmapViewOfFile( header );
+        if ( mapping )
+            CloseHandle( mapping );
+        header = NULL;
+        mapping = NULL;
+    }
+
+    bool isOpen() const { return header != NULL; }
+    const FrameBusHeader* getHeader() const { return header; }
+
+    /**
+     * @brief The newest complete set.
+     * @arg None.
+     * @returns Its number, or -1 if none has been published.
+     */
+    int64_t latest() const
+    {
+        int64_t published = header->published;
+        MemoryBarrier();
+        return published - 1;
+    }
+
+    /**
+     * @brief Look up a set.
+     * @param set Number of the set.
+     * @param view Out: the set, if it is still in the bus.
+     * @returns Whether the set is complete and not yet overwritten.
+     */
+    bool acquire( int64_t set, View& view ) const
+    {
+        if ( set < 0 )
+            return false;
+        view.set = set;
+        view.slot = (const FrameBusSlot*)( (const uint8_t*)header + FrameBusLayout::HEADER_SIZE + ( set % header->slotCount ) * header->slotSize );
+        return valid( view );
+    }
+
+    /**
+     * @brief Check that a set has not been overwritten.
+     * @param view The set.
+     * @returns Whether everything read from it since acquiring it is good.
+     */
+    bool valid( const View& view ) const
+    {
+        MemoryBarrier();
+        return view.slot->sequence == 2 * view.set + 2;
+    }
+
+    /**
+     * @brief The set after the one last returned, or the oldest one left if the publisher has lapped it.
+     * @param view Out: the set.
+     * @returns Whether there was a new set.
+     */
+    bool next( View& view )
+    {
+        int64_t newest = latest();
+        while ( lastSet < newest )
+        {
+            // The publisher may already be writing into the slot of the oldest set
+            int64_t oldest = newest - header->slotCount + 2;
+            int64_t set = lastSet + 1;
+            if ( set < oldest )
+            {
+                lapped += oldest - set;
+                set = oldest;
+            }
+            lastSet = set;
+            if ( acquire( set, view ) )
+                return true;
+            lapped++;
+            newest = latest();
+        }
+        return false;
+    }
+
+    /**
+     * @brief Number of sets skipped by next() because the reader fell behind.
+     * @arg None.
+     * @returns Sets since open().
+     */
+    int64_t getLapped() const { return lapped; }
+
+private:
+    HANDLE mapping;
+    const FrameBusHeader* header;
+    int64_t lastSet;                /**< Set last returned by next(). */
+    int64_t lapped;
+};
@@ -0,0 +1,78 @@
+/**
+ * @file frame_bus_publisher.h
+ * @brief Publishes synchronized frame sets on the shared memory frame bus
+ *
+ * The publisher owns the bus: it creates the named mapping, lays out its slots
+ * as described in frame_bus.h, and copies each frame set into the next slot.
+ * It never waits for readers. The copy runs on the transporter thread, before
+ * the set is queued for the processors; a full set of raw frames is a few
+ * megabytes, about a millisecond of memory bandwidth.
+ */
+
+#pragma once
+
+// Project includes
+#include "frame_bus.h"
+
+// Libraries
+#include <QTCore/QRect>
+
+// C++
+#include <mutex>
+#include <string>
+
+/** Settings of the frame bus */
+struct FrameBusSettings
+{
+    bool enabled;           /**< Whether frame sets are published. */
+    std::string name;       /**< Name of the shared memory, e.g. Local\HunterFrameBus. */
+    int slotCount;          /**< Sets in the ring. */
+    int slotMegabytes;      /**< Space per set; frames that don't fit are published without data. */
+
+    FrameBusSettings( void );
+};
+
+class FrameBusPublisher
+{
+public:
+    enum
+    {
+        DEFAULT_SLOTS = 8,              /**< Default number of slots. */
+        DEFAULT_SLOT_MEGABYTES = 12,    /**< Default slot size: two full Point Grey frames, a color and a depth frame. */
+        MIN_SLOTS = 3,                  /**< A reader needs at least one slot the publisher isn't writing. */
+    };
+
+    /** One channel's frame handed to publish() */
+    struct Frame
+    {
+        FrameBusLayout::Format format;  /**< NoFrame if the channel is not in the set. */
+        const void* data;
+        int width;
+        int height;
+        int stride;                     /**< Bytes per row. */
+        QRect roi;
+        int timestampSeconds;
+        int timestampMilliSeconds;
+        unsigned long long frameIndex;
+    };
+
+    FrameBusPublisher( void );
+    ~FrameBusPublisher( void );
+
+    bool open( const FrameBusSettings& settings );
+    void close();
+    bool isOpen();
+
+    void publish( const Frame frames[ FrameBusLayout::MAX_CHANNELS ], bool recording, bool gateOpen );
+
+    long long getPublished();
+    long long getTruncated();
+
+    static std::string benchmark( int readers, double seconds );
+
+private:
+    HANDLE mapping;
+    FrameBusHeader* header;
+    long long truncated;        /**< Frames published without data because they didn't fit. */
+    std::mutex mutex;           /**< Protects all of the above. */
+};
@@ -0,0 +1,74 @@
+/**
+ * @file headless_recorder.h
+ * @brief Records from the command line, without the main window
+ *
+ * The recorder loads the same XML configuration as the UI, drives the
+ * CameraController and Streamer directly, and records the configured
+ * channels for a fixed time or until Ctrl+C (or the console closing). Nothing
+ * is previewed, so no time is spent converting frames for display. While it
+ * records it prints, per channel, the frames and bytes written since the last
+ * report, the frames dropped, frames that crossed NUMA nodes (if any), and
+ * the QoS level.
+ *
+ * Settings on the side bar are taken from the configuration as the UI would
+ * apply them: camera properties, ROIs, Record and JPEG, the USB switch and the
+ * background depth. Values the UI would reject leave the camera's default.
+ *
+ * With <controlServer> in the configuration, the recorder can also just serve:
+ * recordings are then started and stopped through the control server, and
+ * reported on the same way.
+ */
+
+#pragma once
+
+// Project includes
+#include "camera_controller.h"
+#include "streamer.h"
+#include "pugixml.hpp"
+
+// C++
+#include <atomic>
+#include <string>
+
+class HeadlessRecorder
+{
+public:
+    enum
+    {
+        DEFAULT_STATS_SECONDS = 5,  /**< Default interval between reports. */
+        POLL_MS = 100,              /**< How often the recorder checks whether it should stop. */
+    };
+
+    HeadlessRecorder( void );
+    ~HeadlessRecorder( void );
+
+    bool loadConfig( const std::string& fileName, std::string& error );
+    int record( double seconds, double statsSeconds );
+    int serve( double statsSeconds );
+
+private:
+    enum AdmissionPolicy
+    {
+        AdmissionOff,       /**< Don't check. */
+        AdmissionWarn,      /**< Report, and record anyway. */
+        AdmissionRefuse,    /**< Report, and don't record if the disks are overcommitted (default). */
+    };
+
+    void loadPointGrey( pugi::xml_node node, CameraController::Cameras camera );
+    void loadRecord( pugi::xml_node node, CameraController::Cameras camera );
+    bool loadROI( pugi::xml_node roi, CameraController::Cameras camera );
+    void printStats( double seconds );
+    bool finish( double seconds );
+    bool stop();
+    void waitForCompression();
+
+    static BOOL WINAPI consoleHandler( DWORD event );
+
+    CameraController* cc;
+    Streamer* streamer;
+    bool recorded[ CameraController::Cameras::NUM_CAMERAS ];   /**< Cameras selected for recording. */
+    AdmissionPolicy admissionPolicy;
+    Streamer::ChannelStatus lastStatus[ Streamer::N_CHANNELS ]; /**< As of the previous report. */
+
+    static std::atomic<int> stopRequests;   /**< Ctrl+C presses and the like since recording started. */
+};
@@ -21,6 +21,8 @@
 #include <QTGui/QCloseEvent>
 #include <QTGui/QPainter>
 #include <QTCore/QDateTime>
+#include <QTCore/QFutureWatcher>
+#include <QTWidgets/QProgressDialog>
 
 // C++
 #include <array>
@@ -37,6 +39,12 @@ public:
 	// Set the initial camera settings on the side bar
 	void setSideBar();
 
+	// Pick and save the encoder settings the rig can sustain
+	std::string autoTuneEncoders();
+
+	// Apply the settings that have no control on the side bar; shared with the headless recorder
+	static void loadStreamerSettings( pugi::xml_node cameraSetting, Streamer* streamer );
+
 private slots:
 	// UI signals
 	void on_recordButton_clicked();
@@ -72,6 +80,7 @@ private slots:
 	void on_menu_outputFolder_triggered();
 	void on_menu_loadConfig_triggered();
 	void on_menu_saveConfig_triggered();
+	void on_menu_autoTune_triggered();
 
 	void on_fpsPGT_textChanged();
 	void on_shutterPGT_textChanged();
@@ -110,6 +119,8 @@ private slots:
     void updateStreamForCamera( CameraController::Cameras cam, QImage image );
 	void timerEvent();
 	void updateRecordButtonOnStopSaving();
+	void updateRecordButtonOnRecordingChanged( bool recording );
+	void autoTuneFinished();
 
 protected:
 	// Window events
@@ -139,6 +150,13 @@ private:
         QLabel** canvas;                 /**< The camera's drawing canvas. */
     } CameraControls;
 
+    /** Outcome of the encoder tuning, which runs on a worker thread. */
+    struct AutoTuneResult
+    {
+        std::string report;                       /**< The streamer's report. */
+        bool compressed[ Streamer::N_CHANNELS ];  /**< Whether each channel is to be JPEG compressed. */
+    };
+
     /** A 2D point. */
     struct Point
     {
@@ -230,6 +248,9 @@ private:
 	void Hunter::applyColor();
 	int Hunter::getDepthValue( QImage image, QPoint point );
 	void Hunter::createLUTs();
+	bool Hunter::admitRecording( bool pgt, bool pgf, bool color, bool depth );
+	bool Hunter::autoTuneSelection( bool selected[ CameraController::Cameras::NUM_CAMERAS ], bool compressed[ Streamer::N_CHANNELS ] );
+	std::string Hunter::applyAutoTune( const AutoTuneResult& result );
 
 	// Objects
     std::array< CameraControls, CameraController::Cameras::NUM_CAMERAS > cameras; // Must use std::array due to CS2536
@@ -248,6 +269,19 @@ private:
 
 	bool recording;
 
+	// Encoder tuning in progress from the menu, if any
+	QFutureWatcher<AutoTuneResult> autoTuneWatcher;
+	QProgressDialog* autoTuneProgress;
+
+	// What to do when the output disks can't keep up with the selected streams
+	enum AdmissionPolicy
+	{
+		AdmissionOff,    /**< Don't check. */
+		AdmissionWarn,   /**< Warn, and let the user record anyway. */
+		AdmissionRefuse, /**< Warn when marginal, refuse when overcommitted. */
+	};
+	AdmissionPolicy admissionPolicy;
+
     struct Point calibrationPoints[ 4 ];
 	bool calibrationInitialized;
 	int calibrationPointMoved;
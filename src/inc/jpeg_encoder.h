@@ -0,0 +1,67 @@
+/**
+ * @file jpeg_encoder.h
+ * @brief JPEG encoder with configurable profiles
+ *
+ * Baseline profiles go through TurboJPEG. Progressive profiles and profiles
+ * with restart markers need settings TurboJPEG doesn't expose, so they go
+ * through the libjpeg API of the same library. Baseline profiles with more
+ * than one thread are encoded in slices by a SliceEncoder.
+ */
+
+#pragma once
+
+// Project includes
+#include "slice_encoder.h"
+
+// Libraries
+#include <QTGui/QImage>
+#include <turbojpeg.h>
+
+// C++
+#include <string>
+#include <vector>
+
+struct EncoderProfile
+{
+    int quality;        /**< Default JPEG quality (1-100). */
+    int subsampling;    /**< Chroma subsampling of color images (TJSAMP_444, TJSAMP_422 or TJSAMP_420). */
+    bool accurateDCT;   /**< Use the accurate integer DCT instead of the fast one. */
+    bool progressive;   /**< Write a progressive instead of a baseline JPEG. */
+    int restartRows;    /**< MCU rows between restart markers; 0 for none. */
+    int threads;        /**< Threads encoding each frame; more than one puts a restart marker between their slices instead. */
+
+    EncoderProfile( void );
+
+    std::string describe() const;
+    bool needsLibjpeg() const;
+    bool isSliced() const;
+
+    static int subsamplingFromName( const std::string& name );
+    static std::string subsamplingName( int subsampling );
+};
+
+class JPEGEncoder
+{
+public:
+    JPEGEncoder( void );
+    ~JPEGEncoder( void );
+    JPEGEncoder( const JPEGEncoder& ) = delete;
+    JPEGEncoder& operator=( const JPEGEncoder& ) = delete;
+
+    void setProfile( const EncoderProfile& profile );
+    EncoderProfile getProfile();
+
+    int encode( const QImage* image, unsigned char* destination, unsigned long capacity, int quality );
+
+    static unsigned long bufferSize( int width, int height );
+    static std::string benchmark( const std::vector<QImage>& samples, const std::vector<EncoderProfile>& profiles, int repetitions );
+
+private:
+    int encodeTurbo( const QImage* image, unsigned char* destination, unsigned long capacity, int quality );
+    int encodeLibjpeg( const QImage* image, unsigned char* destination, unsigned long capacity, int quality );
+    static const QImage* prepare( const QImage* image, QImage& converted );
+
+    tjhandle handle;          /**< TurboJPEG compressor, kept for the life of the encoder. */
+    SliceEncoder *slicer;     /**< Parallel encoder for profiles with more than one thread. */
+    EncoderProfile profile;
+};
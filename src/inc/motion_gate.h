@@ -0,0 +1,92 @@
+/**
+ * @file motion_gate.h
+ * @brief Pauses recording while nothing moves in front of a camera
+ *
+ * Overnight sessions spend hours on a sleeping animal. The gate watches one
+ * Point Grey channel: every SAMPLE_INTERVAL_MS it reduces the ROI to the means
+ * of BLOCK_SIZE x BLOCK_SIZE blocks, which averages away sensor noise, and
+ * takes the mean squared difference from the previous sample. Once that energy
+ * has stayed below the threshold for the hold time, the gate closes and no
+ * channel writes frames; the first sample above it opens the gate again.
+ *
+ * The gate decides per frame set, so all channels pause and resume on the
+ * same frame. While it is closed, each channel keeps its last preRollFrames
+ * frames and writes them when it opens, so the recording picks up a little
+ * before the motion was detected. Each pause is logged in the session's
+ * events sidecar, Mouse_<date>_events.csv next to the manifest.
+ */
+
+#pragma once
+
+// Project includes
+#include "sidecar_writer.h"
+
+// Libraries
+#include <QTCore/QRect>
+
+// C++
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+/** Settings of the motion gate */
+struct MotionGateSettings
+{
+    bool enabled;           /**< Whether recording pauses without motion. */
+    int channel;            /**< Point Grey channel that is watched. */
+    double threshold;       /**< Difference energy, in grey levels squared, that counts as motion. */
+    double holdSeconds;     /**< Time without motion before recording pauses. */
+    int preRollFrames;      /**< Frames per channel written from before the motion that resumes recording. */
+
+    MotionGateSettings( void );
+};
+
+class MotionGate
+{
+public:
+    enum
+    {
+        BLOCK_SIZE = 8,                 /**< Edge of the blocks the ROI is reduced to. */
+        SAMPLE_INTERVAL_MS = 200,       /**< Time between motion samples. */
+        DEFAULT_THRESHOLD = 4,          /**< Default difference energy threshold. */
+        DEFAULT_HOLD_SECONDS = 10,      /**< Default hold time. */
+        DEFAULT_PRE_ROLL_FRAMES = 30,   /**< Default pre-roll. */
+    };
+
+    MotionGate( void );
+
+    void start( const MotionGateSettings& settings, const QString& sessionPath );
+    bool update( unsigned long long index, const uchar* data, int stride, const QRect& roi, int secs, int ms );
+    void stop();
+
+    int getPauses();
+    unsigned long long getSkippedSets();
+
+    static void downsample( const uchar* data, int stride, const QRect& roi, std::vector<uint8_t>& blocks );
+    static double differenceEnergy( const std::vector<uint8_t>& a, const std::vector<uint8_t>& b );
+
+private:
+    /** A frame set that was not written */
+    struct SkippedSet
+    {
+        unsigned long long index;
+        int secs;
+        int ms;
+    };
+
+    MotionGateSettings settings;
+    bool active;                        /**< Between start() and stop() with the gate enabled. */
+    bool open;
+    bool sampled;                       /**< Whether previous holds a sample. */
+    long long lastSample;               /**< Time of the previous sample, in ms. */
+    long long lastMotion;               /**< Time motion was last seen, in ms. */
+    std::vector<uint8_t> previous;      /**< Block means of the previous sample. */
+    std::vector<uint8_t> current;
+    std::deque<SkippedSet> preRoll;     /**< The last sets skipped, which the channels hold on to. */
+    unsigned long long pausedSets;      /**< Sets skipped in the current pause. */
+    unsigned long long skippedSets;     /**< Sets skipped in the session, not counting pre-roll. */
+    int pauses;
+    SidecarWriter events;
+    std::mutex mutex;                   /**< Protects all of the above. */
+};
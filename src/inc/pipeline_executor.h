@@ -0,0 +1,97 @@
+/**
+ * @file pipeline_executor.h
+ * @brief Fixed set of worker threads that run the per-channel processing
+ *
+ * The workers are created once, when the streamer is, so starting to stream
+ * or record never waits for a thread to be created. Each worker is pinned to
+ * a configured core and runs at a configured priority, so the placement of
+ * the pipeline is the same from one run to the next.
+ *
+ * A task is queued on a preferred worker (for a channel: the worker of the
+ * same index), and only that worker is woken for it. It runs there unless that
+ * worker is busy and another worker on the same NUMA node is idle, which then
+ * steals it. A channel's task processes the channel's frames in order until
+ * the channel neither streams nor records, so frames of one channel are never
+ * split across workers.
+ *
+ * On hosts with more than one NUMA node, each worker is kept on one node:
+ * unless configured otherwise, the Point Grey Top and Front workers go to the
+ * first two nodes and the DepthSense workers, whose frames arrive on a single
+ * callback thread, to the first. The camera callbacks and the frame pools of
+ * a channel follow the node of its worker, see node() and affinity().
+ */
+
+#pragma once
+
+// C++
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PipelineSettings;
+
+class PipelineExecutor
+{
+public:
+    enum Priority
+    {
+        NormalPriority,         /**< THREAD_PRIORITY_NORMAL. */
+        AboveNormalPriority,    /**< THREAD_PRIORITY_ABOVE_NORMAL. */
+        HighestPriority,        /**< THREAD_PRIORITY_HIGHEST. */
+        TimeCriticalPriority,   /**< THREAD_PRIORITY_TIME_CRITICAL (default). */
+        NUM_PRIORITIES          /**< Number of priorities. */
+    };
+
+    enum
+    {
+        DEFAULT_WORKERS = 4,    /**< One per processing channel: Point Grey Top and Front, Color, Depth (with IR). */
+    };
+
+    static const std::string priorityNames[ NUM_PRIORITIES ];
+
+    static Priority priorityFromName( const std::string& name );
+
+    static int nodeCount();
+    static int currentNode();
+    static unsigned long long nodeMask( int node );
+
+    PipelineExecutor( int workers );
+    ~PipelineExecutor( void );
+
+    bool configure( const PipelineSettings& settings );
+    void submit( std::function<void()> task, int preferredWorker );
+    void stop();
+    int workers();
+    int node( int worker );
+    unsigned long long affinity( int worker );
+
+private:
+    void worker( int index );
+    bool takeTask( int index, std::function<void()>& task );
+
+    std::vector<std::thread> threads;
+    std::vector<std::deque<std::function<void()>>> tasks;  /**< Per worker, queued but not yet running. */
+    std::vector<bool> busy;                         /**< Per worker, whether it runs a task. */
+    std::vector<int> workerNodes;                   /**< Node of each worker; -1 if it may run on any. */
+    std::vector<unsigned long long> workerMasks;    /**< Cores each worker may run on. */
+    std::mutex mutex;                   /**< Protects tasks, busy, stopping and the placement. */
+    std::vector<std::unique_ptr<std::condition_variable>> wakeups;  /**< Per worker, signalled when it has a task to take. */
+    bool stopping;
+};
+
+/** Placement of the pipeline workers */
+struct PipelineSettings
+{
+    // Worker i is placed by entry i % size: on core cores[ i ] if it is set, else anywhere on node nodes[ i ]
+    // if that is set, else on any core. Without entries, workers are spread over the NUMA nodes.
+    std::vector<int> cores;
+    std::vector<int> nodes;
+    PipelineExecutor::Priority priority;    /**< Priority of every worker. */
+
+    PipelineSettings( void );
+};
@@ -0,0 +1,61 @@
+/**
+ * @file qos_controller.h
+ * @brief Degradation ladder for when processing falls behind the cameras
+ *
+ * When the per-channel frame queues back up, the controller degrades in a
+ * fixed order: first the UI preview is throttled, then the JPEG quality is
+ * lowered step by step, and only when that is exhausted may frames be
+ * dropped. Once the queues drain it climbs back up the same way.
+ */
+
+#pragma once
+
+// C++
+#include <atomic>
+#include <mutex>
+#include <string>
+
+class QoSController
+{
+public:
+    enum Level
+    {
+        Normal,           /**< Full preview rate and JPEG quality. */
+        PreviewThrottled, /**< Preview updated less often. */
+        QualityReduced,   /**< Preview throttled and JPEG quality lowered. */
+        Dropping,         /**< Everything degraded; frames may be dropped. */
+        NUM_LEVELS        /**< Number of levels. */
+    };
+
+    static const std::string levelNames[ NUM_LEVELS ];
+
+    enum
+    {
+        SOFT_QUEUE_SIZE = 3,          /**< Queue depth that counts as falling behind. */
+        CALM_QUEUE_SIZE = 1,          /**< Queue depth that counts as keeping up. */
+        ESCALATE_AFTER = 5,           /**< Frame sets behind before degrading one step. */
+        RELAX_AFTER = 90,             /**< Frame sets keeping up before recovering one step. */
+        PREVIEW_THROTTLE_FACTOR = 5,  /**< Preview interval multiplier while throttled. */
+        QUALITY_STEP = 10,            /**< JPEG quality decrement per step. */
+        MIN_QUALITY = 40,             /**< Lowest JPEG quality before frames are dropped. */
+    };
+
+    QoSController( int previewInterval, int quality );
+
+    void reset();
+    void update( int queueDepth );
+
+    Level level();
+    int previewInterval();
+    int qualityReduction();
+    bool mayDrop();
+
+private:
+    const int basePreviewInterval;   /**< Preview interval in ms at Normal. */
+    const int baseQuality;           /**< JPEG quality at Normal. */
+    std::atomic<int> currentLevel;
+    std::atomic<int> quality;
+    int behindSets;                  /**< Consecutive frame sets above SOFT_QUEUE_SIZE. */
+    int calmSets;                    /**< Consecutive frame sets at or below CALM_QUEUE_SIZE. */
+    std::mutex mutex;                /**< Protects the counters. */
+};
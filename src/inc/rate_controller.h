@@ -0,0 +1,43 @@
+/**
+ * @file rate_controller.h
+ * @brief JPEG quality control towards a target bitrate
+ *
+ * JPEG frame sizes swing with scene content. The rate controller picks the
+ * quality of each frame so that the stream averages a target number of bytes
+ * per second, paying back overshoot over a short horizon rather than in one
+ * jump. It only does arithmetic on the size of the previous frame.
+ */
+
+#pragma once
+
+class RateController
+{
+public:
+    enum
+    {
+        HORIZON_FRAMES = 30,  /**< Frames over which accumulated over- or undershoot is paid back. */
+        MAX_STEP = 4,         /**< Largest quality change from one frame to the next. */
+    };
+
+    RateController( void );
+
+    void configure( double targetBytesPerSecond, int minQuality, int maxQuality );
+    void start( double fps, int initialQuality );
+    bool enabled();
+
+    int quality();
+    void update( int frameBytes );
+
+    double getTarget();
+    int getMinQuality();
+    int getMaxQuality();
+
+private:
+    double target;           /**< Target bytes per second; 0 when disabled. */
+    int minQuality;
+    int maxQuality;
+    double targetPerFrame;   /**< Target bytes per frame at the recording's frame rate. */
+    double averageSize;      /**< Moving average of recent frame sizes at the current quality. */
+    double debt;             /**< Bytes written beyond the target so far; negative when under. */
+    double currentQuality;   /**< Quality of the next frame, unrounded. */
+};
@@ -0,0 +1,121 @@
+/**
+ * @file residual_codec.h
+ * @brief Temporal background-residual codec for static-camera grayscale streams
+ *
+ * The Point Grey cameras look at an arena that hardly changes; the animal
+ * covers a small part of the frame. Rather than a full JPEG per frame, the
+ * encoder writes a JPEG keyframe every so often, and in between only the
+ * 16x16 tiles that differ from what the decoder already shows, packed side by
+ * side into one small JPEG. A tile is sent when its mean absolute difference
+ * from the decoder's copy exceeds a threshold, or one of its pixels differs by
+ * more than PEAK_FACTOR times the threshold (so the edge of the animal crossing
+ * the corner of a tile isn't left behind). In addition, a few tiles per
+ * frame are refreshed from a slowly updated running average of the scene, so
+ * lighting drift below the threshold is caught up with and sensor noise is
+ * not recorded.
+ *
+ * Frame records have the same layout as JPEG SEQ records ([size] payload
+ * timestamp), so files can be walked the same way, but the payload is:
+ *   keyframe: KEYFRAME, then a JPEG of the whole frame.
+ *   residual: RESIDUAL, uint32 tile count, per tile uint16 column and row,
+ *             then (if any tiles) a JPEG of the packed tiles, TILES_PER_ROW
+ *             tiles to a row.
+ * SEQWriter appends an index of record offsets and a footer (INDEX_FOOTER_SIZE
+ * bytes: uint64 index offset, uint32 frame count, uint32 INDEX_MAGIC) for
+ * random access. These files aren't Norpix SEQ files; hunter --transcode
+ * converts them to JPEG SEQ.
+ */
+
+#pragma once
+
+// Project includes
+#include "jpeg_encoder.h"
+
+// Libraries
+#include <QTGui/QImage>
+#include <turbojpeg.h>
+
+// C++
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/** Settings of the residual codec for a channel */
+struct ResidualSettings
+{
+    bool enabled;           /**< Whether the channel uses the residual codec (grayscale channels only). */
+    int threshold;          /**< Mean absolute difference per pixel above which a tile is sent. */
+    int keyframeInterval;   /**< Frames from one keyframe to the next. */
+
+    ResidualSettings( void );
+
+    std::string describe() const;
+};
+
+class ResidualEncoder
+{
+public:
+    enum
+    {
+        TILE_SIZE = 16,                 /**< Tile edge in pixels; a multiple of the 8-pixel JPEG block. */
+        TILES_PER_ROW = 64,             /**< Tiles per row of the packed tile image. */
+        REFRESH_TILES = 4,              /**< Tiles per frame refreshed from the background model. */
+        BACKGROUND_UPDATE_INTERVAL = 4, /**< Frames between updates of the background model. */
+        BACKGROUND_SHIFT = 3,           /**< The model moves 1/2^BACKGROUND_SHIFT of the way to the frame per update. */
+        PEAK_FACTOR = 8,                /**< A tile is also sent if one pixel differs by this many times the threshold. */
+        KEYFRAME = 1,                   /**< Payload type of keyframes. */
+        RESIDUAL = 2,                   /**< Payload type of residual frames. */
+        INDEX_MAGIC = 0x58495248,       /**< "HRIX", ends the index footer. */
+        INDEX_FOOTER_SIZE = 16,         /**< Size of the index footer in bytes. */
+        DEFAULT_THRESHOLD = 6,          /**< Default tile threshold. */
+        DEFAULT_KEYFRAME_INTERVAL = 300,/**< Default keyframe interval. */
+    };
+    static const uint64_t KEYFRAME_FLAG = 1ULL << 63;   /**< Marks keyframes in the index. */
+
+    ResidualEncoder( void );
+
+    void start( int width, int height, const ResidualSettings& settings );
+    int encode( const QImage* image, unsigned char* destination, unsigned long capacity, int quality, JPEGEncoder& jpeg, bool& keyframe );
+
+    static unsigned long bufferSize( int width, int height );
+
+private:
+    bool tileChanged( const QImage* image, int column, int row );
+    void updateBackground( const QImage* image );
+    void copyTile( const uchar* source, int sourcePitch, uchar* destination, int destinationPitch, int width, int height );
+
+    ResidualSettings settings;
+    int width;
+    int height;
+    int columns;                        /**< Tiles across. */
+    int rows;                           /**< Tiles down. */
+    int frameIndex;                     /**< Frames encoded since start(). */
+    int nextRefresh;                    /**< Next tile refreshed from the background model. */
+    QImage reference;                   /**< What the decoder shows, before JPEG loss. */
+    QImage background;                  /**< Background model, rounded, for refreshing tiles. */
+    std::vector<uint16_t> average;      /**< Background model in 8.8 fixed point. */
+    std::vector<uint16_t> tiles;        /**< Column and row of each tile sent with the current frame. */
+    QImage packed;                      /**< Tiles sent with the current frame. */
+};
+
+class ResidualDecoder
+{
+public:
+    ResidualDecoder( void );
+    ~ResidualDecoder( void );
+    ResidualDecoder( const ResidualDecoder& ) = delete;
+    ResidualDecoder& operator=( const ResidualDecoder& ) = delete;
+
+    void start( int width, int height );
+    bool decode( const unsigned char* data, size_t size, QImage& frame );
+
+    static bool isKeyframe( const unsigned char* data, size_t size );
+
+private:
+    bool decompress( const unsigned char* jpeg, size_t size, QImage& image );
+
+    tjhandle decompressor;
+    QImage current;                     /**< The last frame decoded. */
+    QImage packed;
+    bool haveKeyframe;                  /**< Whether residual frames can be applied yet. */
+};
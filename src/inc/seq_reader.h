@@ -0,0 +1,85 @@
+/**
+ * @file seq_reader.h
+ * @brief SEQ file reader
+ *
+ * Reads the files SEQWriter produces: the header, and frames one by one,
+ * either as the stored bytes or decoded into a QImage in the format the
+ * recorder passed to SEQWriter::writeFrame(). Residual-coded files are
+ * decoded in order; seek() starts from the nearest keyframe.
+ */
+
+#pragma once
+
+// Project includes
+#include "residual_codec.h"
+
+// Libraries
+#include <QTCore/QFile.h>
+#include <QTGui/QImage>
+#include <turbojpeg.h>
+
+// C++
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class SEQReader
+{
+public:
+    SEQReader( void );
+    ~SEQReader( void );
+
+    bool open( const QString& path );
+    void close();
+
+    bool readRecord( std::vector<unsigned char>& data, int& secs, short& ms );
+    bool readFrame( QImage& image, int& secs, short& ms );
+    bool decode( const std::vector<unsigned char>& data, QImage& image, tjhandle decompressor ) const;
+    bool seek( int frame );
+
+    int getWidth();
+    int getHeight();
+    int getBitsPerPixel();
+    int getImageFormat();
+    int getFrameCount();
+    double getFrameRate();
+    std::string getDescription();
+    bool isCompressed() const;
+    bool isResidual() const;
+    QImage::Format getPixelFormat() const;
+    QString getFileName();
+
+private:
+    // Constants
+    enum
+    {
+        SEQ_HEADER_SIZE = 1024,            /**< Size of SEQ header in bytes. */
+        DESCRIPTION_OFFSET = 36,           /**< Offset of the UTF-16 description. */
+        DESCRIPTION_SIZE = 512,            /**< Size of the description in bytes. */
+        IMAGE_INFO_OFFSET = 548,           /**< Offset of width, height, bit depth... */
+        FRAME_RATE_OFFSET = 584,           /**< Offset of the frame rate (double). */
+        SEQ_JPEG_COLOR = 201,              /**< Identifier for JPEG color images. */
+        SEQ_JPEG_GRAYSCALE = 102,          /**< Identifier for JPEG grayscale images. */
+        SEQ_RESIDUAL_GRAYSCALE = 900,      /**< Identifier for Hunter residual-coded grayscale images. */
+        TIMESTAMP_SIZE = 8,                /**< Size of the timestamp trailing each frame in bytes. */
+    };
+
+    bool readTimestamp( int& secs, short& ms );
+    bool seekRecord( int frame );
+    void readResidualIndex();
+
+    QFile file;
+    int width;
+    int height;
+    int bitsPerPixel;
+    int imageFormat;
+    int frameCount;
+    double frameRate;
+    std::string description;
+    int nextFrame;                       /**< Index of the frame readRecord() returns next. */
+    std::vector<qint64> index;           /**< Offsets of the JPEG frames seen so far (all of them for indexed residual files). */
+    std::vector<bool> keyframes;         /**< For residual files with an index, whether each frame is a keyframe. */
+    ResidualDecoder residualDecoder;
+    std::vector<unsigned char> record;   /**< The last record read. */
+    tjhandle decompressor;
+};
@@ -0,0 +1,162 @@
+/**
+ * @file seq_storage.h
+ * @brief Storage backends for the SEQ writer
+ *
+ * The SEQWriter assembles frame records in buffers obtained from its storage
+ * backend and hands full buffers back with submit(). How, and how
+ * asynchronously, they reach the disk is up to the backend.
+ */
+
+#pragma once
+
+// Project includes
+#include "buffer_pool.h"
+
+// Libraries
+#include <QTCore/qt_windows.h>
+#include <QTCore/QFile.h>
+
+// C++
+#include <string>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+class SEQStorage
+{
+public:
+    enum Backend
+    {
+        QFileBackend,      /**< Buffered writes through QFile (default). */
+        DirectBackend,     /**< Synchronous unbuffered writes, bypassing the page cache. */
+        OverlappedBackend, /**< Asynchronous unbuffered writes with a fixed queue depth. */
+        NUM_BACKENDS       /**< Number of backends. */
+    };
+
+    enum
+    {
+        SECTOR_ALIGNMENT = 4096,  /**< Alignment required by the unbuffered backends (page/sector size). */
+        DEFAULT_QUEUE_DEPTH = 4,  /**< Default number of writes in flight for the overlapped backend. */
+        END_OF_FILE_CHUNK = 64 * 1024 * 1024, /**< End of file extension ahead of unbuffered writes when preallocation is disabled. */
+    };
+
+    static const std::string backendNames[ NUM_BACKENDS ];
+
+    static SEQStorage* create( Backend backend, int queueDepth );
+    static Backend backendFromName( const std::string& name );
+    static bool maySetValidData();
+
+    virtual ~SEQStorage( void ) {}
+
+    virtual bool open( const QString& path, size_t bufferSize ) = 0;
+    virtual void submit( unsigned char* buffer, size_t size ) = 0;
+    virtual void finish( qint64 logicalSize, const char* header, int headerSize ) = 0;
+
+    unsigned char* acquire();
+    void recycle( unsigned char* buffer );
+    size_t alignment();
+    Backend backend();
+    int getFailedWrites();
+    void setAllocationChunk( qint64 chunk );
+    void setNode( int node );
+    void setMemory( const BufferMemorySettings& settings );
+
+protected:
+    SEQStorage( Backend type, size_t writeAlignment );
+
+    void allocateBuffers( size_t bufferSize, int count );
+    void extendAllocation( HANDLE file, qint64 end );
+    void trimAllocation( HANDLE file, qint64 end );
+    void extendEndOfFile( HANDLE file, qint64 end );
+    void trimEndOfFile( HANDLE file, qint64 end );
+    static bool writeHeaderBuffered( const QString& path, qint64 logicalSize, const char* header, int headerSize );
+
+    BufferPool pool;          /**< Buffers the writer stages records in. */
+    QString path;             /**< Path of the open file. */
+    qint64 offset;            /**< Offset of the next submitted buffer. */
+    qint64 allocated;         /**< Disk space reserved for the file so far. */
+    qint64 endOfFile;         /**< End of file (and valid data length) set ahead of the writes so far. */
+    bool endOfFileFailed;     /**< Whether moving the end of file failed for the open file. */
+    qint64 allocationChunk;   /**< Disk space reserved ahead of the write pointer at a time; 0 to disable. */
+    int bufferNode;           /**< NUMA node the staging buffers come from; -1 for any. */
+    std::atomic<int> failedWrites; /**< Writes to the open (or last) file that failed, header included. */
+
+private:
+    Backend type;
+    size_t writeAlignment;    /**< Required alignment of write sizes and offsets. */
+};
+
+/** Buffered writes through QFile. */
+class QFileStorage : public SEQStorage
+{
+public:
+    QFileStorage( void );
+
+    bool open( const QString& path, size_t bufferSize );
+    void submit( unsigned char* buffer, size_t size );
+    void finish( qint64 logicalSize, const char* header, int headerSize );
+
+private:
+    HANDLE osHandle();
+
+    QFile file;
+};
+
+/** Synchronous writes with FILE_FLAG_NO_BUFFERING. */
+class DirectStorage : public SEQStorage
+{
+public:
+    DirectStorage( void );
+
+    bool open( const QString& path, size_t bufferSize );
+    void submit( unsigned char* buffer, size_t size );
+    void finish( qint64 logicalSize, const char* header, int headerSize );
+
+private:
+    HANDLE handle;
+};
+
+/**
+ * Asynchronous unbuffered writes.
+ *
+ * Up to queueDepth writes are in flight at once. A completion thread waits on an
+ * I/O completion port and recycles each buffer into the pool as soon as its write
+ * has landed, so the writer only ever blocks when the disk is queueDepth buffers behind.
+ */
+class OverlappedStorage : public SEQStorage
+{
+public:
+    OverlappedStorage( int queueDepth );
+
+    bool open( const QString& path, size_t bufferSize );
+    void submit( unsigned char* buffer, size_t size );
+    void finish( qint64 logicalSize, const char* header, int headerSize );
+
+private:
+    /** One write in flight. OVERLAPPED must stay the first member. */
+    struct Request
+    {
+        OVERLAPPED overlapped;
+        unsigned char* buffer;
+    };
+
+    enum
+    {
+        COMPLETION_KEY_WRITE = 0, /**< Completion packet of a write. */
+        COMPLETION_KEY_QUIT = 1,  /**< Asks the completion thread to exit. */
+    };
+
+    void completionLoop();
+
+    HANDLE handle;
+    HANDLE completionPort;
+    int queueDepth;                     /**< Maximum number of writes in flight. */
+    int inFlight;                       /**< Writes submitted but not yet completed. */
+    std::vector<Request> requests;      /**< One per staging buffer, so none is allocated per write. */
+    std::vector<Request*> freeRequests; /**< Requests not in flight. */
+    std::mutex mutex;                   /**< Protects inFlight and freeRequests. */
+    std::condition_variable drained;    /**< Signalled when a write completes. */
+    std::thread completionThread;
+};
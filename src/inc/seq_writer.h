@@ -10,11 +10,17 @@
 
 // Project includes
 #include "streamer.h"
+#include "seq_storage.h"
+#include "rate_controller.h"
+#include "sidecar_writer.h"
+#include "jpeg_encoder.h"
+#include "residual_codec.h"
 
 // C++
 #include <fstream>
 #include <string>
 #include <vector>
+#include <atomic>
 
 // Libraries
 #include <QTCore/QFile.h>
@@ -25,14 +31,44 @@ class Streamer;
 class SEQWriter
 {
 public:
+    enum
+    {
+        JPEG_QUALITY = 80,                 /**< Default JPEG quality. */
+    };
+
     SEQWriter( Streamer::Channels channel );
     ~SEQWriter( void );
 
-    void startRecording( std::string workingDir, int width, int height, bool compressed, std::string dateTime, bool isPGswitched);
+    void startRecording( std::string workingDir, int width, int height, bool compressed, std::string dateTime, bool isPGswitched, double fps );
     void stopRecording();
     void writeFrame( QImage *image, int secs, short ms);
+    void setStorageBackend( SEQStorage::Backend backend, int queueDepth );
+    SEQStorage::Backend getStorageBackend();
+    int getQueueDepth();
+    QString getFileName();
+    void setEncoderProfile( const EncoderProfile& profile );
+    EncoderProfile getEncoderProfile();
+    void setResidualCodec( const ResidualSettings& settings );
+    ResidualSettings getResidualCodec();
+    void setQualityReduction( int reduction );
+    void setNode( int node );
+    void setMemory( const BufferMemorySettings& settings );
+    void setRateControl( double targetBytesPerSecond, int minQuality, int maxQuality );
+    double getRateTarget();
+    int getRateMinQuality();
+    int getRateMaxQuality();
+    int getFrameCount();
+    qint64 getFileSize();
+    int getFailedWrites();
 	static void compressJPEG(QImage* image, unsigned char*& _compressedImage, int& compressed_size, int width, int heigth);
+	static void compressJPEG(QImage* image, unsigned char* destination, unsigned long capacity, int& compressed_size, int width, int height, int quality = JPEG_QUALITY);
 	static std::wstring s2ws(const std::string& s);
+	static std::string benchmarkStorage(std::string workingDir, int frames);
+	static double expectedRecordSize(Streamer::Channels channel, int width, int height, bool compressed, double jpegRatio = 0);
+	static double measureCompressionRatio(const QImage& sample, const EncoderProfile& profile);
+	static Streamer::Channels fileChannel(Streamer::Channels channel, bool isPGswitched);
+	static QString filePathFor(std::string workingDir, Streamer::Channels channel, bool compressed, std::string dateTime, bool isPGswitched, bool residual = false);
+	static bool usesResidual(Streamer::Channels channel, bool compressed, const ResidualSettings& settings);
 
 	static const std::string fileNameChannels[Streamer::N_CHANNELS];
 
@@ -43,19 +79,27 @@ private:
         SEQ_HEADER_SIZE = 1024,            /**< Size of SEQ header in bytes. */
         SEQ_VER = 3,                       /**< SEQ file version. */
         NORPIX_STRING_LENGTH = 10,         /**< Length of the Norpix string. */
-        NORPIX_DESC_LENGTH = 1,            /**< Length of the file description. */
         NORPIX_DESC_SIZE = 512,            /**< Size the description should be. */
-        JPEG_QUALITY = 80,                 /**< JPEG quality specified in the header. */
         SEQ_UNCOMPRESSED_COLOR = 200,      /**< Identifier for uncompressed color images. */
         SEQ_JPEG_COLOR = 201,              /**< Identifier for JPEG color images. */
         SEQ_UNCOMPRESSED_GRAYSCALE = 100,  /**< Identifier for uncompressed grayscale images. */
         SEQ_JPEG_GRAYSCALE = 102,          /**< Identifier for JPEG grayscale images. */
+        SEQ_RESIDUAL_GRAYSCALE = 900,      /**< Identifier for Hunter residual-coded grayscale images (not a Norpix format). */
+        TIMESTAMP_SIZE = 8,                /**< Size of the timestamp trailing each frame in bytes. */
+        IO_ALIGNMENT = 4096,               /**< Alignment of staging buffer, write sizes and offsets (page/sector size). */
+        STAGING_SIZE = 8 * 1024 * 1024,    /**< Default size of the write staging buffer in bytes. */
+        PREALLOCATION_SECONDS = 10,        /**< Seconds of recording to reserve disk space for at a time. */
+        MIN_PREALLOCATION = 64 * 1024 * 1024,   /**< Smallest disk reservation in bytes. */
+        MAX_PREALLOCATION = 1024 * 1024 * 1024, /**< Largest disk reservation in bytes. */
+        JPEG_RATIO_ESTIMATE = 8,           /**< Conservative JPEG compression ratio, for sizing reservations. */
     };
     static const char null = NULL;
     static const std::string fileNameHead;
     static const std::string fileNameFoot;
     static const std::string fileNameCompressed;
     static const std::string fileNameRaw;
+    static const std::string fileNameResidual;
+    static const std::string fileNameResidualFoot;
     static const char fileNameSeparator = '_';
     static const std::string compressionExt;
 
@@ -68,24 +112,47 @@ private:
 	static const int norpixHeaderSize = SEQ_HEADER_SIZE;
     static const int norpixOrigin = 0;
     static const int norpixBPS = 8;
-    static const char norpixDesc[ NORPIX_DESC_LENGTH ];
 
 
     // Objects
-    QFile seqFile;
-    QDataStream *seqFileStream;
+    SEQStorage *storage;               /**< Backend the staging buffers are submitted to. */
+    SEQStorage::Backend storageBackend; /**< Backend to use for the next recording. */
+    int queueDepth;                    /**< Writes in flight for asynchronous backends. */
+    int bufferNode;                    /**< NUMA node the staging buffers come from; -1 for any. */
+    BufferMemorySettings bufferMemory; /**< How the staging buffers are allocated. */
+    QString filePath;                  /**< Path of the file being recorded. */
+    unsigned char *staging;            /**< Page-aligned buffer in which frame records are batched. */
+    size_t stagingCapacity;            /**< Size of the staging buffer in bytes. */
+    size_t stagingUsed;                /**< Bytes currently held in the staging buffer. */
+    size_t maxRecordSize;              /**< Upper bound on the size of one frame record in bytes. */
+    qint64 fileSize;                   /**< Logical size of the file, including staged bytes. */
     int totalFrames;
+    int failedWrites;                  /**< Writes of the current (or last) file that failed, as of the last flush. */
+    double frameRate;
     int width;
     int height;
     Streamer::Channels streamChannel;
     bool compressed;
+    JPEGEncoder encoder;               /**< Compresses frames with the channel's encoder profile. */
+    std::atomic<int> qualityReduction; /**< Amount the QoS ladder currently lowers JPEG quality by. */
+    int minQualityUsed;                /**< Lowest JPEG quality written to the current file. */
+    int maxQualityUsed;                /**< Highest JPEG quality written to the current file. */
+    RateController rateController;     /**< Chooses JPEG quality per frame when a target bitrate is set. */
+    SidecarWriter qualitySidecar;      /**< Quality and size of each JPEG frame. */
     std::vector<unsigned char> compressionBuffer;
+    ResidualSettings residualSettings; /**< Residual codec settings for the next recording. */
+    bool residual;                     /**< Whether the current file uses the residual codec. */
+    ResidualEncoder residualEncoder;
+    std::vector<uint64_t> residualIndex; /**< Offset of each frame record, with keyframes flagged. */
 	
 
 
     // Helper functions
     void makeEmptyHeader();
     void writeHeader( int width, int height, int bpp_num );
+    std::string describeFormat();
+    void flushStaging( bool final );
+    void writeResidualIndex();
     int hexCharToDecimal( char ch );
     int hexToDec( const std::string &hex );
 };
\ No newline at end of file
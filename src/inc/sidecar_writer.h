@@ -0,0 +1,38 @@
+/**
+ * @file sidecar_writer.h
+ * @brief Per-frame metadata written next to a SEQ file
+ *
+ * A sidecar is a CSV file named after the SEQ file it accompanies, e.g.
+ * Mouse_<date>_Top_J85_quality.csv, with one row per frame. Rows are
+ * buffered, so writing one costs about as much as formatting it.
+ */
+
+#pragma once
+
+// Libraries
+#include <QTCore/QFile.h>
+
+// C++
+#include <string>
+
+class SidecarWriter
+{
+public:
+    enum
+    {
+        MAX_LINE_LENGTH = 512, /**< Longest row writeRow() can format. */
+    };
+
+    SidecarWriter( void );
+    ~SidecarWriter( void );
+
+    bool open( const QString& seqPath, const std::string& suffix, const std::string& columns );
+    void close();
+    bool isOpen();
+    void writeRow( const char* format, ... );
+
+    static QString pathFor( const QString& seqPath, const std::string& suffix );
+
+private:
+    QFile file;
+};
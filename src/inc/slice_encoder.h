@@ -0,0 +1,75 @@
+/**
+ * @file slice_encoder.h
+ * @brief Intra-frame parallel JPEG encoder
+ *
+ * The frame is cut into horizontal slices on MCU boundaries. The slices are
+ * compressed concurrently as separate baseline JPEGs with identical tables,
+ * and their entropy-coded data is stitched into one JPEG with a restart
+ * marker between slices. Since the DC predictors of each slice start from
+ * zero, exactly as they do after a restart marker, the result is an ordinary
+ * standards-compliant JPEG with a restart interval of one slice.
+ *
+ * On a NUMA machine the helper threads move to the node of the thread that
+ * hands them the frame, so that the frame is encoded where it is stored.
+ */
+
+#pragma once
+
+// Libraries
+#include <QTGui/QImage>
+#include <turbojpeg.h>
+
+// C++
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class SliceEncoder
+{
+public:
+    enum
+    {
+        MAX_RESTART_INTERVAL = 65535,   /**< Largest restart interval (in MCUs) a DRI marker can hold. */
+    };
+
+    SliceEncoder( int threads );
+    ~SliceEncoder( void );
+
+    int threads();
+    int encode( const QImage* image, unsigned char* destination, unsigned long capacity, int subsampling, int quality, int flags );
+
+private:
+    struct Slice
+    {
+        int firstRow;                       /**< First image row of the slice. */
+        int rows;                           /**< Number of image rows in the slice. */
+        std::vector<unsigned char> buffer;  /**< The slice compressed as a complete JPEG. */
+        unsigned long size;                 /**< Bytes of buffer in use. */
+        bool failed;                        /**< Whether compression failed. */
+    };
+
+    void worker( int index );
+    void encodeSlices( tjhandle handle );
+    int stitch( unsigned char* destination, unsigned long capacity, int height, int restartInterval );
+
+    std::vector<std::thread> workers;   /**< Helper threads; the calling thread encodes slices too. */
+    std::vector<tjhandle> handles;      /**< One compressor per thread, the last one for the calling thread. */
+    std::vector<Slice> slices;
+
+    // The job being encoded
+    const QImage* image;
+    int subsampling;
+    int quality;
+    int flags;
+    std::atomic<int> nextSlice;         /**< Next slice to be claimed by a thread. */
+    int node;                           /**< NUMA node of the calling thread; -1 if the machine has one node. */
+
+    std::mutex mutex;                   /**< Protects generation, busyWorkers and stopping. */
+    std::condition_variable started;    /**< Signalled when a job is handed to the workers. */
+    std::condition_variable finished;   /**< Signalled when a worker is done with a job. */
+    int generation;                     /**< Incremented for every job. */
+    int busyWorkers;                    /**< Workers still encoding the current job. */
+    bool stopping;
+};
@@ -0,0 +1,31 @@
+/**
+ * @file throughput_probe.h
+ * @brief Sustained write throughput of the volume behind a directory
+ *
+ * Probing takes a few seconds, so results are cached per volume for the
+ * lifetime of the process.
+ */
+
+#pragma once
+
+// C++
+#include <string>
+#include <map>
+#include <mutex>
+
+class ThroughputProbe
+{
+public:
+    enum
+    {
+        PROBE_SIZE = 256 * 1024 * 1024,    /**< Bytes written by one probe. */
+        PROBE_BUFFER_SIZE = 8 * 1024 * 1024, /**< Size of each write in bytes. */
+    };
+
+    static double measure( const std::string& directory, bool refresh = false );
+    static std::string volumeOf( const std::string& directory );
+
+private:
+    static std::map<std::string, double> cache; /**< Measured bytes/s by volume. */
+    static std::mutex mutex;                     /**< Protects cache, and keeps probes from competing. */
+};
@@ -0,0 +1,102 @@
+/**
+ * @file transcoder.h
+ * @brief Offline SEQ transcoder
+ *
+ * Converts recordings between raw, JPEG and the residual codec, re-encodes
+ * them with another encoder profile, crops them to a new ROI or scales them
+ * down. Residual files converted to JPEG are ordinary Norpix SEQ files. Output is
+ * written through SEQWriter, so its name and header are those the live
+ * recorder would have given it.
+ *
+ * Each file is a pipeline: a reader thread reads records and hands each to a
+ * shared pool, which decodes and transforms frames in parallel, and a writer
+ * thread encodes and writes them in order. Residual frames depend on the
+ * frames before them, so those are decoded by the reader thread instead.
+ * The queue between reader and writer is bounded, so memory use is set by
+ * the number of files in flight, not by their length. Several files are
+ * transcoded at once to keep all cores busy, since encoding within one file
+ * is sequential (unless the profile uses several threads).
+ */
+
+#pragma once
+
+// Project includes
+#include "seq_writer.h"
+#include "seq_reader.h"
+#include "bounded_queue.h"
+
+// Libraries
+#include <turbojpeg.h>
+
+// C++
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <atomic>
+
+class Transcoder
+{
+public:
+    enum
+    {
+        QUEUE_FRAMES = 8,   /**< Frames each file may have in flight between reader and writer. */
+    };
+
+    /** What to turn the recordings into */
+    struct Options
+    {
+        std::string outputDir;             /**< Output root; files go to its recordings folder, as with the recorder. */
+        bool compressed;                   /**< Whether output is JPEG. */
+        EncoderProfile profile;            /**< Encoder profile for JPEG output. */
+        ResidualSettings residual;         /**< Residual codec for grayscale JPEG output; off by default. */
+        QRect crop;                        /**< Region kept, in input pixels; null for the whole frame. */
+        double scale;                      /**< Scale factor applied after cropping; 1 for none. */
+        SEQStorage::Backend backend;       /**< Storage backend to write with. */
+        int queueDepth;
+
+        Options() : compressed( true ), scale( 1.0 ), backend( SEQStorage::QFileBackend ), queueDepth( SEQStorage::DEFAULT_QUEUE_DEPTH ) { }
+    };
+
+    Transcoder( const Options& options, int threads, int concurrentFiles );
+    ~Transcoder( void );
+
+    std::string run( const std::vector<QString>& files );
+
+    static bool parseFileName( const QString& path, Streamer::Channels& channel, std::string& dateTime );
+
+private:
+    /** Outcome of one file, for the report */
+    struct FileResult
+    {
+        QString input;
+        QString output;
+        std::string error;   /**< Empty on success. */
+        int frames;
+        qint64 bytes;        /**< Size of the output. */
+        double seconds;
+    };
+
+    typedef std::function<void( tjhandle )> Task;
+
+    void fileWorker( const std::vector<QString>* files, std::vector<FileResult>* results );
+    void transcode( const QString& path, FileResult& result );
+    QImage transform( const QImage& frame, const QRect& region, const QSize& size );
+    void submit( Task task );
+    void poolWorker();
+
+    Options options;
+    int concurrentFiles;
+    std::atomic<int> nextFile;             /**< Index of the next file to be claimed. */
+
+    // Decode and transform pool; each worker has its own decompressor
+    std::vector<std::thread> pool;
+    std::deque<Task> tasks;
+    std::mutex mutex;                      /**< Protects tasks and stopping. */
+    std::condition_variable queued;        /**< Signalled when a task is queued. */
+    bool stopping;
+};
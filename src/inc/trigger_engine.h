@@ -0,0 +1,151 @@
+/**
+ * @file trigger_engine.h
+ * @brief Closed-loop triggers on the freshest Point Grey and depth frames
+ *
+ * A trigger watches a rectangular zone of one channel's ROI and fires a sink
+ * when the animal enters or leaves it. The test runs in the camera callback,
+ * on the frame just delivered and before it is queued, so its latency does
+ * not depend on how far behind encoding or the disks are.
+ *
+ * On the depth channel a pixel is occupied if it is at least level mm closer
+ * than the background (the UI's maximum depth). On a Point Grey channel it is
+ * occupied if it differs by more than level grey levels from the zone's
+ * background, which is taken from the first frame after arming and follows
+ * slow changes while the zone is unoccupied, so arm with the zone empty. The
+ * zone is entered once the occupied fraction reaches fraction, and left once
+ * it falls below half of that, so a trigger doesn't chatter on the boundary.
+ *
+ * The callback only decides; it hands each event to a sender thread through a
+ * bounded lock-free queue, so a sink that is slow to take a message never holds
+ * up capture. If the queue is full the event is dropped and counted. The sender
+ * fires the sink, and writes the event to the session's triggers sidecar,
+ * Mouse_<date>_triggers.csv next to the manifest, with its latency: the time
+ * from the frame reaching the callback to the sink returning. The camera's own
+ * capture time is on a clock of its own, so exposure and transfer come on top
+ * of that.
+ *
+ * Triggers are armed for the duration of a recording.
+ */
+
+#pragma once
+
+// Project includes
+#include "sidecar_writer.h"
+#include "trigger_sink.h"
+
+// Libraries
+#include <QTCore/QRect>
+#include <QTCore/qt_windows.h>
+
+// C++
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+/** A zone that fires a sink when the animal enters or leaves it */
+struct TriggerZone
+{
+    enum Edge
+    {
+        Enter,          /**< Fire when the zone becomes occupied (default). */
+        Leave,          /**< Fire when it becomes free. */
+        Both,           /**< Fire on both. */
+        NUM_EDGES       /**< Number of edges. */
+    };
+
+    static const std::string edgeNames[ NUM_EDGES ];
+
+    std::string name;           /**< Name of the trigger, sent with each event. */
+    int channel;                /**< Point Grey or depth channel watched. */
+    QRect zone;                 /**< The zone, in ROI pixels. */
+    int level;                  /**< Depth: height in mm above the background; Point Grey: grey-level change. */
+    double fraction;            /**< Fraction of the zone that must be occupied. */
+    Edge edge;
+    TriggerSink::Kind sink;
+    std::string target;         /**< Where the sink sends its messages. */
+
+    TriggerZone( void );
+
+    static Edge edgeFromName( const std::string& name );
+};
+
+class TriggerEngine
+{
+public:
+    enum
+    {
+        DEFAULT_DEPTH_LEVEL = 15,   /**< Default level of depth zones, in mm. */
+        DEFAULT_GREY_LEVEL = 30,    /**< Default level of Point Grey zones, in grey levels. */
+        BACKGROUND_SHIFT = 5,       /**< A free zone's background moves 1/2^BACKGROUND_SHIFT of the way to the frame per frame. */
+        MAX_MESSAGE_LENGTH = 128,   /**< Longest message sent to a sink. */
+        QUEUE_SIZE = 64,            /**< Events waiting for the sender before more are dropped. */
+    };
+
+    TriggerEngine( void );
+    ~TriggerEngine( void );
+
+    void setZones( const std::vector<TriggerZone>& zones );
+    std::vector<TriggerZone> getZones();
+
+    void arm( const QString& sessionPath );
+    void disarm();
+
+    void testGrey( int channel, const uchar* data, int stride, const QRect& frame, const QPoint& roi,
+                   std::chrono::high_resolution_clock::time_point arrival, int secs, int ms );
+    void testDepth( int channel, const int16_t* data, const QRect& frame, const QPoint& roi, int backgroundMM,
+                    std::chrono::high_resolution_clock::time_point arrival, int secs, int ms );
+
+    bool isArmed();
+    int getEvents();
+    int getDropped();
+    double getLatencyPercentile( double percentile );
+    double getMaxLatency();
+
+private:
+    /** An armed zone */
+    struct ZoneState
+    {
+        TriggerZone zone;
+        TriggerSink* sink;
+        bool occupied;
+        std::vector<uint16_t> background;   /**< Point Grey only: background in 8.8 fixed point. */
+    };
+
+    /** An event on its way from a callback to the sender */
+    struct Event
+    {
+        int zone;                   /**< Index into states. */
+        bool entered;
+        double occupied;
+        int secs;
+        int ms;
+        std::chrono::high_resolution_clock::time_point arrival;
+    };
+
+    void decide( int zone, int occupiedPixels, int pixels,
+                 std::chrono::high_resolution_clock::time_point arrival, int secs, int ms );
+    void sender();
+    void send( const Event& event );
+
+    std::vector<TriggerZone> zones;     /**< Zones armed by the next recording. */
+    std::vector<ZoneState> states;      /**< Only resized while the sender is stopped. */
+    bool armed;
+    std::mutex mutex;                   /**< Protects all of the above, and the callbacks' end of the queue. */
+
+    // Single producer (whichever callback holds mutex), single consumer (the sender)
+    Event queue[ QUEUE_SIZE ];
+    std::atomic<unsigned int> queueHead;    /**< Next event to be queued. */
+    std::atomic<unsigned int> queueTail;    /**< Next event to be sent. */
+    std::atomic<int> dropped;               /**< Events of the session dropped because the queue was full. */
+    HANDLE wakeup;                          /**< Set when an event is queued, or the sender should stop. */
+    std::atomic<bool> stopping;
+    std::thread senderThread;
+
+    SidecarWriter log;
+    std::vector<float> latencies;       /**< Of every event in the session, in microseconds. */
+    std::mutex statsMutex;              /**< Protects log and latencies. */
+};
@@ -0,0 +1,56 @@
+/**
+ * @file trigger_sink.h
+ * @brief Outputs fired by the closed-loop triggers
+ *
+ * A sink delivers a short text message, one line per trigger event, to
+ * whatever drives the experiment's hardware: a UDP datagram to a listener on
+ * this machine, or a write to a file, named pipe or serial port. fire() is
+ * called from the trigger engine's sender thread, not from the capture
+ * callbacks, but should still return quickly so events don't queue up: the
+ * UDP sink never waits for the socket, a pipe is written without waiting for
+ * its reader, and a serial port gives up after WRITE_TIMEOUT_MS.
+ */
+
+#pragma once
+
+// C++
+#include <string>
+
+class TriggerSink
+{
+public:
+    enum Kind
+    {
+        UdpSink,        /**< A datagram to host:port; the host defaults to 127.0.0.1 (default). */
+        FileSink,       /**< A write to a file, or to a device such as \\.\pipe\name or \\.\COM3. */
+        NUM_SINKS       /**< Number of sinks. */
+    };
+
+    enum
+    {
+        DEFAULT_PORT = 5005,    /**< UDP port used if the target names none. */
+        WRITE_TIMEOUT_MS = 20,  /**< Longest a serial port may hold up a message, e.g. under flow control. */
+    };
+
+    static const std::string kindNames[ NUM_SINKS ];
+
+    static TriggerSink* create( Kind kind, const std::string& target );
+    static Kind kindFromName( const std::string& name );
+
+    virtual ~TriggerSink( void ) {}
+
+    virtual bool open() = 0;
+    virtual bool fire( const char* message, int length ) = 0;
+    virtual void close() = 0;
+
+    Kind kind();
+    const std::string& getTarget();
+
+protected:
+    TriggerSink( Kind type, const std::string& target );
+
+    std::string target;     /**< Where the messages go, as configured. */
+
+private:
+    Kind type;
+};
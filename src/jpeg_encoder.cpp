@@ -0,0 +1,378 @@
+/**
+ * @file jpeg_encoder.cpp
+ * @brief JPEG encoder with configurable profiles
+ */
+
+// Project includes
+#include "jpeg_encoder.h"
+
+// Libraries
+#include <cstdio>
+#include <jpeglib.h>
+
+// C++
+#include <csetjmp>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * @brief EncoderProfile constructor
+ * @arg None
+ *
+ * The defaults reproduce what Hunter always wrote: quality 80, no chroma
+ * subsampling, fast DCT, baseline, no restart markers.
+ */
+EncoderProfile::EncoderProfile( void )
+    : quality( 80 ),
+      subsampling( TJSAMP_444 ),
+      accurateDCT( false ),
+      progressive( false ),
+      restartRows( 0 ),
+      threads( 1 )
+{
+}
+
+/**
+ * @brief Describe the profile, e.g. for the SEQ header or a benchmark report.
+ * @arg None.
+ * @returns Settings as "key=value" pairs, without the quality.
+ */
+std::string EncoderProfile::describe() const
+{
+    ostringstream description;
+    description << "subsampling=" << subsamplingName( subsampling )
+                << " dct=" << ( accurateDCT ? "accurate" : "fast" )
+                << " " << ( progressive ? "progressive" : "baseline" )
+                << " restartRows=" << restartRows
+                << " threads=" << threads;
+    return description.str();
+}
+
+/**
+ * @brief Whether the profile needs settings TurboJPEG doesn't expose.
+ * @arg None.
+ * @returns True for progressive profiles and profiles with restart markers.
+ */
+bool EncoderProfile::needsLibjpeg() const
+{
+    return progressive || ( restartRows > 0 && !isSliced() );
+}
+
+/**
+ * @brief Whether frames are encoded in parallel slices.
+ * @arg None.
+ * @returns True for baseline profiles with more than one thread.
+ *
+ * Slices are separated by restart markers, which take the place of restartRows.
+ * Progressive scans can't be stitched, so progressive profiles use one thread.
+ */
+bool EncoderProfile::isSliced() const
+{
+    return threads > 1 && !progressive;
+}
+
+/**
+ * @brief Parse a chroma subsampling name.
+ * @param name "444", "422" or "420".
+ * @returns The TurboJPEG subsampling, or -1 if the name is unknown.
+ */
+int EncoderProfile::subsamplingFromName( const std::string& name )
+{
+    if ( name == "444" )
+        return TJSAMP_444;
+    if ( name == "422" )
+        return TJSAMP_422;
+    if ( name == "420" )
+        return TJSAMP_420;
+    return -1;
+}
+
+/**
+ * @brief Name of a chroma subsampling.
+ * @param subsampling The TurboJPEG subsampling.
+ * @returns "444", "422", "420" or "gray".
+ */
+std::string EncoderProfile::subsamplingName( int subsampling )
+{
+    switch ( subsampling )
+    {
+    case TJSAMP_422:
+        return "422";
+    case TJSAMP_420:
+        return "420";
+    case TJSAMP_GRAY:
+        return "gray";
+    default:
+        return "444";
+    }
+}
+
+/**
+ * @brief JPEGEncoder constructor
+ * @arg None
+ */
+JPEGEncoder::JPEGEncoder( void )
+    : handle( tjInitCompress() ),
+      slicer( NULL )
+{
+}
+
+/**
+ * @brief JPEGEncoder destructor
+ * @arg None
+ */
+JPEGEncoder::~JPEGEncoder( void )
+{
+    if ( handle )
+        tjDestroy( handle );
+    delete slicer;
+}
+
+/**
+ * @brief Select the profile for subsequent frames.
+ * @param profile The profile. Its quality is only a default; encode() takes the quality per frame.
+ * @returns void.
+ */
+void JPEGEncoder::setProfile( const EncoderProfile& profile )
+{
+    this->profile = profile;
+
+    // The slice threads are kept as long as the thread count doesn't change
+    if ( slicer && ( !profile.isSliced() || slicer->threads() != profile.threads ) )
+    {
+        delete slicer;
+        slicer = NULL;
+    }
+    if ( !slicer && profile.isSliced() )
+        slicer = new SliceEncoder( profile.threads );
+}
+
+/**
+ * @brief Accessor for the profile.
+ * @arg None.
+ * @returns The profile in use.
+ */
+EncoderProfile JPEGEncoder::getProfile()
+{
+    return profile;
+}
+
+/**
+ * @brief Upper bound on the size of an encoded frame, for any profile.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @returns Size in bytes.
+ */
+unsigned long JPEGEncoder::bufferSize( int width, int height )
+{
+    return tjBufSize( width, height, TJSAMP_444 );
+}
+
+/**
+ * @brief Bring an image into a format the encoders accept.
+ * @param image The image.
+ * @param converted Storage for a converted copy, if one is needed.
+ * @returns The image to encode: either image or converted.
+ */
+const QImage* JPEGEncoder::prepare( const QImage* image, QImage& converted )
+{
+    switch ( image->format() )
+    {
+    case QImage::Format_Grayscale8:
+    case QImage::Format_RGB888:
+        return image;
+    case QImage::Format_RGB16:
+        // JPEG doesn't support 16-bit RGB. We need to up-convert.
+        converted = image->convertToFormat( QImage::Format_RGB888 );
+        return &converted;
+    default:
+        throw std::invalid_argument( "Image format not implemented!" );
+    }
+}
+
+/**
+ * @brief Compress an image into a caller-provided buffer.
+ * @param image Image to be compressed.
+ * @param destination Buffer the compressed image is written to.
+ * @param capacity Size of the destination buffer; should be at least bufferSize().
+ * @param quality JPEG quality (1-100).
+ * @returns The size of the compressed image in bytes.
+ *
+ * Grayscale images are always written without chroma, whatever the profile says.
+ */
+int JPEGEncoder::encode( const QImage* image, unsigned char* destination, unsigned long capacity, int quality )
+{
+    QImage converted;
+    const QImage* source = prepare( image, converted );
+
+    if ( profile.needsLibjpeg() )
+        return encodeLibjpeg( source, destination, capacity, quality );
+    if ( slicer )
+        return slicer->encode( source, destination, capacity, profile.subsampling, quality,
+                               profile.accurateDCT ? TJFLAG_ACCURATEDCT : TJFLAG_FASTDCT );
+    return encodeTurbo( source, destination, capacity, quality );
+}
+
+/**
+ * @brief Compress a baseline JPEG with TurboJPEG.
+ * @param image Image to be compressed, in Grayscale8 or RGB888.
+ * @param destination Buffer the compressed image is written to.
+ * @param capacity Size of the destination buffer.
+ * @param quality JPEG quality (1-100).
+ * @returns The size of the compressed image in bytes.
+ */
+int JPEGEncoder::encodeTurbo( const QImage* image, unsigned char* destination, unsigned long capacity, int quality )
+{
+    bool gray = image->format() == QImage::Format_Grayscale8;
+    unsigned long size = capacity;
+    int flags = TJFLAG_NOREALLOC | ( profile.accurateDCT ? TJFLAG_ACCURATEDCT : TJFLAG_FASTDCT );
+
+    // Pass the real pitch: QImage scanlines are padded to 32 bits
+    int result = tjCompress2( handle, const_cast<uchar*>( image->constBits() ), image->width(), image->bytesPerLine(), image->height(),
+                              gray ? TJPF_GRAY : TJPF_RGB, &destination, &size,
+                              gray ? TJSAMP_GRAY : profile.subsampling, quality, flags );
+    if ( result != 0 )
+        throw std::runtime_error( "JPEG compression failed!" );
+    return (int)size;
+}
+
+namespace
+{
+    // libjpeg reports errors through a callback that must not return
+    struct ErrorManager
+    {
+        jpeg_error_mgr pub;
+        jmp_buf jump;
+    };
+
+    void errorExit( j_common_ptr cinfo )
+    {
+        longjmp( ( (ErrorManager*)cinfo->err )->jump, 1 );
+    }
+
+    // The destination is a fixed buffer: running out of it is an error, not a reason to grow
+    void initDestination( j_compress_ptr ) { }
+    void termDestination( j_compress_ptr ) { }
+    boolean emptyOutputBuffer( j_compress_ptr cinfo )
+    {
+        cinfo->err->error_exit( (j_common_ptr)cinfo );
+        return FALSE;
+    }
+}
+
+/**
+ * @brief Compress a JPEG with the libjpeg API, for progressive output and restart markers.
+ * @param image Image to be compressed, in Grayscale8 or RGB888.
+ * @param destination Buffer the compressed image is written to.
+ * @param capacity Size of the destination buffer.
+ * @param quality JPEG quality (1-100).
+ * @returns The size of the compressed image in bytes.
+ */
+int JPEGEncoder::encodeLibjpeg( const QImage* image, unsigned char* destination, unsigned long capacity, int quality )
+{
+    bool gray = image->format() == QImage::Format_Grayscale8;
+
+    jpeg_compress_struct cinfo;
+    ErrorManager errors;
+    jpeg_destination_mgr dest;
+
+    cinfo.err = jpeg_std_error( &errors.pub );
+    errors.pub.error_exit = errorExit;
+    if ( setjmp( errors.jump ) )
+    {
+        jpeg_destroy_compress( &cinfo );
+        throw std::runtime_error( "JPEG compression failed!" );
+    }
+    jpeg_create_compress( &cinfo );
+
+    dest.next_output_byte = destination;
+    dest.free_in_buffer = capacity;
+    dest.init_destination = initDestination;
+    dest.empty_output_buffer = emptyOutputBuffer;
+    dest.term_destination = termDestination;
+    cinfo.dest = &dest;
+
+    cinfo.image_width = image->width();
+    cinfo.image_height = image->height();
+    cinfo.input_components = gray ? 1 : 3;
+    cinfo.in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults( &cinfo );
+    jpeg_set_quality( &cinfo, quality, TRUE );
+    cinfo.dct_method = profile.accurateDCT ? JDCT_ISLOW : JDCT_IFAST;
+    cinfo.restart_in_rows = profile.restartRows;
+
+    // Chroma is sampled at 1x1; luma sets the ratio
+    if ( !gray )
+    {
+        cinfo.comp_info[ 0 ].h_samp_factor = profile.subsampling == TJSAMP_444 ? 1 : 2;
+        cinfo.comp_info[ 0 ].v_samp_factor = profile.subsampling == TJSAMP_420 ? 2 : 1;
+    }
+    if ( profile.progressive )
+        jpeg_simple_progression( &cinfo );
+
+    jpeg_start_compress( &cinfo, TRUE );
+    while ( cinfo.next_scanline < cinfo.image_height )
+    {
+        JSAMPROW row = const_cast<JSAMPROW>( image->constScanLine( cinfo.next_scanline ) );
+        jpeg_write_scanlines( &cinfo, &row, 1 );
+    }
+    jpeg_finish_compress( &cinfo );
+
+    int size = (int)( capacity - dest.free_in_buffer );
+    jpeg_destroy_compress( &cinfo );
+    return size;
+}
+
+/**
+ * @brief Measure encode time and output size of several profiles on the same frames.
+ * @param samples Frames to encode.
+ * @param profiles Profiles to compare; each is run at its own quality.
+ * @param repetitions Number of times each frame is encoded per profile.
+ * @returns A human-readable report, one line per profile.
+ */
+std::string JPEGEncoder::benchmark( const std::vector<QImage>& samples, const std::vector<EncoderProfile>& profiles, int repetitions )
+{
+    ostringstream report;
+    report << fixed << setprecision( 2 );
+    if ( samples.empty() )
+        return "No frames to encode.\n";
+
+    int width = 0;
+    int height = 0;
+    for ( auto& sample : samples )
+    {
+        width = (std::max)( width, sample.width() );
+        height = (std::max)( height, sample.height() );
+    }
+    std::vector<unsigned char> buffer( bufferSize( width, height ) );
+
+    for ( auto& profile : profiles )
+    {
+        JPEGEncoder encoder;
+        encoder.setProfile( profile );
+
+        double bytes = 0;
+        int frames = 0;
+        auto start = chrono::steady_clock::now();
+        for ( int r = 0; r < repetitions; r++ )
+        {
+            for ( auto& sample : samples )
+            {
+                bytes += encoder.encode( &sample, buffer.data(), (unsigned long)buffer.size(), profile.quality );
+                frames++;
+            }
+        }
+        double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+        report << "quality=" << setw( 3 ) << profile.quality << " " << setw( 62 ) << left << profile.describe() << right
+               << setw( 8 ) << seconds * 1000 / frames << " ms/frame, "
+               << setw( 10 ) << setprecision( 0 ) << bytes / frames << " bytes/frame" << setprecision( 2 ) << endl;
+    }
+
+    return report.str();
+}
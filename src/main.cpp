@@ -7,17 +7,310 @@
  */
 // Project includes
 #include "hunter.h"
+#include "seq_writer.h"
+#include "transcoder.h"
+#include "frame_bus.h"
+#include "frame_bus_publisher.h"
+#include "headless_recorder.h"
 
 // Libraries
 #include <QtWidgets/QApplication>
+#include <QTCore/QDir>
+#include <QTCore/QFileInfo>
+
+// C++
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 using namespace std;
 
+// Number of frames written per run by --benchmark-storage
+static const int BENCHMARK_FRAMES = 300;
+
+// Runs the storage benchmark on a directory and prints the results to the console
+static int benchmarkStorage( string dir, int frames )
+{
+	// Hunter is a GUI application; borrow the console it was started from, if any
+	if ( AttachConsole( ATTACH_PARENT_PROCESS ) )
+		freopen( "CONOUT$", "w", stdout );
+
+	if ( !dir.empty() && dir.back() != '/' && dir.back() != '\\' )
+		dir += '/';
+	printf( "%s", SEQWriter::benchmarkStorage( dir, frames ).c_str() );
+	fflush( stdout );
+	return 0;
+}
+
+// Number of times each frame is encoded per profile by --benchmark-encoder
+static const int BENCHMARK_REPETITIONS = 5;
+
+// Runs the encoder profile benchmark on the images in a directory (e.g. snapshots) and prints the results to the console
+static int benchmarkEncoder( string dir, int repetitions )
+{
+	if ( AttachConsole( ATTACH_PARENT_PROCESS ) )
+		freopen( "CONOUT$", "w", stdout );
+
+	// Encode the frames the way the streams deliver them: grayscale or 24-bit color
+	vector<QImage> samples;
+	QDir directory( QString::fromStdString( dir ) );
+	QStringList filters;
+	filters << "*.jpeg" << "*.jpg" << "*.png" << "*.bmp";
+	for ( auto& name : directory.entryList( filters, QDir::Files ) )
+	{
+		QImage image( directory.filePath( name ) );
+		if ( image.isNull() )
+			continue;
+		samples.push_back( image.convertToFormat( image.isGrayscale() ? QImage::Format_Grayscale8 : QImage::Format_RGB888 ) );
+	}
+	printf( "%d frames from %s\n", (int)samples.size(), dir.c_str() );
+
+	// The default profile, and one change from it at a time
+	vector<EncoderProfile> profiles;
+	EncoderProfile profile;
+	profiles.push_back( profile );
+	for ( int quality : { 60, 90 } )
+	{
+		profile = EncoderProfile();
+		profile.quality = quality;
+		profiles.push_back( profile );
+	}
+	for ( int subsampling : { TJSAMP_422, TJSAMP_420 } )
+	{
+		profile = EncoderProfile();
+		profile.subsampling = subsampling;
+		profiles.push_back( profile );
+	}
+	profile = EncoderProfile();
+	profile.accurateDCT = true;
+	profiles.push_back( profile );
+	profile = EncoderProfile();
+	profile.progressive = true;
+	profiles.push_back( profile );
+	profile = EncoderProfile();
+	profile.restartRows = 1;
+	profiles.push_back( profile );
+	for ( int threads = 2; threads <= (int)std::thread::hardware_concurrency(); threads *= 2 )
+	{
+		profile = EncoderProfile();
+		profile.threads = threads;
+		profiles.push_back( profile );
+	}
+
+	printf( "%s", JPEGEncoder::benchmark( samples, profiles, repetitions ).c_str() );
+	fflush( stdout );
+	return 0;
+}
+
+// Tunes the encoders of the streams selected in the saved configuration, and saves the result
+static int autoTune()
+{
+	if ( AttachConsole( ATTACH_PARENT_PROCESS ) )
+		freopen( "CONOUT$", "w", stdout );
+
+	Hunter w;
+	printf( "%s", w.autoTuneEncoders().c_str() );
+	fflush( stdout );
+	return 0;
+}
+
+// Transcodes recordings: hunter --transcode <output dir> [--raw] [--quality N] [--subsampling 444|422|420]
+// [--residual] [--crop x,y,w,h] [--scale f] [--files N] [--threads N] <files or directories>...
+// Residual files given without --residual come out as standard JPEG SEQ files.
+static int transcode( int argc, char* argv[] )
+{
+	if ( AttachConsole( ATTACH_PARENT_PROCESS ) )
+		freopen( "CONOUT$", "w", stdout );
+
+	int cores = (std::max)( (int)std::thread::hardware_concurrency(), 1 );
+	Transcoder::Options options;
+	options.outputDir = argv[ 2 ];
+	int threads = cores;
+	int files = cores; // Encoding a file is sequential, so one file per core
+	vector<QString> inputs;
+
+	for ( int i = 3; i < argc; i++ )
+	{
+		bool hasValue = i + 1 < argc;
+		if ( !strcmp( argv[ i ], "--raw" ) )
+			options.compressed = false;
+		else if ( !strcmp( argv[ i ], "--quality" ) && hasValue )
+			options.profile.quality = (std::min)( (std::max)( atoi( argv[ ++i ] ), 1 ), 100 );
+		else if ( !strcmp( argv[ i ], "--subsampling" ) && hasValue )
+			options.profile.subsampling = (std::max)( EncoderProfile::subsamplingFromName( argv[ ++i ] ), (int)TJSAMP_444 );
+		else if ( !strcmp( argv[ i ], "--residual" ) )
+			options.residual.enabled = true;
+		else if ( !strcmp( argv[ i ], "--crop" ) && hasValue )
+		{
+			int x, y, w, h;
+			if ( sscanf( argv[ ++i ], "%d,%d,%d,%d", &x, &y, &w, &h ) == 4 )
+				options.crop = QRect( x, y, w, h );
+		}
+		else if ( !strcmp( argv[ i ], "--scale" ) && hasValue )
+			options.scale = (std::min)( (std::max)( atof( argv[ ++i ] ), 0.01 ), 1.0 );
+		else if ( !strcmp( argv[ i ], "--files" ) && hasValue )
+			files = (std::max)( atoi( argv[ ++i ] ), 1 );
+		else if ( !strcmp( argv[ i ], "--threads" ) && hasValue )
+			threads = (std::max)( atoi( argv[ ++i ] ), 1 );
+		else if ( QFileInfo( argv[ i ] ).isDir() )
+		{
+			QDir directory( argv[ i ] );
+			for ( auto& name : directory.entryList( QStringList() << "*.seq" << "*.rseq", QDir::Files ) )
+				inputs.push_back( directory.filePath( name ) );
+		}
+		else
+			inputs.push_back( QString( argv[ i ] ) );
+	}
+
+	Transcoder transcoder( options, threads, files );
+	printf( "%s", transcoder.run( inputs ).c_str() );
+	fflush( stdout );
+	return 0;
+}
+
+// Sample frame bus consumer: follows the sets published by a running Hunter and prints, once a second,
+// how many it got, how many it missed, and the mean grey level of each Point Grey ROI in the newest one
+static int watchFrameBus( const char* name )
+{
+	if ( AttachConsole( ATTACH_PARENT_PROCESS ) )
+		freopen( "CONOUT$", "w", stdout );
+
+	FrameBusReader reader;
+	if ( !reader.open( name ) )
+	{
+		printf( "No frame bus %s; is Hunter running with <frameBus> in its configuration?\n", name );
+		return 1;
+	}
+
+	long long sets = 0;
+	long long overwritten = 0;
+	double means[ FrameBusLayout::MAX_CHANNELS ] = {};
+	auto last = chrono::steady_clock::now();
+	while ( true )
+	{
+		FrameBusReader::View view;
+		if ( !reader.next( view ) )
+		{
+			this_thread::sleep_for( chrono::milliseconds( 1 ) );
+		}
+		else
+		{
+			// Read straight from the bus, then check that the publisher didn't overwrite the set meanwhile
+			double latest[ FrameBusLayout::MAX_CHANNELS ] = {};
+			for ( int c = 0; c < FrameBusLayout::MAX_CHANNELS; c++ )
+			{
+				const FrameBusChannel& channel = view.channel( c );
+				if ( !view.has( c ) || channel.format != FrameBusLayout::Grey8 || channel.roiWidth <= 0 || channel.roiHeight <= 0 )
+					continue;
+				unsigned long long sum = 0;
+				for ( int y = channel.roiY; y < channel.roiY + channel.roiHeight && y < channel.height; y++ )
+				{
+					const uint8_t* row = view.data( c ) + (size_t)y * channel.stride;
+					for ( int x = channel.roiX; x < channel.roiX + channel.roiWidth && x < channel.width; x++ )
+						sum += row[ x ];
+				}
+				latest[ c ] = (double)sum / ( channel.roiWidth * channel.roiHeight );
+			}
+			if ( reader.valid( view ) )
+			{
+				sets++;
+				copy( latest, latest + FrameBusLayout::MAX_CHANNELS, means );
+			}
+			else
+			{
+				overwritten++;
+			}
+		}
+
+		if ( chrono::steady_clock::now() - last >= chrono::seconds( 1 ) )
+		{
+			last = chrono::steady_clock::now();
+			printf( "%lld sets, %lld missed, %lld overwritten; ROI means %.1f %.1f\n",
+			        sets, (long long)reader.getLapped(), overwritten, means[ 0 ], means[ 1 ] );
+			fflush( stdout );
+		}
+	}
+	return 0;
+}
+
+// Number of reader threads and seconds used by --benchmark-bus
+static const int BENCHMARK_BUS_READERS = 4;
+static const double BENCHMARK_BUS_SECONDS = 10;
+
+// Runs the frame bus benchmark and prints the results to the console
+static int benchmarkFrameBus( int readers, double seconds )
+{
+	if ( AttachConsole( ATTACH_PARENT_PROCESS ) )
+		freopen( "CONOUT$", "w", stdout );
+
+	printf( "%s", FrameBusPublisher::benchmark( readers, seconds ).c_str() );
+	fflush( stdout );
+	return 0;
+}
+
+// Records without the main window: hunter --headless <config.xml> [--duration seconds] [--stats seconds] [--serve]
+// Without --duration, records until Ctrl+C. With --serve, waits for the control server to start and stop recordings.
+static int headless( int argc, char* argv[] )
+{
+	if ( AttachConsole( ATTACH_PARENT_PROCESS ) )
+		freopen( "CONOUT$", "w", stdout );
+
+	double seconds = 0;
+	double statsSeconds = HeadlessRecorder::DEFAULT_STATS_SECONDS;
+	bool serve = false;
+	for ( int i = 3; i < argc; i++ )
+	{
+		bool hasValue = i + 1 < argc;
+		if ( !strcmp( argv[ i ], "--duration" ) && hasValue )
+			seconds = (std::max)( atof( argv[ ++i ] ), 0.0 );
+		else if ( !strcmp( argv[ i ], "--stats" ) && hasValue )
+			statsSeconds = (std::max)( atof( argv[ ++i ] ), 0.1 );
+		else if ( !strcmp( argv[ i ], "--serve" ) )
+			serve = true;
+	}
+
+	HeadlessRecorder recorder;
+	string error;
+	if ( !recorder.loadConfig( argv[ 2 ], error ) )
+	{
+		printf( "%s\n", error.c_str() );
+		return 1;
+	}
+	return serve ? recorder.serve( statsSeconds ) : recorder.record( seconds, statsSeconds );
+}
+
 // The entry point
 int main(int argc, char *argv[])
 {
 	qRegisterMetaType<vector<QImage>>("vector<QImage>");
 	QApplication app(argc, argv);
+
+	// Command line tools: hunter --benchmark-storage <dir> [frames]
+	if ( argc >= 3 && !strcmp( argv[ 1 ], "--benchmark-storage" ) )
+		return benchmarkStorage( argv[ 2 ], argc >= 4 ? (std::max)( atoi( argv[ 3 ] ), 1 ) : BENCHMARK_FRAMES );
+	// hunter --benchmark-encoder <image dir> [repetitions]
+	if ( argc >= 3 && !strcmp( argv[ 1 ], "--benchmark-encoder" ) )
+		return benchmarkEncoder( argv[ 2 ], argc >= 4 ? (std::max)( atoi( argv[ 3 ] ), 1 ) : BENCHMARK_REPETITIONS );
+	// hunter --transcode <output dir> [options] <files or directories>...
+	if ( argc >= 4 && !strcmp( argv[ 1 ], "--transcode" ) )
+		return transcode( argc, argv );
+	// hunter --autotune
+	if ( argc >= 2 && !strcmp( argv[ 1 ], "--autotune" ) )
+		return autoTune();
+	// hunter --watch-bus [name]
+	if ( argc >= 2 && !strcmp( argv[ 1 ], "--watch-bus" ) )
+		return watchFrameBus( argc >= 3 ? argv[ 2 ] : FrameBusLayout::defaultName() );
+	// hunter --benchmark-bus [readers] [seconds]
+	if ( argc >= 2 && !strcmp( argv[ 1 ], "--benchmark-bus" ) )
+		return benchmarkFrameBus( argc >= 3 ? (std::max)( atoi( argv[ 2 ] ), 1 ) : BENCHMARK_BUS_READERS,
+		                          argc >= 4 ? (std::max)( atof( argv[ 3 ] ), 0.1 ) : BENCHMARK_BUS_SECONDS );
+	// hunter --headless <config.xml> [--duration seconds] [--stats seconds] [--serve]
+	if ( argc >= 3 && !strcmp( argv[ 1 ], "--headless" ) )
+		return headless( argc, argv );
+
 	Hunter w;
 	w.show();
 	return app.exec();
@@ -0,0 +1,272 @@
+/**
+ * @file motion_gate.cpp
+ * @brief Pauses recording while nothing moves in front of a camera
+ */
+
+// Project includes
+#include "motion_gate.h"
+
+// Libraries
+#include <QTCore/QtDebug>
+
+// C++
+#include <algorithm>
+#include <emmintrin.h>
+
+using namespace std;
+
+/**
+ * @brief MotionGateSettings constructor
+ * @arg None
+ *
+ * The gate is off by default and watches PG Top when enabled.
+ */
+MotionGateSettings::MotionGateSettings( void )
+    : enabled( false ),
+      channel( 0 ),
+      threshold( MotionGate::DEFAULT_THRESHOLD ),
+      holdSeconds( MotionGate::DEFAULT_HOLD_SECONDS ),
+      preRollFrames( MotionGate::DEFAULT_PRE_ROLL_FRAMES )
+{
+}
+
+/**
+ * @brief MotionGate constructor
+ * @arg None
+ */
+MotionGate::MotionGate( void )
+    : active( false ),
+      open( true ),
+      sampled( false ),
+      lastSample( 0 ),
+      lastMotion( 0 ),
+      pausedSets( 0 ),
+      skippedSets( 0 ),
+      pauses( 0 )
+{
+}
+
+/**
+ * @brief Arm the gate for a recording.
+ * @param settings The gate settings; if not enabled, the gate stays open.
+ * @param sessionPath Recordings folder and session prefix, e.g. .../recordings/Mouse_<date>; the events sidecar is named after it.
+ * @returns void.
+ *
+ * The gate starts open and stays open for at least the hold time.
+ */
+void MotionGate::start( const MotionGateSettings& settings, const QString& sessionPath )
+{
+    lock_guard<std::mutex> lock( mutex );
+    this->settings = settings;
+    active = settings.enabled;
+    open = true;
+    sampled = false;
+    preRoll.clear();
+    pausedSets = 0;
+    skippedSets = 0;
+    pauses = 0;
+    if ( active )
+        events.open( sessionPath, "events", "event,index,seconds,milliseconds,skippedSets" );
+}
+
+/**
+ * @brief Decide whether a frame set is written.
+ * @param index Arrival index of the watched channel's frame.
+ * @param data 8-bit pixels of the watched channel's frame.
+ * @param stride Bytes per row of data.
+ * @param roi The watched channel's ROI; it must lie within the frame.
+ * @param secs Timestamp of the frame: seconds.
+ * @param ms Timestamp of the frame: milliseconds.
+ * @returns Whether the frame set is written; always true while the gate is not active.
+ */
+bool MotionGate::update( unsigned long long index, const uchar* data, int stride, const QRect& roi, int secs, int ms )
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( !active )
+        return true;
+
+    long long now = (long long)secs * 1000 + ms;
+    if ( !sampled )
+    {
+        downsample( data, stride, roi, previous );
+        lastSample = now;
+        lastMotion = now;
+        sampled = true;
+    }
+    else if ( now - lastSample >= SAMPLE_INTERVAL_MS || now < lastSample )
+    {
+        downsample( data, stride, roi, current );
+        if ( current.size() != previous.size() || differenceEnergy( previous, current ) >= settings.threshold )
+            lastMotion = now;
+        previous.swap( current );
+        lastSample = now;
+    }
+
+    bool motion = now - lastMotion < settings.holdSeconds * 1000;
+    if ( open && !motion )
+    {
+        // Nothing has moved for the hold time: pause from this set on
+        open = false;
+        pausedSets = 0;
+        pauses++;
+        events.writeRow( "pause,%llu,%d,%d,0", index, secs, ms );
+#ifdef DEBUG
+        qDebug() << "Motion gate closed at frame" << index << endl;
+#endif
+    }
+    else if ( !open && motion )
+    {
+        // The channels write the sets they held on to first
+        open = true;
+        unsigned long long skipped = pausedSets - preRoll.size();
+        skippedSets += skipped;
+        SkippedSet first = preRoll.empty() ? SkippedSet{ index, secs, ms } : preRoll.front();
+        events.writeRow( "resume,%llu,%d,%d,%llu", first.index, first.secs, first.ms, skipped );
+        preRoll.clear();
+#ifdef DEBUG
+        qDebug() << "Motion gate opened at frame" << index << "after skipping" << skipped << "frames" << endl;
+#endif
+    }
+
+    if ( !open )
+    {
+        pausedSets++;
+        preRoll.push_back( { index, secs, ms } );
+        while ( (int)preRoll.size() > settings.preRollFrames )
+            preRoll.pop_front();
+    }
+    return open;
+}
+
+/**
+ * @brief Disarm the gate at the end of a recording.
+ * @arg None.
+ * @returns void.
+ *
+ * A pause still running is logged with the sets it skipped, including those
+ * the channels held on to.
+ */
+void MotionGate::stop()
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( active && !open )
+    {
+        skippedSets += pausedSets;
+        events.writeRow( "stop,,,,%llu", pausedSets );
+    }
+    active = false;
+    open = true;
+    preRoll.clear();
+    events.close();
+}
+
+/**
+ * @brief Number of pauses in the current (or last) recording.
+ * @arg None.
+ * @returns The number of times the gate closed.
+ */
+int MotionGate::getPauses()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return pauses;
+}
+
+/**
+ * @brief Number of frame sets not written in the current (or last) recording.
+ * @arg None.
+ * @returns Sets skipped; final once the gate is stopped.
+ */
+unsigned long long MotionGate::getSkippedSets()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return skippedSets;
+}
+
+/**
+ * @brief Reduce an ROI to the means of its blocks.
+ * @param data 8-bit pixels.
+ * @param stride Bytes per row of data.
+ * @param roi The region reduced; partial blocks at its right and bottom edges are left out.
+ * @param blocks Out: one mean per block, row by row.
+ * @returns void.
+ */
+void MotionGate::downsample( const uchar* data, int stride, const QRect& roi, std::vector<uint8_t>& blocks )
+{
+    int columns = roi.width() / BLOCK_SIZE;
+    int rows = roi.height() / BLOCK_SIZE;
+    blocks.resize( columns * rows );
+    if ( blocks.empty() )
+        return;
+
+    const __m128i zero = _mm_setzero_si128();
+    for ( int row = 0; row < rows; row++ )
+    {
+        const uchar* top = data + (size_t)( roi.y() + row * BLOCK_SIZE ) * stride + roi.x();
+        uint8_t* means = &blocks[ row * columns ];
+        int column = 0;
+
+        // Two blocks at a time: average the eight rows, then sum each half
+        for ( ; column + 2 <= columns; column += 2 )
+        {
+            const uchar* p = top + column * BLOCK_SIZE;
+            __m128i r[ BLOCK_SIZE ];
+            for ( int y = 0; y < BLOCK_SIZE; y++ )
+                r[ y ] = _mm_loadu_si128( (const __m128i*)( p + y * stride ) );
+            __m128i average = _mm_avg_epu8( _mm_avg_epu8( _mm_avg_epu8( r[ 0 ], r[ 1 ] ), _mm_avg_epu8( r[ 2 ], r[ 3 ] ) ),
+                                            _mm_avg_epu8( _mm_avg_epu8( r[ 4 ], r[ 5 ] ), _mm_avg_epu8( r[ 6 ], r[ 7 ] ) ) );
+            __m128i sums = _mm_sad_epu8( average, zero );
+            means[ column ] = (uint8_t)( ( _mm_cvtsi128_si32( sums ) + BLOCK_SIZE / 2 ) / BLOCK_SIZE );
+            means[ column + 1 ] = (uint8_t)( ( _mm_extract_epi16( sums, 4 ) + BLOCK_SIZE / 2 ) / BLOCK_SIZE );
+        }
+
+        // An odd block at the end
+        for ( ; column < columns; column++ )
+        {
+            const uchar* p = top + column * BLOCK_SIZE;
+            int sum = 0;
+            for ( int y = 0; y < BLOCK_SIZE; y++ )
+                for ( int x = 0; x < BLOCK_SIZE; x++ )
+                    sum += p[ y * stride + x ];
+            means[ column ] = (uint8_t)( ( sum + BLOCK_SIZE * BLOCK_SIZE / 2 ) / ( BLOCK_SIZE * BLOCK_SIZE ) );
+        }
+    }
+}
+
+/**
+ * @brief Mean squared difference between two sets of block means.
+ * @param a Block means.
+ * @param b Block means of the same size.
+ * @returns The energy, in grey levels squared; 0 for empty sets.
+ */
+double MotionGate::differenceEnergy( const std::vector<uint8_t>& a, const std::vector<uint8_t>& b )
+{
+    size_t count = (std::min)( a.size(), b.size() );
+    if ( count == 0 )
+        return 0;
+
+    const __m128i zero = _mm_setzero_si128();
+    unsigned long long total = 0;
+    size_t i = 0;
+    while ( i + 16 <= count )
+    {
+        // 32-bit lanes hold at most 4 * 65025 per chunk; move them out before they could overflow
+        __m128i sums = _mm_setzero_si128();
+        for ( int chunk = 0; chunk < 1024 && i + 16 <= count; chunk++, i += 16 )
+        {
+            __m128i x = _mm_loadu_si128( (const __m128i*)&a[ i ] );
+            __m128i y = _mm_loadu_si128( (const __m128i*)&b[ i ] );
+            __m128i low = _mm_sub_epi16( _mm_unpacklo_epi8( x, zero ), _mm_unpacklo_epi8( y, zero ) );
+            __m128i high = _mm_sub_epi16( _mm_unpackhi_epi8( x, zero ), _mm_unpackhi_epi8( y, zero ) );
+            sums = _mm_add_epi32( sums, _mm_add_epi32( _mm_madd_epi16( low, low ), _mm_madd_epi16( high, high ) ) );
+        }
+        uint32_t lanes[ 4 ];
+        _mm_storeu_si128( (__m128i*)lanes, sums );
+        total += (unsigned long long)lanes[ 0 ] + lanes[ 1 ] + lanes[ 2 ] + lanes[ 3 ];
+    }
+    for ( ; i < count; i++ )
+    {
+        int difference = (int)a[ i ] - b[ i ];
+        total += difference * difference;
+    }
+    return (double)total / count;
+}
@@ -0,0 +1,334 @@
+/**
+ * @file pipeline_executor.cpp
+ * @brief Fixed set of worker threads that run the per-channel processing
+ */
+
+// Project includes
+#include "pipeline_executor.h"
+
+// Libraries
+#include <QTCore/qt_windows.h>
+#include <QTCore/QtDebug>
+
+// C++
+#include <algorithm>
+
+using namespace std;
+
+//// Constants
+const std::string PipelineExecutor::priorityNames[] = { "normal", "aboveNormal", "highest", "timeCritical" };
+
+/** Windows priority of each Priority */
+static const int threadPriorities[] = { THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_ABOVE_NORMAL,
+                                        THREAD_PRIORITY_HIGHEST, THREAD_PRIORITY_TIME_CRITICAL };
+
+/** Default node of each worker: the Point Grey cameras apart, the DepthSense channels together */
+static const int defaultNodes[ PipelineExecutor::DEFAULT_WORKERS ] = { 0, 1, 0, 0 };
+
+/**
+ * @brief PipelineSettings constructor
+ * @arg None
+ *
+ * Spread over the NUMA nodes, at the priority the processors always ran at.
+ */
+PipelineSettings::PipelineSettings( void )
+    : priority( PipelineExecutor::TimeCriticalPriority )
+{
+}
+
+/**
+ * @brief Look up a priority by its configuration name.
+ * @param name One of priorityNames.
+ * @returns The priority, or TimeCriticalPriority if the name is unknown.
+ */
+PipelineExecutor::Priority PipelineExecutor::priorityFromName( const std::string& name )
+{
+    for ( int i = 0; i < NUM_PRIORITIES; i++ )
+    {
+        if ( priorityNames[ i ] == name )
+            return (Priority)i;
+    }
+    return TimeCriticalPriority;
+}
+
+/**
+ * @brief Number of NUMA nodes of this machine.
+ * @arg None.
+ * @returns Nodes; 1 if the machine is not NUMA.
+ */
+int PipelineExecutor::nodeCount()
+{
+    ULONG highest = 0;
+    if ( !GetNumaHighestNodeNumber( &highest ) )
+        return 1;
+    return (int)highest + 1;
+}
+
+/**
+ * @brief NUMA node of the core the calling thread runs on.
+ * @arg None.
+ * @returns The node; 0 if it cannot be told.
+ */
+int PipelineExecutor::currentNode()
+{
+    PROCESSOR_NUMBER processor;
+    USHORT node = 0;
+    GetCurrentProcessorNumberEx( &processor );
+    if ( !GetNumaProcessorNodeEx( &processor, &node ) )
+        return 0;
+    return node;
+}
+
+/**
+ * @brief Cores of a NUMA node.
+ * @param node The node.
+ * @returns An affinity mask; 0 if the node does not exist or is not in the first processor group.
+ */
+unsigned long long PipelineExecutor::nodeMask( int node )
+{
+    GROUP_AFFINITY affinity;
+    if ( node < 0 || !GetNumaNodeProcessorMaskEx( (USHORT)node, &affinity ) || affinity.Group != 0 )
+        return 0;
+    return affinity.Mask;
+}
+
+/**
+ * @brief PipelineExecutor constructor
+ * @param workers Number of worker threads, created right away.
+ */
+PipelineExecutor::PipelineExecutor( int workers )
+    : stopping( false )
+{
+    workers = (std::max)( workers, 1 );
+    tasks.resize( workers );
+    busy.resize( workers, false );
+    for ( int i = 0; i < workers; i++ )
+        wakeups.push_back( std::unique_ptr<std::condition_variable>( new std::condition_variable() ) );
+    workerNodes.resize( workers, -1 );
+    workerMasks.resize( workers, 0 );
+    for ( int i = 0; i < workers; i++ )
+        threads.push_back( std::thread( &PipelineExecutor::worker, this, i ) );
+    configure( PipelineSettings() );
+}
+
+/**
+ * @brief PipelineExecutor destructor
+ * @arg None
+ */
+PipelineExecutor::~PipelineExecutor( void )
+{
+    stop();
+}
+
+/**
+ * @brief Place the workers.
+ * @param settings Core or node of each worker, and their priority.
+ * @returns Whether every worker could be placed; a worker whose core or node does not exist runs on any core.
+ * @note Takes effect immediately, also for running tasks.
+ */
+bool PipelineExecutor::configure( const PipelineSettings& settings )
+{
+    DWORD_PTR processMask = 0;
+    DWORD_PTR systemMask = 0;
+    GetProcessAffinityMask( GetCurrentProcess(), &processMask, &systemMask );
+    int nodes = nodeCount();
+
+    lock_guard<std::mutex> lock( mutex );
+    bool placed = true;
+    for ( size_t i = 0; i < threads.size(); i++ )
+    {
+        HANDLE thread = (HANDLE)threads[ i ].native_handle();
+        SetThreadPriority( thread, threadPriorities[ settings.priority ] );
+
+        int core = -1;
+        int node = -1;
+        if ( !settings.cores.empty() )
+        {
+            core = settings.cores[ i % settings.cores.size() ];
+            if ( !settings.nodes.empty() )
+                node = settings.nodes[ i % settings.nodes.size() ];
+        }
+        else if ( nodes > 1 )
+        {
+            node = defaultNodes[ i % DEFAULT_WORKERS ] % nodes;
+        }
+
+        DWORD_PTR mask = processMask;
+        if ( core >= 0 )
+        {
+            if ( core < (int)( 8 * sizeof( DWORD_PTR ) ) && ( processMask >> core ) & 1 )
+            {
+                mask = (DWORD_PTR)1 << core;
+                node = -1;
+                for ( int n = 0; n < nodes && node < 0; n++ )
+                {
+                    if ( ( nodeMask( n ) >> core ) & 1 )
+                        node = n;
+                }
+            }
+            else
+            {
+#ifdef DEBUG
+                qDebug() << "Pipeline worker" << i << "cannot be placed on core" << core << endl;
+#endif
+                placed = false;
+                node = -1;
+            }
+        }
+        else if ( node >= 0 )
+        {
+            if ( nodeMask( node ) & processMask )
+            {
+                mask = (DWORD_PTR)( nodeMask( node ) & processMask );
+            }
+            else
+            {
+#ifdef DEBUG
+                qDebug() << "Pipeline worker" << i << "cannot be placed on node" << node << endl;
+#endif
+                placed = false;
+                node = -1;
+            }
+        }
+        if ( !SetThreadAffinityMask( thread, mask ) )
+            placed = false;
+
+        // On a machine with one node, nothing needs to follow the workers
+        workerNodes[ i ] = nodes > 1 ? node : -1;
+        workerMasks[ i ] = mask;
+    }
+    return placed;
+}
+
+/**
+ * @brief Queue a task.
+ * @param task The task; it runs until it returns, so a long task occupies its worker.
+ * @param preferredWorker Worker that runs the task, unless it is busy and another one on its node is idle.
+ * @returns void.
+ */
+void PipelineExecutor::submit( std::function<void()> task, int preferredWorker )
+{
+    lock_guard<std::mutex> lock( mutex );
+    int owner = preferredWorker % (int)tasks.size();
+    tasks[ owner ].push_back( task );
+    if ( !busy[ owner ] )
+    {
+        wakeups[ owner ]->notify_one();
+        return;
+    }
+    for ( size_t i = 0; i < tasks.size(); i++ )
+    {
+        if ( !busy[ i ] && workerNodes[ i ] == workerNodes[ owner ] )
+            wakeups[ i ]->notify_one();
+    }
+}
+
+/**
+ * @brief Wait for the running tasks to return, and for the workers to exit.
+ * @arg None.
+ * @returns void.
+ *
+ * Tasks still queued are dropped. Tasks must be told to return first; the
+ * streamer does so by no longer running.
+ */
+void PipelineExecutor::stop()
+{
+    {
+        lock_guard<std::mutex> lock( mutex );
+        stopping = true;
+        for ( auto& queue : tasks )
+            queue.clear();
+        for ( auto& wakeup : wakeups )
+            wakeup->notify_one();
+    }
+    for ( auto& thread : threads )
+    {
+        if ( thread.joinable() )
+            thread.join();
+    }
+}
+
+/**
+ * @brief Accessor for the number of workers.
+ * @arg None.
+ * @returns Worker threads.
+ */
+int PipelineExecutor::workers()
+{
+    return (int)threads.size();
+}
+
+/**
+ * @brief NUMA node of a worker.
+ * @param worker The worker; for a channel, the channel.
+ * @returns The node, or -1 if the worker may run on any node, or the machine has only one.
+ */
+int PipelineExecutor::node( int worker )
+{
+    lock_guard<std::mutex> lock( mutex );
+    return workerNodes[ worker % workerNodes.size() ];
+}
+
+/**
+ * @brief Cores a worker may run on, for threads that hand it work to follow.
+ * @param worker The worker; for a channel, the channel.
+ * @returns An affinity mask.
+ */
+unsigned long long PipelineExecutor::affinity( int worker )
+{
+    lock_guard<std::mutex> lock( mutex );
+    return workerMasks[ worker % workerMasks.size() ];
+}
+
+/**
+ * @brief Take the next task for a worker: its own oldest, or else the newest of a busy worker on the same node.
+ * @param index The worker.
+ * @param task Out: the task.
+ * @returns Whether there was one. Call with mutex held.
+ *
+ * An idle worker is left its own tasks, so where a channel runs does not depend on
+ * which worker wakes first, and a task never leaves the node its frame pool is on.
+ */
+bool PipelineExecutor::takeTask( int index, std::function<void()>& task )
+{
+    if ( !tasks[ index ].empty() )
+    {
+        task = tasks[ index ].front();
+        tasks[ index ].pop_front();
+        return true;
+    }
+    for ( size_t i = 1; i < tasks.size(); i++ )
+    {
+        size_t owner = ( index + i ) % tasks.size();
+        std::deque<std::function<void()>>& victim = tasks[ owner ];
+        if ( !victim.empty() && busy[ owner ] && workerNodes[ owner ] == workerNodes[ index ] )
+        {
+            task = victim.back();
+            victim.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Worker thread: run tasks until stopped.
+ * @param index The worker.
+ * @returns void.
+ */
+void PipelineExecutor::worker( int index )
+{
+    while ( true )
+    {
+        std::function<void()> task;
+        {
+            unique_lock<std::mutex> lock( mutex );
+            busy[ index ] = false;
+            wakeups[ index ]->wait( lock, [ & ]() { return stopping || takeTask( index, task ); } );
+            if ( stopping )
+                return;
+            busy[ index ] = true;
+        }
+        task();
+    }
+}
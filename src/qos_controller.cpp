@@ -0,0 +1,161 @@
+/**
+ * @file qos_controller.cpp
+ * @brief Degradation ladder for when processing falls behind the cameras
+ */
+
+// Project includes
+#include "qos_controller.h"
+
+// Libraries
+#include <QTCore/QtDebug>
+
+// C++
+#include <algorithm>
+
+using namespace std;
+
+//// Constants
+const std::string QoSController::levelNames[] = { "normal", "preview throttled", "quality reduced", "dropping" };
+
+/**
+ * @brief QoSController constructor
+ * @param previewInterval Preview update interval in ms when not degraded.
+ * @param quality JPEG quality when not degraded.
+ */
+QoSController::QoSController( int previewInterval, int quality )
+    : basePreviewInterval( previewInterval ),
+      baseQuality( quality ),
+      currentLevel( Level::Normal ),
+      quality( quality ),
+      behindSets( 0 ),
+      calmSets( 0 )
+{
+}
+
+/**
+ * @brief Return to full quality, e.g. when a recording starts.
+ * @arg None.
+ * @returns void.
+ */
+void QoSController::reset()
+{
+    lock_guard<std::mutex> lock( mutex );
+    currentLevel = Level::Normal;
+    quality = baseQuality;
+    behindSets = 0;
+    calmSets = 0;
+}
+
+/**
+ * @brief Feed the controller the state of the queues after a frame set was queued.
+ * @param queueDepth Depth of the fullest frame queue.
+ * @returns void.
+ */
+void QoSController::update( int queueDepth )
+{
+    lock_guard<std::mutex> lock( mutex );
+
+    if ( queueDepth >= SOFT_QUEUE_SIZE )
+    {
+        calmSets = 0;
+        if ( ++behindSets < ESCALATE_AFTER )
+            return;
+        behindSets = 0;
+
+        // Degrade one step
+        switch ( currentLevel )
+        {
+        case Level::Normal:
+            currentLevel = Level::PreviewThrottled;
+            break;
+        case Level::PreviewThrottled:
+            currentLevel = Level::QualityReduced;
+            quality = (std::max)( baseQuality - QUALITY_STEP, (int)MIN_QUALITY );
+            break;
+        case Level::QualityReduced:
+            if ( quality > MIN_QUALITY )
+                quality = (std::max)( quality - QUALITY_STEP, (int)MIN_QUALITY );
+            else
+                currentLevel = Level::Dropping;
+            break;
+        default:
+            return;
+        }
+    }
+    else if ( queueDepth <= CALM_QUEUE_SIZE )
+    {
+        behindSets = 0;
+        if ( ++calmSets < RELAX_AFTER )
+            return;
+        calmSets = 0;
+
+        // Recover one step
+        switch ( currentLevel )
+        {
+        case Level::Dropping:
+            currentLevel = Level::QualityReduced;
+            break;
+        case Level::QualityReduced:
+            quality = (std::min)( quality + QUALITY_STEP, baseQuality );
+            if ( quality == baseQuality )
+                currentLevel = Level::PreviewThrottled;
+            break;
+        case Level::PreviewThrottled:
+            currentLevel = Level::Normal;
+            break;
+        default:
+            return;
+        }
+    }
+    else
+    {
+        return;
+    }
+
+#ifdef DEBUG
+    qDebug() << "QoS level" << (int)currentLevel << "JPEG quality" << (int)quality << endl;
+#endif
+}
+
+/**
+ * @brief Accessor for the current level.
+ * @arg None.
+ * @returns How far down the ladder the controller is.
+ */
+QoSController::Level QoSController::level()
+{
+    return (Level)(int)currentLevel;
+}
+
+/**
+ * @brief Minimum interval between preview updates.
+ * @arg None.
+ * @returns Interval in ms.
+ */
+int QoSController::previewInterval()
+{
+    return currentLevel >= Level::PreviewThrottled ? basePreviewInterval * PREVIEW_THROTTLE_FACTOR : basePreviewInterval;
+}
+
+/**
+ * @brief How far compressed channels should currently lower their JPEG quality.
+ * @arg None.
+ * @returns Quality steps below the base quality; 0 when not degraded.
+ *
+ * Channels have their own encoder profiles, so the ladder is applied as a
+ * reduction rather than an absolute quality.
+ */
+int QoSController::qualityReduction()
+{
+    return baseQuality - quality;
+}
+
+/**
+ * @brief Whether the ladder is exhausted, so full queues should shed frames rather than grow.
+ * @arg None.
+ * @returns True when dropping.
+ */
+bool QoSController::mayDrop()
+{
+    return currentLevel == Level::Dropping;
+}
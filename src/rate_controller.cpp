@@ -0,0 +1,133 @@
+/**
+ * @file rate_controller.cpp
+ * @brief JPEG quality control towards a target bitrate
+ */
+
+// Project includes
+#include "rate_controller.h"
+
+// C++
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// Quality points per factor e of size error. JPEG size roughly doubles from quality 50 to 90.
+static const double QUALITY_GAIN = 12.0;
+// Weight of the newest frame in the moving average of frame sizes
+static const double AVERAGE_WEIGHT = 0.25;
+
+/**
+ * @brief RateController constructor
+ * @arg None
+ */
+RateController::RateController( void )
+    : target( 0 ),
+      minQuality( 30 ),
+      maxQuality( 95 ),
+      targetPerFrame( 0 ),
+      averageSize( 0 ),
+      debt( 0 ),
+      currentQuality( 80 )
+{
+}
+
+/**
+ * @brief Set the target bitrate and the bounds quality may move within.
+ * @param targetBytesPerSecond Target average rate; 0 disables rate control.
+ * @param minQuality Lowest quality the controller may choose.
+ * @param maxQuality Highest quality the controller may choose.
+ * @returns void.
+ * @note Takes effect on the next call to start().
+ */
+void RateController::configure( double targetBytesPerSecond, int minQuality, int maxQuality )
+{
+    target = targetBytesPerSecond;
+    this->minQuality = (std::min)( minQuality, maxQuality );
+    this->maxQuality = (std::max)( minQuality, maxQuality );
+}
+
+/**
+ * @brief Start controlling a new stream.
+ * @param fps Frame rate of the stream.
+ * @param initialQuality Quality of the first frame.
+ * @returns void.
+ */
+void RateController::start( double fps, int initialQuality )
+{
+    targetPerFrame = ( fps > 0 ) ? target / fps : 0;
+    averageSize = 0;
+    debt = 0;
+    currentQuality = (std::min)( (std::max)( (double)initialQuality, (double)minQuality ), (double)maxQuality );
+}
+
+/**
+ * @brief Whether a target bitrate is set.
+ * @arg None.
+ * @returns True if quality should come from the controller.
+ */
+bool RateController::enabled()
+{
+    return target > 0;
+}
+
+/**
+ * @brief Quality to compress the next frame at.
+ * @arg None.
+ * @returns Quality (0-100).
+ */
+int RateController::quality()
+{
+    return (int)( currentQuality + 0.5 );
+}
+
+/**
+ * @brief Account for a compressed frame and choose the quality of the next one.
+ * @param frameBytes Size of the frame just compressed at quality().
+ * @returns void.
+ */
+void RateController::update( int frameBytes )
+{
+    if ( targetPerFrame <= 0 || frameBytes <= 0 )
+        return;
+
+    debt += frameBytes - targetPerFrame;
+    averageSize = ( averageSize > 0 ) ? averageSize + AVERAGE_WEIGHT * ( frameBytes - averageSize ) : frameBytes;
+
+    // Aim to have paid back the debt after HORIZON_FRAMES, but never aim below a tenth of the target
+    double desired = (std::max)( targetPerFrame - debt / HORIZON_FRAMES, targetPerFrame / 10 );
+
+    double step = QUALITY_GAIN * log( desired / averageSize );
+    step = (std::min)( (std::max)( step, (double)-MAX_STEP ), (double)MAX_STEP );
+    currentQuality = (std::min)( (std::max)( currentQuality + step, (double)minQuality ), (double)maxQuality );
+}
+
+/**
+ * @brief Accessor for the target bitrate.
+ * @arg None.
+ * @returns Target bytes per second; 0 when disabled.
+ */
+double RateController::getTarget()
+{
+    return target;
+}
+
+/**
+ * @brief Accessor for the lower quality bound.
+ * @arg None.
+ * @returns Lowest quality the controller may choose.
+ */
+int RateController::getMinQuality()
+{
+    return minQuality;
+}
+
+/**
+ * @brief Accessor for the upper quality bound.
+ * @arg None.
+ * @returns Highest quality the controller may choose.
+ */
+int RateController::getMaxQuality()
+{
+    return maxQuality;
+}
@@ -0,0 +1,395 @@
+/**
+ * @file residual_codec.cpp
+ * @brief Temporal background-residual codec for static-camera grayscale streams
+ */
+
+// Project includes
+#include "residual_codec.h"
+
+// C++
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <emmintrin.h>
+
+using namespace std;
+
+/**
+ * @brief ResidualSettings constructor
+ * @arg None
+ *
+ * The codec is off by default.
+ */
+ResidualSettings::ResidualSettings( void )
+    : enabled( false ),
+      threshold( ResidualEncoder::DEFAULT_THRESHOLD ),
+      keyframeInterval( ResidualEncoder::DEFAULT_KEYFRAME_INTERVAL )
+{
+}
+
+/**
+ * @brief Describe the settings, for file headers.
+ * @arg None.
+ * @returns e.g. "tile=16 threshold=6 keyframeInterval=300".
+ */
+std::string ResidualSettings::describe() const
+{
+    ostringstream description;
+    description << "tile=" << (int)ResidualEncoder::TILE_SIZE << " threshold=" << threshold << " keyframeInterval=" << keyframeInterval;
+    return description.str();
+}
+
+/**
+ * @brief ResidualEncoder constructor
+ * @arg None
+ */
+ResidualEncoder::ResidualEncoder( void )
+    : width( 0 ),
+      height( 0 ),
+      columns( 0 ),
+      rows( 0 ),
+      frameIndex( 0 ),
+      nextRefresh( 0 )
+{
+}
+
+/**
+ * @brief Prepare for a new file.
+ * @param width Width of the frames.
+ * @param height Height of the frames.
+ * @param settings Threshold and keyframe interval.
+ * @returns void.
+ *
+ * The first frame encoded is a keyframe.
+ */
+void ResidualEncoder::start( int width, int height, const ResidualSettings& settings )
+{
+    this->settings = settings;
+    this->width = width;
+    this->height = height;
+    columns = ( width + TILE_SIZE - 1 ) / TILE_SIZE;
+    rows = ( height + TILE_SIZE - 1 ) / TILE_SIZE;
+    frameIndex = 0;
+    nextRefresh = 0;
+    reference = QImage( width, height, QImage::Format_Grayscale8 );
+    background = QImage( width, height, QImage::Format_Grayscale8 );
+    average.assign( (size_t)width * height, 0 );
+}
+
+/**
+ * @brief Upper bound on the size of an encoded frame.
+ * @param width Width of the frames.
+ * @param height Height of the frames.
+ * @returns Bytes; a keyframe, or a residual frame in which every tile is sent.
+ */
+unsigned long ResidualEncoder::bufferSize( int width, int height )
+{
+    unsigned long tiles = (unsigned long)( ( width + TILE_SIZE - 1 ) / TILE_SIZE ) * ( ( height + TILE_SIZE - 1 ) / TILE_SIZE );
+    unsigned long packedRows = ( tiles + TILES_PER_ROW - 1 ) / TILES_PER_ROW;
+    unsigned long keyframe = 1 + JPEGEncoder::bufferSize( width, height );
+    unsigned long residual = 1 + sizeof( uint32_t ) + tiles * 2 * sizeof( uint16_t ) +
+                             JPEGEncoder::bufferSize( TILES_PER_ROW * TILE_SIZE, (int)packedRows * TILE_SIZE );
+    return (std::max)( keyframe, residual );
+}
+
+/**
+ * @brief Encode a frame.
+ * @param image The frame, in Grayscale8.
+ * @param destination Buffer the payload is written to.
+ * @param capacity Size of the destination buffer; at least bufferSize().
+ * @param quality JPEG quality of keyframes and tiles.
+ * @param jpeg Encoder for keyframes and tiles, with the channel's profile.
+ * @param keyframe Out: whether a keyframe was written.
+ * @returns The size of the payload in bytes.
+ */
+int ResidualEncoder::encode( const QImage* image, unsigned char* destination, unsigned long capacity, int quality, JPEGEncoder& jpeg, bool& keyframe )
+{
+    QImage converted;
+    const QImage* source = image;
+    if ( image->format() != QImage::Format_Grayscale8 )
+    {
+        converted = image->convertToFormat( QImage::Format_Grayscale8 );
+        source = &converted;
+    }
+
+    keyframe = frameIndex % (std::max)( settings.keyframeInterval, 1 ) == 0;
+    frameIndex++;
+
+    // Keyframe: the whole frame, which also resets the background model
+    if ( keyframe )
+    {
+        destination[ 0 ] = KEYFRAME;
+        int size = jpeg.encode( source, destination + 1, capacity - 1, quality );
+        for ( int y = 0; y < height; y++ )
+        {
+            const uchar* line = source->constScanLine( y );
+            memcpy( reference.scanLine( y ), line, width );
+            memcpy( background.scanLine( y ), line, width );
+            uint16_t* averageLine = average.data() + (size_t)y * width;
+            for ( int x = 0; x < width; x++ )
+                averageLine[ x ] = (uint16_t)( line[ x ] << 8 );
+        }
+        return size + 1;
+    }
+
+    if ( frameIndex % BACKGROUND_UPDATE_INTERVAL == 0 )
+        updateBackground( source );
+
+    // Tiles that changed beyond the threshold are sent as they are now
+    int total = columns * rows;
+    std::vector<char> sent( total, 0 );
+    tiles.clear();
+    for ( int row = 0; row < rows; row++ )
+    {
+        for ( int column = 0; column < columns; column++ )
+        {
+            if ( !tileChanged( source, column, row ) )
+                continue;
+            int tileWidth = (std::min)( (int)TILE_SIZE, width - column * TILE_SIZE );
+            int tileHeight = (std::min)( (int)TILE_SIZE, height - row * TILE_SIZE );
+            tiles.push_back( (uint16_t)column );
+            tiles.push_back( (uint16_t)row );
+            sent[ row * columns + column ] = 1;
+            copyTile( source->constScanLine( row * TILE_SIZE ) + column * TILE_SIZE, source->bytesPerLine(),
+                      reference.scanLine( row * TILE_SIZE ) + column * TILE_SIZE, reference.bytesPerLine(), tileWidth, tileHeight );
+        }
+    }
+
+    // A few others are refreshed from the background model, in turn
+    for ( int i = 0; i < (std::min)( (int)REFRESH_TILES, total ); i++ )
+    {
+        int tile = nextRefresh;
+        nextRefresh = ( nextRefresh + 1 ) % total;
+        if ( sent[ tile ] )
+            continue;
+        int column = tile % columns;
+        int row = tile / columns;
+        tiles.push_back( (uint16_t)column );
+        tiles.push_back( (uint16_t)row );
+        copyTile( background.constScanLine( row * TILE_SIZE ) + column * TILE_SIZE, background.bytesPerLine(),
+                  reference.scanLine( row * TILE_SIZE ) + column * TILE_SIZE, reference.bytesPerLine(),
+                  (std::min)( (int)TILE_SIZE, width - column * TILE_SIZE ), (std::min)( (int)TILE_SIZE, height - row * TILE_SIZE ) );
+    }
+
+    uint32_t count = (uint32_t)( tiles.size() / 2 );
+    destination[ 0 ] = RESIDUAL;
+    memcpy( destination + 1, &count, sizeof( uint32_t ) );
+    memcpy( destination + 1 + sizeof( uint32_t ), tiles.data(), tiles.size() * sizeof( uint16_t ) );
+    int size = 1 + sizeof( uint32_t ) + (int)( tiles.size() * sizeof( uint16_t ) );
+    if ( !count )
+        return size;
+
+    // Pack the tiles, as the decoder will show them, side by side into one image
+    int packedWidth = (std::min)( (int)count, (int)TILES_PER_ROW ) * TILE_SIZE;
+    int packedHeight = (int)( ( count + TILES_PER_ROW - 1 ) / TILES_PER_ROW ) * TILE_SIZE;
+    if ( packed.width() != packedWidth || packed.height() != packedHeight )
+    {
+        packed = QImage( packedWidth, packedHeight, QImage::Format_Grayscale8 );
+        packed.fill( 0 );
+    }
+    for ( uint32_t i = 0; i < count; i++ )
+    {
+        int column = tiles[ 2 * i ];
+        int row = tiles[ 2 * i + 1 ];
+        copyTile( reference.constScanLine( row * TILE_SIZE ) + column * TILE_SIZE, reference.bytesPerLine(),
+                  packed.scanLine( ( i / TILES_PER_ROW ) * TILE_SIZE ) + ( i % TILES_PER_ROW ) * TILE_SIZE, packed.bytesPerLine(),
+                  (std::min)( (int)TILE_SIZE, width - column * TILE_SIZE ), (std::min)( (int)TILE_SIZE, height - row * TILE_SIZE ) );
+    }
+    return size + jpeg.encode( &packed, destination + size, capacity - size, quality );
+}
+
+/**
+ * @brief Whether a tile of a frame differs enough from the reference to be sent.
+ * @param image The frame.
+ * @param column Column of the tile.
+ * @param row Row of the tile.
+ * @returns True if the mean or the peak absolute difference is over its threshold.
+ */
+bool ResidualEncoder::tileChanged( const QImage* image, int column, int row )
+{
+    int x0 = column * TILE_SIZE;
+    int y0 = row * TILE_SIZE;
+    int tileWidth = (std::min)( (int)TILE_SIZE, width - x0 );
+    int tileHeight = (std::min)( (int)TILE_SIZE, height - y0 );
+    int sum = 0;
+    int peak = 0;
+
+    // Whole tile rows are 16 bytes: one SSE2 SAD and max each
+    if ( tileWidth == TILE_SIZE )
+    {
+        __m128i sums = _mm_setzero_si128();
+        __m128i peaks = _mm_setzero_si128();
+        for ( int y = 0; y < tileHeight; y++ )
+        {
+            __m128i a = _mm_loadu_si128( (const __m128i*)( image->constScanLine( y0 + y ) + x0 ) );
+            __m128i b = _mm_loadu_si128( (const __m128i*)( reference.constScanLine( y0 + y ) + x0 ) );
+            sums = _mm_add_epi64( sums, _mm_sad_epu8( a, b ) );
+            peaks = _mm_max_epu8( peaks, _mm_or_si128( _mm_subs_epu8( a, b ), _mm_subs_epu8( b, a ) ) );
+        }
+        sum = _mm_cvtsi128_si32( sums ) + _mm_cvtsi128_si32( _mm_srli_si128( sums, 8 ) );
+        unsigned char lanes[ 16 ];
+        _mm_storeu_si128( (__m128i*)lanes, peaks );
+        peak = *std::max_element( lanes, lanes + 16 );
+    }
+    else
+    {
+        for ( int y = 0; y < tileHeight; y++ )
+        {
+            const uchar* a = image->constScanLine( y0 + y ) + x0;
+            const uchar* b = reference.constScanLine( y0 + y ) + x0;
+            for ( int x = 0; x < tileWidth; x++ )
+            {
+                int difference = abs( a[ x ] - b[ x ] );
+                sum += difference;
+                peak = (std::max)( peak, difference );
+            }
+        }
+    }
+    return sum > settings.threshold * tileWidth * tileHeight || peak > settings.threshold * PEAK_FACTOR;
+}
+
+/**
+ * @brief Move the background model a step towards a frame.
+ * @param image The frame.
+ * @returns void.
+ */
+void ResidualEncoder::updateBackground( const QImage* image )
+{
+    for ( int y = 0; y < height; y++ )
+    {
+        const uchar* line = image->constScanLine( y );
+        uchar* backgroundLine = background.scanLine( y );
+        uint16_t* averageLine = average.data() + (size_t)y * width;
+        for ( int x = 0; x < width; x++ )
+        {
+            int value = averageLine[ x ];
+            value += ( ( line[ x ] << 8 ) - value ) >> BACKGROUND_SHIFT;
+            averageLine[ x ] = (uint16_t)value;
+            backgroundLine[ x ] = (uchar)( ( value + 128 ) >> 8 );
+        }
+    }
+}
+
+/**
+ * @brief Copy a rectangle of pixels.
+ * @param source First pixel of the source.
+ * @param sourcePitch Bytes per source line.
+ * @param destination First pixel of the destination.
+ * @param destinationPitch Bytes per destination line.
+ * @param width Width in pixels.
+ * @param height Height in pixels.
+ * @returns void.
+ */
+void ResidualEncoder::copyTile( const uchar* source, int sourcePitch, uchar* destination, int destinationPitch, int width, int height )
+{
+    for ( int y = 0; y < height; y++ )
+        memcpy( destination + y * destinationPitch, source + y * sourcePitch, width );
+}
+
+/**
+ * @brief ResidualDecoder constructor
+ * @arg None
+ */
+ResidualDecoder::ResidualDecoder( void )
+    : decompressor( tjInitDecompress() ),
+      haveKeyframe( false )
+{
+}
+
+/**
+ * @brief ResidualDecoder destructor
+ * @arg None
+ */
+ResidualDecoder::~ResidualDecoder( void )
+{
+    tjDestroy( decompressor );
+}
+
+/**
+ * @brief Prepare for a new file, or for decoding from a keyframe.
+ * @param width Width of the frames.
+ * @param height Height of the frames.
+ * @returns void.
+ */
+void ResidualDecoder::start( int width, int height )
+{
+    current = QImage( width, height, QImage::Format_Grayscale8 );
+    current.fill( 0 );
+    haveKeyframe = false;
+}
+
+/**
+ * @brief Whether a payload is a keyframe, from which decoding can start.
+ * @param data The payload.
+ * @param size Its size in bytes.
+ * @returns True for keyframes.
+ */
+bool ResidualDecoder::isKeyframe( const unsigned char* data, size_t size )
+{
+    return size > 0 && data[ 0 ] == ResidualEncoder::KEYFRAME;
+}
+
+/**
+ * @brief Decode the next frame.
+ * @param data The payload.
+ * @param size Its size in bytes.
+ * @param frame Out: the frame, in Grayscale8.
+ * @returns Whether the frame could be decoded; residual frames need a keyframe before them.
+ */
+bool ResidualDecoder::decode( const unsigned char* data, size_t size, QImage& frame )
+{
+    if ( isKeyframe( data, size ) )
+    {
+        haveKeyframe = decompress( data + 1, size - 1, current );
+        frame = current;
+        return haveKeyframe;
+    }
+
+    uint32_t count;
+    size_t headerSize = 1 + sizeof( uint32_t );
+    if ( !haveKeyframe || size < headerSize || data[ 0 ] != ResidualEncoder::RESIDUAL )
+        return false;
+    memcpy( &count, data + 1, sizeof( uint32_t ) );
+    size_t listSize = (size_t)count * 2 * sizeof( uint16_t );
+    if ( size < headerSize + listSize || ( count && !decompress( data + headerSize + listSize, size - headerSize - listSize, packed ) ) )
+        return false;
+
+    int width = current.width();
+    int height = current.height();
+    for ( uint32_t i = 0; i < count; i++ )
+    {
+        uint16_t position[ 2 ];
+        memcpy( position, data + headerSize + i * sizeof( position ), sizeof( position ) );
+        int x0 = position[ 0 ] * ResidualEncoder::TILE_SIZE;
+        int y0 = position[ 1 ] * ResidualEncoder::TILE_SIZE;
+        int px = ( i % ResidualEncoder::TILES_PER_ROW ) * ResidualEncoder::TILE_SIZE;
+        int py = ( i / ResidualEncoder::TILES_PER_ROW ) * ResidualEncoder::TILE_SIZE;
+        if ( x0 >= width || y0 >= height || px >= packed.width() || py >= packed.height() )
+            return false;
+        int tileWidth = (std::min)( (int)ResidualEncoder::TILE_SIZE, width - x0 );
+        for ( int y = 0; y < (std::min)( (int)ResidualEncoder::TILE_SIZE, height - y0 ); y++ )
+            memcpy( current.scanLine( y0 + y ) + x0, packed.constScanLine( py + y ) + px, tileWidth );
+    }
+    frame = current;
+    return true;
+}
+
+/**
+ * @brief Decompress a grayscale JPEG.
+ * @param jpeg The JPEG data.
+ * @param size Its size in bytes.
+ * @param image In/out: the image; reallocated unless it already has the JPEG's size.
+ * @returns Whether the JPEG could be decompressed.
+ */
+bool ResidualDecoder::decompress( const unsigned char* jpeg, size_t size, QImage& image )
+{
+    int jpegWidth, jpegHeight, subsampling;
+    unsigned char* buffer = const_cast<unsigned char*>( jpeg ); // TurboJPEG 1.4 takes non-const buffers
+    if ( tjDecompressHeader2( decompressor, buffer, (unsigned long)size, &jpegWidth, &jpegHeight, &subsampling ) != 0 )
+        return false;
+    if ( &image == &current && ( jpegWidth != current.width() || jpegHeight != current.height() ) )
+        return false;
+    if ( image.width() != jpegWidth || image.height() != jpegHeight || image.format() != QImage::Format_Grayscale8 )
+        image = QImage( jpegWidth, jpegHeight, QImage::Format_Grayscale8 );
+    return tjDecompress2( decompressor, buffer, (unsigned long)size, image.bits(), jpegWidth, image.bytesPerLine(), jpegHeight, TJPF_GRAY, 0 ) == 0;
+}
@@ -0,0 +1,471 @@
+/**
+ * @file seq_reader.cpp
+ * @brief SEQ file reader
+ */
+
+// Project includes
+#include "seq_reader.h"
+
+// C++
+#include <cstring>
+
+using namespace std;
+
+/**
+ * @brief SEQReader constructor
+ * @arg None
+ */
+SEQReader::SEQReader( void )
+    : width( 0 ),
+      height( 0 ),
+      bitsPerPixel( 0 ),
+      imageFormat( 0 ),
+      frameCount( 0 ),
+      frameRate( 0 ),
+      nextFrame( 0 ),
+      decompressor( NULL )
+{
+}
+
+/**
+ * @brief SEQReader destructor
+ * @arg None
+ */
+SEQReader::~SEQReader( void )
+{
+    close();
+    if ( decompressor )
+        tjDestroy( decompressor );
+}
+
+/**
+ * @brief Open a SEQ file and read its header.
+ * @param path Path of the file.
+ * @returns Whether the file could be opened and has a valid header.
+ */
+bool SEQReader::open( const QString& path )
+{
+    close();
+    file.setFileName( path );
+    if ( !file.open( QIODevice::ReadOnly ) )
+        return false;
+
+    char header[ SEQ_HEADER_SIZE ];
+    if ( file.read( header, SEQ_HEADER_SIZE ) != SEQ_HEADER_SIZE )
+    {
+        close();
+        return false;
+    }
+
+    int32_t info[ 7 ];
+    memcpy( info, header + IMAGE_INFO_OFFSET, sizeof( info ) );
+    width = info[ 0 ];
+    height = info[ 1 ];
+    bitsPerPixel = info[ 2 ];
+    imageFormat = info[ 5 ];
+    frameCount = info[ 6 ];
+    memcpy( &frameRate, header + FRAME_RATE_OFFSET, sizeof( double ) );
+
+    // The description is UTF-16; Hunter only writes ASCII into it
+    description.clear();
+    for ( int i = 0; i < DESCRIPTION_SIZE; i += 2 )
+    {
+        uint16_t ch;
+        memcpy( &ch, header + DESCRIPTION_OFFSET + i, sizeof( uint16_t ) );
+        if ( !ch )
+            break;
+        description += ch < 128 ? (char)ch : '?';
+    }
+
+    if ( width <= 0 || height <= 0 || ( bitsPerPixel != 8 && bitsPerPixel != 16 && bitsPerPixel != 24 ) )
+    {
+        close();
+        return false;
+    }
+
+    if ( isResidual() )
+    {
+        residualDecoder.start( width, height );
+        readResidualIndex();
+    }
+
+    if ( isCompressed() && !decompressor )
+        decompressor = tjInitDecompress();
+    return true;
+}
+
+/**
+ * @brief Close the file.
+ * @arg None.
+ * @returns void.
+ */
+void SEQReader::close()
+{
+    if ( file.isOpen() )
+        file.close();
+    nextFrame = 0;
+    index.clear();
+    keyframes.clear();
+}
+
+/**
+ * @brief Load the index SEQWriter appends to residual files.
+ * @arg None.
+ * @returns void.
+ *
+ * Files whose recording was cut short have no index; they can still be read
+ * from the start, and seek() then walks the size fields as for JPEG files.
+ */
+void SEQReader::readResidualIndex()
+{
+    char footer[ ResidualEncoder::INDEX_FOOTER_SIZE ];
+    uint64_t indexOffset;
+    uint32_t count, magic;
+    if ( file.size() < SEQ_HEADER_SIZE + ResidualEncoder::INDEX_FOOTER_SIZE ||
+         !file.seek( file.size() - ResidualEncoder::INDEX_FOOTER_SIZE ) ||
+         file.read( footer, ResidualEncoder::INDEX_FOOTER_SIZE ) != ResidualEncoder::INDEX_FOOTER_SIZE )
+    {
+        file.seek( SEQ_HEADER_SIZE );
+        return;
+    }
+    memcpy( &indexOffset, footer, sizeof( uint64_t ) );
+    memcpy( &count, footer + sizeof( uint64_t ), sizeof( uint32_t ) );
+    memcpy( &magic, footer + sizeof( uint64_t ) + sizeof( uint32_t ), sizeof( uint32_t ) );
+
+    std::vector<uint64_t> entries( count );
+    qint64 indexSize = (qint64)count * sizeof( uint64_t );
+    if ( magic == ResidualEncoder::INDEX_MAGIC && (int)count == frameCount &&
+         indexOffset + indexSize + ResidualEncoder::INDEX_FOOTER_SIZE == (uint64_t)file.size() &&
+         file.seek( indexOffset ) && file.read( (char*)entries.data(), indexSize ) == indexSize )
+    {
+        for ( auto entry : entries )
+        {
+            index.push_back( (qint64)( entry & ~ResidualEncoder::KEYFRAME_FLAG ) );
+            keyframes.push_back( ( entry & ResidualEncoder::KEYFRAME_FLAG ) != 0 );
+        }
+    }
+    file.seek( SEQ_HEADER_SIZE );
+}
+
+/**
+ * @brief Read the timestamp trailing a frame.
+ * @param secs Out: seconds.
+ * @param ms Out: milliseconds.
+ * @returns Whether the timestamp could be read.
+ */
+bool SEQReader::readTimestamp( int& secs, short& ms )
+{
+    char timestamp[ TIMESTAMP_SIZE ];
+    if ( file.read( timestamp, TIMESTAMP_SIZE ) != TIMESTAMP_SIZE )
+        return false;
+    memcpy( &secs, timestamp, sizeof( int32_t ) );
+    memcpy( &ms, timestamp + sizeof( int32_t ), sizeof( int16_t ) );
+    return true;
+}
+
+/**
+ * @brief Read the next frame as stored.
+ * @param data Out: the JPEG data, or the raw pixels without row padding.
+ * @param secs Out: timestamp, seconds portion.
+ * @param ms Out: timestamp, milliseconds portion.
+ * @returns Whether a frame was read; false at the end of the file.
+ */
+bool SEQReader::readRecord( std::vector<unsigned char>& data, int& secs, short& ms )
+{
+    if ( !file.isOpen() || nextFrame >= frameCount )
+        return false;
+    if ( nextFrame == (int)index.size() )
+        index.push_back( file.pos() );
+
+    // Same layout as SEQWriter::writeFrame(): the size field only precedes JPEG frames
+    int32_t size = width * height * bitsPerPixel / 8;
+#ifdef COMPATIBILITY_MODE
+    bool sizeField = true;
+#else
+    bool sizeField = isCompressed();
+#endif
+    if ( sizeField )
+    {
+        int32_t stored_size;
+        if ( file.read( (char*)&stored_size, sizeof( int32_t ) ) != sizeof( int32_t ) )
+            return false;
+#ifdef COMPATIBILITY_MODE
+        stored_size -= 4;
+#endif
+        if ( isCompressed() )
+            size = stored_size;
+    }
+    if ( size <= 0 )
+        return false;
+
+    data.resize( size );
+    if ( file.read( (char*)data.data(), size ) != size || !readTimestamp( secs, ms ) )
+        return false;
+
+    nextFrame++;
+    return true;
+}
+
+/**
+ * @brief Read and decode the next frame.
+ * @param image Out: the frame, in getPixelFormat().
+ * @param secs Out: timestamp, seconds portion.
+ * @param ms Out: timestamp, milliseconds portion.
+ * @returns Whether a frame was read; false at the end of the file or if it can't be decoded.
+ */
+bool SEQReader::readFrame( QImage& image, int& secs, short& ms )
+{
+    if ( isResidual() )
+        return readRecord( record, secs, ms ) && residualDecoder.decode( record.data(), record.size(), image );
+    return readRecord( record, secs, ms ) && decode( record, image, decompressor );
+}
+
+/**
+ * @brief Decode a record returned by readRecord().
+ * @param data The record.
+ * @param image Out: the frame, in getPixelFormat().
+ * @param decompressor TurboJPEG decompressor to use for JPEG files.
+ * @returns Whether the record could be decoded.
+ *
+ * Only reads the header fields, so records may be decoded on other threads,
+ * each with its own decompressor, while the file is being read. Residual frames
+ * depend on the frames before them, and can only be decoded by readFrame().
+ */
+bool SEQReader::decode( const std::vector<unsigned char>& data, QImage& image, tjhandle decompressor ) const
+{
+    if ( isResidual() )
+        return false;
+
+    image = QImage( width, height, getPixelFormat() );
+    if ( isCompressed() )
+    {
+        int jpegWidth, jpegHeight, subsampling;
+        unsigned char* jpeg = const_cast<unsigned char*>( data.data() ); // TurboJPEG 1.4 takes non-const buffers
+        if ( tjDecompressHeader2( decompressor, jpeg, (unsigned long)data.size(), &jpegWidth, &jpegHeight, &subsampling ) != 0 ||
+             jpegWidth != width || jpegHeight != height )
+            return false;
+        return tjDecompress2( decompressor, jpeg, (unsigned long)data.size(), image.bits(), width, image.bytesPerLine(), height,
+                              imageFormat == SEQ_JPEG_GRAYSCALE ? TJPF_GRAY : TJPF_RGB, 0 ) == 0;
+    }
+
+    // QImage scanlines are padded to 32 bits
+    int lineSize = width * bitsPerPixel / 8;
+    if ( (int)data.size() < lineSize * height )
+        return false;
+    for ( int y = 0; y < height; y++ )
+        memcpy( image.scanLine( y ), data.data() + y * lineSize, lineSize );
+    return true;
+}
+
+/**
+ * @brief Position the reader so the next frame read is a given one.
+ * @param frame Index of the frame.
+ * @returns Whether the frame exists.
+ *
+ * Raw frames are found directly. JPEG frames are found by walking the size
+ * fields from the last frame seen, so later seeks are fast. Residual frames
+ * are decoded from the keyframe before them, so readFrame() can pick up there.
+ */
+bool SEQReader::seek( int frame )
+{
+    if ( !file.isOpen() || frame < 0 || frame >= frameCount )
+        return false;
+
+    if ( isResidual() )
+    {
+        // Without an index, keyframes aren't known; decode from the start
+        int keyframe = frame;
+        while ( keyframe > 0 && ( keyframe >= (int)keyframes.size() || !keyframes[ keyframe ] ) )
+            keyframe--;
+        if ( !seekRecord( keyframe ) )
+            return false;
+        residualDecoder.start( width, height );
+        QImage skipped;
+        int secs;
+        short ms;
+        while ( nextFrame < frame )
+        {
+            if ( !readFrame( skipped, secs, ms ) )
+                return false;
+        }
+        return true;
+    }
+    return seekRecord( frame );
+}
+
+/**
+ * @brief Position the reader at a frame record, without decoding anything.
+ * @param frame Index of the frame.
+ * @returns Whether the frame exists.
+ */
+bool SEQReader::seekRecord( int frame )
+{
+    if ( !isCompressed() )
+    {
+#ifdef COMPATIBILITY_MODE
+        qint64 recordSize = sizeof( int32_t ) + (qint64)width * height * bitsPerPixel / 8 + TIMESTAMP_SIZE;
+#else
+        qint64 recordSize = (qint64)width * height * bitsPerPixel / 8 + TIMESTAMP_SIZE;
+#endif
+        nextFrame = frame;
+        return file.seek( SEQ_HEADER_SIZE + frame * recordSize );
+    }
+
+    if ( frame < (int)index.size() )
+    {
+        nextFrame = frame;
+        return file.seek( index[ frame ] );
+    }
+
+    // Skip ahead from the furthest frame known
+    if ( !index.empty() )
+    {
+        nextFrame = (int)index.size() - 1;
+        file.seek( index.back() );
+    }
+    else
+    {
+        nextFrame = 0;
+        file.seek( SEQ_HEADER_SIZE );
+    }
+    while ( nextFrame < frame )
+    {
+        if ( nextFrame == (int)index.size() )
+            index.push_back( file.pos() );
+        int32_t size;
+        if ( file.read( (char*)&size, sizeof( int32_t ) ) != sizeof( int32_t ) )
+            return false;
+#ifdef COMPATIBILITY_MODE
+        size -= 4;
+#endif
+        if ( !file.seek( file.pos() + size + TIMESTAMP_SIZE ) )
+            return false;
+        nextFrame++;
+    }
+    if ( nextFrame == (int)index.size() )
+        index.push_back( file.pos() );
+    return true;
+}
+
+/**
+ * @brief Accessor for the frame width.
+ * @arg None.
+ * @returns Width in pixels.
+ */
+int SEQReader::getWidth()
+{
+    return width;
+}
+
+/**
+ * @brief Accessor for the frame height.
+ * @arg None.
+ * @returns Height in pixels.
+ */
+int SEQReader::getHeight()
+{
+    return height;
+}
+
+/**
+ * @brief Accessor for the bit depth of the raw frames.
+ * @arg None.
+ * @returns Bits per pixel.
+ */
+int SEQReader::getBitsPerPixel()
+{
+    return bitsPerPixel;
+}
+
+/**
+ * @brief Accessor for the Norpix image format.
+ * @arg None.
+ * @returns e.g. 100 for raw grayscale, 201 for JPEG color.
+ */
+int SEQReader::getImageFormat()
+{
+    return imageFormat;
+}
+
+/**
+ * @brief Accessor for the number of frames.
+ * @arg None.
+ * @returns Frames in the file, according to the header.
+ */
+int SEQReader::getFrameCount()
+{
+    return frameCount;
+}
+
+/**
+ * @brief Accessor for the frame rate.
+ * @arg None.
+ * @returns Frames per second, according to the header.
+ */
+double SEQReader::getFrameRate()
+{
+    return frameRate;
+}
+
+/**
+ * @brief Accessor for the header description.
+ * @arg None.
+ * @returns The description, e.g. how the frames were encoded.
+ */
+std::string SEQReader::getDescription()
+{
+    return description;
+}
+
+/**
+ * @brief Whether the frames are JPEG compressed.
+ * @arg None.
+ * @returns True for JPEG and residual files, whose records have a size field.
+ */
+bool SEQReader::isCompressed() const
+{
+    return imageFormat == SEQ_JPEG_COLOR || imageFormat == SEQ_JPEG_GRAYSCALE || isResidual();
+}
+
+/**
+ * @brief Whether the frames are residual coded.
+ * @arg None.
+ * @returns True for files written with the residual codec; their records can't be decoded one by one.
+ */
+bool SEQReader::isResidual() const
+{
+    return imageFormat == SEQ_RESIDUAL_GRAYSCALE;
+}
+
+/**
+ * @brief Format of the frames returned by readFrame().
+ * @arg None.
+ * @returns Grayscale8 or RGB888 for JPEG files; for raw files, whatever matches the bit depth.
+ *
+ * For raw files this is the format the recorder passed to SEQWriter::writeFrame(),
+ * so writing the frames again reproduces the recorder's output.
+ */
+QImage::Format SEQReader::getPixelFormat() const
+{
+    if ( isCompressed() )
+        return imageFormat == SEQ_JPEG_COLOR ? QImage::Format_RGB888 : QImage::Format_Grayscale8;
+    switch ( bitsPerPixel )
+    {
+    case 16:
+        return QImage::Format_RGB16;
+    case 24:
+        return QImage::Format_RGB888;
+    default:
+        return QImage::Format_Grayscale8;
+    }
+}
+
+/**
+ * @brief Accessor for the file being read.
+ * @arg None.
+ * @returns Path of the file.
+ */
+QString SEQReader::getFileName()
+{
+    return file.fileName();
+}
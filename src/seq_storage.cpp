@@ -0,0 +1,629 @@
+/**
+ * @file seq_storage.cpp
+ * @brief Storage backends for the SEQ writer
+ */
+
+// Project includes
+#include "seq_storage.h"
+
+// Libraries
+#include <QTCore/QtDebug>
+
+// C++
+#include <algorithm>
+#include <io.h>
+
+using namespace std;
+
+//// Constants
+const std::string SEQStorage::backendNames[] = { "qfile", "direct", "overlapped" };
+
+/**
+ * @brief Create a storage backend.
+ * @param backend The kind of backend.
+ * @param queueDepth Maximum number of writes in flight (asynchronous backends only).
+ * @returns The new backend. Ownership passes to the caller.
+ */
+SEQStorage* SEQStorage::create( Backend backend, int queueDepth )
+{
+    switch ( backend )
+    {
+    case DirectBackend:
+        return new DirectStorage();
+    case OverlappedBackend:
+        return new OverlappedStorage( queueDepth );
+    case QFileBackend:
+    default: // Intentional fall-through
+        return new QFileStorage();
+    }
+}
+
+/**
+ * @brief Look up a backend by its configuration name.
+ * @param name One of backendNames.
+ * @returns The backend, or QFileBackend if the name is unknown.
+ */
+SEQStorage::Backend SEQStorage::backendFromName( const std::string& name )
+{
+    for ( int i = 0; i < NUM_BACKENDS; i++ )
+    {
+        if ( backendNames[ i ] == name )
+            return (Backend)i;
+    }
+    return QFileBackend;
+}
+
+/**
+ * @brief SEQStorage constructor
+ * @param type The kind of backend.
+ * @param writeAlignment Required alignment of write sizes and offsets.
+ */
+SEQStorage::SEQStorage( Backend type, size_t writeAlignment )
+    : offset( 0 ), allocated( 0 ), endOfFile( 0 ), endOfFileFailed( false ), allocationChunk( 0 ), bufferNode( -1 ), failedWrites( 0 ), type( type ), writeAlignment( writeAlignment )
+{
+}
+
+/**
+ * @brief Take an empty staging buffer, waiting for an in-flight write to complete if necessary.
+ * @arg None.
+ * @returns A buffer of the size passed to open().
+ */
+unsigned char* SEQStorage::acquire()
+{
+    return pool.acquire();
+}
+
+/**
+ * @brief Give back a buffer that will not be submitted.
+ * @param buffer The buffer.
+ * @returns void.
+ */
+void SEQStorage::recycle( unsigned char* buffer )
+{
+    pool.recycle( buffer );
+}
+
+/**
+ * @brief Required alignment of submitted sizes.
+ * @arg None.
+ * @returns Alignment in bytes; 1 if any size is allowed.
+ */
+size_t SEQStorage::alignment()
+{
+    return writeAlignment;
+}
+
+/**
+ * @brief Accessor for the backend type.
+ * @arg None.
+ * @returns The backend type.
+ */
+SEQStorage::Backend SEQStorage::backend()
+{
+    return type;
+}
+
+/**
+ * @brief Number of writes that failed.
+ * @arg None.
+ * @returns Failed writes to the open (or last) file; asynchronous ones are counted as they complete.
+ */
+int SEQStorage::getFailedWrites()
+{
+    return failedWrites;
+}
+
+/**
+ * @brief Set how much disk space to reserve ahead of the write pointer.
+ * @param chunk Size of each reservation in bytes; 0 disables preallocation.
+ * @returns void.
+ * @note Takes effect on the next call to open().
+ */
+void SEQStorage::setAllocationChunk( qint64 chunk )
+{
+    allocationChunk = chunk;
+}
+
+/**
+ * @brief Set the NUMA node whose memory the staging buffers come from.
+ * @param node The node; -1 for any.
+ * @returns void.
+ * @note Takes effect on the next call to open().
+ */
+void SEQStorage::setNode( int node )
+{
+    bufferNode = node;
+}
+
+/**
+ * @brief Choose how the memory of the staging buffers is obtained.
+ * @param settings Whether to use large pages, and whether to lock ordinary pages.
+ * @returns void.
+ * @note Takes effect on the next call to open().
+ */
+void SEQStorage::setMemory( const BufferMemorySettings& settings )
+{
+    pool.setMemory( settings );
+}
+
+/**
+ * @brief Make sure disk space is reserved up to a given offset, reserving a whole chunk ahead if not.
+ * @param file Handle of the open file.
+ * @param end Offset the next write will reach.
+ * @returns void.
+ *
+ * The space is reserved without moving the end of file, so the file system can lay
+ * out the recording in a few large extents instead of growing every file a buffer at
+ * a time while four of them compete for the same volume.
+ */
+void SEQStorage::extendAllocation( HANDLE file, qint64 end )
+{
+    if ( !allocationChunk || end <= allocated )
+        return;
+
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = end + allocationChunk;
+    if ( SetFileInformationByHandle( file, FileAllocationInfo, &info, sizeof( info ) ) )
+    {
+        allocated = info.AllocationSize.QuadPart;
+    }
+    else
+    {
+#ifdef DEBUG
+        qDebug() << "Could not preallocate" << path << "error" << GetLastError() << endl;
+#endif
+        // Don't retry on every write; the file just grows as it would without preallocation
+        allocated = end + allocationChunk;
+    }
+}
+
+/**
+ * @brief Whether the process may set the valid data length of files, enabling the privilege the first time.
+ * @arg None.
+ * @returns True if the account has the "Perform volume maintenance tasks" right.
+ *
+ * Windows runs a write that extends the valid data length of a file synchronously,
+ * even when it is issued as an overlapped write. Without this right every append does,
+ * and the overlapped backend degrades to one write in flight.
+ */
+bool SEQStorage::maySetValidData()
+{
+    static bool allowed = []() {
+        HANDLE token;
+        if ( !OpenProcessToken( GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token ) )
+            return false;
+
+        TOKEN_PRIVILEGES privileges;
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[ 0 ].Attributes = SE_PRIVILEGE_ENABLED;
+        bool granted = LookupPrivilegeValueW( NULL, SE_MANAGE_VOLUME_NAME, &privileges.Privileges[ 0 ].Luid ) &&
+                       AdjustTokenPrivileges( token, FALSE, &privileges, 0, NULL, NULL ) &&
+                       GetLastError() != ERROR_NOT_ALL_ASSIGNED;
+        CloseHandle( token );
+        return granted;
+    }();
+    return allowed;
+}
+
+/**
+ * @brief Make sure the end of file and valid data length lie beyond a given offset, moving both a whole chunk ahead if not.
+ * @param file Handle of the open file.
+ * @param end Offset the next write will reach.
+ * @returns void.
+ *
+ * Used by the unbuffered backends, so their writes land inside the valid data and
+ * can complete asynchronously. The sectors between the data and the valid data length
+ * are not zeroed, so finish() trims the file to the data before anyone can read it.
+ * Without the privilege (see maySetValidData()) this only reserves disk space.
+ */
+void SEQStorage::extendEndOfFile( HANDLE file, qint64 end )
+{
+    if ( endOfFileFailed || !maySetValidData() )
+    {
+        extendAllocation( file, end );
+        return;
+    }
+    if ( end <= endOfFile )
+        return;
+
+    FILE_END_OF_FILE_INFO info;
+    info.EndOfFile.QuadPart = end + ( allocationChunk ? allocationChunk : (qint64)END_OF_FILE_CHUNK );
+    if ( SetFileInformationByHandle( file, FileEndOfFileInfo, &info, sizeof( info ) ) &&
+         SetFileValidData( file, info.EndOfFile.QuadPart ) )
+    {
+        endOfFile = info.EndOfFile.QuadPart;
+    }
+    else
+    {
+#ifdef DEBUG
+        qDebug() << "Could not extend" << path << "ahead of the writes, error" << GetLastError() << endl;
+#endif
+        // E.g. not NTFS; the writes still land, just synchronously
+        endOfFileFailed = true;
+        endOfFile = (std::max)( endOfFile, info.EndOfFile.QuadPart );
+        extendAllocation( file, end );
+    }
+}
+
+/**
+ * @brief Move the end of file back to the data actually written.
+ * @param file Handle of the open file.
+ * @param end Size of the data written.
+ * @returns void.
+ */
+void SEQStorage::trimEndOfFile( HANDLE file, qint64 end )
+{
+    if ( endOfFile > end )
+    {
+        FILE_END_OF_FILE_INFO info;
+        info.EndOfFile.QuadPart = end;
+        SetFileInformationByHandle( file, FileEndOfFileInfo, &info, sizeof( info ) );
+    }
+    endOfFile = 0;
+    endOfFileFailed = false;
+    trimAllocation( file, end );
+}
+
+/**
+ * @brief Give back the space reserved beyond the data actually written.
+ * @param file Handle of the open file.
+ * @param end Size of the data written.
+ * @returns void.
+ */
+void SEQStorage::trimAllocation( HANDLE file, qint64 end )
+{
+    if ( allocated <= end )
+        return;
+
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = end;
+    SetFileInformationByHandle( file, FileAllocationInfo, &info, sizeof( info ) );
+    allocated = 0;
+}
+
+/**
+ * @brief (Re)allocate the staging buffers, and lock them (if so configured) until finish().
+ * @param bufferSize Size of each buffer in bytes.
+ * @param count Number of buffers.
+ * @returns void.
+ */
+void SEQStorage::allocateBuffers( size_t bufferSize, int count )
+{
+    bufferSize = ( bufferSize + SECTOR_ALIGNMENT - 1 ) / SECTOR_ALIGNMENT * SECTOR_ALIGNMENT;
+    pool.allocate( bufferSize, count, SECTOR_ALIGNMENT, bufferNode );
+    pool.lock();
+}
+
+/**
+ * @brief Trim a file written with unbuffered I/O and fill in its header.
+ * @param path The file.
+ * @param logicalSize The size the file should have.
+ * @param header Header bytes, written at offset 0.
+ * @param headerSize Size of the header.
+ * @returns Whether the file could be trimmed and the header written.
+ *
+ * Unbuffered writes are padded to a whole sector and cannot rewrite less than a
+ * sector, so both are done through a regular buffered handle once the data is down.
+ */
+bool SEQStorage::writeHeaderBuffered( const QString& path, qint64 logicalSize, const char* header, int headerSize )
+{
+    QFile file( path );
+    if ( !file.open( QIODevice::ReadWrite ) )
+    {
+#ifdef DEBUG
+        qDebug() << "Could not reopen" << path << "to write its header." << endl;
+#endif
+        return false;
+    }
+    bool ok = file.resize( logicalSize ) && file.seek( 0 ) && file.write( header, headerSize ) == headerSize;
+    file.close();
+    return ok;
+}
+
+/**
+ * @brief QFileStorage constructor
+ * @arg None
+ */
+QFileStorage::QFileStorage( void )
+    : SEQStorage( QFileBackend, 1 )
+{
+}
+
+/**
+ * @brief Open a file for writing.
+ * @param path The file.
+ * @param bufferSize Size of the staging buffers.
+ * @returns Whether the file could be opened.
+ */
+bool QFileStorage::open( const QString& path, size_t bufferSize )
+{
+    // One buffer being filled, one to carry a tail into
+    allocateBuffers( bufferSize, 2 );
+    this->path = path;
+    offset = 0;
+    allocated = 0;
+    failedWrites = 0;
+    file.setFileName( path );
+    return file.open( QIODevice::WriteOnly | QIODevice::Unbuffered ); // The staging buffers replace Qt's
+}
+
+/**
+ * @brief Append a staging buffer to the file.
+ * @param buffer The buffer; it is back in the pool when this returns.
+ * @param size Number of bytes to write.
+ * @returns void.
+ */
+void QFileStorage::submit( unsigned char* buffer, size_t size )
+{
+    extendAllocation( osHandle(), offset + size );
+    if ( file.write( (const char*)buffer, size ) != (qint64)size )
+    {
+#ifdef DEBUG
+        qDebug() << "Write failed on" << path << file.errorString() << endl;
+#endif
+        failedWrites++;
+    }
+    offset += size;
+    recycle( buffer );
+}
+
+/**
+ * @brief Write the header and close the file.
+ * @param logicalSize Size of the file (unused: buffered writes are never padded).
+ * @param header Header bytes, written at offset 0.
+ * @param headerSize Size of the header.
+ * @returns void.
+ */
+void QFileStorage::finish( qint64 logicalSize, const char* header, int headerSize )
+{
+    trimAllocation( osHandle(), offset );
+    if ( !file.seek( 0 ) || file.write( header, headerSize ) != headerSize )
+        failedWrites++;
+    file.close();
+    pool.unlock();
+}
+
+/**
+ * @brief Win32 handle of the open file.
+ * @arg None.
+ * @returns The handle underlying the QFile.
+ */
+HANDLE QFileStorage::osHandle()
+{
+    return (HANDLE)_get_osfhandle( file.handle() );
+}
+
+/**
+ * @brief DirectStorage constructor
+ * @arg None
+ */
+DirectStorage::DirectStorage( void )
+    : SEQStorage( DirectBackend, SECTOR_ALIGNMENT ), handle( INVALID_HANDLE_VALUE )
+{
+}
+
+/**
+ * @brief Open a file for unbuffered writing.
+ * @param path The file.
+ * @param bufferSize Size of the staging buffers.
+ * @returns Whether the file could be opened.
+ */
+bool DirectStorage::open( const QString& path, size_t bufferSize )
+{
+    allocateBuffers( bufferSize, 2 );
+    this->path = path;
+    offset = 0;
+    allocated = 0;
+    endOfFile = 0;
+    endOfFileFailed = false;
+    failedWrites = 0;
+
+    // Unbuffered writes must be sector-aligned in offset, size and memory, which the staging buffers guarantee
+    handle = CreateFileW( path.toStdWString().c_str(),
+                          GENERIC_WRITE,
+                          0,
+                          NULL,
+                          CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN,
+                          NULL );
+    return handle != INVALID_HANDLE_VALUE;
+}
+
+/**
+ * @brief Append a staging buffer to the file.
+ * @param buffer The buffer; it is back in the pool when this returns.
+ * @param size Number of bytes to write; a multiple of SECTOR_ALIGNMENT.
+ * @returns void.
+ */
+void DirectStorage::submit( unsigned char* buffer, size_t size )
+{
+    DWORD written = 0;
+    extendEndOfFile( handle, offset + size );
+    if ( !WriteFile( handle, buffer, (DWORD)size, &written, NULL ) || written != size )
+    {
+#ifdef DEBUG
+        qDebug() << "Direct write failed on" << path << "error" << GetLastError() << endl;
+#endif
+        failedWrites++;
+    }
+    offset += size;
+    recycle( buffer );
+}
+
+/**
+ * @brief Trim the file, write the header and close the file.
+ * @param logicalSize Size of the file without the padding of the last write.
+ * @param header Header bytes, written at offset 0.
+ * @param headerSize Size of the header.
+ * @returns void.
+ */
+void DirectStorage::finish( qint64 logicalSize, const char* header, int headerSize )
+{
+    trimEndOfFile( handle, offset );
+    CloseHandle( handle );
+    handle = INVALID_HANDLE_VALUE;
+    if ( !writeHeaderBuffered( path, logicalSize, header, headerSize ) )
+        failedWrites++;
+    pool.unlock();
+}
+
+/**
+ * @brief OverlappedStorage constructor
+ * @param queueDepth Maximum number of writes in flight.
+ */
+OverlappedStorage::OverlappedStorage( int queueDepth )
+    : SEQStorage( OverlappedBackend, SECTOR_ALIGNMENT ),
+      handle( INVALID_HANDLE_VALUE ),
+      completionPort( NULL ),
+      queueDepth( (std::max)( queueDepth, 1 ) ),
+      inFlight( 0 )
+{
+    requests.resize( this->queueDepth + 1 );
+}
+
+/**
+ * @brief Open a file for asynchronous unbuffered writing.
+ * @param path The file.
+ * @param bufferSize Size of the staging buffers.
+ * @returns Whether the file could be opened.
+ */
+bool OverlappedStorage::open( const QString& path, size_t bufferSize )
+{
+    // queueDepth buffers in flight, plus the one being filled
+    allocateBuffers( bufferSize, queueDepth + 1 );
+    this->path = path;
+    offset = 0;
+    allocated = 0;
+    endOfFile = 0;
+    endOfFileFailed = false;
+    failedWrites = 0;
+    inFlight = 0;
+    freeRequests.clear();
+    for ( auto& request : requests )
+        freeRequests.push_back( &request );
+
+    handle = CreateFileW( path.toStdWString().c_str(),
+                          GENERIC_WRITE,
+                          0,
+                          NULL,
+                          CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED,
+                          NULL );
+    if ( handle == INVALID_HANDLE_VALUE )
+        return false;
+
+    completionPort = CreateIoCompletionPort( handle, NULL, COMPLETION_KEY_WRITE, 1 );
+    if ( completionPort == NULL )
+    {
+        CloseHandle( handle );
+        handle = INVALID_HANDLE_VALUE;
+        return false;
+    }
+    completionThread = std::thread( &OverlappedStorage::completionLoop, this );
+    return true;
+}
+
+/**
+ * @brief Queue a staging buffer to be appended to the file.
+ * @param buffer The buffer; it returns to the pool when the write completes.
+ * @param size Number of bytes to write; a multiple of SECTOR_ALIGNMENT.
+ * @returns void.
+ */
+void OverlappedStorage::submit( unsigned char* buffer, size_t size )
+{
+    // There are as many requests as buffers, so one is always free
+    Request* request;
+    {
+        lock_guard<std::mutex> lock( mutex );
+        request = freeRequests.back();
+        freeRequests.pop_back();
+        inFlight++;
+    }
+    ZeroMemory( &request->overlapped, sizeof( OVERLAPPED ) );
+    request->overlapped.Offset = (DWORD)( offset & 0xFFFFFFFF );
+    request->overlapped.OffsetHigh = (DWORD)( offset >> 32 );
+    request->buffer = buffer;
+    extendEndOfFile( handle, offset + size );
+    offset += size;
+
+    if ( !WriteFile( handle, buffer, (DWORD)size, NULL, &request->overlapped ) && GetLastError() != ERROR_IO_PENDING )
+    {
+        // No completion packet will be queued for this one
+#ifdef DEBUG
+        qDebug() << "Overlapped write failed on" << path << "error" << GetLastError() << endl;
+#endif
+        failedWrites++;
+        recycle( buffer );
+        {
+            lock_guard<std::mutex> lock( mutex );
+            freeRequests.push_back( request );
+            inFlight--;
+        }
+        drained.notify_all();
+    }
+}
+
+/**
+ * @brief Wait for completed writes and recycle their buffers.
+ * @arg None.
+ * @returns void.
+ */
+void OverlappedStorage::completionLoop()
+{
+    while ( true )
+    {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        LPOVERLAPPED overlapped = NULL;
+        BOOL ok = GetQueuedCompletionStatus( completionPort, &bytes, &key, &overlapped, INFINITE );
+
+        if ( key == COMPLETION_KEY_QUIT )
+            return;
+        if ( overlapped == NULL ) // The port itself failed
+            return;
+
+        Request* request = (Request*)overlapped;
+        if ( !ok )
+        {
+#ifdef DEBUG
+            qDebug() << "Overlapped write failed on" << path << "error" << GetLastError() << endl;
+#endif
+            failedWrites++;
+        }
+        recycle( request->buffer );
+
+        {
+            lock_guard<std::mutex> lock( mutex );
+            freeRequests.push_back( request );
+            inFlight--;
+        }
+        drained.notify_all();
+    }
+}
+
+/**
+ * @brief Wait for all writes, trim the file, write the header and close the file.
+ * @param logicalSize Size of the file without the padding of the last write.
+ * @param header Header bytes, written at offset 0.
+ * @param headerSize Size of the header.
+ * @returns void.
+ */
+void OverlappedStorage::finish( qint64 logicalSize, const char* header, int headerSize )
+{
+    {
+        unique_lock<std::mutex> lock( mutex );
+        drained.wait( lock, [this] { return inFlight == 0; } );
+    }
+
+    PostQueuedCompletionStatus( completionPort, 0, COMPLETION_KEY_QUIT, NULL );
+    completionThread.join();
+    CloseHandle( completionPort );
+    completionPort = NULL;
+    trimEndOfFile( handle, offset );
+    CloseHandle( handle );
+    handle = INVALID_HANDLE_VALUE;
+
+    if ( !writeHeaderBuffered( path, logicalSize, header, headerSize ) )
+        failedWrites++;
+    pool.unlock();
+}
@@ -11,10 +11,15 @@
 // Libraries
 #include <QTGui/QImage.h>
 #include <QTCore/QBuffer.h>
+#include <QTCore/QDir>
 
 
 // C++
 #include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
 
 using namespace std;
 
@@ -23,6 +28,8 @@ const std::string SEQWriter::fileNameHead = "Mouse_";
 const std::string SEQWriter::fileNameFoot = ".seq";
 const std::string SEQWriter::fileNameCompressed = "J85";
 const std::string SEQWriter::fileNameRaw = "Raw";
+const std::string SEQWriter::fileNameResidual = "Res";
+const std::string SEQWriter::fileNameResidualFoot = ".rseq";
 const std::string SEQWriter::compressionExt = "jpg";
 
 // Set the proper number of bits per pixel. If compatiblity mode, use 8-bit depth and IR
@@ -34,14 +41,29 @@ const int SEQWriter::bitsPerPixel[] = { 8, 8, 24, 16, 16 };
 
 const std::string SEQWriter::fileNameChannels[] = { "Top", "Front", "Color", "DepGr", "IR" };
 const unsigned short SEQWriter::norpixString[] = { 'N', 'o', 'r', 'p', 'i', 'x', ' ', 's', 'e', 'q' };
-const char SEQWriter::norpixDesc[] = "";
 
 /**
  * @brief SEQWriter constructor
  * @arg None
  */
 SEQWriter::SEQWriter( Streamer::Channels channel )
-    : streamChannel( channel )
+    : streamChannel( channel ),
+      storage( NULL ),
+      storageBackend( SEQStorage::QFileBackend ),
+      queueDepth( SEQStorage::DEFAULT_QUEUE_DEPTH ),
+      bufferNode( -1 ),
+      staging( NULL ),
+      stagingCapacity( 0 ),
+      stagingUsed( 0 ),
+      maxRecordSize( 0 ),
+      fileSize( 0 ),
+      totalFrames( 0 ),
+      failedWrites( 0 ),
+      frameRate( 30.0 ),
+      qualityReduction( 0 ),
+      minQualityUsed( 0 ),
+      maxQualityUsed( 0 ),
+      residual( false )
 {
 }
 
@@ -51,7 +73,213 @@ SEQWriter::SEQWriter( Streamer::Channels channel )
  */
 SEQWriter::~SEQWriter( void )
 {
-	
+	delete storage;
+}
+
+/**
+ * @brief Select the storage backend for subsequent recordings.
+ * @param backend The backend.
+ * @param queueDepth Maximum number of writes in flight (asynchronous backends only).
+ * @returns void.
+ * @note Takes effect on the next call to startRecording().
+ */
+void SEQWriter::setStorageBackend( SEQStorage::Backend backend, int queueDepth )
+{
+	if ( backend != storageBackend || queueDepth != this->queueDepth )
+	{
+		delete storage;
+		storage = NULL;
+	}
+	storageBackend = backend;
+	this->queueDepth = queueDepth;
+}
+
+/**
+ * @brief Accessor for the storage backend.
+ * @arg None.
+ * @returns The backend used for recordings.
+ */
+SEQStorage::Backend SEQWriter::getStorageBackend()
+{
+	return storageBackend;
+}
+
+/**
+ * @brief Accessor for the queue depth of asynchronous backends.
+ * @arg None.
+ * @returns Maximum number of writes in flight.
+ */
+int SEQWriter::getQueueDepth()
+{
+	return queueDepth;
+}
+
+/**
+ * @brief Accessor for the file being recorded.
+ * @arg None.
+ * @returns Path of the current (or last) SEQ file.
+ */
+QString SEQWriter::getFileName()
+{
+	return filePath;
+}
+
+/**
+ * @brief Select how compressed frames are encoded.
+ * @param profile The encoder profile. Its quality is used unless rate control is on.
+ * @returns void.
+ * @note Takes effect on the next call to startRecording().
+ */
+void SEQWriter::setEncoderProfile( const EncoderProfile& profile )
+{
+	encoder.setProfile( profile );
+}
+
+/**
+ * @brief Accessor for the encoder profile.
+ * @arg None.
+ * @returns The profile used for compressed frames.
+ */
+EncoderProfile SEQWriter::getEncoderProfile()
+{
+	return encoder.getProfile();
+}
+
+/**
+ * @brief Select the residual codec for a grayscale channel.
+ * @param settings Whether it is used, its threshold and keyframe interval.
+ * @note Takes effect on the next call to startRecording(). Ignored for color and 16-bit channels.
+ */
+void SEQWriter::setResidualCodec( const ResidualSettings& settings )
+{
+	residualSettings = settings;
+}
+
+/**
+ * @brief Accessor for the residual codec settings.
+ * @arg None.
+ * @returns The settings.
+ */
+ResidualSettings SEQWriter::getResidualCodec()
+{
+	return residualSettings;
+}
+
+/**
+ * @brief Whether a recording would use the residual codec.
+ * @param channel The channel.
+ * @param compressed Whether the channel is compressed.
+ * @param settings The channel's residual codec settings.
+ * @returns True for compressed 8-bit channels with the codec enabled.
+ */
+bool SEQWriter::usesResidual( Streamer::Channels channel, bool compressed, const ResidualSettings& settings )
+{
+	return compressed && settings.enabled && bitsPerPixel[ channel ] == 8;
+}
+
+/**
+ * @brief Lower the JPEG quality of subsequent frames, e.g. while processing falls behind.
+ * @param reduction Quality steps below what the profile or rate controller asks for.
+ * @returns void.
+ */
+void SEQWriter::setQualityReduction( int reduction )
+{
+	qualityReduction = reduction;
+}
+
+/**
+ * @brief Allocate the staging buffers from the memory of a NUMA node, the one of the thread that writes the frames.
+ * @param node The node; -1 for any.
+ * @returns void.
+ * @note Takes effect on the next recording.
+ */
+void SEQWriter::setNode( int node )
+{
+	bufferNode = node;
+}
+
+/**
+ * @brief Choose how the memory of the staging buffers is obtained.
+ * @param settings Whether to use large pages, and whether to lock ordinary pages.
+ * @returns void.
+ * @note Takes effect on the next recording.
+ */
+void SEQWriter::setMemory( const BufferMemorySettings& settings )
+{
+	bufferMemory = settings;
+}
+
+/**
+ * @brief Let JPEG quality vary per frame to hit a target bitrate.
+ * @param targetBytesPerSecond Target average rate; 0 to use a fixed quality.
+ * @param minQuality Lowest quality the rate controller may choose.
+ * @param maxQuality Highest quality the rate controller may choose.
+ * @returns void.
+ * @note Takes effect on the next call to startRecording().
+ */
+void SEQWriter::setRateControl( double targetBytesPerSecond, int minQuality, int maxQuality )
+{
+	rateController.configure( targetBytesPerSecond, minQuality, maxQuality );
+}
+
+/**
+ * @brief Accessor for the target bitrate.
+ * @arg None.
+ * @returns Target bytes per second; 0 if rate control is off.
+ */
+double SEQWriter::getRateTarget()
+{
+	return rateController.getTarget();
+}
+
+/**
+ * @brief Accessor for the rate controller's lower quality bound.
+ * @arg None.
+ * @returns Lowest quality.
+ */
+int SEQWriter::getRateMinQuality()
+{
+	return rateController.getMinQuality();
+}
+
+/**
+ * @brief Accessor for the rate controller's upper quality bound.
+ * @arg None.
+ * @returns Highest quality.
+ */
+int SEQWriter::getRateMaxQuality()
+{
+	return rateController.getMaxQuality();
+}
+
+/**
+ * @brief Accessor for the number of frames written.
+ * @arg None.
+ * @returns Frames in the current (or last) SEQ file.
+ */
+int SEQWriter::getFrameCount()
+{
+	return totalFrames;
+}
+
+/**
+ * @brief Accessor for the size of the file.
+ * @arg None.
+ * @returns Size of the current (or last) SEQ file in bytes, including staged data.
+ */
+qint64 SEQWriter::getFileSize()
+{
+	return fileSize;
+}
+
+/**
+ * @brief Accessor for the number of failed writes.
+ * @arg None.
+ * @returns Writes of the current (or last) SEQ file that failed; the file is incomplete if any did.
+ */
+int SEQWriter::getFailedWrites()
+{
+	return failedWrites;
 }
 
 // Utility function for converting to a windows string
@@ -67,6 +295,47 @@ std::wstring SEQWriter::s2ws(const std::string& s)
 	return r;
 }
 
+/**
+ * @brief Channel a recording's files are named after.
+ * @param channel The channel being recorded.
+ * @param isPGswitched Whether the Point Grey cameras are swapped.
+ * @returns The channel, with the Point Grey channels exchanged if the cameras are swapped.
+ */
+Streamer::Channels SEQWriter::fileChannel( Streamer::Channels channel, bool isPGswitched )
+{
+	if (channel == Streamer::Channels::PointGreyFront && isPGswitched) {
+		return Streamer::Channels::PointGreyTop;
+	}
+	else if (channel == Streamer::Channels::PointGreyTop && isPGswitched) {
+		return Streamer::Channels::PointGreyFront;
+	}
+	return channel;
+}
+
+/**
+ * @brief Path of the file a recording is written to.
+ * @param workingDir The working directory (output root) of the channel.
+ * @param channel The channel being recorded.
+ * @param compressed Whether the channel is being compressed.
+ * @param dateTime The date and time for the file's timestamp.
+ * @param isPGswitched Whether the Point Grey cameras are swapped.
+ * @param residual Whether the residual codec is used, which gives the file its own name and extension.
+ * @returns e.g. workingDir/recordings/Mouse_2017-05-03_12-00-00_Top_J85.seq.
+ */
+QString SEQWriter::filePathFor( std::string workingDir, Streamer::Channels channel, bool compressed, std::string dateTime, bool isPGswitched, bool residual )
+{
+	Streamer::Channels current_chan = fileChannel(channel, isPGswitched);
+
+	return QString::fromStdString(workingDir + "recordings/" +
+													fileNameHead +
+													dateTime +
+													fileNameSeparator +
+													fileNameChannels[current_chan] +
+													fileNameSeparator +
+													(residual ? fileNameResidual : compressed ? fileNameCompressed : fileNameRaw) +
+													(residual ? fileNameResidualFoot : fileNameFoot));
+}
+
 /**
  * @brief Start recording to a SEQ file
  * @param workingDir The working directory where the file should be saved.
@@ -74,6 +343,8 @@ std::wstring SEQWriter::s2ws(const std::string& s)
  * @param height The height of the stream being saved in pixels.
  * @param compressed Whether the channel is being compressed.
  * @param dateTime The date and time for the file's timestamp.
+ * @param isPGswitched Whether the Point Grey cameras are swapped.
+ * @param fps The frame rate of the stream, for the header and for sizing disk reservations.
  * @returns void.
  */
 void SEQWriter::startRecording( std::string workingDir, 
@@ -81,44 +352,165 @@ void SEQWriter::startRecording( std::string workingDir,
                                 int height,
                                 bool compressed, 
                                 std::string dateTime,
-								bool isPGswitched)
+								bool isPGswitched,
+                                double fps )
 {
-	Streamer::Channels current_chan = this->streamChannel;
-	if (this->streamChannel == Streamer::Channels::PointGreyFront && isPGswitched) {
-		current_chan = Streamer::Channels::PointGreyTop;
-	}
-	else if (this->streamChannel == Streamer::Channels::PointGreyTop && isPGswitched) {
-		current_chan = Streamer::Channels::PointGreyFront;
-	}
-
-	QString path = QString::fromStdString(workingDir + "recordings/" +
-													fileNameHead +
-													dateTime +
-													fileNameSeparator +
-													fileNameChannels[current_chan] +
-													fileNameSeparator +
-													(compressed ? fileNameCompressed : fileNameRaw) +
-													fileNameFoot);
+	this->residual = usesResidual(this->streamChannel, compressed, residualSettings);
+	QString path = filePathFor(workingDir, this->streamChannel, compressed, dateTime, isPGswitched, residual);
 	
-	// Attempt to create the directory, if it doesn't already exist
+	// Attempt to create the directory, if it doesn't already exist. The output root may be new too.
 	auto directory = QString::fromStdString(workingDir + "recordings/");
-	if (!(CreateDirectoryW(s2ws(directory.toStdString()).c_str(), NULL) ||
-		ERROR_ALREADY_EXISTS == GetLastError()))
+	if (!QDir().mkpath(directory))
 	{
 		// Couldn't create directory!
 	}
-    seqFile.setFileName(path);
-	auto success = seqFile.open( QIODevice::WriteOnly );
-    seqFileStream = new QDataStream( &seqFile );
-	makeEmptyHeader();
 	this->totalFrames = 0;
+	this->failedWrites = 0;
     this->compressed = compressed;
     this->width = width;
     this->height = height;
+	this->frameRate = fps;
+
+	// Size the staging buffer so that at least two worst-case frame records fit in it
+	if ( residual )
+		maxRecordSize = sizeof( int32_t ) + ResidualEncoder::bufferSize( width, height ) + TIMESTAMP_SIZE;
+	else if ( compressed )
+		maxRecordSize = sizeof( int32_t ) + JPEGEncoder::bufferSize( width, height ) + TIMESTAMP_SIZE;
+	else
+		maxRecordSize = sizeof( int32_t ) + width * height * bitsPerPixel[ streamChannel ] / 8 + TIMESTAMP_SIZE;
+	stagingCapacity = (std::max)( (size_t)STAGING_SIZE, 2 * maxRecordSize + SEQ_HEADER_SIZE );
+	stagingCapacity = ( stagingCapacity + IO_ALIGNMENT - 1 ) / IO_ALIGNMENT * IO_ALIGNMENT;
+	stagingUsed = 0;
+
+	// Reserve disk space a few seconds of recording at a time
+	qint64 allocationChunk = (qint64)( expectedRecordSize( streamChannel, width, height, compressed ) * fps * PREALLOCATION_SECONDS );
+	allocationChunk = (std::min)( (std::max)( allocationChunk, (qint64)MIN_PREALLOCATION ), (qint64)MAX_PREALLOCATION );
+
+	filePath = path;
+	if ( !storage )
+		storage = SEQStorage::create( storageBackend, queueDepth );
+	storage->setAllocationChunk( allocationChunk );
+	storage->setNode( bufferNode );
+	storage->setMemory( bufferMemory );
+	if ( !storage->open( path, stagingCapacity ) && storage->backend() != SEQStorage::QFileBackend )
+	{
+#ifdef DEBUG
+		qDebug() << "Could not open" << path << "with the" << SEQStorage::backendNames[ storageBackend ].c_str()
+		         << "backend, falling back to buffered I/O." << endl;
+#endif
+		// Only for this recording; the configured backend is tried again next time
+		delete storage;
+		storage = SEQStorage::create( SEQStorage::QFileBackend, queueDepth );
+		storage->setAllocationChunk( allocationChunk );
+		storage->setNode( bufferNode );
+		storage->setMemory( bufferMemory );
+		storage->open( path, stagingCapacity );
+	}
+	staging = storage->acquire();
+	makeEmptyHeader();
+
+	// JPEG quality may change from frame to frame, so record it for analysis
+	if ( compressed )
+	{
+		rateController.start( fps, encoder.getProfile().quality );
+		minQualityUsed = 100;
+		maxQualityUsed = 0;
+		qualitySidecar.open( path, "quality", "frame,seconds,milliseconds,quality,bytes" );
+	}
+	if ( residual )
+	{
+		residualEncoder.start( width, height, residualSettings );
+		residualIndex.clear();
+	}
+}
+
+/**
+ * @brief Hand the staging buffer to the storage backend.
+ * @param final Whether this is the last flush before the file is closed.
+ * @returns void.
+ *
+ * Unbuffered backends only accept whole multiples of their alignment; any tail is
+ * copied to the front of the next staging buffer and goes out with the next batch.
+ * On the final flush the tail is zero-padded, and the backend truncates the file back
+ * to its logical size when it is finished.
+ */
+void SEQWriter::flushStaging( bool final )
+{
+	size_t alignment = storage->alignment();
+	size_t toWrite = stagingUsed;
+	if ( final )
+	{
+		size_t padded = ( stagingUsed + alignment - 1 ) / alignment * alignment;
+		memset( staging + stagingUsed, 0, padded - stagingUsed );
+		toWrite = padded;
+	}
+	else
+	{
+		toWrite -= toWrite % alignment;
+	}
+
+	if ( !toWrite )
+	{
+		if ( final )
+		{
+			storage->recycle( staging );
+			staging = NULL;
+		}
+		return;
+	}
+
+	// Carry the unaligned tail over before the buffer is given away
+	unsigned char* next = NULL;
+	size_t tail = stagingUsed - (std::min)( toWrite, stagingUsed );
+	if ( !final )
+	{
+		next = storage->acquire();
+		memcpy( next, staging + toWrite, tail );
+	}
+
+	storage->submit( staging, toWrite );
+	staging = next;
+	stagingUsed = tail;
+	failedWrites = storage->getFailedWrites();
 }
 
 
 
+/**
+ * @brief Append the index of a residual file: one offset per frame, then a footer.
+ * @arg None.
+ * @returns void.
+ *
+ * Offsets have ResidualEncoder::KEYFRAME_FLAG set for keyframes. The footer holds
+ * the offset of the index, the number of frames and ResidualEncoder::INDEX_MAGIC.
+ */
+void SEQWriter::writeResidualIndex()
+{
+	uint64_t indexOffset = (uint64_t)fileSize;
+	uint32_t count = (uint32_t)residualIndex.size();
+	uint32_t magic = ResidualEncoder::INDEX_MAGIC;
+
+	std::vector<unsigned char> trailer( residualIndex.size() * sizeof( uint64_t ) + ResidualEncoder::INDEX_FOOTER_SIZE );
+	memcpy( trailer.data(), residualIndex.data(), residualIndex.size() * sizeof( uint64_t ) );
+	unsigned char* footer = trailer.data() + residualIndex.size() * sizeof( uint64_t );
+	memcpy( footer, &indexOffset, sizeof( uint64_t ) );
+	memcpy( footer + sizeof( uint64_t ), &count, sizeof( uint32_t ) );
+	memcpy( footer + sizeof( uint64_t ) + sizeof( uint32_t ), &magic, sizeof( uint32_t ) );
+
+	// The index can be larger than what is left of the staging buffer
+	size_t written = 0;
+	while ( written < trailer.size() )
+	{
+		if ( stagingUsed == stagingCapacity )
+			flushStaging( false );
+		size_t chunk = (std::min)( trailer.size() - written, stagingCapacity - stagingUsed );
+		memcpy( staging + stagingUsed, trailer.data() + written, chunk );
+		stagingUsed += chunk;
+		fileSize += chunk;
+		written += chunk;
+	}
+}
+
 /**
  * @brief Stop recording to the SEQ file
  * @arg None.
@@ -127,11 +519,25 @@ void SEQWriter::startRecording( std::string workingDir,
 void SEQWriter::stopRecording()
 {
     int bpp = bitsPerPixel[ streamChannel ];
-    // Write the header
+
+	// Residual files end with their index
+	if ( residual )
+		writeResidualIndex();
+
+	// Push out whatever is still staged
+	flushStaging( true );
+
+    // Write the header; the backend closes the file
     writeHeader( width, height, bpp );
+	failedWrites = storage->getFailedWrites();
+	qualitySidecar.close();
 
-    // And close the file
-	seqFile.close();
+	// Drop a fallback backend, so the configured one is tried again next time
+	if ( storage->backend() != storageBackend )
+	{
+		delete storage;
+		storage = NULL;
+	}
 }
 
 /**
@@ -143,137 +549,179 @@ void SEQWriter::stopRecording()
 */
 void SEQWriter::writeFrame( QImage *image, int secs, short ms) 
 {
-    int initialPos = seqFile.pos();
-    int finalPos;
 	int32_t image_size = 0;
-	unsigned char* _compressedImage = NULL;
 
-	// Figure out how big the image is
+	// Make sure a whole worst-case record fits behind what is already staged
+	if ( stagingCapacity - stagingUsed < maxRecordSize )
+		flushStaging( false );
+
+	// The record is assembled in place: [size] pixels timestamp
+	unsigned char* record = staging + stagingUsed;
+	unsigned char* sizeField = NULL;
+
+	// According to spec, the frame size is written before the image data ONLY for compressed images.
+	// The old code wrote it before both.
+#ifdef COMPATIBILITY_MODE
+	sizeField = record;
+#else
+	if (compressed)
+	{
+		sizeField = record;
+	}
+#endif
+	unsigned char* pixels = record + ( sizeField ? sizeof( int32_t ) : 0 );
+	unsigned long pixelCapacity = (unsigned long)( maxRecordSize - sizeof( int32_t ) - TIMESTAMP_SIZE );
+
+	// Put the image data straight into the staging buffer
 	if (compressed) {
-		compressJPEG(image, _compressedImage, image_size, width, height); // LibJPEG-turbo compression
+		int quality = rateController.enabled() ? rateController.quality() : encoder.getProfile().quality;
+		// The QoS ladder applies on top, but never pushes a profile below the ladder's own floor
+		quality = (std::max)( quality - qualityReduction, (std::min)( quality, (int)QoSController::MIN_QUALITY ) );
+		if ( residual ) {
+			bool keyframe;
+			image_size = residualEncoder.encode( image, pixels, pixelCapacity, quality, encoder, keyframe );
+			residualIndex.push_back( (uint64_t)fileSize | ( keyframe ? ResidualEncoder::KEYFRAME_FLAG : 0 ) );
+		}
+		else {
+			image_size = encoder.encode( image, pixels, pixelCapacity, quality ); // LibJPEG-turbo compression
+		}
+		minQualityUsed = (std::min)( minQualityUsed, quality );
+		maxQualityUsed = (std::max)( maxQualityUsed, quality );
+		rateController.update( image_size );
+		qualitySidecar.writeRow( "%d,%d,%d,%d,%d", totalFrames, secs, (int)ms, quality, image_size );
 	}
 	else {
-		image_size = image->width() * image->height() * bitsPerPixel[streamChannel] / 8;
+		// Copy line by line: QImage scanlines are padded to 32 bits
+		int lineSize = image->width() * bitsPerPixel[streamChannel] / 8;
+		for ( int y = 0; y < image->height(); y++ )
+			memcpy( pixels + y * lineSize, image->constScanLine( y ), lineSize );
+		image_size = lineSize * image->height();
 	}
 
-	// Write the image size
-    // According to spec, the frame size is written before the image data ONLY for compressed images.
-	// The old code wrote it before both.
 	// Apparently, image size is supposed to (in the Matlab code) include the size of the size field also
 	// so - (JPEG size + sizeof(int32_t)
+	if ( sizeField )
+	{
 #ifdef COMPATIBILITY_MODE
-	image_size += 4;
-	seqFileStream->writeRawData((char*)&image_size, sizeof(int32_t));
-	image_size -= 4;
+		int32_t stored_size = image_size + 4;
 #else
-	if (compressed)
-	{
-		seqFileStream->writeRawData((char*)&image_size, sizeof(int32_t));
-	}
+		int32_t stored_size = image_size;
 #endif
-
-    // Write data
-    if ( compressed )
-    {
-		seqFileStream->writeRawData((char*)_compressedImage, image_size);
-		tjFree(_compressedImage);
-    }
-    else
-    {
-		seqFileStream->writeRawData((char*)image->bits(), image_size);
-    }
+		memcpy( sizeField, &stored_size, sizeof( int32_t ) );
+	}
 
     // Write timestamp written after image bytes
+	unsigned char* timestamp = pixels + image_size;
 	short mc = 0;
-	seqFileStream->writeRawData( (char*) &secs, sizeof(int32_t) );
-	seqFileStream->writeRawData( (char*) &ms, sizeof(int16_t) );
-	seqFileStream->writeRawData( (char*) &mc, sizeof(int16_t) );
+	memcpy( timestamp, &secs, sizeof( int32_t ) );
+	memcpy( timestamp + sizeof( int32_t ), &ms, sizeof( int16_t ) );
+	memcpy( timestamp + sizeof( int32_t ) + sizeof( int16_t ), &mc, sizeof( int16_t ) );
 
 	// There should be no padding after the frame (I think.)
 	// The old version had 8 bytes of padding
 	// It appears the matlab code can handle 0 or 8 bytes, so I'll do 0.
+	size_t recordSize = ( timestamp + TIMESTAMP_SIZE ) - record;
+	stagingUsed += recordSize;
+	fileSize += recordSize;
 
     // Keep track of how many frames were saved
     totalFrames++;
 }
 
 /**
-* @brief Compresses a QImage using the LibJPEG-turbo compression library. 
+* @brief Runs the LibJPEG-turbo compressor on a QImage.
 * @param image Image to be compressed
-* @param _compressedImage The location where the compressed image will be put
-* @param compressed_size The size of the resulting image
+* @param jpegBuffer In/out pointer to the destination buffer
+* @param jpegSize In: capacity of the buffer. Out: size of the resulting image
+* @param width Width of the image
+* @param height Height of the image
+* @param flags Extra TurboJPEG flags (e.g. TJFLAG_NOREALLOC)
 * @returns void.
 */
-void SEQWriter::compressJPEG(QImage* image, unsigned char*& _compressedImage, int& compressed_size, int width, int height)
+static void runCompressor(QImage* image, unsigned char** jpegBuffer, unsigned long* jpegSize, int width, int height, int flags, int quality)
 {
 	TJPF pixel_format;
+	int subsampling;
 	QImage frame_converted;
-	int COLOR_COMPONENTS = 0; // How many channels are in the image?
-	
-	// Create the compressor
-	tjhandle _jpegCompressor = tjInitCompress();
+	const QImage* source = image;
 
 	// Figure out what image type we have
 	if (image->format() == QImage::Format_Grayscale8) {
 		pixel_format = TJPF::TJPF_GRAY;
-		COLOR_COMPONENTS = 1;
+		subsampling = TJSAMP_GRAY;
 	}
 	else if (image->format() == QImage::Format_RGB888) {
 		pixel_format = TJPF::TJPF_RGB;
-		COLOR_COMPONENTS = 3;
+		subsampling = TJSAMP_444;
 	}
 	else if (image->format() == QImage::Format_RGB16) {
 		// JPEG doesn't support 16-bit RGB. We need to up-convert.
 		frame_converted = image->convertToFormat(QImage::Format_RGB888);
+		source = &frame_converted;
 		pixel_format = TJPF::TJPF_RGB;
-		COLOR_COMPONENTS = 3;
+		subsampling = TJSAMP_444;
 	}
 	else {
 		throw std::invalid_argument("Image format not implemented!");
 	}
-	
-	unsigned long _jpegSize = 0;
-	
-	int result;
 
-	// We need to treat the different formats separately during compression
-	if (image->format() == QImage::Format_RGB16) {
-		 result = tjCompress2(_jpegCompressor, frame_converted.bits(), width, 0, height, pixel_format,
-			&_compressedImage, &_jpegSize, TJSAMP_444, JPEG_QUALITY,
-			TJFLAG_FASTDCT);
-	}
-	else if (image->format() == QImage::Format_Grayscale8) {
-		result = tjCompress2(_jpegCompressor, image->bits(), width, 0, height, pixel_format,
-			&_compressedImage, &_jpegSize, TJSAMP_GRAY, JPEG_QUALITY,
-			TJFLAG_FASTDCT);
-	}
-	else {
-		result = tjCompress2(_jpegCompressor, image->bits(), width, 0, height, pixel_format,
-			&_compressedImage, &_jpegSize, TJSAMP_444, JPEG_QUALITY,
-			TJFLAG_FASTDCT);
-	}
+	// Create the compressor
+	tjhandle _jpegCompressor = tjInitCompress();
+
+	// Pass the real pitch: QImage scanlines are padded to 32 bits
+	int result = tjCompress2(_jpegCompressor, const_cast<uchar*>(source->constBits()), width, source->bytesPerLine(), height, pixel_format,
+		jpegBuffer, jpegSize, subsampling, quality,
+		TJFLAG_FASTDCT | flags);
+	tjDestroy(_jpegCompressor);
 
 	if (result != 0) {
 		throw std::runtime_error("JPEG compression failed!");
 	}
-	tjDestroy(_jpegCompressor);
+}
 
+/**
+* @brief Compresses a QImage using the LibJPEG-turbo compression library. 
+* @param image Image to be compressed
+* @param _compressedImage The location where the compressed image will be put (free with tjFree)
+* @param compressed_size The size of the resulting image
+* @returns void.
+*/
+void SEQWriter::compressJPEG(QImage* image, unsigned char*& _compressedImage, int& compressed_size, int width, int height)
+{
+	unsigned long _jpegSize = 0;
+	runCompressor(image, &_compressedImage, &_jpegSize, width, height, 0, JPEG_QUALITY);
 	compressed_size = _jpegSize;
 }
 
-
+/**
+* @brief Compresses a QImage into a caller-provided buffer.
+* @param image Image to be compressed
+* @param destination Buffer the compressed image is written to
+* @param capacity Size of the destination buffer; should be at least tjBufSize( width, height, TJSAMP_444 )
+* @param compressed_size The size of the resulting image
+* @param quality JPEG quality (0-100)
+* @returns void.
+*/
+void SEQWriter::compressJPEG(QImage* image, unsigned char* destination, unsigned long capacity, int& compressed_size, int width, int height, int quality)
+{
+	unsigned long _jpegSize = capacity;
+	runCompressor(image, &destination, &_jpegSize, width, height, TJFLAG_NOREALLOC, quality);
+	compressed_size = _jpegSize;
+}
 
 /**
  * @brief Allocate space for a SEQ file header
  * @arg None.
  * @returns void.
+ *
+ * The placeholder is staged together with the first frames, so the file starts
+ * with one large aligned write instead of 1024 single-byte ones.
  */
 void SEQWriter::makeEmptyHeader( )
 {
-	for ( int i = 0; i < SEQ_HEADER_SIZE; i++ )
-	{
-		seqFileStream->writeRawData( &null, sizeof( char ) );
-	}
+	memset( staging + stagingUsed, null, SEQ_HEADER_SIZE );
+	stagingUsed += SEQ_HEADER_SIZE;
+	fileSize = SEQ_HEADER_SIZE;
 }
 
 /**
@@ -282,6 +730,8 @@ void SEQWriter::makeEmptyHeader( )
  * @param height Height of the images in the stream
  * @param bpp_num Number of bits per pixel
  * @returns void.
+ *
+ * The header is assembled in memory and written with a single call.
  */
 void SEQWriter::writeHeader( int width, int height, int bpp_num )
 {
@@ -301,42 +751,39 @@ void SEQWriter::writeHeader( int width, int height, int bpp_num )
 	int32_t trueImageSize = bytesPerFrame + 8 * sizeof(uint8_t);
 #endif
 
-    int remainingHeader = SEQ_HEADER_SIZE; // Keep track of how much room is left in header
-
-    //seek to beginning of file
-	seqFile.seek( 0 );
+	char header[ SEQ_HEADER_SIZE ] = { 0 }; // Anything not written below stays null
+	int offset = 0;
+	auto put = [&]( const void* data, int size ) { memcpy( header + offset, data, size ); offset += size; };
 
     // Write header
     // Random magic number (unsigned int = 4 bytes)
-	seqFileStream->writeRawData( (char*) &norpixVar, sizeof(uint32_t) );
-    remainingHeader -= sizeof(uint32_t);
+	put( &norpixVar, sizeof(uint32_t) );
     // Norpix string
 	for ( int i = 0; i < NORPIX_STRING_LENGTH; i++ )
-        seqFileStream->writeRawData( (char*) &norpixString[ i ], sizeof(uint16_t) );
-    remainingHeader -= NORPIX_STRING_LENGTH * sizeof(uint16_t);
+        put( &norpixString[ i ], sizeof(uint16_t) );
 
     // Blank space (4 bytes)
-	for (int i = 0; i < 4; i++) 
-        seqFileStream->writeRawData( (char*) &null, sizeof(uint8_t) );
-    remainingHeader -= 4;
+	offset += 4;
 	// Version number (int = 4 bytes)
-	seqFileStream->writeRawData( (char*) &norpixVer, sizeof(int32_t) );
-    remainingHeader -= sizeof(int32_t);
+	put( &norpixVer, sizeof(int32_t) );
     // Header size (int = 4 bytes)
-	seqFileStream->writeRawData( (char*) &norpixHeaderSize, sizeof(int32_t) );
-    remainingHeader -= sizeof(int32_t);
-	// Description (512 bytes)
-	seqFileStream->writeRawData( (char*) &norpixDesc, NORPIX_DESC_LENGTH );
-	for ( int i = 0; i < NORPIX_DESC_SIZE - NORPIX_DESC_LENGTH; i++ )
-		seqFileStream->writeRawData( (char*) &null, sizeof(uint8_t) );
-    remainingHeader -= NORPIX_DESC_SIZE;
+	put( &norpixHeaderSize, sizeof(int32_t) );
+	// Description (512 bytes of UTF-16, null terminated)
+	std::string description = describeFormat();
+	int descriptionLength = (std::min)( (int)description.size(), NORPIX_DESC_SIZE / 2 - 1 );
+	for ( int i = 0; i < descriptionLength; i++ )
+	{
+		uint16_t ch = (unsigned char)description[ i ];
+		memcpy( header + offset + i * sizeof( uint16_t ), &ch, sizeof( uint16_t ) );
+	}
+	offset += NORPIX_DESC_SIZE;
 
 	// Write CImage data
-	seqFileStream->writeRawData( (char*) &width, sizeof(int32_t) );
-	seqFileStream->writeRawData( (char*) &height, sizeof(int32_t) );
-	seqFileStream->writeRawData( (char*) &bpp_num, sizeof(int32_t) );
-	seqFileStream->writeRawData( (char*) &norpixBPS, sizeof(int32_t) );
-	seqFileStream->writeRawData( (char*) &bytesPerFrame, sizeof(int32_t) );
+	put( &width, sizeof(int32_t) );
+	put( &height, sizeof(int32_t) );
+	put( &bpp_num, sizeof(int32_t) );
+	put( &norpixBPS, sizeof(int32_t) );
+	put( &bytesPerFrame, sizeof(int32_t) );
     // Including image format, which depends on a bunch of things
     int imageFormat;
     if ( !compressed )
@@ -346,6 +793,10 @@ void SEQWriter::writeHeader( int width, int height, int bpp_num )
         else
             imageFormat = SEQ_UNCOMPRESSED_GRAYSCALE;
     }
+    else if ( residual )
+    {
+        imageFormat = SEQ_RESIDUAL_GRAYSCALE;
+    }
     else
     {
         if ( streamChannel == Streamer::Channels::Color )
@@ -353,27 +804,52 @@ void SEQWriter::writeHeader( int width, int height, int bpp_num )
         else
             imageFormat = SEQ_JPEG_GRAYSCALE;
     }
-	seqFileStream->writeRawData( (char*) &imageFormat, sizeof(int32_t) );
-    remainingHeader -= 6 * sizeof(int32_t);
+	put( &imageFormat, sizeof(int32_t) );
 
 	// Write number of frames (int = 4 bytes)
-	seqFileStream->writeRawData( (char*) &totalFrames, sizeof(int32_t) );
-    remainingHeader -= sizeof(int32_t);
+	put( &totalFrames, sizeof(int32_t) );
 	// Write origin (int = 4 bytes)
-	seqFileStream->writeRawData( (char*) &norpixOrigin, sizeof(int32_t) );
-    remainingHeader -= sizeof(int32_t);
+	put( &norpixOrigin, sizeof(int32_t) );
 	// Write true image size (unsigned int = 4 bytes)
-	seqFileStream->writeRawData( (char*) &trueImageSize, sizeof(uint32_t) );
-    remainingHeader -= sizeof( uint32_t);
+	put( &trueImageSize, sizeof(uint32_t) );
 
 	// Write 8 bytes: framerate (double)
-	double fps = 30.0; // TODO: This shouldn't be a constant
-	seqFileStream->writeRawData( (char*) &fps, sizeof( double ) );
-    remainingHeader -= sizeof( double );
+	put( &frameRate, sizeof( double ) );
 
-	// Fill the rest of the header with nulls
-	for (int i = 0; i < remainingHeader; i++)
-		seqFileStream->writeRawData( (char*) &null, sizeof(uint8_t) );
+	// The rest of the header is already null
+	storage->finish( fileSize, header, SEQ_HEADER_SIZE );
+}
+
+/**
+ * @brief Describe how the frames in the file were encoded, for the header.
+ * @arg None.
+ * @returns Description text, e.g. "Hunter JPEG quality=80 subsampling=420 dct=fast baseline restartRows=0",
+ *          or "Hunter residual tile=16 threshold=6 keyframeInterval=300 JPEG quality=80 ...".
+ *
+ * When the quality varied during the recording the range is given; the quality of
+ * each frame is in the quality sidecar.
+ */
+std::string SEQWriter::describeFormat()
+{
+	if ( !compressed )
+		return "Hunter raw";
+
+	EncoderProfile profile = encoder.getProfile();
+	// Point Grey frames are grayscale; the others are encoded as color
+	if ( streamChannel == Streamer::Channels::PointGreyTop || streamChannel == Streamer::Channels::PointGreyFront )
+		profile.subsampling = TJSAMP_GRAY;
+
+	ostringstream description;
+	if ( residual )
+		description << "Hunter residual " << residualSettings.describe() << " JPEG quality=";
+	else
+		description << "Hunter JPEG quality=";
+	if ( totalFrames == 0 || minQualityUsed == maxQualityUsed )
+		description << ( totalFrames ? minQualityUsed : profile.quality );
+	else
+		description << minQualityUsed << "-" << maxQualityUsed << " (per frame in quality sidecar)";
+	description << " " << profile.describe();
+	return description.str();
 }
 
 /**
@@ -403,3 +879,108 @@ int SEQWriter::hexToDec( const string &hex )
 		decimalValue = decimalValue * 16 + hexCharToDecimal( hex[ i ] );
 	return decimalValue;
 }
+
+/**
+ * @brief Expected size of one frame record on disk.
+ * @param channel The channel being recorded.
+ * @param width The width of the stream in pixels.
+ * @param height The height of the stream in pixels.
+ * @param compressed Whether the channel is being compressed.
+ * @param jpegRatio Compressed size as a fraction of the raw size; 0 to use a conservative estimate.
+ * @returns Bytes per frame, including the size field and timestamp.
+ */
+double SEQWriter::expectedRecordSize( Streamer::Channels channel, int width, int height, bool compressed, double jpegRatio )
+{
+	double bytesPerFrame = (double)width * height * bitsPerPixel[ channel ] / 8;
+	if ( compressed )
+		bytesPerFrame *= ( jpegRatio > 0 ) ? jpegRatio : 1.0 / JPEG_RATIO_ESTIMATE;
+	return bytesPerFrame + sizeof( int32_t ) + TIMESTAMP_SIZE;
+}
+
+/**
+ * @brief Compress a sample frame to see how well a stream compresses.
+ * @param sample A recent frame of the stream, in the format it is recorded in.
+ * @param profile The encoder profile of the stream; frames are encoded at its quality, as they are recorded.
+ * @returns Compressed size as a fraction of the raw size, or 0 if the frame can't be compressed.
+ */
+double SEQWriter::measureCompressionRatio( const QImage& sample, const EncoderProfile& profile )
+{
+	if ( sample.isNull() )
+		return 0;
+
+	JPEGEncoder encoder;
+	encoder.setProfile( profile );
+	unsigned long capacity = JPEGEncoder::bufferSize( sample.width(), sample.height() );
+	std::vector<unsigned char> compressedImage( capacity );
+	int compressed_size = 0;
+	try
+	{
+		compressed_size = encoder.encode( &sample, compressedImage.data(), capacity, profile.quality );
+	}
+	catch ( std::exception& )
+	{
+		return 0;
+	}
+
+	double rawSize = (double)sample.width() * sample.height() * sample.depth() / 8;
+	return compressed_size / rawSize;
+}
+
+/**
+ * @brief Measure the sustained write rate of each storage backend.
+ * @param workingDir Directory on the volume to be measured. The files are written to its recordings folder and deleted afterwards.
+ * @param frames Number of frames written per run.
+ * @returns A human-readable report, one line per backend and frame size.
+ *
+ * Synthetic raw frames the size of a full and a half-resolution Point Grey stream are
+ * written through each backend with the same code path as a recording.
+ */
+std::string SEQWriter::benchmarkStorage( std::string workingDir, int frames )
+{
+	const int sizes[][ 2 ] = { { 1920, 1200 }, { 960, 600 } };
+	ostringstream report;
+	report << fixed << setprecision( 1 );
+
+	for ( auto size : sizes )
+	{
+		// Gradient rather than a constant, so nothing along the way can shortcut the data
+		QImage frame( size[ 0 ], size[ 1 ], QImage::Format_Grayscale8 );
+		for ( int y = 0; y < frame.height(); y++ )
+		{
+			unsigned char* line = frame.scanLine( y );
+			for ( int x = 0; x < frame.width(); x++ )
+				line[ x ] = (unsigned char)( x + y );
+		}
+
+		for ( int b = 0; b < SEQStorage::NUM_BACKENDS; b++ )
+		{
+			SEQWriter writer( Streamer::Channels::PointGreyTop );
+			writer.setStorageBackend( (SEQStorage::Backend)b, SEQStorage::DEFAULT_QUEUE_DEPTH );
+
+			auto start = chrono::steady_clock::now();
+			writer.startRecording( workingDir, size[ 0 ], size[ 1 ], false, "benchmark_" + SEQStorage::backendNames[ b ], false, 30.0 );
+			for ( int i = 0; i < frames; i++ )
+				writer.writeFrame( &frame, i / 30, (short)( ( i % 30 ) * 33 ) );
+			writer.stopRecording();
+			double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+			double megabytes = (double)writer.fileSize / ( 1024 * 1024 );
+			report << setw( 10 ) << left << SEQStorage::backendNames[ b ] << right
+			       << size[ 0 ] << "x" << size[ 1 ] << ": "
+			       << frames << " frames in " << seconds << " s, "
+			       << frames / seconds << " fps, "
+			       << megabytes / seconds << " MB/s";
+			if ( writer.getFailedWrites() )
+				report << " (" << writer.getFailedWrites() << " writes failed)";
+			report << endl;
+
+			QFile::remove( writer.getFileName() );
+		}
+	}
+
+	if ( !SEQStorage::maySetValidData() )
+		report << "Note: without the \"Perform volume maintenance tasks\" right, every unbuffered write extends the "
+		          "valid data of its file, so Windows completes overlapped writes synchronously." << endl;
+
+	return report.str();
+}
@@ -0,0 +1,113 @@
+/**
+ * @file sidecar_writer.cpp
+ * @brief Per-frame metadata written next to a SEQ file
+ */
+
+// Project includes
+#include "sidecar_writer.h"
+
+// Libraries
+#include <QTCore/QtDebug>
+
+// C++
+#include <cstdarg>
+#include <cstdio>
+
+using namespace std;
+
+/**
+ * @brief SidecarWriter constructor
+ * @arg None
+ */
+SidecarWriter::SidecarWriter( void )
+{
+}
+
+/**
+ * @brief SidecarWriter destructor
+ * @arg None
+ */
+SidecarWriter::~SidecarWriter( void )
+{
+    close();
+}
+
+/**
+ * @brief Path of the sidecar belonging to a SEQ file.
+ * @param seqPath Path of the SEQ file.
+ * @param suffix What the sidecar holds, e.g. "quality".
+ * @returns The SEQ path with its extension replaced by _<suffix>.csv.
+ */
+QString SidecarWriter::pathFor( const QString& seqPath, const std::string& suffix )
+{
+    QString base = seqPath;
+    if ( base.endsWith( ".seq" ) )
+        base.chop( 4 );
+    return base + "_" + QString::fromStdString( suffix ) + ".csv";
+}
+
+/**
+ * @brief Create the sidecar for a SEQ file and write its column header.
+ * @param seqPath Path of the SEQ file.
+ * @param suffix What the sidecar holds, e.g. "quality".
+ * @param columns Comma-separated column names.
+ * @returns Whether the file could be created.
+ */
+bool SidecarWriter::open( const QString& seqPath, const std::string& suffix, const std::string& columns )
+{
+    close();
+    file.setFileName( pathFor( seqPath, suffix ) );
+    if ( !file.open( QIODevice::WriteOnly | QIODevice::Text ) )
+    {
+#ifdef DEBUG
+        qDebug() << "Could not create sidecar" << file.fileName() << endl;
+#endif
+        return false;
+    }
+    file.write( columns.c_str() );
+    file.write( "\n" );
+    return true;
+}
+
+/**
+ * @brief Flush and close the sidecar.
+ * @arg None.
+ * @returns void.
+ */
+void SidecarWriter::close()
+{
+    if ( file.isOpen() )
+        file.close();
+}
+
+/**
+ * @brief Whether a sidecar is open.
+ * @arg None.
+ * @returns True between open() and close().
+ */
+bool SidecarWriter::isOpen()
+{
+    return file.isOpen();
+}
+
+/**
+ * @brief Append one row.
+ * @param format printf-style format of the row, without the trailing newline.
+ * @returns void.
+ */
+void SidecarWriter::writeRow( const char* format, ... )
+{
+    if ( !file.isOpen() )
+        return;
+
+    char line[ MAX_LINE_LENGTH ];
+    va_list args;
+    va_start( args, format );
+    int length = vsnprintf( line, MAX_LINE_LENGTH - 1, format, args );
+    va_end( args );
+    if ( length < 0 )
+        return;
+    length = ( length < MAX_LINE_LENGTH - 1 ) ? length : MAX_LINE_LENGTH - 2;
+    line[ length++ ] = '\n';
+    file.write( line, length );
+}
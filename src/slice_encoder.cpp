@@ -0,0 +1,282 @@
+/**
+ * @file slice_encoder.cpp
+ * @brief Intra-frame parallel JPEG encoder
+ */
+
+// Project includes
+#include "slice_encoder.h"
+#include "pipeline_executor.h"
+
+// Libraries
+#include <QTCore/qt_windows.h>
+
+// C++
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+/**
+ * @brief Locate the frame header and the scan in a baseline JPEG.
+ * @param data The JPEG.
+ * @param size Size of the JPEG in bytes.
+ * @param frameHeader Out: offset of the SOF0 marker.
+ * @param scanHeader Out: offset of the SOS marker.
+ * @param scanData Out: offset of the entropy-coded data following the SOS header.
+ * @returns Whether all three were found.
+ */
+static bool findScan( const unsigned char* data, unsigned long size, size_t& frameHeader, size_t& scanHeader, size_t& scanData )
+{
+    frameHeader = 0;
+    size_t offset = 2; // Skip SOI
+    while ( offset + 4 <= size && data[ offset ] == 0xFF )
+    {
+        unsigned char marker = data[ offset + 1 ];
+        size_t length = ( data[ offset + 2 ] << 8 ) | data[ offset + 3 ];
+        if ( marker == 0xC0 )
+            frameHeader = offset;
+        if ( marker == 0xDA )
+        {
+            scanHeader = offset;
+            scanData = offset + 2 + length;
+            return frameHeader && scanData <= size;
+        }
+        offset += 2 + length;
+    }
+    return false;
+}
+
+/**
+ * @brief SliceEncoder constructor
+ * @param threads Number of threads encoding a frame, including the calling thread.
+ */
+SliceEncoder::SliceEncoder( int threads )
+    : image( NULL ),
+      subsampling( TJSAMP_444 ),
+      quality( 0 ),
+      flags( 0 ),
+      nextSlice( 0 ),
+      node( -1 ),
+      generation( 0 ),
+      busyWorkers( 0 ),
+      stopping( false )
+{
+    threads = (std::max)( threads, 1 );
+    for ( int i = 0; i < threads; i++ )
+        handles.push_back( tjInitCompress() );
+    for ( int i = 0; i < threads - 1; i++ )
+        workers.push_back( std::thread( &SliceEncoder::worker, this, i ) );
+}
+
+/**
+ * @brief SliceEncoder destructor
+ * @arg None
+ */
+SliceEncoder::~SliceEncoder( void )
+{
+    {
+        lock_guard<std::mutex> lock( mutex );
+        stopping = true;
+    }
+    started.notify_all();
+    for ( auto& thread : workers )
+        thread.join();
+    for ( auto handle : handles )
+        tjDestroy( handle );
+}
+
+/**
+ * @brief Accessor for the number of threads.
+ * @arg None.
+ * @returns Threads encoding a frame, including the calling thread.
+ */
+int SliceEncoder::threads()
+{
+    return (int)handles.size();
+}
+
+/**
+ * @brief Compress an image into a caller-provided buffer, one slice per thread.
+ * @param image Image to be compressed, in Grayscale8 or RGB888.
+ * @param destination Buffer the compressed image is written to.
+ * @param capacity Size of the destination buffer.
+ * @param subsampling Chroma subsampling of color images.
+ * @param quality JPEG quality (1-100).
+ * @param flags TurboJPEG flags, e.g. the DCT method.
+ * @returns The size of the compressed image in bytes.
+ */
+int SliceEncoder::encode( const QImage* image, unsigned char* destination, unsigned long capacity, int subsampling, int quality, int flags )
+{
+    if ( image->format() == QImage::Format_Grayscale8 )
+        subsampling = TJSAMP_GRAY;
+    int width = image->width();
+    int height = image->height();
+
+    // Slices are whole MCU rows, and a restart interval must fit in 16 bits
+    int mcuHeight = tjMCUHeight[ subsampling ];
+    int mcusPerRow = ( width + tjMCUWidth[ subsampling ] - 1 ) / tjMCUWidth[ subsampling ];
+    int mcuRows = ( height + mcuHeight - 1 ) / mcuHeight;
+    int sliceMcuRows = ( mcuRows + threads() - 1 ) / threads();
+    sliceMcuRows = (std::max)( (std::min)( sliceMcuRows, MAX_RESTART_INTERVAL / mcusPerRow ), 1 );
+    int sliceCount = ( mcuRows + sliceMcuRows - 1 ) / sliceMcuRows;
+
+    this->image = image;
+    this->subsampling = subsampling;
+    this->quality = quality;
+    this->flags = flags | TJFLAG_NOREALLOC;
+
+    // A single slice needs no stitching
+    if ( sliceCount == 1 )
+    {
+        unsigned long size = capacity;
+        if ( tjCompress2( handles.back(), const_cast<uchar*>( image->constBits() ), width, image->bytesPerLine(), height,
+                          subsampling == TJSAMP_GRAY ? TJPF_GRAY : TJPF_RGB, &destination, &size,
+                          subsampling, quality, this->flags ) != 0 )
+            throw std::runtime_error( "JPEG compression failed!" );
+        return (int)size;
+    }
+
+    // Slice buffers are kept from frame to frame, and only grow
+    slices.resize( sliceCount );
+    for ( int i = 0; i < sliceCount; i++ )
+    {
+        slices[ i ].firstRow = i * sliceMcuRows * mcuHeight;
+        slices[ i ].rows = (std::min)( sliceMcuRows * mcuHeight, height - slices[ i ].firstRow );
+        unsigned long bound = tjBufSize( width, slices[ i ].rows, subsampling );
+        if ( slices[ i ].buffer.size() < bound )
+            slices[ i ].buffer.resize( bound );
+    }
+
+    // Hand the job to the workers, and take part in it
+    nextSlice = 0;
+    node = PipelineExecutor::nodeCount() > 1 ? PipelineExecutor::currentNode() : -1;
+    {
+        lock_guard<std::mutex> lock( mutex );
+        generation++;
+        busyWorkers = (int)workers.size();
+    }
+    started.notify_all();
+    encodeSlices( handles.back() );
+    {
+        unique_lock<std::mutex> lock( mutex );
+        finished.wait( lock, [ this ] { return busyWorkers == 0; } );
+    }
+
+    for ( auto& slice : slices )
+    {
+        if ( slice.failed )
+            throw std::runtime_error( "JPEG compression failed!" );
+    }
+    return stitch( destination, capacity, height, sliceMcuRows * mcusPerRow );
+}
+
+/**
+ * @brief Worker thread: encodes slices of every job it is handed.
+ * @param index Index of the worker, which selects its compressor.
+ * @returns void.
+ */
+void SliceEncoder::worker( int index )
+{
+    int seen = 0;
+    int placedNode = -1;
+    while ( true )
+    {
+        {
+            unique_lock<std::mutex> lock( mutex );
+            started.wait( lock, [ & ] { return stopping || generation != seen; } );
+            if ( stopping )
+                return;
+            seen = generation;
+        }
+
+        // Follow the calling thread to its node
+        if ( node != placedNode && PipelineExecutor::nodeMask( node ) )
+        {
+            SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR)PipelineExecutor::nodeMask( node ) );
+            placedNode = node;
+        }
+
+        encodeSlices( handles[ index ] );
+
+        lock_guard<std::mutex> lock( mutex );
+        if ( --busyWorkers == 0 )
+            finished.notify_all();
+    }
+}
+
+/**
+ * @brief Claim and encode slices of the current job until none are left.
+ * @param handle The calling thread's compressor.
+ * @returns void.
+ */
+void SliceEncoder::encodeSlices( tjhandle handle )
+{
+    int i;
+    while ( ( i = nextSlice++ ) < (int)slices.size() )
+    {
+        Slice& slice = slices[ i ];
+        unsigned char* buffer = slice.buffer.data();
+        slice.size = (unsigned long)slice.buffer.size();
+        slice.failed = tjCompress2( handle, const_cast<uchar*>( image->constScanLine( slice.firstRow ) ), image->width(), image->bytesPerLine(), slice.rows,
+                                    subsampling == TJSAMP_GRAY ? TJPF_GRAY : TJPF_RGB, &buffer, &slice.size,
+                                    subsampling, quality, flags ) != 0;
+    }
+}
+
+/**
+ * @brief Join the encoded slices into one JPEG.
+ * @param destination Buffer the JPEG is written to.
+ * @param capacity Size of the destination buffer.
+ * @param height Height of the whole image.
+ * @param restartInterval MCUs per slice (except possibly the last).
+ * @returns The size of the JPEG in bytes.
+ *
+ * The headers of the first slice are used, with the image height patched in
+ * and a DRI marker added. The entropy-coded data of every slice follows,
+ * separated by RST0..RST7 in turn.
+ */
+int SliceEncoder::stitch( unsigned char* destination, unsigned long capacity, int height, int restartInterval )
+{
+    size_t used = 0;
+    auto put = [ & ]( const void* data, size_t size )
+    {
+        if ( used + size > capacity )
+            throw std::runtime_error( "JPEG compression failed!" );
+        memcpy( destination + used, data, size );
+        used += size;
+    };
+
+    for ( size_t i = 0; i < slices.size(); i++ )
+    {
+        const unsigned char* data = slices[ i ].buffer.data();
+        size_t frameHeader, scanHeader, scanData;
+        if ( !findScan( data, slices[ i ].size, frameHeader, scanHeader, scanData ) || slices[ i ].size < scanData + 2 )
+            throw std::runtime_error( "JPEG compression failed!" );
+
+        if ( i == 0 )
+        {
+            // Everything up to the scan, with the full height in the frame header
+            put( data, scanHeader );
+            destination[ frameHeader + 5 ] = (unsigned char)( height >> 8 );
+            destination[ frameHeader + 6 ] = (unsigned char)( height & 0xFF );
+
+            const unsigned char restart[] = { 0xFF, 0xDD, 0x00, 0x04,
+                                              (unsigned char)( restartInterval >> 8 ), (unsigned char)( restartInterval & 0xFF ) };
+            put( restart, sizeof( restart ) );
+            put( data + scanHeader, scanData - scanHeader );
+        }
+        else
+        {
+            const unsigned char marker[] = { 0xFF, (unsigned char)( 0xD0 + ( i - 1 ) % 8 ) };
+            put( marker, sizeof( marker ) );
+        }
+
+        // Entropy-coded data, without the trailing EOI
+        put( data + scanData, slices[ i ].size - 2 - scanData );
+    }
+
+    const unsigned char end[] = { 0xFF, 0xD9 };
+    put( end, sizeof( end ) );
+    return (int)used;
+}
@@ -10,9 +10,20 @@
 #include "streamer.h"
 #include "seq_writer.h"
 #include "exceptions.h"
+#include "pugixml.hpp"
+#include "throughput_probe.h"
+#include "encoder_tuner.h"
+#include "compactor.h"
+
+// Libraries
+#include <QTCore/QDir>
 #include <math.h>
 
 #include <sstream>
+#include <map>
+#include <algorithm>
+#include <climits>
+#include <future>
 
 Streamer *Streamer::transporterObject = NULL;
 /**
@@ -20,6 +31,7 @@ Streamer *Streamer::transporterObject = NULL;
  * @arg None
  */
 Streamer::Streamer( CameraController* _camera )
+    : qos( UI_UPDATE_RATE, SEQWriter::JPEG_QUALITY )
 {
     // Default values
 	maxDepthMM = MAX_DEPTH_DEFAULT;
@@ -40,6 +52,10 @@ Streamer::Streamer( CameraController* _camera )
     seqWriters[ Channels::Depth ] = new SEQWriter( Channels::Depth );
 	seqWriters[Channels::IR] = new SEQWriter(Channels::IR);
 
+	// Only the Point Grey channels can record a moving crop with a context file
+	for ( int i = 0; i < N_CHANNELS; i++ )
+		contextWriters[ i ] = ( i <= Channels::PointGreyFront ) ? new SEQWriter( (Channels)i ) : NULL;
+
 	/* ROIs */
 	ROIs[ CameraController::Cameras::PointGreyTop ][ ROICoordinates::X ] = 0;
 	ROIs[ CameraController::Cameras::PointGreyTop ][ ROICoordinates::Y ] = 0;
@@ -71,8 +87,39 @@ Streamer::Streamer( CameraController* _camera )
 
 	isPGswitched = false;
 
+	// Everything under the working directory until configured otherwise
+	outputMode = OutputMode::SingleRoot;
+	for ( int i = 0; i < N_CHANNELS; i++ )
+	{
+		sessionChannels[ i ] = false;
+		sessionDeferred[ i ] = false;
+		sessionCropped[ i ] = false;
+		sessionContextInterval[ i ] = 0;
+	}
+
+	// Half the cores compress deferred recordings; the rest are left for the user
+	deferredCompression = false;
+	sessionGated = false;
+	depthTracking = false;
+	sessionTracked = false;
+	sessionTriggered = false;
+	compactor = new Compactor( (std::max)( (int)std::thread::hardware_concurrency() / 2, 1 ) );
+
+	// Processor workers are created now, so that streaming and recording start without creating threads
+	pipeline = new PipelineExecutor( PipelineExecutor::DEFAULT_WORKERS );
+	for ( int i = 0; i < N_CHANNELS; i++ )
+	{
+		crossNodeHandoffs[ i ] = 0;
+		crossNodeFrames[ i ] = 0;
+		framePoolStale[ i ] = false;
+		processorActive[ i ] = false;
+	}
+	allocateFramePools();
+
 	// Overall streaming indicator
 	running = false;
+	transporting = false;
+	recording = false;
 	
 	// Overall recording indicator
 	record = false;
@@ -83,6 +130,20 @@ Streamer::Streamer( CameraController* _camera )
     // We really should only have one of these.
     transporterObject = this;
 
+	// Off until configured; no frame set is recorded until a recording starts
+	saving = false;
+	frameSets = 0;
+	recordFirstSet = 0;
+	recordEndSet = 0;
+	sessionDrained = true;
+	for ( int i = 0; i < N_CHANNELS; i++ )
+	{
+		drained[ i ] = true;
+		channelOpen[ i ] = false;
+		sessionUnwritten[ i ] = 0;
+	}
+	controlServer = new ControlServer( this, camera );
+
 	startTime = chrono::high_resolution_clock::now();
 }
 
@@ -92,10 +153,30 @@ Streamer::Streamer( CameraController* _camera )
  */
 Streamer::~Streamer( void )
 {
-    // Stop image transporters
+	// No more commands from scripts
+	delete controlServer;
+
+	// Stop the transporter first, so that no stop it still has queued can race the one below.
+	// Commands it did not get to are dropped.
+	transporting = false;
+	if ( transporterThread.joinable() )
+		transporterThread.join();
+
+	// No more sets are assembled, so this is between two of them. A recording still running
+	// is written out in full, by the processors, which are still running.
+	stopRecording();
+	waitForStop();
+
+    // Stop the processors, and wait for each to finish what it is doing
 	running = false;
 	camera->getDepthSenseContext().quit();
-	this_thread::sleep_for(std::chrono::milliseconds(1000)); // give threads time to react and shut down
+	pipeline->stop();
+	delete pipeline;
+	if ( depthSenseThread.joinable() )
+		depthSenseThread.join();
+
+	// Recordings not compressed yet stay raw
+	delete compactor;
 }
 
 /**
@@ -124,25 +205,817 @@ void Streamer::setCompressed( CameraController::Cameras camera, bool compressed
     streamAttributes[ camera ].compressed = compressed;
 }
 
+/**
+ * @brief Selects the storage backend for all SEQ writers.
+ * @param backend The backend.
+ * @param queueDepth Maximum number of writes in flight per file (asynchronous backends only).
+ * @note Takes effect on the next recording.
+ */
+void Streamer::setStorageBackend( SEQStorage::Backend backend, int queueDepth )
+{
+    for ( int i = 0; i < N_CHANNELS; i++ )
+    {
+        seqWriters[ i ]->setStorageBackend( backend, queueDepth );
+        if ( contextWriters[ i ] )
+            contextWriters[ i ]->setStorageBackend( backend, queueDepth );
+    }
+}
+
+/**
+ * @brief Accessor for the storage backend.
+ * @arg None.
+ * @returns The backend used for recordings.
+ */
+SEQStorage::Backend Streamer::getStorageBackend()
+{
+    return seqWriters[ Channels::PointGreyTop ]->getStorageBackend();
+}
+
+/**
+ * @brief Accessor for the storage queue depth.
+ * @arg None.
+ * @returns Maximum number of writes in flight per file.
+ */
+int Streamer::getStorageQueueDepth()
+{
+    return seqWriters[ Channels::PointGreyTop ]->getQueueDepth();
+}
+
+/**
+ * @brief Sets a target bitrate for a channel's JPEG stream.
+ * @param channel The channel.
+ * @param targetBytesPerSecond Target average rate; 0 for a fixed quality.
+ * @param minQuality Lowest quality the rate controller may choose.
+ * @param maxQuality Highest quality the rate controller may choose.
+ * @note Takes effect on the next recording.
+ */
+void Streamer::setRateControl( Channels channel, double targetBytesPerSecond, int minQuality, int maxQuality )
+{
+    seqWriters[ channel ]->setRateControl( targetBytesPerSecond, minQuality, maxQuality );
+}
+
+/**
+ * @brief Accessor for a channel's target bitrate.
+ * @param channel The channel.
+ * @returns Target bytes per second; 0 if rate control is off.
+ */
+double Streamer::getRateTarget( Channels channel )
+{
+    return seqWriters[ channel ]->getRateTarget();
+}
+
+/**
+ * @brief Accessor for a channel's lowest rate-controlled quality.
+ * @param channel The channel.
+ * @returns Lowest quality.
+ */
+int Streamer::getRateMinQuality( Channels channel )
+{
+    return seqWriters[ channel ]->getRateMinQuality();
+}
+
+/**
+ * @brief Accessor for a channel's highest rate-controlled quality.
+ * @param channel The channel.
+ * @returns Highest quality.
+ */
+int Streamer::getRateMaxQuality( Channels channel )
+{
+    return seqWriters[ channel ]->getRateMaxQuality();
+}
+
+/**
+ * @brief Sets how a channel's JPEG stream is encoded.
+ * @param channel The channel.
+ * @param profile The encoder profile.
+ * @note Takes effect on the next recording.
+ */
+void Streamer::setEncoderProfile( Channels channel, const EncoderProfile& profile )
+{
+    seqWriters[ channel ]->setEncoderProfile( profile );
+    if ( contextWriters[ channel ] )
+        contextWriters[ channel ]->setEncoderProfile( profile );
+}
+
+/**
+ * @brief Accessor for a channel's encoder profile.
+ * @param channel The channel.
+ * @returns The profile.
+ */
+EncoderProfile Streamer::getEncoderProfile( Channels channel )
+{
+    return seqWriters[ channel ]->getEncoderProfile();
+}
+
+/**
+ * @brief Selects the residual codec for a Point Grey channel's JPEG stream.
+ * @param channel The channel.
+ * @param settings Whether the codec is used, its threshold and keyframe interval.
+ * @note Takes effect on the next recording. Only grayscale channels use the codec.
+ */
+void Streamer::setResidualCodec( Channels channel, const ResidualSettings& settings )
+{
+    seqWriters[ channel ]->setResidualCodec( settings );
+}
+
+/**
+ * @brief Accessor for a channel's residual codec settings.
+ * @param channel The channel.
+ * @returns The settings.
+ */
+ResidualSettings Streamer::getResidualCodec( Channels channel )
+{
+    return seqWriters[ channel ]->getResidualCodec();
+}
+
+/**
+ * @brief Configures the motion gate, which pauses recording while nothing moves.
+ * @param settings Whether the gate is used, the Point Grey channel it watches, its threshold, hold time and pre-roll.
+ * @note Takes effect on the next recording. The gate only acts while its channel is recorded.
+ */
+void Streamer::setMotionGate( const MotionGateSettings& settings )
+{
+    motionGateSettings = settings;
+}
+
+/**
+ * @brief Accessor for the motion gate settings.
+ * @arg None.
+ * @returns The settings.
+ */
+MotionGateSettings Streamer::getMotionGate()
+{
+    return motionGateSettings;
+}
+
+/**
+ * @brief Selects whether a Point Grey channel records a crop that follows the animal.
+ * @param channel The channel; other channels are ignored.
+ * @param settings Whether the crop is used, its size, and how often the whole ROI is recorded for context.
+ * @note Takes effect on the next recording.
+ */
+void Streamer::setDynamicCrop( Channels channel, const DynamicCropSettings& settings )
+{
+    if ( contextWriters[ channel ] )
+        cropSettings[ channel ] = settings;
+}
+
+/**
+ * @brief Accessor for a channel's dynamic crop settings.
+ * @param channel The channel.
+ * @returns The settings; never enabled for channels other than the Point Grey ones.
+ */
+DynamicCropSettings Streamer::getDynamicCrop( Channels channel )
+{
+    return cropSettings[ channel ];
+}
+
+/**
+ * @brief Selects whether the animal is tracked on the depth stream while recording.
+ * @param tracking If true, recordings that include depth get a tracking sidecar.
+ * @note Takes effect on the next recording.
+ */
+void Streamer::setDepthTracking( bool tracking )
+{
+    depthTracking = tracking;
+}
+
+/**
+ * @brief Accessor for depth tracking.
+ * @arg None.
+ * @returns Whether the animal is tracked on the depth stream.
+ */
+bool Streamer::getDepthTracking()
+{
+    return depthTracking;
+}
+
+/**
+ * @brief Configures the closed-loop triggers, which fire an output when the animal enters or leaves a zone.
+ * @param zones The zones, on Point Grey or depth channels; none to switch the triggers off.
+ * @note Takes effect on the next recording. Triggers are only armed while recording.
+ */
+void Streamer::setTriggerZones( const std::vector<TriggerZone>& zones )
+{
+    triggers.setZones( zones );
+}
+
+/**
+ * @brief Accessor for the trigger zones.
+ * @arg None.
+ * @returns The zones.
+ */
+std::vector<TriggerZone> Streamer::getTriggerZones()
+{
+    return triggers.getZones();
+}
+
+/**
+ * @brief Configures the frame bus, which publishes every frame set in shared memory for other processes.
+ * @param settings Whether the bus is used, its name and its size.
+ * @returns Whether the bus is up, or false if it is not enabled or could not be created.
+ * @note Takes effect immediately; readers of a previous bus must map the new one.
+ */
+bool Streamer::setFrameBus( const FrameBusSettings& settings )
+{
+    frameBusSettings = settings;
+    frameBus.close();
+    return settings.enabled && frameBus.open( settings );
+}
+
+/**
+ * @brief Accessor for the frame bus settings.
+ * @arg None.
+ * @returns The settings.
+ */
+FrameBusSettings Streamer::getFrameBus()
+{
+    return frameBusSettings;
+}
+
+/**
+ * @brief Selects whether JPEG channels are compressed while recording or afterwards.
+ * @param deferred If true, JPEG channels are recorded raw and compressed in the background once the recording stops.
+ * @note Takes effect on the next recording.
+ */
+void Streamer::setDeferredCompression( bool deferred )
+{
+    deferredCompression = deferred;
+}
+
+/**
+ * @brief Accessor for deferred compression.
+ * @arg None.
+ * @returns Whether JPEG channels are compressed after recording.
+ */
+bool Streamer::getDeferredCompression()
+{
+    return deferredCompression;
+}
+
+/**
+ * @brief Configures the control server, which lets scripts on this machine drive the recorder.
+ * @param settings Whether the server is used, and its port.
+ * @returns Whether the server is listening, or false if it is not enabled or the port is taken.
+ * @note Takes effect immediately; connected clients are dropped.
+ */
+bool Streamer::setControlServer( const ControlServerSettings& settings )
+{
+    controlServerSettings = settings;
+    controlServer->close();
+    return settings.enabled && controlServer->open( settings );
+}
+
+/**
+ * @brief Accessor for the control server settings.
+ * @arg None.
+ * @returns The settings.
+ */
+ControlServerSettings Streamer::getControlServer()
+{
+    return controlServerSettings;
+}
+
+/**
+ * @brief Places the processor workers on cores, and sets their priority.
+ * @param settings Core of each worker, and their priority.
+ * @returns Whether every worker could be placed as configured.
+ * @note Takes effect immediately.
+ */
+bool Streamer::setPipeline( const PipelineSettings& settings )
+{
+    pipelineSettings = settings;
+    bool placed = pipeline->configure( settings );
+    allocateFramePools();
+    return placed;
+}
+
+/**
+ * @brief Accessor for the pipeline settings.
+ * @arg None.
+ * @returns The settings.
+ */
+PipelineSettings Streamer::getPipeline()
+{
+    return pipelineSettings;
+}
+
+/**
+ * @brief Chooses how frame and staging buffers are allocated: on large pages, or locked in memory.
+ * @param settings Whether to use large pages, and whether to lock ordinary pages while streaming.
+ * @note Frame pools not in use are allocated again right away, the others when their channel next starts; staging buffers on the next recording.
+ */
+void Streamer::setBufferMemory( const BufferMemorySettings& settings )
+{
+    bufferMemory = settings;
+    for ( int i = 0; i < N_CHANNELS; i++ )
+    {
+        framePools[ i ].setMemory( settings );
+        seqWriters[ i ]->setMemory( settings );
+        if ( contextWriters[ i ] )
+            contextWriters[ i ]->setMemory( settings );
+    }
+    allocateFramePools();
+}
+
+/**
+ * @brief Accessor for the buffer memory settings.
+ * @arg None.
+ * @returns The settings.
+ */
+BufferMemorySettings Streamer::getBufferMemory()
+{
+    return bufferMemory;
+}
+
+/**
+ * @brief Number of recorded files still waiting for deferred compression.
+ * @arg None.
+ * @returns Files not yet compressed.
+ */
+int Streamer::pendingCompactions()
+{
+    return compactor->pending();
+}
+
+/**
+ * @brief Progress of a channel's recording, for reporting while it runs.
+ * @param channel The channel.
+ * @returns Its status; the counts are those of the last recording once it stops.
+ */
+Streamer::ChannelStatus Streamer::getChannelStatus( Channels channel )
+{
+    ChannelStatus status;
+    status.recording = recording && sessionChannels[ channel ];
+    status.frames = seqWriters[ channel ]->getFrameCount();
+    status.bytes = seqWriters[ channel ]->getFileSize();
+
+    // IR frames arrive with the depth frames, so they are dropped with them
+    SynchronizationQueue& queue = synchronizationQueues[ channel == Channels::IR ? Channels::Depth : channel ];
+    queue.mutex.lock();
+    status.dropped = (int)queue.dropped_frames.size();
+    queue.mutex.unlock();
+    status.crossNodeHandoffs = crossNodeHandoffs[ channel ];
+    status.crossNodeFrames = crossNodeFrames[ channel ];
+    status.failedWrites = seqWriters[ channel ]->getFailedWrites();
+    return status;
+}
+
+/**
+ * @brief Current step of the degradation ladder.
+ * @arg None.
+ * @returns The QoS level.
+ */
+QoSController::Level Streamer::getQoSLevel()
+{
+    return qos.level();
+}
+
+/**
+ * @brief Whether a recording is running.
+ * @arg None.
+ * @returns True from the end of startRecording() to the start of stopRecording().
+ */
+bool Streamer::isRecording()
+{
+    return recording;
+}
+
+/**
+ * @brief Whether a stopped recording is still being written out.
+ * @arg None.
+ * @returns True from stopRecording() until its files are closed and onStopSavingEvent is emitted.
+ */
+bool Streamer::isSaving()
+{
+    return saving;
+}
+
+/**
+ * @brief Number of frame sets assembled so far.
+ * @arg None.
+ * @returns Sets since the cameras started, including sets dropped because the queues were full.
+ */
+unsigned long long Streamer::getFrameSets()
+{
+    return frameSets;
+}
+
+/**
+ * @brief Whether a frame set belongs to the current (or last) recording.
+ * @param frameSet Number of the set.
+ * @returns True if the set was assembled between startRecording() and stopRecording().
+ */
+bool Streamer::isRecordedSet( unsigned long long frameSet )
+{
+    return frameSet >= recordFirstSet && frameSet < recordEndSet;
+}
+
+/**
+ * @brief Note when a stopping recording has no more sets waiting on a channel.
+ * @param channel The channel, as processed by imageProcessor.
+ * @returns void.
+ */
+void Streamer::checkDrained( Channels channel )
+{
+    if ( drained[ channel ] )
+        return;
+
+    frameQueues[ channel ].mutex.lock();
+    bool done = frameQueues[ channel ].queue.empty() || frameQueues[ channel ].queue.front()->frameSet >= recordEndSet;
+    frameQueues[ channel ].mutex.unlock();
+    if ( !done )
+        return;
+
+    lock_guard<std::mutex> lock( drainMutex );
+    drained[ channel ] = true;
+    drainCondition.notify_all();
+}
+
+/**
+ * @brief Have the transporter thread run a command between two frame sets.
+ * @param command The command. It must not refer to anything on the caller's stack: if the wait times out, it still runs later.
+ * @param frameSet Out: number of the first frame set assembled after the command ran.
+ * @returns Whether the command ran within BOUNDARY_TIMEOUT_MS.
+ */
+bool Streamer::runAtFrameSetBoundary( std::function<void()> command, unsigned long long& frameSet )
+{
+    auto done = make_shared<promise<unsigned long long>>();
+    future<unsigned long long> result = done->get_future();
+    boundaryMutex.lock();
+    boundaryCommands.push_back( [ this, command, done ]() {
+        command();
+        done->set_value( frameSets );
+    } );
+    boundaryMutex.unlock();
+
+    if ( result.wait_for( chrono::milliseconds( BOUNDARY_TIMEOUT_MS ) ) != future_status::ready )
+        return false;
+    frameSet = result.get();
+    return true;
+}
+
+/**
+ * @brief Have the transporter thread run a command between two frame sets, or call it off if that takes too long.
+ * @param command The command. It must not refer to anything on the caller's stack.
+ * @param frameSet Out: number of the first frame set assembled after the command ran.
+ * @returns Whether the command ran. If not, it never will.
+ *
+ * For commands that must not take effect long after the caller gave up on them, like a start
+ * nobody would stop. The command runs under the cancel's mutex, so once the wait is called off,
+ * it has either run to the end or never will.
+ */
+bool Streamer::tryAtFrameSetBoundary( std::function<void()> command, unsigned long long& frameSet )
+{
+    struct Cancel
+    {
+        std::mutex mutex;
+        bool cancelled = false;
+        bool ran = false;
+        unsigned long long frameSet = 0;
+    };
+    auto cancel = make_shared<Cancel>();
+    if ( runAtFrameSetBoundary( [ this, command, cancel ]() {
+        lock_guard<std::mutex> lock( cancel->mutex );
+        if ( cancel->cancelled )
+            return;
+        command();
+        cancel->ran = true;
+        cancel->frameSet = frameSets;
+    }, frameSet ) )
+        return true;
+
+    // It may have run just as the wait timed out
+    lock_guard<std::mutex> lock( cancel->mutex );
+    cancel->cancelled = true;
+    frameSet = cancel->frameSet;
+    return cancel->ran;
+}
+
+/**
+ * @brief Have the transporter thread run a command between two frame sets, without waiting for it.
+ * @param command The command. It must not refer to anything on the caller's stack.
+ * @returns void.
+ */
+void Streamer::postAtFrameSetBoundary( std::function<void()> command )
+{
+    lock_guard<std::mutex> lock( boundaryMutex );
+    boundaryCommands.push_back( command );
+}
+
+/**
+ * @brief Run the commands waiting for a frame set boundary. Called by the transporter thread only.
+ * @arg None.
+ * @returns void.
+ */
+void Streamer::runBoundaryCommands()
+{
+    boundaryMutex.lock();
+    std::deque<std::function<void()>> commands;
+    commands.swap( boundaryCommands );
+    boundaryMutex.unlock();
+
+    for ( auto& command : commands )
+        command();
+}
+
 /**
  * @brief Saves a snapshot from a camera stream.
  * @param camera The camera the attribute should be changed for.
  *
- * @note The stream must be streaming for this to take immediate effect.
+ * @note The stream must be streaming for this to take immediate effect.
+ */
+void Streamer::saveSnapshot( CameraController::Cameras camera )
+{
+    streamAttributes[ camera ].shouldSnap = true;
+}
+
+/**
+ * @brief Change the working directory
+ * @param workingDir The new working directory.
+ * @returns void.
+ */
+void Streamer::setCurrentWorkingDir( string workingDir )
+{
+	this->workingDir = workingDir + "/";
+}
+
+/**
+ * @brief Spread recordings over several output roots (typically one per drive).
+ * @param mode How roots are assigned to channels.
+ * @param roots Per channel: one directory per channel, indexed by channel, empty for the working directory.
+ *              Round robin: the directories, in the order they are dealt out.
+ * @returns void.
+ * @note Takes effect on the next recording.
+ */
+void Streamer::setOutputRoots( OutputMode mode, std::vector<std::string> roots )
+{
+	if ( mode == OutputMode::PerChannelRoots )
+		roots.resize( N_CHANNELS );
+	if ( mode == OutputMode::RoundRobinRoots && roots.empty() )
+		mode = OutputMode::SingleRoot;
+
+	outputMode = mode;
+	outputRoots = roots;
+}
+
+/**
+ * @brief Accessor for the output root assignment mode.
+ * @arg None.
+ * @returns The mode.
+ */
+Streamer::OutputMode Streamer::getOutputMode()
+{
+	return outputMode;
+}
+
+/**
+ * @brief Accessor for the output roots.
+ * @arg None.
+ * @returns The roots, as passed to setOutputRoots().
+ */
+std::vector<std::string> Streamer::getOutputRoots()
+{
+	return outputRoots;
+}
+
+/**
+ * @brief Directory a channel's recordings folder goes in.
+ * @param channel The channel.
+ * @returns The directory, with a trailing slash.
+ *
+ * In round robin mode the Point Grey streams each get a root of their own, since they
+ * are by far the largest, and the DepthSense streams share the next one.
+ */
+std::string Streamer::getOutputDir( Channels channel )
+{
+	std::string root;
+	switch ( outputMode )
+	{
+	case OutputMode::PerChannelRoots:
+		root = outputRoots[ channel ];
+		break;
+	case OutputMode::RoundRobinRoots:
+		root = outputRoots[ (std::min)( (int)channel, (int)Channels::Color ) % outputRoots.size() ];
+		break;
+	default:
+		break;
+	}
+
+	if ( root.empty() )
+		return workingDir;
+	if ( root.back() != '/' && root.back() != '\\' )
+		root += "/";
+	return root;
+}
+
+/**
+ * @brief Common start of the paths of the current (or last) recording's session files.
+ * @arg None.
+ * @returns The working directory's recordings folder and Mouse_<date>.
+ */
+std::string Streamer::getSessionPrefix()
+{
+	return workingDir + "recordings/Mouse_" + sessionDateTime;
+}
+
+/**
+ * @brief Path of the current (or last) recording's manifest.
+ * @arg None.
+ * @returns Path in the working directory's recordings folder.
+ */
+std::string Streamer::getManifestPath()
+{
+	return getSessionPrefix() + "_manifest.xml";
+}
+
+/**
+ * @brief Start following the animal on a Point Grey channel, if it records a moving crop.
+ * @param channel The channel.
+ * @param dateTime The recording's timestamp; the context file's is the same with "-context" appended.
+ * @returns void.
+ *
+ * The crop sidecar is named after the session and the channel's file name; the
+ * context file is recorded at the channel's compression, never deferred, as
+ * it is small.
  */
-void Streamer::saveSnapshot( CameraController::Cameras camera )
+void Streamer::startDynamicCrop( Channels channel, std::string dateTime )
 {
-    streamAttributes[ camera ].shouldSnap = true;
+	const DynamicCropSettings& settings = cropSettings[ channel ];
+	sessionCropped[ channel ] = settings.enabled;
+	sessionContextInterval[ channel ] = settings.enabled ? (std::max)( settings.contextInterval, 0 ) : 0;
+	if ( !settings.enabled )
+		return;
+
+	QSize roi( ROIs[ channel ][ ROICoordinates::W ], ROIs[ channel ][ ROICoordinates::H ] );
+	std::string name = getSessionPrefix() + "_" + SEQWriter::fileNameChannels[ SEQWriter::fileChannel( channel, isPGswitched ) ];
+	cropTrackers[ channel ].start( settings, roi, QString::fromStdString( name ) );
+	if ( sessionContextInterval[ channel ] > 0 )
+		contextWriters[ channel ]->startRecording( getOutputDir( channel ), roi.width(), roi.height(),
+		                                           streamAttributes[ channel ].compressed,
+		                                           dateTime + "-context", isPGswitched,
+		                                           getFrameRate( channel ) / sessionContextInterval[ channel ] );
 }
 
 /**
- * @brief Change the working directory
- * @param workingDir The new working directory.
+ * @brief Record where each file of the current recording went.
+ * @param complete Whether the recording has stopped and the frame counts are final.
  * @returns void.
+ *
+ * The manifest is written to the working directory's recordings folder when recording
+ * starts, and again with frame counts and sizes when it stops.
  */
-void Streamer::setCurrentWorkingDir( string workingDir )
+void Streamer::writeSessionManifest( bool complete )
 {
-	this->workingDir = workingDir + "/";
+	pugi::xml_document doc;
+	pugi::xml_node decl = doc.prepend_child( pugi::node_declaration );
+	decl.append_attribute( "version" ) = "1.0";
+	decl.append_attribute( "encoding" ) = "UTF-8";
+
+	pugi::xml_node session = doc.append_child( "session" );
+	session.append_attribute( "dateTime" ) = sessionDateTime.c_str();
+	session.append_attribute( "complete" ) = complete;
+	if ( complete )
+	{
+		// Every channel's frames belong to the sets from the first up to, not including, the end
+		session.append_attribute( "firstFrameSet" ) = to_string( recordFirstSet.load() ).c_str();
+		session.append_attribute( "endFrameSet" ) = to_string( recordEndSet.load() ).c_str();
+		if ( !sessionDrained )
+			session.append_attribute( "drained" ) = false; // See the unwritten counts of the drops
+	}
+
+	for ( int c = 0; c < N_CHANNELS; c++ )
+	{
+		if ( !sessionChannels[ c ] )
+			continue;
+
+		pugi::xml_node file = session.append_child( "file" );
+		file.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ c ].c_str();
+		file.append_attribute( "root" ) = getOutputDir( (Channels)c ).c_str();
+		if ( sessionDeferred[ c ] )
+			file.append_attribute( "deferred" ) = true; // Raw until the compactor replaces it
+		if ( complete )
+		{
+			file.append_attribute( "frames" ) = seqWriters[ c ]->getFrameCount();
+			file.append_attribute( "bytes" ) = (long long)seqWriters[ c ]->getFileSize();
+			if ( seqWriters[ c ]->getFailedWrites() )
+				file.append_attribute( "failedWrites" ) = seqWriters[ c ]->getFailedWrites(); // The file is incomplete
+		}
+		file.append_child( pugi::node_pcdata ).set_value( seqWriters[ c ]->getFileName().toStdString().c_str() );
+	}
+
+	// Moving crops: the crop of each frame is in the crop sidecar, and the whole ROI in the context file
+	for ( int c = 0; c < N_CHANNELS; c++ )
+	{
+		if ( !sessionChannels[ c ] || !sessionCropped[ c ] )
+			continue;
+
+		Channels named = SEQWriter::fileChannel( (Channels)c, isPGswitched );
+		pugi::xml_node crop = session.append_child( "crop" );
+		crop.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ named ].c_str();
+		crop.append_attribute( "width" ) = cropTrackers[ c ].getSize().width();
+		crop.append_attribute( "height" ) = cropTrackers[ c ].getSize().height();
+		crop.append_attribute( "contextInterval" ) = sessionContextInterval[ c ];
+		QString sidecar = SidecarWriter::pathFor( QString::fromStdString( getSessionPrefix() + "_" + SEQWriter::fileNameChannels[ named ] ), "crop" );
+		crop.append_child( pugi::node_pcdata ).set_value( sidecar.toStdString().c_str() );
+
+		if ( sessionContextInterval[ c ] == 0 )
+			continue;
+		pugi::xml_node file = session.append_child( "file" );
+		file.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ c ].c_str();
+		file.append_attribute( "root" ) = getOutputDir( (Channels)c ).c_str();
+		file.append_attribute( "context" ) = true;
+		if ( complete )
+		{
+			file.append_attribute( "frames" ) = contextWriters[ c ]->getFrameCount();
+			file.append_attribute( "bytes" ) = (long long)contextWriters[ c ]->getFileSize();
+			if ( contextWriters[ c ]->getFailedWrites() )
+				file.append_attribute( "failedWrites" ) = contextWriters[ c ]->getFailedWrites();
+		}
+		file.append_child( pugi::node_pcdata ).set_value( contextWriters[ c ]->getFileName().toStdString().c_str() );
+	}
+
+	// Frame sets the motion gate kept from being written; each pause is in the events sidecar
+	if ( sessionGated )
+	{
+		pugi::xml_node gate = session.append_child( "motionGate" );
+		gate.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ motionGateSettings.channel ].c_str();
+		gate.append_attribute( "threshold" ) = motionGateSettings.threshold;
+		gate.append_attribute( "holdSeconds" ) = motionGateSettings.holdSeconds;
+		gate.append_attribute( "preRollFrames" ) = motionGateSettings.preRollFrames;
+		if ( complete )
+		{
+			gate.append_attribute( "pauses" ) = motionGate.getPauses();
+			gate.append_attribute( "skippedSets" ) = motionGate.getSkippedSets();
+		}
+		QString events = SidecarWriter::pathFor( QString::fromStdString( getSessionPrefix() ), "events" );
+		gate.append_child( pugi::node_pcdata ).set_value( events.toStdString().c_str() );
+	}
+
+	// Where the animal was in each depth frame
+	if ( sessionTracked )
+	{
+		pugi::xml_node tracking = session.append_child( "tracking" );
+		if ( complete )
+		{
+			tracking.append_attribute( "frames" ) = depthTracker.getFrames();
+			tracking.append_attribute( "skipped" ) = depthTracker.getSkipped();
+			tracking.append_attribute( "meanMs" ) = depthTracker.getMeanMilliseconds();
+			tracking.append_attribute( "maxMs" ) = depthTracker.getMaxMilliseconds();
+		}
+		QString sidecar = SidecarWriter::pathFor( QString::fromStdString( getSessionPrefix() ), "tracking" );
+		tracking.append_child( pugi::node_pcdata ).set_value( sidecar.toStdString().c_str() );
+	}
+
+	// Closed-loop trigger events, and how long they took from the callback to the sink
+	if ( sessionTriggered )
+	{
+		pugi::xml_node triggerNode = session.append_child( "triggers" );
+		triggerNode.append_attribute( "zones" ) = (unsigned int)triggers.getZones().size();
+		if ( complete )
+		{
+			triggerNode.append_attribute( "events" ) = triggers.getEvents();
+			triggerNode.append_attribute( "p50Us" ) = triggers.getLatencyPercentile( 50 );
+			triggerNode.append_attribute( "p99Us" ) = triggers.getLatencyPercentile( 99 );
+			triggerNode.append_attribute( "maxUs" ) = triggers.getMaxLatency();
+			triggerNode.append_attribute( "dropped" ) = triggers.getDropped(); // The sinks could not keep up
+		}
+		QString sidecar = SidecarWriter::pathFor( QString::fromStdString( getSessionPrefix() ), "triggers" );
+		triggerNode.append_child( pugi::node_pcdata ).set_value( sidecar.toStdString().c_str() );
+	}
+
+	// Frames dropped because processing fell behind, and sets not written in time when the recording stopped.
+	// IR frames arrive with the depth frames.
+	for ( int c = 0; complete && c < Channels::IR; c++ )
+	{
+		if ( !sessionChannels[ c ] )
+			continue;
+
+		std::lock_guard<std::mutex> lock( synchronizationQueues[ c ].mutex );
+		pugi::xml_node drops = session.append_child( "drops" );
+		drops.append_attribute( "channel" ) = SEQWriter::fileNameChannels[ c ].c_str();
+		drops.append_attribute( "count" ) = (unsigned int)synchronizationQueues[ c ].dropped_frames.size();
+		if ( sessionUnwritten[ c ] > 0 )
+			drops.append_attribute( "unwritten" ) = sessionUnwritten[ c ];
+		for ( auto& dropped : synchronizationQueues[ c ].dropped_frames )
+		{
+			pugi::xml_node drop = drops.append_child( "drop" );
+			drop.append_attribute( "index" ) = (unsigned long long)dropped.index;
+			drop.append_attribute( "seconds" ) = dropped.timestampSeconds;
+			drop.append_attribute( "milliseconds" ) = dropped.timestampMilliSeconds;
+		}
+		synchronizationQueues[ c ].log_drops = false;
+	}
+
+	QString directory = QString::fromStdString( workingDir + "recordings/" );
+	QDir().mkpath( directory );
+	std::string path = getManifestPath();
+	if ( !doc.save_file( path.c_str() ) )
+	{
+#ifdef DEBUG
+		qDebug() << "Could not write session manifest" << path.c_str() << endl;
+#endif
+	}
 }
 
 /**
@@ -208,20 +1081,62 @@ void SingleFrameBuffer::push(CameraFrame* frame) {
 }
 */
 
+/**
+* @brief Push a CameraFrame to the queue, dropping the oldest frame if the queue is full.
+* @param frame The CameraFrame to be pushed.
+* @returns void.
+*/
 void SynchronizationQueue::push(CameraFrame* frame) {
 	mutex.lock();
+	frame->frameIndex = next_index++;
 	if (current_frame_queue.size() >= max_synchronization_queue_size) {
-		auto temp = current_frame_queue.front();
-		current_frame_queue.pop();
-		delete temp;
-#ifdef DEBUG
-		qDebug() << "dropped a frame!" << endl;
-#endif
+		dropFront();
 	}
 	current_frame_queue.push(frame);
 	mutex.unlock();
 }
 
+/**
+* @brief Drop the oldest frame, recording it if drops are being logged. The caller must hold the mutex.
+* @arg None
+* @returns void.
+*/
+void SynchronizationQueue::dropFront() {
+	auto temp = current_frame_queue.front();
+	current_frame_queue.pop();
+	if (log_drops) {
+		dropped_frames.push_back({ temp->frameIndex, temp->timestampSeconds, temp->timestampMilliSeconds });
+	}
+#ifdef DEBUG
+	qDebug() << "dropped frame" << temp->frameIndex << endl;
+#endif
+	delete temp;
+}
+
+/**
+* @brief Start a new drop log, e.g. when a recording starts. Frame indices restart at 0.
+* @arg None
+* @returns void.
+*/
+void SynchronizationQueue::startLog() {
+	mutex.lock();
+	next_index = 0;
+	dropped_frames.clear();
+	log_drops = true;
+	mutex.unlock();
+}
+
+/**
+* @brief Stop logging drops, e.g. when a recording stops. The log is kept for the manifest.
+* @arg None
+* @returns void.
+*/
+void SynchronizationQueue::stopLog() {
+	mutex.lock();
+	log_drops = false;
+	mutex.unlock();
+}
+
 /**
  * @brief Pop a CameraFrame from the back of the queue.
  * @arg None
@@ -244,12 +1159,18 @@ CameraFrame* FrameQueue::pop()
 * @returns void
 */
 void Streamer::imageTransporter() {
-	while (running) {
+	while (running && transporting) {
+		// Commands from the control server go in between frame sets
+		runBoundaryCommands();
+
+		// Recordings start and stop between two sets, so every set has either all of its recorded channels or none
+		setMutex.lock();
 		checkFrameBuffer(
 			(streamAttributes[Channels::PointGreyTop].streaming || (streamAttributes[Channels::PointGreyTop].recording && recording)),
 			(streamAttributes[Channels::PointGreyFront].streaming || (streamAttributes[Channels::PointGreyFront].recording && recording)),
 			(streamAttributes[Channels::Depth].streaming || (streamAttributes[Channels::Depth].recording && recording)),
 			(streamAttributes[Channels::Color].streaming || (streamAttributes[Channels::Color].recording && recording)));
+		setMutex.unlock();
 		// Sleep a bit, so we're not using 100% CPU
 		this_thread::sleep_for(std::chrono::milliseconds(1)); 
 	}
@@ -289,6 +1210,11 @@ void Streamer::checkFrameBuffer(bool p_pgTop, bool p_pgFront, bool p_depth, bool
 		return;
 	}
 
+	// The frames of a complete set, taken out of the synchronization queues
+	CameraFrame* frame_set[N_CHANNELS] = {};
+	bool assembled = false;
+	bool gate_open = true;
+
 	// Acquire mutexes. Should not deadlock AS LONG AS this is the only function that ever acquires 
 	// more than one mutex (it currently is).
 	for (auto& channel : channels_to_check) {
@@ -304,33 +1230,131 @@ void Streamer::checkFrameBuffer(bool p_pgTop, bool p_pgFront, bool p_depth, bool
 
 
 	if (return_value) { // All channels have a frame ready
-		// Check if any of the queues for enabled channels are full
-		bool queue_full = false;
+		// Check if any of the queues for enabled channels are full. Until the QoS ladder is
+		// exhausted the queues may grow past MAX_QUEUE_SIZE, so no frames are lost to a burst.
+		int queue_limit = qos.mayDrop() ? MAX_QUEUE_SIZE : HARD_QUEUE_SIZE;
+		int queue_depth = 0;
 		for (auto& channel : channels_to_check) {
-			if (frameQueues[channel].queue.size() > MAX_QUEUE_SIZE) { 
-				queue_full = true;
-			}
+			queue_depth = (std::max)(queue_depth, (int)frameQueues[channel].queue.size());
 		}
 
 		// If all queues have space, push frames to queues and clear buffers
-		if (!queue_full) {
+		if (queue_depth <= queue_limit) {
+			// The motion gate decides for the whole set, so all channels pause and resume on the same frame
+			Channels gate_channel = (Channels)motionGateSettings.channel;
+			if (recording && std::find(channels_to_check.begin(), channels_to_check.end(), gate_channel) != channels_to_check.end()) {
+				CameraFrame* frame = synchronizationQueues[gate_channel].current_frame_queue.front();
+				if (frame->PGData) {
+					QRect roi = QRect(ROIs[gate_channel][ROICoordinates::X],
+					                  ROIs[gate_channel][ROICoordinates::Y],
+					                  ROIs[gate_channel][ROICoordinates::W],
+					                  ROIs[gate_channel][ROICoordinates::H]).intersected(
+					            QRect(0, 0, frame->PGData->GetCols(), frame->PGData->GetRows()));
+					gate_open = motionGate.update(frame->frameIndex, frame->PGData->GetData(), frame->PGData->GetStride(), roi,
+					                              frame->timestampSeconds, frame->timestampMilliSeconds);
+				}
+			}
+
+			// Take the set out; it is published and queued once the camera callbacks can go on
 			for (auto& channel : channels_to_check) {
-				frameQueues[channel].push(synchronizationQueues[channel].current_frame_queue.front());
+				CameraFrame* frame = synchronizationQueues[channel].current_frame_queue.front();
+				frame->gateOpen = gate_open;
+				frame->frameSet = frameSets;
+				frame_set[channel] = frame;
 				synchronizationQueues[channel].current_frame_queue.pop();
 			}
-
-			// Send update to the FPS meter
-			emit updateFPSMeter();
+			assembled = true;
+			qos.update(queue_depth + 1);
+			frameSets++;
 		}
 		else {
-			qDebug() << "Queue full, can't push!" << endl;
+			// Drop the whole frame set, so the channels stay in step
+			qDebug() << "Queue full, dropping frame set" << synchronizationQueues[channels_to_check[0]].current_frame_queue.front()->frameIndex << endl;
+			for (auto& channel : channels_to_check) {
+				synchronizationQueues[channel].dropFront();
+			}
+			qos.update(queue_depth);
+			frameSets++;
 		}
+
+		// Deferred compression backs off as soon as capture starts to struggle
+		compactor->setCaptureState(recording, qos.level() != QoSController::Normal);
 	}
 
 	// Release mutexes
 	for (auto& channel : channels_to_check) {
 		synchronizationQueues[channel].mutex.unlock();
 	}
+
+	if (!assembled) {
+		return;
+	}
+
+	// Other processes get the set before the processors can free its frames. Queuing stays under
+	// setMutex, so a stop cannot fall between numbering the set and queuing it.
+	publishFrameSet(frame_set, channels_to_check, gate_open);
+	for (auto& channel : channels_to_check) {
+		frameQueues[channel].push(frame_set[channel]);
+	}
+
+	// Send update to the FPS meter
+	emit updateFPSMeter();
+}
+
+/**
+ * @brief Publish a frame set on the frame bus.
+ * @param set The frames of the set, by channel; no longer in the synchronization queues, and not yet in the frame queues.
+ * @param channels The channels in the set; IR comes with depth.
+ * @param gateOpen Whether the motion gate lets the set be written.
+ * @returns void.
+ */
+void Streamer::publishFrameSet( CameraFrame* const set[], const std::vector<Channels>& channels, bool gateOpen )
+{
+    if ( !frameBus.isOpen() )
+        return;
+
+    FrameBusPublisher::Frame frames[ FrameBusLayout::MAX_CHANNELS ] = {};
+    for ( auto& channel : channels )
+    {
+        CameraFrame* frame = set[ channel ];
+        FrameBusPublisher::Frame& published = frames[ channel ];
+        published.roi = QRect( ROIs[ channel ][ ROICoordinates::X ], ROIs[ channel ][ ROICoordinates::Y ],
+                               ROIs[ channel ][ ROICoordinates::W ], ROIs[ channel ][ ROICoordinates::H ] );
+        published.timestampSeconds = frame->timestampSeconds;
+        published.timestampMilliSeconds = frame->timestampMilliSeconds;
+        published.frameIndex = frame->frameIndex;
+        if ( frame->PGData )
+        {
+            published.format = FrameBusLayout::Grey8;
+            published.data = frame->PGData->GetData();
+            published.width = frame->PGData->GetCols();
+            published.height = frame->PGData->GetRows();
+            published.stride = frame->PGData->GetStride();
+            continue;
+        }
+
+        CameraController::FrameSize frameSize = CameraController::getDepthSenseFormatSize( frame->imageFormat );
+        published.width = frameSize.width;
+        published.height = frameSize.height;
+        if ( channel == Channels::Color )
+        {
+            published.format = FrameBusLayout::BGR24;
+            published.data = (const uint8_t*)frame->DSData8;
+            published.stride = frameSize.width * 3;
+        }
+        else
+        {
+            published.format = FrameBusLayout::Depth16;
+            published.data = (const int16_t*)frame->DSData16;
+            published.stride = frameSize.width * sizeof( int16_t );
+            if ( frame->DSConfidenceMap )
+            {
+                frames[ Channels::IR ] = published;
+                frames[ Channels::IR ].data = (const int16_t*)frame->DSConfidenceMap;
+            }
+        }
+    }
+    frameBus.publish( frames, recording, gateOpen );
 }
 
 /**
@@ -342,6 +1366,135 @@ static void cleanme(void* data) {
 	delete data;
 }
 
+/**
+* @brief Queue the processor of a channel on its pipeline worker, unless it is still running.
+* @arg channel Channel to process; set it streaming or recording first.
+* @returns void
+*/
+void Streamer::startProcessor( Channels channel )
+{
+	lock_guard<std::mutex> lock( processorMutex );
+	if ( processorActive[ channel ] )
+		return;
+
+	// Frames must not wait for pages to be faulted in
+	if ( framePoolStale[ channel ] )
+		allocateFramePool( channel );
+	framePools[ channel ].lock();
+	processorActive[ channel ] = true;
+	pipeline->submit( [ this, channel ]() { imageProcessor( channel ); }, channel );
+}
+
+/**
+* @brief Allocate the Point Grey frame pools from the memory of their channels' nodes.
+* @arg None
+* @returns void
+*
+* Pools still in use, by their processor or by frames left in the queues, are
+* allocated when their channel next starts.
+*/
+void Streamer::allocateFramePools()
+{
+	lock_guard<std::mutex> lock( processorMutex );
+	for ( int c = Channels::PointGreyTop; c <= Channels::PointGreyFront; c++ )
+	{
+		framePoolStale[ c ] = true;
+		allocateFramePool( (Channels)c );
+	}
+}
+
+/**
+* @brief Allocate a Point Grey frame pool from the memory of its channel's node, unless it is in use.
+* @arg channel The channel; call with processorMutex held.
+* @returns void
+*
+* If the pool cannot be allocated, its frames are copied onto the heap.
+*/
+void Streamer::allocateFramePool( Channels channel )
+{
+	if ( processorActive[ channel ] )
+		return;
+
+	size_t size = (size_t)originalROIs[ channel ][ ROICoordinates::W ] * originalROIs[ channel ][ ROICoordinates::H ];
+	try
+	{
+		if ( framePools[ channel ].allocate( size, FRAME_POOL_BUFFERS, 64, pipeline->node( channel ) ) )
+			framePoolStale[ channel ] = false;
+	}
+	catch ( std::bad_alloc& )
+	{
+		framePoolStale[ channel ] = false; // Left empty; trying again would not help
+	}
+}
+
+/**
+* @brief Keep a camera callback thread on the NUMA node of the worker that processes its frames.
+* @arg channel Channel of the frames the thread delivers
+* @returns void
+*/
+void Streamer::followChannel( Channels channel )
+{
+	static thread_local int placedNode = -1;
+	int node = pipeline->node( channel );
+	if ( node < 0 || node == placedNode )
+		return;
+	SetThreadAffinityMask( GetCurrentThread(), (DWORD_PTR)PipelineExecutor::nodeMask( node ) );
+	placedNode = node;
+}
+
+/**
+* @brief Copy a Point Grey frame out of the callback, into the channel's frame pool if it has a buffer left.
+* @arg channel Channel of the frame
+* @arg image The frame; it is freed once the callback returns
+* @arg sec Timestamp: seconds
+* @arg ms Timestamp: milliseconds
+* @returns The frame to be queued
+*/
+CameraFrame* Streamer::handOffPG( Channels channel, FlyCapture2::Image* image, int sec, int ms )
+{
+	followChannel( channel );
+	int node = framePools[ channel ].node();
+	if ( node >= 0 && PipelineExecutor::currentNode() != node )
+		crossNodeHandoffs[ channel ]++;
+
+	// Once a buffer is out, the pool is not replaced, so its size holds
+	unsigned char* buffer = framePools[ channel ].tryAcquire();
+	if ( buffer && image->GetDataSize() > framePools[ channel ].bufferSize() )
+	{
+		framePools[ channel ].recycle( buffer );
+		buffer = NULL;
+	}
+	if ( !buffer )
+	{
+		FlyCapture2::Image* copy = new FlyCapture2::Image();
+		copy->DeepCopy( image );
+		return new CameraFrame( copy, sec, ms );
+	}
+
+	memcpy( buffer, image->GetData(), image->GetDataSize() );
+	CameraFrame* frame = new CameraFrame( new FlyCapture2::Image( image->GetRows(), image->GetCols(), image->GetStride(),
+	                                                              buffer, image->GetDataSize(), image->GetPixelFormat() ),
+	                                      sec, ms );
+	frame->pool = &framePools[ channel ];
+	frame->pooled = buffer;
+	return frame;
+}
+
+/**
+* @brief Whether a processor thread should go on; if not, it is marked as stopped.
+* @arg channel Channel of the processor
+* @returns False once the streamer shuts down, or the channel neither streams nor records.
+*/
+bool Streamer::keepProcessing( Channels channel )
+{
+	lock_guard<std::mutex> lock( processorMutex );
+	if ( running && ( streamAttributes[ channel ].streaming || streamAttributes[ channel ].recording ) )
+		return true;
+	processorActive[ channel ] = false;
+	framePools[ channel ].unlock();
+	return false;
+}
+
 /**
 * @brief Repeatedly checks if queues have frames ready, and if so displays them on UI and saves to disk.
 * @arg channel Queue channel to monitor
@@ -350,8 +1503,6 @@ static void cleanme(void* data) {
 void Streamer::imageProcessor( Channels channel )
 {
 	int dataIndex;
-    
-    SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL );
 
     CameraController::Cameras cam;
 
@@ -376,7 +1527,11 @@ void Streamer::imageProcessor( Channels channel )
         break;
     }
 
-    while ( running && ( streamAttributes[ channel ].streaming || streamAttributes[ channel ].recording ) ) { 
+    // Frames held back while the motion gate is closed (IR comes with depth)
+    std::deque<HeldFrame> held;
+    std::deque<HeldFrame> heldIR;
+
+    while ( keepProcessing( channel ) ) { 
 		QImage rawImage;
 		CameraFrame *currentFrame;
 		QImage roiImage;
@@ -388,35 +1543,44 @@ void Streamer::imageProcessor( Channels channel )
                            ROIs[ cam ][ ROICoordinates::H ] );
 			
         // Grab stuff from the queue
+        // A stopping recording waits until every set before its end has been written
+        checkDrained( channel );
         while ( frameQueues[ channel ].queue.empty() )
         {
+			checkDrained( channel );
 			this_thread::sleep_for(std::chrono::milliseconds(2));
-            if ( !running || ( !streamAttributes[ channel ].streaming && !streamAttributes[ channel ].recording ) )
+            if ( !keepProcessing( channel ) )
                 return;
         }
+        // Until the frame is written, the recording cannot close this channel
+        unique_lock<std::mutex> writeLock( writeMutexes[ channel ] );
         currentFrame = frameQueues[ channel ].pop();
 		
         if ( !currentFrame )
             continue;
 
+        // The Point Grey and Color frames are freed below, so keep what is needed for recording
+        int timestampSeconds = currentFrame->timestampSeconds;
+        int timestampMilliSeconds = currentFrame->timestampMilliSeconds;
+        bool gateOpen = currentFrame->gateOpen;
+        unsigned long long frameIndex = currentFrame->frameIndex;
+        unsigned long long frameSet = currentFrame->frameSet;
+
+        // Frames from a pool are stored on the node of this channel's worker, unless the task was stolen
+        if ( currentFrame->pool && currentFrame->pool->node() >= 0 && PipelineExecutor::currentNode() != currentFrame->pool->node() )
+            crossNodeFrames[ channel ]++;
+
         // Assign the image data however necessary
         if ( currentFrame->PGData )
         {
-			// We decide to make a copy of the frame data here, because otherwise we can't call the currentFrame destructor 
-			// as it frees the frame memory. If we re-wrote the destructor to not free this memory we could make it work, but 
-			// then other portions of the code would have to be modified to free their own data (ugly).
-			
-			uchar* data_to_pass = new uchar[currentFrame->PGData->GetDataSize()];
-			memcpy(data_to_pass, currentFrame->PGData->GetData(), currentFrame->PGData->GetDataSize());
-
-			rawImage = QImage::QImage(data_to_pass,
+			// The image is processed where the callback copied it to; the frame (and its pool buffer) is
+			// freed along with the last image sharing the data.
+			rawImage = QImage::QImage(currentFrame->PGData->GetData(),
 				currentFrame->PGData->GetCols(),
 				currentFrame->PGData->GetRows(),
 				QImage::Format::Format_Grayscale8,
-				cleanme,
-				data_to_pass);
-
-			delete currentFrame;
+				DSImageCleanup,
+				currentFrame);
         }
         else 
         {
@@ -574,8 +1738,12 @@ void Streamer::imageProcessor( Channels channel )
 
         // And process the ROI for recording
 	    
-		if ( streamAttributes[ channel ].recording && recording ) 
+		if ( channelOpen[ channel ] && isRecordedSet( frameSet ) )
         {
+			// Follow the QoS ladder's JPEG quality
+			seqWriters[ channel ]->setQualityReduction( qos.qualityReduction() );
+			if ( channel == Channels::Depth )
+				seqWriters[ Channels::IR ]->setQualityReduction( qos.qualityReduction() );
 			
 			// If channel is Depth, also write the "Confidence" data
 			if (channel == Channels::Depth) {
@@ -622,15 +1790,17 @@ void Streamer::imageProcessor( Channels channel )
 						scaled_IR.bits()[i] = scaled_value;
 					}
 
-					seqWriters[Channels::IR]->writeFrame(&scaled_IR.copy(roi),
-						currentFrame->timestampSeconds,
-						currentFrame->timestampMilliSeconds);
+					recordFrame(Channels::IR, scaled_IR.copy(roi),
+						timestampSeconds,
+						timestampMilliSeconds,
+						gateOpen, heldIR);
 
 #else
 					// Just save 16 bit data
-					seqWriters[Channels::IR]->writeFrame(&confidenceImage.copy(roi),
-						currentFrame->timestampSeconds,
-						currentFrame->timestampMilliSeconds);
+					recordFrame(Channels::IR, confidenceImage.copy(roi),
+						timestampSeconds,
+						timestampMilliSeconds,
+						gateOpen, heldIR);
 #endif
 				}
 				// Also handle the regular depth frame
@@ -638,24 +1808,59 @@ void Streamer::imageProcessor( Channels channel )
 				// If compatibility mode, save scaled image. Else, save 16-bit image
 #ifdef COMPATIBILITY_MODE
 				roiImage = scaledImage.copy(roi);
-				seqWriters[channel]->writeFrame(&roiImage,
-					currentFrame->timestampSeconds,
-					currentFrame->timestampMilliSeconds);
+				recordFrame(channel, roiImage,
+					timestampSeconds,
+					timestampMilliSeconds,
+					gateOpen, held);
 #else
 				roiImage = rawImage.copy(roi);
-				seqWriters[channel]->writeFrame(&roiImage,
-					currentFrame->timestampSeconds,
-					currentFrame->timestampMilliSeconds);
+				recordFrame(channel, roiImage,
+					timestampSeconds,
+					timestampMilliSeconds,
+					gateOpen, held);
 #endif
 				
 			}
+			else if (sessionCropped[channel]) {
+				// A moving crop to the main file, and the whole ROI to the context file now and then
+				QRect crop = cropTrackers[channel].update(frameIndex, rawImage, roi, timestampSeconds, timestampMilliSeconds);
+				if (gateOpen && sessionContextInterval[channel] > 0 && frameIndex % sessionContextInterval[channel] == 0) {
+					QImage context = rawImage.copy(roi);
+					contextWriters[channel]->writeFrame(&context, timestampSeconds, (short)timestampMilliSeconds);
+				}
+				roiImage = rawImage.copy(crop.translated(roi.topLeft()));
+				recordFrame(channel, roiImage,
+					timestampSeconds,
+					timestampMilliSeconds,
+					gateOpen, held);
+			}
 			else {
 				roiImage = rawImage.copy(roi);
-				seqWriters[channel]->writeFrame(&roiImage,
-					currentFrame->timestampSeconds,
-					currentFrame->timestampMilliSeconds);
+				recordFrame(channel, roiImage,
+					timestampSeconds,
+					timestampMilliSeconds,
+					gateOpen, held);
+			}
+
+			// Track the animal on the raw depth once the frame is on its way to disk; it is the first thing
+			// given up when capture falls behind
+			if (channel == Channels::Depth && sessionTracked) {
+				if (qos.level() == QoSController::Dropping) {
+					depthTracker.skip();
+				}
+				else {
+					depthTracker.track(frameIndex, rawImage, roi, maxDepthMM,
+						timestampSeconds, timestampMilliSeconds);
+				}
 			}
         }
+		else
+		{
+			// Frames held in the last recording must not end up in the next
+			held.clear();
+			heldIR.clear();
+		}
+		writeLock.unlock();
 		
         // Display the image - must do this at the end, since memory is freed after the image is displayed
         if ( ( channel != Channels::IR ) && streamAttributes[ channel ].streaming )
@@ -670,7 +1875,7 @@ void Streamer::imageProcessor( Channels channel )
 			chrono::high_resolution_clock::time_point now = chrono::high_resolution_clock::now();
 			int time_diff = chrono::duration_cast<chrono::milliseconds>(now - lastUIUpdate[channel]).count() % 1000000000;
 			
-			if (time_diff > UI_UPDATE_RATE) {
+			if (time_diff > qos.previewInterval()) {
 				lastUIUpdate[channel] = now;
 				QImage cropped_image;
 				if (channel == Channels::Depth) {
@@ -680,6 +1885,10 @@ void Streamer::imageProcessor( Channels channel )
 					cropped_image = rawImage.copy(roi);
 				}
 				
+				{
+					lock_guard<std::mutex> lock( previewMutex );
+					lastPreview[ channel ] = cropped_image;
+				}
 				emit updateCamera(cam, cropped_image);
 			}
         }
@@ -687,6 +1896,33 @@ void Streamer::imageProcessor( Channels channel )
 }
 
 
+/**
+ * @brief Write a frame, or hold on to it while the motion gate is closed.
+ * @param channel The channel written to.
+ * @param image The frame, cropped to the ROI.
+ * @param secs Timestamp: seconds value.
+ * @param ms Timestamp: milliseconds value.
+ * @param gateOpen Whether the motion gate lets the frame's set be written.
+ * @param held The channel's held frames; written before the frame once the gate opens.
+ * @returns void.
+ */
+void Streamer::recordFrame( Channels channel, QImage image, int secs, int ms, bool gateOpen, std::deque<HeldFrame>& held )
+{
+	if ( !gateOpen )
+	{
+		// Keep only the pre-roll; older frames are never encoded or stored
+		held.push_back( { image, secs, ms } );
+		while ( (int)held.size() > motionGateSettings.preRollFrames )
+			held.pop_front();
+		return;
+	}
+
+	for ( auto& frame : held )
+		seqWriters[ channel ]->writeFrame( &frame.image, frame.timestampSeconds, (short)frame.timestampMilliSeconds );
+	held.clear();
+	seqWriters[ channel ]->writeFrame( &image, secs, (short)ms );
+}
+
 /**
  * @brief Transport Point Grey Camera frames from the CameraController to the Queue. 
  * @arg None.
@@ -710,24 +1946,27 @@ void Streamer::PGImageTransporter(FlyCapture2::Image* pImage, const void* pCallb
 		int sec = (int)(timestampOrig / 1000);
 		short ms = (short)(timestampOrig % 1000);
 
+		// Closed-loop triggers test the frame before anything else is done with it
+		Channels channel = (Channels)*((CameraController::Cameras*) pCallbackData);
+		triggers.testGrey(channel, pImage->GetData(), pImage->GetStride(),
+		                  QRect(0, 0, pImage->GetCols(), pImage->GetRows()),
+		                  QPoint(ROIs[channel][ROICoordinates::X], ROIs[channel][ROICoordinates::Y]),
+		                  now, sec, ms);
+
 	#ifdef DEBUG
 		//qDebug() << "PG: " << (int)pCallbackData << " " << sec << ms << endl;
 		//qDebug() << "Color buffer size: " << synchronizationQueues[Channels::Color].current_frame_queue.size() << endl;
 		//qDebug() << data.timeOfCapture << endl;
 	#endif // DEBUG
 
+		// We make a copy of the image because the original seems to be freed after this function returns
 		if (*((CameraController::Cameras*) pCallbackData) == CameraController::Cameras::PointGreyFront
 			&& (streamAttributes[Channels::PointGreyFront].recording || streamAttributes[Channels::PointGreyFront].streaming)) {
-			FlyCapture2::Image* image_copy = new FlyCapture2::Image();
-			image_copy->DeepCopy(pImage);
-			synchronizationQueues[Channels::PointGreyFront].push(new CameraFrame(image_copy, sec, ms));
+			synchronizationQueues[Channels::PointGreyFront].push(handOffPG(Channels::PointGreyFront, pImage, sec, ms));
 		}
 		else if (*((CameraController::Cameras*) pCallbackData) == CameraController::Cameras::PointGreyTop &&
 			(streamAttributes[Channels::PointGreyTop].recording || streamAttributes[Channels::PointGreyTop].streaming)) {
-			// We make a copy of the image because the original seems to be freed after this function returns
-			FlyCapture2::Image* image_copy = new FlyCapture2::Image();
-			image_copy->DeepCopy(pImage);
-			synchronizationQueues[Channels::PointGreyTop].push(new CameraFrame(image_copy, sec, ms));
+			synchronizationQueues[Channels::PointGreyTop].push(handOffPG(Channels::PointGreyTop, pImage, sec, ms));
 		}
 	}
 }
@@ -760,6 +1999,7 @@ void Streamer::depthSenseDepthTransporter( DepthSense::DepthNode::NewSampleRecei
     if ( !streamAttributes[ Channels::Depth ].streaming && !streamAttributes[ Channels::Depth ].recording )
         return;
 	if (!running) { return; }
+	chrono::high_resolution_clock::time_point arrival = chrono::high_resolution_clock::now();
     CameraFrame *theFrame;
 
     uint sec = data.timeOfCapture / 1000000;
@@ -771,6 +2011,15 @@ void Streamer::depthSenseDepthTransporter( DepthSense::DepthNode::NewSampleRecei
 	qDebug() << "Depth buffer size: " << synchronizationQueues[Channels::Depth].current_frame_queue.size() << endl;
 #endif // DEBUG
 
+	// The DepthSense callbacks share one thread, which follows the depth channel
+	followChannel( Channels::Depth );
+
+	// Closed-loop triggers test the frame before it is queued
+	CameraController::FrameSize frameSize = CameraController::getDepthSenseFormatSize(data.captureConfiguration.frameFormat);
+	triggers.testDepth(Channels::Depth, data.depthMap, QRect(0, 0, frameSize.width, frameSize.height),
+	                   QPoint(ROIs[Channels::Depth][ROICoordinates::X], ROIs[Channels::Depth][ROICoordinates::Y]),
+	                   maxDepthMM, arrival, sec, ms);
+
     theFrame = new CameraFrame( data.depthMap,
 								data.confidenceMap,
                                 data.captureConfiguration.frameFormat,
@@ -814,7 +2063,7 @@ void Streamer::run()
     }
 
 	// This thread will generate callbacks for the depthsense camera
-    std::thread( &DepthSense::Context::run, camera->getDepthSenseContext() ).detach();
+    depthSenseThread = std::thread( &DepthSense::Context::run, camera->getDepthSenseContext() );
 
 	// These threads will generate callbacks for the pointgrey camera
 	// We pass the index of the camera as the pCallbackInfo - will need parsed to the actual camera on the other side
@@ -826,7 +2075,8 @@ void Streamer::run()
 	}
 
 	// This thread runs the synchronization loop
-	std::thread(&Streamer::imageTransporter, this).detach();
+	transporting = true;
+	transporterThread = std::thread( &Streamer::imageTransporter, this );
 }
 
 /**
@@ -855,10 +2105,8 @@ void Streamer::startStreaming( CameraController::Cameras camera )
     }
 
     streamAttributes[ channel ].streaming = true;
-    // Start the image processor thread pretty much only if it hadn't already been started
-	if (!streamAttributes[channel].recording) {
-        std::thread( &Streamer::imageProcessor, this, channel ).detach();
-	}
+    // Start the image processor thread, unless it is still running
+    startProcessor( channel );
 }
 
 /**
@@ -889,6 +2137,33 @@ void Streamer::stopStreaming( CameraController::Cameras camera )
     streamAttributes[ channel ].streaming = false;
 }
 
+/**
+ * @brief Frame rate a channel is being captured at.
+ * @param channel The channel.
+ * @returns Frames per second.
+ */
+double Streamer::getFrameRate( Channels channel )
+{
+    switch ( channel )
+    {
+    case Channels::PointGreyTop:
+    case Channels::PointGreyFront:
+        try
+        {
+            return camera->getValue( (CameraController::Cameras)channel, CameraController::CameraProperties::FPS );
+        }
+        catch ( ... )
+        {
+            // Camera not connected; the file still needs a sensible header
+            return camera->CameraProps[ channel ].DefaultFPS;
+        }
+    case Channels::Color:
+        return camera->CameraProps[ CameraController::Cameras::Color ].DefaultFPS;
+    default: // Depth and IR come from the same node
+        return camera->CameraProps[ CameraController::Cameras::Depth ].DefaultFPS;
+    }
+}
+
 /**
  * @brief Start recording all selected videos.
  * @param pgt Whether the Point Grey Top camera stream should be recorded.
@@ -896,79 +2171,374 @@ void Streamer::stopStreaming( CameraController::Cameras camera )
  * @param color Whether the Color camera stream should be recorded.
  * @param depth Whether the Depth camera stream should be recorded.
  * @returns void.
+ * @note Waits for the last recording to be written out first, holding up the frame sets; check isSaving() to avoid that.
  */
 void Streamer::startRecording( bool pgt, bool pgf, bool color, bool depth )
 {
+	// The writers are reused
+	waitForStop();
+
 	string dateTime = currentDateTime();
+	sessionDateTime = dateTime;
+	for ( int c = 0; c < N_CHANNELS; c++ )
+	{
+		sessionChannels[ c ] = false;
+		sessionCropped[ c ] = false;
+		sessionContextInterval[ c ] = 0;
+		sessionDeferred[ c ] = deferredCompression && streamAttributes[ c == Channels::IR ? Channels::Depth : c ].compressed;
+
+		// Writers stage on the node of the worker that writes to them
+		seqWriters[ c ]->setNode( pipeline->node( c == Channels::IR ? Channels::Depth : c ) );
+		if ( contextWriters[ c ] )
+			contextWriters[ c ]->setNode( pipeline->node( c ) );
+	}
+
+	// Start at full quality, with fresh drop logs
+	qos.reset();
+	for ( int c = 0; c < Channels::IR; c++ )
+		synchronizationQueues[ c ].startLog();
 		
 	// Open PointGreyTop file stream and start thread
 	if ( pgt )
     {
-        seqWriters[ Channels::PointGreyTop ]->startRecording( workingDir, 
-                                                              ROIs[ Channels::PointGreyTop ][ ROICoordinates::W ],
-                                                              ROIs[ Channels::PointGreyTop ][ ROICoordinates::H ],
-                                                              streamAttributes[ Channels::PointGreyTop ].compressed,
-                                                              dateTime, isPGswitched );
+        startDynamicCrop( Channels::PointGreyTop, dateTime );
+        QSize size( ROIs[ Channels::PointGreyTop ][ ROICoordinates::W ], ROIs[ Channels::PointGreyTop ][ ROICoordinates::H ] );
+        if ( sessionCropped[ Channels::PointGreyTop ] )
+            size = cropSettings[ Channels::PointGreyTop ].cropSize( size );
+        seqWriters[ Channels::PointGreyTop ]->startRecording( getOutputDir( Channels::PointGreyTop ),
+                                                              size.width(),
+                                                              size.height(),
+                                                              streamAttributes[ Channels::PointGreyTop ].compressed && !sessionDeferred[ Channels::PointGreyTop ],
+                                                              dateTime, isPGswitched,
+                                                              getFrameRate( Channels::PointGreyTop ) );
         streamAttributes[ Channels::PointGreyTop ].recording = true;
-        if ( !streamAttributes[ Channels::PointGreyTop ].streaming )
-            std::thread ( &Streamer::imageProcessor, this, Channels::PointGreyTop ).detach();
+        sessionChannels[ Channels::PointGreyTop ] = true;
+        startProcessor( Channels::PointGreyTop );
     }
 
 	// Open PointGreyFront file stream and start thread
 	if ( pgf )
     {
-        seqWriters[ Channels::PointGreyFront ]->startRecording( workingDir, 
-                                                              ROIs[ Channels::PointGreyFront ][ ROICoordinates::W ],
-                                                              ROIs[ Channels::PointGreyFront ][ ROICoordinates::H ],
-                                                              streamAttributes[ Channels::PointGreyFront ].compressed,
-															  dateTime, isPGswitched);
+        startDynamicCrop( Channels::PointGreyFront, dateTime );
+        QSize size( ROIs[ Channels::PointGreyFront ][ ROICoordinates::W ], ROIs[ Channels::PointGreyFront ][ ROICoordinates::H ] );
+        if ( sessionCropped[ Channels::PointGreyFront ] )
+            size = cropSettings[ Channels::PointGreyFront ].cropSize( size );
+        seqWriters[ Channels::PointGreyFront ]->startRecording( getOutputDir( Channels::PointGreyFront ),
+                                                              size.width(),
+                                                              size.height(),
+                                                              streamAttributes[ Channels::PointGreyFront ].compressed && !sessionDeferred[ Channels::PointGreyFront ],
+															  dateTime, isPGswitched,
+                                                              getFrameRate( Channels::PointGreyFront ) );
         streamAttributes[ Channels::PointGreyFront ].recording = true;
-        if ( !streamAttributes[ Channels::PointGreyFront ].streaming )
-            std::thread ( &Streamer::imageProcessor, this, Channels::PointGreyFront ).detach();
+        sessionChannels[ Channels::PointGreyFront ] = true;
+        startProcessor( Channels::PointGreyFront );
     }
 
 	// Open Color file stream and start thread
 	if ( color )
     {
-        seqWriters[ Channels::Color ]->startRecording( workingDir, 
+        seqWriters[ Channels::Color ]->startRecording( getOutputDir( Channels::Color ),
                                                        ROIs[ Channels::Color ][ ROICoordinates::W ],
                                                        ROIs[ Channels::Color ][ ROICoordinates::H ],
-                                                       streamAttributes[ Channels::Color ].compressed,
-													   dateTime, isPGswitched);
+                                                       streamAttributes[ Channels::Color ].compressed && !sessionDeferred[ Channels::Color ],
+													   dateTime, isPGswitched,
+                                                       getFrameRate( Channels::Color ) );
         streamAttributes[ Channels::Color ].recording = true;
-        if ( !streamAttributes[ Channels::Color ].streaming )
-            std::thread ( &Streamer::imageProcessor, this, Channels::Color ).detach();
+        sessionChannels[ Channels::Color ] = true;
+        startProcessor( Channels::Color );
     }
 
 	// Open Depth file stream and start thread
 	if ( depth )
     {
-        seqWriters[ Channels::Depth ]->startRecording( workingDir, 
+        seqWriters[ Channels::Depth ]->startRecording( getOutputDir( Channels::Depth ),
                                                        ROIs[ Channels::Depth ][ ROICoordinates::W ],
                                                        ROIs[ Channels::Depth ][ ROICoordinates::H ],
-                                                       streamAttributes[ Channels::Depth ].compressed,
-													   dateTime, isPGswitched);
-		seqWriters[Channels::IR]->startRecording(workingDir,
+                                                       streamAttributes[ Channels::Depth ].compressed && !sessionDeferred[ Channels::Depth ],
+													   dateTime, isPGswitched,
+                                                       getFrameRate( Channels::Depth ) );
+		seqWriters[Channels::IR]->startRecording(getOutputDir(Channels::IR),
 														ROIs[Channels::Depth][ROICoordinates::W],
 														ROIs[Channels::Depth][ROICoordinates::H],
-														streamAttributes[Channels::Depth].compressed,
-														dateTime, isPGswitched);
+														streamAttributes[Channels::Depth].compressed && !sessionDeferred[Channels::IR],
+														dateTime, isPGswitched,
+														getFrameRate(Channels::Depth));
         streamAttributes[ Channels::Depth ].recording = true;
-        if ( !streamAttributes[ Channels::Depth ].streaming )
-            std::thread ( &Streamer::imageProcessor, this, Channels::Depth ).detach();
+        sessionChannels[ Channels::Depth ] = true;
+        sessionChannels[ Channels::IR ] = true;
+        startProcessor( Channels::Depth );
+	}
+
+    // The gate only acts while the channel it watches is recorded
+    sessionGated = motionGateSettings.enabled && sessionChannels[ motionGateSettings.channel ];
+    MotionGateSettings gate = motionGateSettings;
+    gate.enabled = sessionGated;
+    sessionTracked = depthTracking && depth;
+    sessionTriggered = !triggers.getZones().empty();
+    writeSessionManifest( false );
+    motionGate.start( gate, QString::fromStdString( getSessionPrefix() ) );
+    if ( sessionTracked )
+        depthTracker.start( QString::fromStdString( getSessionPrefix() ) );
+    triggers.arm( QString::fromStdString( getSessionPrefix() ) );
+    compactor->setCaptureState( true, false );
+
+    // Do this last, between two frame sets, so every channel starts on the same set
+    setMutex.lock();
+    recordFirstSet = frameSets.load();
+    recordEndSet = ULLONG_MAX;
+    for ( int c = 0; c < N_CHANNELS; c++ )
+    {
+        lock_guard<std::mutex> lock( writeMutexes[ c ] );
+        channelOpen[ c ] = sessionChannels[ c ];
+    }
+    recording = true;
+    setMutex.unlock();
+}
+
+/**
+ * @brief Check whether the output disks can keep up with a set of streams.
+ * @param pgt Whether the Point Grey Top camera stream would be recorded.
+ * @param pgf Whether the Point Grey Front camera stream would be recorded.
+ * @param color Whether the Color camera stream would be recorded.
+ * @param depth Whether the Depth camera stream would be recorded.
+ * @param report Out: one line per volume with the required and measured rates.
+ * @returns The verdict for the worst volume.
+ *
+ * The required rate of each channel follows from its ROI, frame rate and bits per
+ * pixel. For JPEG channels, the most recent preview frame is compressed with the
+ * channel's encoder profile to see how well the scene compresses; depth, whose preview
+ * is scaled to 8 bits, gets a synthetic frame like the encoder tuner's. Channels are grouped by the volume their output root is
+ * on, and each group is compared against a (cached) measurement of that volume.
+ */
+Streamer::Admission Streamer::checkWriteThroughput( bool pgt, bool pgf, bool color, bool depth, std::string& report )
+{
+	bool selected[ N_CHANNELS ] = { pgt, pgf, color, depth, depth }; // IR is recorded with depth
+	std::map<std::string, double> required; // bytes/s by volume
+	std::map<std::string, std::string> directories;
+
+	for ( int c = 0; c < N_CHANNELS; c++ )
+	{
+		if ( !selected[ c ] )
+			continue;
+
+		// IR has no ROI, preview or settings of its own; it follows depth
+		Channels source = ( c == Channels::IR ) ? Channels::Depth : (Channels)c;
+		bool compressed = streamAttributes[ source ].compressed && !deferredCompression; // Deferred channels are written raw
+		double jpegRatio = 0;
+		if ( compressed )
+		{
+			// Like the tuner: the depth preview is scaled to 8 bits, and a preview of another size isn't what is recorded
+			int width = ROIs[ source ][ ROICoordinates::W ];
+			int height = ROIs[ source ][ ROICoordinates::H ];
+			QImage sample;
+			if ( source != Channels::Depth )
+			{
+				lock_guard<std::mutex> lock( previewMutex );
+				sample = lastPreview[ source ];
+			}
+			if ( sample.isNull() || sample.width() != width || sample.height() != height )
+				sample = EncoderTuner::syntheticFrame( (Channels)c, width, height );
+			jpegRatio = SEQWriter::measureCompressionRatio( sample, getEncoderProfile( (Channels)c ) );
+		}
+
+		// A moving crop is all that is recorded at the full rate; its context file adds the whole ROI now and then
+		QSize size( ROIs[ source ][ ROICoordinates::W ], ROIs[ source ][ ROICoordinates::H ] );
+		double contextBytesPerSecond = 0;
+		if ( cropSettings[ c ].enabled )
+		{
+			if ( cropSettings[ c ].contextInterval > 0 )
+				contextBytesPerSecond = SEQWriter::expectedRecordSize( (Channels)c, size.width(), size.height(), streamAttributes[ source ].compressed, jpegRatio )
+				                        * getFrameRate( source ) / cropSettings[ c ].contextInterval;
+			size = cropSettings[ c ].cropSize( size );
+		}
+
+		double bytesPerSecond = SEQWriter::expectedRecordSize( (Channels)c,
+		                                                       size.width(),
+		                                                       size.height(),
+		                                                       compressed,
+		                                                       jpegRatio ) * getFrameRate( source );
+		if ( compressed && getRateTarget( (Channels)c ) > 0 )
+			bytesPerSecond = getRateTarget( (Channels)c ); // The rate controller holds the stream to its target
+		bytesPerSecond += contextBytesPerSecond;
+
+		std::string directory = getOutputDir( (Channels)c ) + "recordings";
+		std::string volume = ThroughputProbe::volumeOf( directory );
+		required[ volume ] += bytesPerSecond;
+		directories[ volume ] = directory;
+	}
+
+	Admission verdict = Admission::Admitted;
+	std::ostringstream lines;
+	lines << std::fixed << std::setprecision( 1 );
+	for ( auto& volume : required )
+	{
+		double available = ThroughputProbe::measure( directories[ volume.first ] );
+		double percent = available > 0 ? 100 * volume.second / available : 100;
+
+		lines << volume.first << ": needs " << volume.second / ( 1024 * 1024 ) << " MB/s of "
+		      << available / ( 1024 * 1024 ) << " MB/s measured (" << (int)percent << "%)" << std::endl;
+
+		if ( percent > THROUGHPUT_OVERCOMMITTED_PERCENT )
+			verdict = Admission::Overcommitted;
+		else if ( percent > THROUGHPUT_MARGINAL_PERCENT && verdict == Admission::Admitted )
+			verdict = Admission::Marginal;
+	}
+
+	report = lines.str();
+	return verdict;
+}
+
+/**
+ * @brief Find the best encoder settings each selected channel can sustain on this rig.
+ * @param pgt Whether the Point Grey Top camera stream is tuned.
+ * @param pgf Whether the Point Grey Front camera stream is tuned.
+ * @param color Whether the Color camera stream is tuned.
+ * @param depth Whether the Depth (and IR) camera streams are tuned.
+ * @param compressed Out: per channel, whether it should be compressed. Untouched for channels not tuned.
+ * @returns A human-readable report, one line per channel.
+ *
+ * Test files are written at each channel's ROI and frame rate, to its output root.
+ * Point Grey and Color channels use their latest preview frame if there is one,
+ * so the scene in view decides how well they compress; the others use synthetic
+ * frames. The chosen encoder profiles are applied right away; whether a channel is
+ * compressed is left to the caller, which owns the JPEG check boxes.
+ * Must not be called while recording.
+ */
+std::string Streamer::autoTuneEncoders( bool pgt, bool pgf, bool color, bool depth, bool compressed[ N_CHANNELS ] )
+{
+	bool selected[ N_CHANNELS ] = { pgt, pgf, color, depth, depth }; // IR is recorded with depth
+	EncoderTuner tuner( getStorageBackend(), getStorageQueueDepth() );
+	int depthIndex = -1;
+	int added = 0;
+
+	for ( int c = 0; c < N_CHANNELS; c++ )
+	{
+		if ( !selected[ c ] )
+			continue;
+
+		// IR has no ROI or settings of its own; it follows depth
+		Channels source = ( c == Channels::IR ) ? Channels::Depth : (Channels)c;
+		QImage sample;
+		if ( source != Channels::Depth ) // The depth preview is scaled to 8 bits; the recording isn't
+		{
+			lock_guard<std::mutex> lock( previewMutex );
+			sample = lastPreview[ source ];
+		}
+
+		tuner.addChannel( (Channels)c,
+		                  ROIs[ source ][ ROICoordinates::W ],
+		                  ROIs[ source ][ ROICoordinates::H ],
+		                  getFrameRate( source ),
+		                  sample,
+		                  getOutputDir( (Channels)c ),
+		                  c == Channels::IR ? depthIndex : -1 );
+		if ( c == Channels::Depth )
+			depthIndex = added;
+		added++;
 	}
 
-    recording = true; // Do this last so everybody starts at the same time.
+	std::string report;
+	for ( auto& result : tuner.run( report ) )
+	{
+		compressed[ result.channel ] = result.compressed;
+		if ( result.compressed )
+			setEncoderProfile( result.channel, result.profile );
+	}
+	return report;
 }
 
 /**
  * @brief Stop recording all active channels.
  * @arg None.
  * @returns void.
+ *
+ * Only fixes the last frame set of the recording; call it between two frame sets. Writing
+ * out the sets before the end and closing the files is left to the stopper thread, which
+ * emits onStopSavingEvent when it is done; waitForStop() waits for it.
+ *
+ * @note Stops can race, e.g. a posted stop and one from the destructor; only the first does anything.
  */
 void Streamer::stopRecording()
 {
+	lock_guard<std::mutex> stopLock( stopMutex );
+	if ( !recording )
+		return;
+
+	// End between two frame sets, so every channel stops after the same set
+	setMutex.lock();
+	recordEndSet = frameSets.load();
 	recording = false;
+	for ( int c = 0; c < N_CHANNELS; c++ )
+	{
+		drained[ c ] = !sessionChannels[ c ] || c == Channels::IR; // IR is written by the depth processor
+		if ( c < Channels::IR )
+			synchronizationQueues[ c ].stopLog();
+	}
+	setMutex.unlock();
+
+	// The previous stopper finished before this recording started
+	if ( stopperThread.joinable() )
+		stopperThread.join();
+	saving = true;
+	stopperThread = std::thread( &Streamer::finishRecording, this );
+}
+
+/**
+ * @brief Wait until the last recording is written out and its files are closed.
+ * @arg None.
+ * @returns void.
+ */
+void Streamer::waitForStop()
+{
+	lock_guard<std::mutex> stopLock( stopMutex );
+	if ( stopperThread.joinable() )
+		stopperThread.join();
+}
+
+/**
+ * @brief Write out the stopped recording and close its files. Runs on the stopper thread.
+ * @arg None.
+ * @returns void.
+ */
+void Streamer::finishRecording()
+{
+	// Let the processors write every set before the end
+	{
+		unique_lock<std::mutex> lock( drainMutex );
+		bool complete = drainCondition.wait_for( lock, chrono::milliseconds( DRAIN_TIMEOUT_MS ), [ this ]() {
+			for ( int c = 0; c < N_CHANNELS; c++ )
+			{
+				if ( !drained[ c ] )
+					return false;
+			}
+			return true;
+		} );
+		sessionDrained = complete;
+#ifdef DEBUG
+		if ( !complete )
+			qDebug() << "Frame sets of the recording still unwritten after" << DRAIN_TIMEOUT_MS << "ms" << endl;
+#endif
+	}
+
+	// Close the channels before their writers; a processor still behind drops the rest, which is counted
+	for ( int c = 0; c < Channels::IR; c++ )
+	{
+		lock_guard<std::mutex> lock( writeMutexes[ c ] );
+		channelOpen[ c ] = false;
+		sessionUnwritten[ c ] = 0;
+		if ( !sessionChannels[ c ] || sessionDrained )
+			continue;
+
+		lock_guard<std::mutex> queueLock( frameQueues[ c ].mutex );
+		std::queue<CameraFrame*> waiting = frameQueues[ c ].queue;
+		for ( ; !waiting.empty(); waiting.pop() )
+		{
+			if ( isRecordedSet( waiting.front()->frameSet ) )
+				sessionUnwritten[ c ]++;
+		}
+	}
+	channelOpen[ Channels::IR ] = false;
+	sessionUnwritten[ Channels::IR ] = sessionUnwritten[ Channels::Depth ];
 
 	for (int c = Channels::IR; c >= 0 ; c--)
     {
@@ -984,6 +2554,46 @@ void Streamer::stopRecording()
 			seqWriters[c]->stopRecording();
 		}
     }
+
+	motionGate.stop();
+	depthTracker.stop();
+	triggers.disarm();
+	for ( int c = 0; c < N_CHANNELS; c++ )
+	{
+		if ( !sessionCropped[ c ] )
+			continue;
+		cropTrackers[ c ].stop();
+		if ( sessionContextInterval[ c ] > 0 )
+			contextWriters[ c ]->stopRecording();
+	}
+	writeSessionManifest( true );
+
+	// Hand deferred channels to the compactor, which writes them again as they would have been recorded
+	compactor->setCaptureState( false, false );
+	for ( int c = 0; c < N_CHANNELS; c++ )
+	{
+		if ( !sessionChannels[ c ] || !sessionDeferred[ c ] )
+			continue;
+
+		Compactor::Job job;
+		job.rawPath = seqWriters[ c ]->getFileName();
+		job.channel = (Channels)c;
+		job.outputDir = getOutputDir( (Channels)c );
+		job.dateTime = sessionDateTime;
+		job.isPGswitched = isPGswitched;
+		job.profile = getEncoderProfile( (Channels)c );
+		job.residual = getResidualCodec( (Channels)c );
+		job.rateTarget = getRateTarget( (Channels)c );
+		job.rateMinQuality = getRateMinQuality( (Channels)c );
+		job.rateMaxQuality = getRateMaxQuality( (Channels)c );
+		job.backend = getStorageBackend();
+		job.queueDepth = getStorageQueueDepth();
+		job.manifestPath = getManifestPath();
+		compactor->enqueue( job );
+	}
+
+	saving = false;
+	emit onStopSavingEvent();
 }
 
 /**
@@ -1008,10 +2618,10 @@ void Streamer::PGImageCleanup( void* image )
 }
 
 /**
- * @brief Clean up after a DepthSense image
+ * @brief Clean up after a DepthSense image, or a Point Grey image in a frame pool
  * @param data Pointer to the previously acquired frame storage.
  * @returns void.
- * @note DS image memory is always freed by this function.
+ * @note DS image memory is always freed by this function; pooled PG memory goes back to its pool.
  */
 void Streamer::DSImageCleanup( void* data )
 {
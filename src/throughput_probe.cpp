@@ -0,0 +1,94 @@
+/**
+ * @file throughput_probe.cpp
+ * @brief Sustained write throughput of the volume behind a directory
+ */
+
+// Project includes
+#include "throughput_probe.h"
+#include "seq_storage.h"
+
+// Libraries
+#include <QTCore/QtDebug>
+#include <QTCore/QDir>
+
+// C++
+#include <chrono>
+#include <cstring>
+
+using namespace std;
+
+//// Static members
+std::map<std::string, double> ThroughputProbe::cache;
+std::mutex ThroughputProbe::mutex;
+
+/**
+ * @brief Find the volume a directory lives on.
+ * @param directory The directory.
+ * @returns The volume's mount point (e.g. "D:\"), or the directory itself if it can't be determined.
+ */
+std::string ThroughputProbe::volumeOf( const std::string& directory )
+{
+    wchar_t volume[ MAX_PATH ];
+    std::wstring path = QString::fromStdString( directory ).toStdWString();
+    if ( !GetVolumePathNameW( path.c_str(), volume, MAX_PATH ) )
+        return directory;
+    return QString::fromWCharArray( volume ).toStdString();
+}
+
+/**
+ * @brief Measure how fast data can be written to a directory's volume.
+ * @param directory A directory on the volume. Created if it doesn't exist.
+ * @param refresh Whether to probe again even if the volume was measured before.
+ * @returns Sustained write rate in bytes per second, or 0 if the volume could not be written to.
+ *
+ * Writes PROBE_SIZE bytes with unbuffered I/O, so the result reflects the disk
+ * rather than the page cache, then deletes the file.
+ */
+double ThroughputProbe::measure( const std::string& directory, bool refresh )
+{
+    std::string volume = volumeOf( directory );
+
+    lock_guard<std::mutex> lock( mutex );
+    auto cached = cache.find( volume );
+    if ( !refresh && cached != cache.end() )
+        return cached->second;
+
+    QDir().mkpath( QString::fromStdString( directory ) );
+    QString path = QDir( QString::fromStdString( directory ) ).filePath( "hunter_probe.tmp" );
+
+    SEQStorage* storage = SEQStorage::create( SEQStorage::DirectBackend, SEQStorage::DEFAULT_QUEUE_DEPTH );
+    if ( !storage->open( path, PROBE_BUFFER_SIZE ) )
+    {
+#ifdef DEBUG
+        qDebug() << "Could not probe write throughput of" << path << endl;
+#endif
+        delete storage;
+        return 0;
+    }
+
+    auto start = chrono::steady_clock::now();
+    for ( qint64 written = 0; written < PROBE_SIZE; written += PROBE_BUFFER_SIZE )
+    {
+        unsigned char* buffer = storage->acquire();
+        memset( buffer, (int)( written / PROBE_BUFFER_SIZE ), PROBE_BUFFER_SIZE );
+        storage->submit( buffer, PROBE_BUFFER_SIZE );
+    }
+    storage->finish( PROBE_SIZE, NULL, 0 );
+    double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+    int failed = storage->getFailedWrites();
+    delete storage;
+    QFile::remove( path );
+
+    // A disk that fails writes sustains nothing, however fast it fails them
+    if ( failed )
+    {
+#ifdef DEBUG
+        qDebug() << failed << "probe writes failed on" << path << endl;
+#endif
+        return 0;
+    }
+
+    double rate = PROBE_SIZE / seconds;
+    cache[ volume ] = rate;
+    return rate;
+}
@@ -0,0 +1,323 @@
+/**
+ * @file transcoder.cpp
+ * @brief Offline SEQ transcoder
+ */
+
+// Project includes
+#include "transcoder.h"
+#include "sidecar_writer.h"
+
+// Libraries
+#include <QTCore/QFileInfo>
+#include <QTCore/QtDebug>
+
+// C++
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+/** A frame on its way from the reader to the writer */
+struct PendingFrame
+{
+    std::vector<unsigned char> record;   /**< The frame as stored; freed once decoded. */
+    QImage image;                        /**< The transformed frame; for residual files, first the decoded one. */
+    int secs;
+    short ms;
+    bool ok;                             /**< Whether the frame could be decoded. */
+    std::promise<void> ready;            /**< Fulfilled once the pool is done with the frame. */
+};
+
+/**
+ * @brief Transcoder constructor
+ * @param options What to turn the recordings into.
+ * @param threads Size of the decode and transform pool.
+ * @param concurrentFiles Number of files transcoded at once.
+ */
+Transcoder::Transcoder( const Options& options, int threads, int concurrentFiles )
+    : options( options ),
+      concurrentFiles( (std::max)( concurrentFiles, 1 ) ),
+      nextFile( 0 ),
+      stopping( false )
+{
+    if ( !this->options.outputDir.empty() && this->options.outputDir.back() != '/' && this->options.outputDir.back() != '\\' )
+        this->options.outputDir += '/';
+    for ( int i = 0; i < (std::max)( threads, 1 ); i++ )
+        pool.push_back( std::thread( &Transcoder::poolWorker, this ) );
+}
+
+/**
+ * @brief Transcoder destructor
+ * @arg None
+ */
+Transcoder::~Transcoder( void )
+{
+    {
+        lock_guard<std::mutex> lock( mutex );
+        stopping = true;
+    }
+    queued.notify_all();
+    for ( auto& thread : pool )
+        thread.join();
+}
+
+/**
+ * @brief Recover the channel and timestamp from the name of a recording.
+ * @param path Path of the file, e.g. .../Mouse_20170503_12-00-00_Top_J85.seq.
+ * @param channel Out: the channel named in the file name.
+ * @param dateTime Out: the timestamp in the file name.
+ * @returns Whether the name is one SEQWriter gives its files.
+ */
+bool Transcoder::parseFileName( const QString& path, Streamer::Channels& channel, std::string& dateTime )
+{
+    // Mouse_<date>_<time>_<channel>_<J85|Raw>; the timestamp has an underscore of its own
+    std::string name = QFileInfo( path ).completeBaseName().toStdString();
+    size_t kind = name.rfind( '_' );
+    if ( name.compare( 0, 6, "Mouse_" ) != 0 || kind == std::string::npos || kind < 6 )
+        return false;
+    size_t channelStart = name.rfind( '_', kind - 1 );
+    if ( channelStart == std::string::npos || channelStart < 6 )
+        return false;
+
+    std::string channelName = name.substr( channelStart + 1, kind - channelStart - 1 );
+    for ( int c = 0; c < Streamer::N_CHANNELS; c++ )
+    {
+        if ( SEQWriter::fileNameChannels[ c ] == channelName )
+        {
+            channel = (Streamer::Channels)c;
+            dateTime = name.substr( 6, channelStart - 6 );
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Transcode a batch of files.
+ * @param files The recordings.
+ * @returns A human-readable report, one line per file and a summary.
+ */
+std::string Transcoder::run( const std::vector<QString>& files )
+{
+    std::vector<FileResult> results( files.size() );
+    nextFile = 0;
+
+    auto start = chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for ( int i = 0; i < (std::min)( concurrentFiles, (int)files.size() ); i++ )
+        workers.push_back( std::thread( &Transcoder::fileWorker, this, &files, &results ) );
+    for ( auto& worker : workers )
+        worker.join();
+    double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+    ostringstream report;
+    report << fixed << setprecision( 1 );
+    long long frames = 0;
+    qint64 bytesIn = 0;
+    qint64 bytesOut = 0;
+    int failed = 0;
+    for ( auto& result : results )
+    {
+        if ( !result.error.empty() )
+        {
+            report << result.input.toStdString() << ": " << result.error << endl;
+            failed++;
+            continue;
+        }
+        report << result.input.toStdString() << " -> " << result.output.toStdString() << ": "
+               << result.frames << " frames, " << result.bytes / ( 1024.0 * 1024.0 ) << " MB, "
+               << result.frames / (std::max)( result.seconds, 0.001 ) << " fps" << endl;
+        frames += result.frames;
+        bytesIn += QFileInfo( result.input ).size();
+        bytesOut += result.bytes;
+    }
+    report << files.size() - failed << " of " << files.size() << " files, " << frames << " frames in " << seconds << " s: "
+           << frames / (std::max)( seconds, 0.001 ) << " fps, "
+           << bytesIn / ( 1024.0 * 1024.0 ) / (std::max)( seconds, 0.001 ) << " MB/s read, "
+           << bytesOut / ( 1024.0 * 1024.0 ) / (std::max)( seconds, 0.001 ) << " MB/s written" << endl;
+    return report.str();
+}
+
+/**
+ * @brief Claim files from the batch and transcode them until none are left.
+ * @param files The batch.
+ * @param results Out: one result per file, at the same index.
+ * @returns void.
+ */
+void Transcoder::fileWorker( const std::vector<QString>* files, std::vector<FileResult>* results )
+{
+    for ( int i = nextFile++; i < (int)files->size(); i = nextFile++ )
+        transcode( ( *files )[ i ], ( *results )[ i ] );
+}
+
+/**
+ * @brief Transcode one file.
+ * @param path The recording.
+ * @param result Out: how it went.
+ * @returns void.
+ *
+ * This thread reads; the pool decodes and transforms; a writer thread encodes
+ * and writes, taking the frames in file order.
+ */
+void Transcoder::transcode( const QString& path, FileResult& result )
+{
+    result.input = path;
+    result.frames = 0;
+    result.bytes = 0;
+    result.seconds = 0;
+    auto start = chrono::steady_clock::now();
+
+    SEQReader reader;
+    Streamer::Channels channel;
+    std::string dateTime;
+    if ( !reader.open( path ) )
+    {
+        result.error = "not a SEQ file";
+        return;
+    }
+    if ( !parseFileName( path, channel, dateTime ) )
+    {
+        result.error = "not named like a Hunter recording, so its channel is unknown";
+        return;
+    }
+
+    QRect frame( 0, 0, reader.getWidth(), reader.getHeight() );
+    QRect region = options.crop.isNull() ? frame : options.crop.intersected( frame );
+    if ( region.isEmpty() )
+    {
+        result.error = "crop region is outside the frame";
+        return;
+    }
+    QSize size( (std::max)( (int)lround( region.width() * options.scale ), 1 ),
+                (std::max)( (int)lround( region.height() * options.scale ), 1 ) );
+
+    // Writing next to the input with the same compression would overwrite it
+    bool residual = SEQWriter::usesResidual( channel, options.compressed, options.residual );
+    result.output = SEQWriter::filePathFor( options.outputDir, channel, options.compressed, dateTime, false, residual );
+    if ( QFileInfo( result.output ).absoluteFilePath() == QFileInfo( path ).absoluteFilePath() )
+    {
+        result.error = "output would overwrite the input";
+        return;
+    }
+
+    SEQWriter writer( channel );
+    writer.setStorageBackend( options.backend, options.queueDepth );
+    writer.setEncoderProfile( options.profile );
+    writer.setResidualCodec( options.residual );
+    writer.startRecording( options.outputDir, size.width(), size.height(), options.compressed, dateTime, false, reader.getFrameRate() );
+
+    BoundedQueue<std::shared_ptr<PendingFrame>> frames( QUEUE_FRAMES );
+    std::atomic<bool> failed( false );
+
+    // Drains the queue completely, even after a failure, so no task outlives the reader
+    std::thread writerThread( [ & ]
+    {
+        std::shared_ptr<PendingFrame> pending;
+        while ( frames.pop( pending ) )
+        {
+            pending->ready.get_future().wait();
+            if ( !pending->ok )
+                failed = true;
+            if ( !failed )
+                writer.writeFrame( &pending->image, pending->secs, pending->ms );
+            pending.reset();
+        }
+    } );
+
+    bool sequential = reader.isResidual();
+    for ( int i = 0; i < reader.getFrameCount() && !failed; i++ )
+    {
+        auto pending = std::make_shared<PendingFrame>();
+        if ( sequential ? !reader.readFrame( pending->image, pending->secs, pending->ms )
+                        : !reader.readRecord( pending->record, pending->secs, pending->ms ) )
+        {
+            failed = true;
+            break;
+        }
+        submit( [ this, &reader, pending, region, size, sequential ]( tjhandle decompressor )
+        {
+            QImage decoded = pending->image;
+            pending->ok = sequential || reader.decode( pending->record, decoded, decompressor );
+            if ( pending->ok )
+                pending->image = transform( decoded, region, size );
+            pending->record = std::vector<unsigned char>();
+            pending->ready.set_value();
+        } );
+        frames.push( pending );
+    }
+    frames.close();
+    writerThread.join();
+    writer.stopRecording();
+
+    if ( failed )
+    {
+        result.error = "stopped after " + std::to_string( writer.getFrameCount() ) + " frames: a frame could not be read or decoded";
+        QFile::remove( writer.getFileName() );
+        QFile::remove( SidecarWriter::pathFor( writer.getFileName(), "quality" ) );
+        return;
+    }
+    result.frames = writer.getFrameCount();
+    result.bytes = writer.getFileSize();
+    result.seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+}
+
+/**
+ * @brief Crop and scale a frame.
+ * @param frame The decoded frame.
+ * @param region The part of the frame kept.
+ * @param size Size of the output.
+ * @returns The frame, in the same pixel format as the input.
+ */
+QImage Transcoder::transform( const QImage& frame, const QRect& region, const QSize& size )
+{
+    QImage result = ( region == frame.rect() ) ? frame : frame.copy( region );
+    if ( result.size() != size )
+    {
+        // 16-bit depth values must not be blended with their neighbours
+        Qt::TransformationMode mode = frame.format() == QImage::Format_RGB16 ? Qt::FastTransformation : Qt::SmoothTransformation;
+        result = result.scaled( size, Qt::IgnoreAspectRatio, mode ).convertToFormat( frame.format() );
+    }
+    return result;
+}
+
+/**
+ * @brief Queue a task for the pool.
+ * @param task The task; it is given the decompressor of the thread that runs it.
+ * @returns void.
+ */
+void Transcoder::submit( Task task )
+{
+    {
+        lock_guard<std::mutex> lock( mutex );
+        tasks.push_back( std::move( task ) );
+    }
+    queued.notify_one();
+}
+
+/**
+ * @brief Pool thread: runs tasks until the transcoder is destroyed.
+ * @arg None.
+ * @returns void.
+ */
+void Transcoder::poolWorker()
+{
+    tjhandle decompressor = tjInitDecompress();
+    while ( true )
+    {
+        Task task;
+        {
+            unique_lock<std::mutex> lock( mutex );
+            queued.wait( lock, [ this ] { return stopping || !tasks.empty(); } );
+            if ( tasks.empty() )
+                break;
+            task = std::move( tasks.front() );
+            tasks.pop_front();
+        }
+        task( decompressor );
+    }
+    tjDestroy( decompressor );
+}
@@ -0,0 +1,412 @@
+/**
+ * @file trigger_engine.cpp
+ * @brief Closed-loop triggers on the freshest Point Grey and depth frames
+ */
+
+// Project includes
+#include "trigger_engine.h"
+#include "depth_tracker.h"
+
+// Libraries
+#include <QTCore/QtDebug>
+
+// C++
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+//// Constants
+const std::string TriggerZone::edgeNames[] = { "enter", "leave", "both" };
+
+/**
+ * @brief TriggerZone constructor
+ * @arg None
+ */
+TriggerZone::TriggerZone( void )
+    : channel( 0 ),
+      level( TriggerEngine::DEFAULT_GREY_LEVEL ),
+      fraction( 0.25 ),
+      edge( Enter ),
+      sink( TriggerSink::UdpSink )
+{
+}
+
+/**
+ * @brief Look up an edge by its configuration name.
+ * @param name One of edgeNames.
+ * @returns The edge, or Enter if the name is unknown.
+ */
+TriggerZone::Edge TriggerZone::edgeFromName( const std::string& name )
+{
+    for ( int i = 0; i < NUM_EDGES; i++ )
+    {
+        if ( edgeNames[ i ] == name )
+            return (Edge)i;
+    }
+    return Enter;
+}
+
+/**
+ * @brief TriggerEngine constructor
+ * @arg None
+ */
+TriggerEngine::TriggerEngine( void )
+    : armed( false ),
+      queueHead( 0 ),
+      queueTail( 0 ),
+      dropped( 0 ),
+      stopping( false )
+{
+    wakeup = CreateEvent( NULL, FALSE, FALSE, NULL );
+}
+
+/**
+ * @brief TriggerEngine destructor
+ */
+TriggerEngine::~TriggerEngine( void )
+{
+    disarm();
+    CloseHandle( wakeup );
+}
+
+/**
+ * @brief Replace the zones.
+ * @param zones The zones; none to switch the triggers off.
+ * @note Takes effect the next time the engine is armed.
+ */
+void TriggerEngine::setZones( const std::vector<TriggerZone>& zones )
+{
+    lock_guard<std::mutex> lock( mutex );
+    this->zones = zones;
+}
+
+/**
+ * @brief Accessor for the zones.
+ * @arg None.
+ * @returns The zones armed by the next recording.
+ */
+std::vector<TriggerZone> TriggerEngine::getZones()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return zones;
+}
+
+/**
+ * @brief Start testing the zones, and open their sinks.
+ * @param sessionPath Recordings folder and session prefix, e.g. .../recordings/Mouse_<date>; the sidecar is named after it.
+ * @returns void.
+ *
+ * Does nothing without zones. A zone whose sink cannot be opened is still
+ * tested and logged, with its events marked unsent.
+ */
+void TriggerEngine::arm( const QString& sessionPath )
+{
+    lock_guard<std::mutex> lock( mutex );
+    {
+        lock_guard<std::mutex> statsLock( statsMutex );
+        latencies.clear();
+    }
+    dropped = 0;
+    if ( zones.empty() || armed )
+        return;
+
+    for ( auto& zone : zones )
+    {
+        ZoneState state;
+        state.zone = zone;
+        state.sink = TriggerSink::create( zone.sink, zone.target );
+        state.occupied = false;
+        if ( !state.sink->open() )
+        {
+#ifdef DEBUG
+            qDebug() << "Trigger" << zone.name.c_str() << "cannot open its sink" << zone.target.c_str() << endl;
+#endif
+        }
+        states.push_back( state );
+    }
+    {
+        lock_guard<std::mutex> statsLock( statsMutex );
+        log.open( sessionPath, "triggers", "trigger,event,seconds,milliseconds,occupied,latencyUs,sent" );
+    }
+    queueHead = 0;
+    queueTail = 0;
+    stopping = false;
+    senderThread = std::thread( &TriggerEngine::sender, this );
+    armed = true;
+}
+
+/**
+ * @brief Stop testing the zones, send the events still queued, and close the sinks.
+ * @arg None.
+ * @returns void.
+ */
+void TriggerEngine::disarm()
+{
+    {
+        lock_guard<std::mutex> lock( mutex );
+        armed = false;
+    }
+
+    // No callback queues anything any more
+    if ( senderThread.joinable() )
+    {
+        stopping = true;
+        SetEvent( wakeup );
+        senderThread.join();
+    }
+
+    lock_guard<std::mutex> lock( mutex );
+    for ( auto& state : states )
+        delete state.sink;
+    states.clear();
+    lock_guard<std::mutex> statsLock( statsMutex );
+    log.close();
+}
+
+/**
+ * @brief Test the zones of a Point Grey channel on a frame just delivered.
+ * @param channel The channel.
+ * @param data The 8-bit frame.
+ * @param stride Bytes per row of the frame.
+ * @param frame Size of the frame, at the origin.
+ * @param roi Origin of the channel's ROI within the frame; zones are relative to it.
+ * @param arrival When the frame reached the callback.
+ * @param secs Timestamp of the frame: seconds.
+ * @param ms Timestamp of the frame: milliseconds.
+ * @returns void.
+ */
+void TriggerEngine::testGrey( int channel, const uchar* data, int stride, const QRect& frame, const QPoint& roi,
+                              std::chrono::high_resolution_clock::time_point arrival, int secs, int ms )
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( !armed )
+        return;
+
+    for ( size_t i = 0; i < states.size(); i++ )
+    {
+        ZoneState& state = states[ i ];
+        if ( state.zone.channel != channel )
+            continue;
+        QRect zone = state.zone.zone.translated( roi ).intersected( frame );
+        if ( zone.isEmpty() )
+            continue;
+
+        // The first frame after arming is the background
+        int pixels = zone.width() * zone.height();
+        bool fresh = (int)state.background.size() != pixels;
+        if ( fresh )
+            state.background.resize( pixels );
+
+        int level = state.zone.level << 8;
+        int occupiedPixels = 0;
+        uint16_t* model = &state.background[ 0 ];
+        for ( int y = zone.top(); y <= zone.bottom(); y++ )
+        {
+            const uchar* row = data + (size_t)y * stride + zone.left();
+            for ( int x = 0; x < zone.width(); x++, model++ )
+            {
+                int value = row[ x ] << 8;
+                if ( fresh )
+                    *model = (uint16_t)value;
+                int difference = value - *model;
+                if ( abs( difference ) > level )
+                    occupiedPixels++;
+                else if ( !state.occupied )
+                    *model = (uint16_t)( *model + ( difference >> BACKGROUND_SHIFT ) );
+            }
+        }
+        decide( (int)i, occupiedPixels, pixels, arrival, secs, ms );
+    }
+}
+
+/**
+ * @brief Test the zones of the depth channel on a frame just delivered.
+ * @param channel The channel.
+ * @param data The raw depth frame, 16 bits per pixel in mm.
+ * @param frame Size of the frame, at the origin.
+ * @param roi Origin of the channel's ROI within the frame; zones are relative to it.
+ * @param backgroundMM Depth of the background.
+ * @param arrival When the frame reached the callback.
+ * @param secs Timestamp of the frame: seconds.
+ * @param ms Timestamp of the frame: milliseconds.
+ * @returns void.
+ */
+void TriggerEngine::testDepth( int channel, const int16_t* data, const QRect& frame, const QPoint& roi, int backgroundMM,
+                               std::chrono::high_resolution_clock::time_point arrival, int secs, int ms )
+{
+    lock_guard<std::mutex> lock( mutex );
+    if ( !armed || !data )
+        return;
+
+    for ( size_t i = 0; i < states.size(); i++ )
+    {
+        ZoneState& state = states[ i ];
+        if ( state.zone.channel != channel )
+            continue;
+        QRect zone = state.zone.zone.translated( roi ).intersected( frame );
+        if ( zone.isEmpty() )
+            continue;
+
+        int occupiedPixels = 0;
+        for ( int y = zone.top(); y <= zone.bottom(); y++ )
+        {
+            const uint16_t* row = (const uint16_t*)data + (size_t)y * frame.width() + zone.left();
+            for ( int x = 0; x < zone.width(); x++ )
+            {
+                int value = row[ x ];
+                if ( value > 0 && value < DepthTracker::INVALID_DEPTH && backgroundMM - value >= state.zone.level )
+                    occupiedPixels++;
+            }
+        }
+        decide( (int)i, occupiedPixels, zone.width() * zone.height(), arrival, secs, ms );
+    }
+}
+
+/**
+ * @brief Whether the engine is armed.
+ * @arg None.
+ * @returns True between arm() and disarm() if there are zones.
+ */
+bool TriggerEngine::isArmed()
+{
+    lock_guard<std::mutex> lock( mutex );
+    return armed;
+}
+
+/**
+ * @brief Number of events in the current (or last) recording.
+ * @arg None.
+ * @returns Events fired, or attempted, by all zones; not counting those dropped.
+ */
+int TriggerEngine::getEvents()
+{
+    lock_guard<std::mutex> lock( statsMutex );
+    return (int)latencies.size();
+}
+
+/**
+ * @brief Number of events of the current (or last) recording that were never fired.
+ * @arg None.
+ * @returns Events dropped because the sender was too far behind.
+ */
+int TriggerEngine::getDropped()
+{
+    return dropped;
+}
+
+/**
+ * @brief A percentile of the latency of the current (or last) recording's events.
+ * @param percentile The percentile, from 0 to 100.
+ * @returns Microseconds; 0 without events.
+ */
+double TriggerEngine::getLatencyPercentile( double percentile )
+{
+    lock_guard<std::mutex> lock( statsMutex );
+    if ( latencies.empty() )
+        return 0;
+    std::vector<float> sorted = latencies;
+    size_t rank = (std::min)( (size_t)( percentile / 100 * sorted.size() ), sorted.size() - 1 );
+    std::nth_element( sorted.begin(), sorted.begin() + rank, sorted.end() );
+    return sorted[ rank ];
+}
+
+/**
+ * @brief Longest latency of the current (or last) recording's events.
+ * @arg None.
+ * @returns Microseconds; 0 without events.
+ */
+double TriggerEngine::getMaxLatency()
+{
+    lock_guard<std::mutex> lock( statsMutex );
+    return latencies.empty() ? 0 : *std::max_element( latencies.begin(), latencies.end() );
+}
+
+/**
+ * @brief Update a zone's occupancy, and queue an event for the sender on the edges it watches.
+ * @param zone Index of the zone; call with mutex held.
+ * @param occupiedPixels Pixels of the zone occupied in this frame.
+ * @param pixels Pixels in the zone.
+ * @param arrival When the frame reached the callback.
+ * @param secs Timestamp of the frame: seconds.
+ * @param ms Timestamp of the frame: milliseconds.
+ * @returns void.
+ */
+void TriggerEngine::decide( int zone, int occupiedPixels, int pixels,
+                            std::chrono::high_resolution_clock::time_point arrival, int secs, int ms )
+{
+    ZoneState& state = states[ zone ];
+    double occupied = (double)occupiedPixels / pixels;
+    bool entered = !state.occupied && occupied >= state.zone.fraction;
+    bool left = state.occupied && occupied < state.zone.fraction / 2;
+    if ( !entered && !left )
+        return;
+    state.occupied = entered;
+
+    if ( ( entered && state.zone.edge == TriggerZone::Leave ) || ( left && state.zone.edge == TriggerZone::Enter ) )
+        return;
+
+    // Never wait for the sender
+    unsigned int head = queueHead.load( std::memory_order_relaxed );
+    if ( head - queueTail.load( std::memory_order_acquire ) >= QUEUE_SIZE )
+    {
+        dropped++;
+        return;
+    }
+    Event& event = queue[ head % QUEUE_SIZE ];
+    event.zone = zone;
+    event.entered = entered;
+    event.occupied = occupied;
+    event.secs = secs;
+    event.ms = ms;
+    event.arrival = arrival;
+    queueHead.store( head + 1, std::memory_order_release );
+    SetEvent( wakeup );
+}
+
+/**
+ * @brief Sender thread: fire the sinks of queued events until disarmed.
+ * @arg None.
+ * @returns void.
+ */
+void TriggerEngine::sender()
+{
+    while ( true )
+    {
+        WaitForSingleObject( wakeup, INFINITE );
+
+        // Events queued before the engine was disarmed are still sent
+        bool last = stopping;
+        unsigned int tail = queueTail.load( std::memory_order_relaxed );
+        while ( tail != queueHead.load( std::memory_order_acquire ) )
+        {
+            Event event = queue[ tail % QUEUE_SIZE ];
+            queueTail.store( ++tail, std::memory_order_release );
+            send( event );
+        }
+        if ( last )
+            return;
+    }
+}
+
+/**
+ * @brief Fire the sink of an event, and log it.
+ * @param event The event.
+ * @returns void.
+ */
+void TriggerEngine::send( const Event& event )
+{
+    // Fire first; the bookkeeping doesn't count towards the latency
+    const TriggerZone& zone = states[ event.zone ].zone;
+    const char* edge = event.entered ? "enter" : "leave";
+    char message[ MAX_MESSAGE_LENGTH ];
+    int length = snprintf( message, sizeof( message ), "%s %s %d.%03d\n", zone.name.c_str(), edge, event.secs, event.ms );
+    length = (std::min)( (std::max)( length, 0 ), (int)sizeof( message ) - 1 );
+    bool sent = states[ event.zone ].sink->fire( message, length );
+    float latency = chrono::duration<float, std::micro>( chrono::high_resolution_clock::now() - event.arrival ).count();
+
+    lock_guard<std::mutex> lock( statsMutex );
+    latencies.push_back( latency );
+    log.writeRow( "%s,%s,%d,%d,%.3f,%.1f,%d", zone.name.c_str(), edge, event.secs, event.ms, event.occupied, latency, sent ? 1 : 0 );
+}
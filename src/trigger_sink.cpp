@@ -0,0 +1,290 @@
+/**
+ * @file trigger_sink.cpp
+ * @brief Outputs fired by the closed-loop triggers
+ */
+
+// Winsock 2 has to come before windows.h, which the project headers pull in
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+// Project includes
+#include "trigger_sink.h"
+
+// Libraries
+#include <QTCore/qt_windows.h>
+#include <QTCore/QtDebug>
+
+// C++
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+using namespace std;
+
+//// Constants
+const std::string TriggerSink::kindNames[] = { "udp", "file" };
+
+/** A datagram per event, sent without waiting. */
+class UdpTriggerSink : public TriggerSink
+{
+public:
+    UdpTriggerSink( const std::string& target );
+    ~UdpTriggerSink( void );
+
+    bool open();
+    bool fire( const char* message, int length );
+    void close();
+
+private:
+    SOCKET handle;
+    sockaddr_in address;
+};
+
+/** A write per event to a file, named pipe or serial port. */
+class FileTriggerSink : public TriggerSink
+{
+public:
+    FileTriggerSink( const std::string& target );
+    ~FileTriggerSink( void );
+
+    bool open();
+    bool fire( const char* message, int length );
+    void close();
+
+private:
+    HANDLE handle;
+};
+
+/**
+ * @brief Create a trigger sink.
+ * @param kind The kind of sink.
+ * @param target Where its messages go: [host:]port for UDP, a path for files and devices.
+ * @returns The new sink, not yet open. Ownership passes to the caller.
+ */
+TriggerSink* TriggerSink::create( Kind kind, const std::string& target )
+{
+    switch ( kind )
+    {
+    case FileSink:
+        return new FileTriggerSink( target );
+    case UdpSink:
+    default: // Intentional fall-through
+        return new UdpTriggerSink( target );
+    }
+}
+
+/**
+ * @brief Look up a sink by its configuration name.
+ * @param name One of kindNames.
+ * @returns The sink, or UdpSink if the name is unknown.
+ */
+TriggerSink::Kind TriggerSink::kindFromName( const std::string& name )
+{
+    for ( int i = 0; i < NUM_SINKS; i++ )
+    {
+        if ( kindNames[ i ] == name )
+            return (Kind)i;
+    }
+    return UdpSink;
+}
+
+/**
+ * @brief TriggerSink constructor
+ * @param type The kind of sink.
+ * @param target Where its messages go.
+ */
+TriggerSink::TriggerSink( Kind type, const std::string& target )
+    : target( target ),
+      type( type )
+{
+}
+
+/**
+ * @brief Accessor for the kind of sink.
+ * @arg None.
+ * @returns The kind.
+ */
+TriggerSink::Kind TriggerSink::kind()
+{
+    return type;
+}
+
+/**
+ * @brief Accessor for the target.
+ * @arg None.
+ * @returns Where the messages go, as configured.
+ */
+const std::string& TriggerSink::getTarget()
+{
+    return target;
+}
+
+/**
+ * @brief UdpTriggerSink constructor
+ * @param target [host:]port; the host defaults to 127.0.0.1.
+ */
+UdpTriggerSink::UdpTriggerSink( const std::string& target )
+    : TriggerSink( UdpSink, target ),
+      handle( INVALID_SOCKET )
+{
+    memset( &address, 0, sizeof( address ) );
+}
+
+/**
+ * @brief UdpTriggerSink destructor
+ */
+UdpTriggerSink::~UdpTriggerSink( void )
+{
+    close();
+}
+
+/**
+ * @brief Create a non-blocking socket and resolve the target.
+ * @arg None.
+ * @returns Whether the sink can fire.
+ */
+bool UdpTriggerSink::open()
+{
+    static std::once_flag started;
+    std::call_once( started, []() {
+        WSADATA data;
+        WSAStartup( MAKEWORD( 2, 2 ), &data );
+    } );
+
+    std::string host = "127.0.0.1";
+    std::string port = target;
+    size_t colon = target.rfind( ':' );
+    if ( colon != std::string::npos )
+    {
+        host = target.substr( 0, colon );
+        port = target.substr( colon + 1 );
+    }
+    address.sin_family = AF_INET;
+    address.sin_port = htons( (u_short)( port.empty() ? (int)DEFAULT_PORT : atoi( port.c_str() ) ) );
+    if ( inet_pton( AF_INET, host.c_str(), &address.sin_addr ) != 1 )
+    {
+#ifdef DEBUG
+        qDebug() << "Trigger sink: not an IPv4 address:" << host.c_str() << endl;
+#endif
+        return false;
+    }
+
+    handle = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+    if ( handle == INVALID_SOCKET )
+        return false;
+    u_long nonBlocking = 1;
+    ioctlsocket( handle, FIONBIO, &nonBlocking );
+    return true;
+}
+
+/**
+ * @brief Send a message as one datagram.
+ * @param message The message.
+ * @param length Its length in bytes.
+ * @returns Whether it was sent; it is dropped if the socket buffer is full.
+ */
+bool UdpTriggerSink::fire( const char* message, int length )
+{
+    if ( handle == INVALID_SOCKET )
+        return false;
+    return sendto( handle, message, length, 0, (const sockaddr*)&address, sizeof( address ) ) == length;
+}
+
+/**
+ * @brief Close the socket.
+ * @arg None.
+ * @returns void.
+ */
+void UdpTriggerSink::close()
+{
+    if ( handle != INVALID_SOCKET )
+        closesocket( handle );
+    handle = INVALID_SOCKET;
+}
+
+/**
+ * @brief FileTriggerSink constructor
+ * @param target Path of a file, or of a device such as \\.\pipe\name or \\.\COM3.
+ */
+FileTriggerSink::FileTriggerSink( const std::string& target )
+    : TriggerSink( FileSink, target ),
+      handle( INVALID_HANDLE_VALUE )
+{
+}
+
+/**
+ * @brief FileTriggerSink destructor
+ */
+FileTriggerSink::~FileTriggerSink( void )
+{
+    close();
+}
+
+/**
+ * @brief Open the file for appending, or the device for writing.
+ * @arg None.
+ * @returns Whether the sink can fire.
+ *
+ * Devices (paths starting \\.\) must exist; files are created if they don't.
+ * Pipes are switched to non-blocking writes, and serial ports get a write timeout.
+ */
+bool FileTriggerSink::open()
+{
+    bool device = target.compare( 0, 4, "\\\\.\\" ) == 0;
+    bool pipe = target.compare( 0, 9, "\\\\.\\pipe\\" ) == 0;
+    bool serial = target.compare( 0, 7, "\\\\.\\COM" ) == 0;
+    handle = CreateFileA( target.c_str(),
+                          device ? GENERIC_WRITE : FILE_APPEND_DATA,
+                          FILE_SHARE_READ | FILE_SHARE_WRITE,
+                          NULL,
+                          device ? OPEN_EXISTING : OPEN_ALWAYS,
+                          FILE_ATTRIBUTE_NORMAL,
+                          NULL );
+    if ( handle == INVALID_HANDLE_VALUE )
+    {
+#ifdef DEBUG
+        qDebug() << "Trigger sink: cannot open" << target.c_str() << GetLastError() << endl;
+#endif
+        return false;
+    }
+
+    // A reader that stops reading, or a port held up by flow control, must not hold up the sender
+    if ( pipe )
+    {
+        DWORD mode = PIPE_READMODE_BYTE | PIPE_NOWAIT;
+        SetNamedPipeHandleState( handle, &mode, NULL, NULL );
+    }
+    else if ( serial )
+    {
+        COMMTIMEOUTS timeouts = {};
+        timeouts.WriteTotalTimeoutConstant = WRITE_TIMEOUT_MS;
+        SetCommTimeouts( handle, &timeouts );
+    }
+    return true;
+}
+
+/**
+ * @brief Write a message.
+ * @param message The message.
+ * @param length Its length in bytes.
+ * @returns Whether all of it was written; a full pipe or a timed-out port drops it.
+ */
+bool FileTriggerSink::fire( const char* message, int length )
+{
+    if ( handle == INVALID_HANDLE_VALUE )
+        return false;
+    DWORD written = 0;
+    return WriteFile( handle, message, length, &written, NULL ) && written == (DWORD)length;
+}
+
+/**
+ * @brief Close the file or device.
+ * @arg None.
+ * @returns void.
+ */
+void FileTriggerSink::close()
+{
+    if ( handle != INVALID_HANDLE_VALUE )
+        CloseHandle( handle );
+    handle = INVALID_HANDLE_VALUE;
+}